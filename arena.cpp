@@ -0,0 +1,31 @@
+// This file is part of the IMP project.
+
+#include "arena.h"
+
+
+
+// -----------------------------------------------------------------------------
+Arena::~Arena()
+{
+  for (auto it = dtors_.rbegin(); it != dtors_.rend(); ++it) {
+    it->Fn(it->Obj);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void *Arena::AllocateSlow(size_t size, size_t align)
+{
+  // Objects larger than a chunk are given a chunk of their own, leaving the
+  // current one in place for subsequent small objects.
+  const size_t bytes = size + align - 1;
+  if (bytes > kChunkSize / 4) {
+    auto &chunk = chunks_.emplace_back(new char[bytes]);
+    auto ptr = reinterpret_cast<uintptr_t>(chunk.get());
+    return reinterpret_cast<void *>((ptr + align - 1) & ~(align - 1));
+  }
+
+  auto &chunk = chunks_.emplace_back(new char[kChunkSize]);
+  ptr_ = chunk.get();
+  end_ = chunk.get() + kChunkSize;
+  return Allocate(size, align);
+}
@@ -0,0 +1,75 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+
+/**
+ * Bump allocator owning a group of objects with the same lifetime.
+ *
+ * Objects are carved out of large chunks and are all released together
+ * when the arena is destroyed, running the destructors of the objects
+ * which need one in the reverse order of their construction.
+ */
+class Arena final {
+public:
+  /// Size of the chunks requested from the heap.
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+public:
+  Arena() = default;
+  ~Arena();
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /// Constructs an object in the arena.
+  template <typename T, typename... Args>
+  T *New(Args &&... args)
+  {
+    T *obj = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      dtors_.push_back({ obj, [] (void *p) { static_cast<T *>(p)->~T(); } });
+    }
+    return obj;
+  }
+
+  /// Allocates uninitialised memory.
+  void *Allocate(size_t size, size_t align)
+  {
+    uintptr_t ptr = (reinterpret_cast<uintptr_t>(ptr_) + align - 1) & ~(align - 1);
+    if (ptr + size > reinterpret_cast<uintptr_t>(end_)) {
+      return AllocateSlow(size, align);
+    }
+    ptr_ = reinterpret_cast<char *>(ptr + size);
+    return reinterpret_cast<void *>(ptr);
+  }
+
+private:
+  /// Allocates memory from a new chunk.
+  void *AllocateSlow(size_t size, size_t align);
+
+private:
+  /// Destructor to run when the arena is released.
+  struct Dtor {
+    void *Obj;
+    void (*Fn)(void *);
+  };
+
+  /// Pointer to the free space in the current chunk.
+  char *ptr_ = nullptr;
+  /// End of the current chunk.
+  char *end_ = nullptr;
+  /// Chunks allocated so far.
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  /// Destructors of objects in the arena.
+  std::vector<Dtor> dtors_;
+};
@@ -0,0 +1,74 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+#include "interp.h"
+
+
+
+/// Errors raised by arithmetic which fails at runtime, shared by all backends.
+constexpr const char *kAddOverflow = "overflow in addition";
+constexpr const char *kSubOverflow = "overflow in subtraction";
+constexpr const char *kMulOverflow = "overflow in multiplication";
+constexpr const char *kDivOverflow = "overflow in division";
+constexpr const char *kDivByZero = "division by zero";
+
+/**
+ * Checked arithmetic on integers.
+ *
+ * Overflows are detected by the compiler intrinsics, which test the flags
+ * set by the operation itself. Only the division of the smallest integer by
+ * -1 overflows, while the matching remainder is zero; both would trap on
+ * x86-64, so they are handled separately along with division by zero.
+ */
+inline int64_t CheckedAdd(int64_t lhs, int64_t rhs)
+{
+  int64_t result;
+  if (__builtin_add_overflow(lhs, rhs, &result)) {
+    throw RuntimeError(kAddOverflow);
+  }
+  return result;
+}
+
+inline int64_t CheckedSub(int64_t lhs, int64_t rhs)
+{
+  int64_t result;
+  if (__builtin_sub_overflow(lhs, rhs, &result)) {
+    throw RuntimeError(kSubOverflow);
+  }
+  return result;
+}
+
+inline int64_t CheckedMul(int64_t lhs, int64_t rhs)
+{
+  int64_t result;
+  if (__builtin_mul_overflow(lhs, rhs, &result)) {
+    throw RuntimeError(kMulOverflow);
+  }
+  return result;
+}
+
+inline int64_t CheckedDiv(int64_t lhs, int64_t rhs)
+{
+  if (rhs == 0) {
+    throw RuntimeError(kDivByZero);
+  }
+  if (rhs == -1) {
+    if (lhs == std::numeric_limits<int64_t>::min()) {
+      throw RuntimeError(kDivOverflow);
+    }
+    return -lhs;
+  }
+  return lhs / rhs;
+}
+
+inline int64_t CheckedMod(int64_t lhs, int64_t rhs)
+{
+  if (rhs == 0) {
+    throw RuntimeError(kDivByZero);
+  }
+  return rhs == -1 ? 0 : lhs % rhs;
+}
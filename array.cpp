@@ -0,0 +1,510 @@
+// This file is part of the IMP project.
+
+#include <cstdlib>
+#include <cstring>
+
+#include "array.h"
+#include "arith.h"
+
+/// Vector kernels are selected at runtime on x86-64 and always used on ARM.
+#if defined(IMP_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#define IMP_HAS_AVX2 1
+#include <immintrin.h>
+#else
+#define IMP_HAS_AVX2 0
+#endif
+
+#if defined(IMP_SIMD) && defined(__aarch64__)
+#define IMP_HAS_NEON 1
+#include <arm_neon.h>
+#else
+#define IMP_HAS_NEON 0
+#endif
+
+
+
+// -----------------------------------------------------------------------------
+std::unique_ptr<Array> Array::New(size_t size)
+{
+  if (size > SIZE_MAX / sizeof(int64_t) - kAlignment) {
+    return nullptr;
+  }
+  // The buffer is padded to whole vectors, as aligned_alloc requires.
+  size_t bytes = (size * sizeof(int64_t) + kAlignment - 1) & ~(kAlignment - 1);
+  void *data = std::aligned_alloc(kAlignment, bytes ? bytes : kAlignment);
+  if (!data) {
+    return nullptr;
+  }
+  memset(data, 0, bytes);
+  return std::unique_ptr<Array>(new Array(static_cast<int64_t *>(data), size));
+}
+
+// -----------------------------------------------------------------------------
+Array::~Array()
+{
+  std::free(data_);
+}
+
+
+// -----------------------------------------------------------------------------
+static void AddCarry(int64_t &total, int64_t &carries, int64_t value)
+{
+  // Wrapped sums differ from the exact ones by multiples of 2^64, which are
+  // counted by the carries: the exact sum fits if they cancel out.
+  if (__builtin_add_overflow(total, value, &total)) {
+    carries += total < 0 ? 1 : -1;
+  }
+}
+
+// -----------------------------------------------------------------------------
+static void Accumulate(int64_t &total, int64_t &carries, const int64_t *a, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    AddCarry(total, carries, a[i]);
+  }
+}
+
+// -----------------------------------------------------------------------------
+static const char *AccumulateProducts(
+    int64_t &total,
+    int64_t &carries,
+    const int64_t *a,
+    const int64_t *b,
+    size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    int64_t product;
+    if (__builtin_mul_overflow(a[i], b[i], &product)) {
+      return kMulOverflow;
+    }
+    AddCarry(total, carries, product);
+  }
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+static const char *AddScalar(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    if (__builtin_add_overflow(a[i], b[i], &out[i])) {
+      return kAddOverflow;
+    }
+  }
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+static const char *MulScalar(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    if (__builtin_mul_overflow(a[i], b[i], &out[i])) {
+      return kMulOverflow;
+    }
+  }
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+static const char *SumScalar(int64_t &sum, const int64_t *a, size_t n)
+{
+  int64_t total = 0, carries = 0;
+  Accumulate(total, carries, a, n);
+  sum = total;
+  return carries ? kAddOverflow : nullptr;
+}
+
+// -----------------------------------------------------------------------------
+static const char *DotScalar(int64_t &dot, const int64_t *a, const int64_t *b, size_t n)
+{
+  int64_t total = 0, carries = 0;
+  if (auto *err = AccumulateProducts(total, carries, a, b, n)) {
+    return err;
+  }
+  dot = total;
+  return carries ? kAddOverflow : nullptr;
+}
+
+// -----------------------------------------------------------------------------
+static void EqScalar(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = a[i] == b[i];
+  }
+}
+
+// -----------------------------------------------------------------------------
+static void LtScalar(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = a[i] < b[i];
+  }
+}
+
+// -----------------------------------------------------------------------------
+static const ArrayKernels kScalarKernels = {
+  "scalar",
+  AddScalar,
+  MulScalar,
+  SumScalar,
+  DotScalar,
+  EqScalar,
+  LtScalar,
+};
+
+
+#if IMP_HAS_AVX2
+
+/// Kernels are compiled for AVX2 without requiring it from the rest of the
+/// build, so they must only be called once the host is known to support it.
+#define AVX2 __attribute__((target("avx2")))
+
+// -----------------------------------------------------------------------------
+AVX2 static inline bool AnySign(__m256i v)
+{
+  return _mm256_movemask_pd(_mm256_castsi256_pd(v)) != 0;
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static inline __m256i Overflows(__m256i a, __m256i b, __m256i sum)
+{
+  // Sums overflow if they differ in sign from both operands.
+  return _mm256_and_si256(_mm256_xor_si256(a, sum), _mm256_xor_si256(b, sum));
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static inline bool Fits32(__m256i a, __m256i b)
+{
+  // Products of 32-bit integers are exact, as computed by vpmuldq.
+  const __m256i lo = _mm256_set1_epi64x(int64_t(INT32_MIN) - 1);
+  const __m256i hi = _mm256_set1_epi64x(int64_t(INT32_MAX) + 1);
+  __m256i fits = _mm256_and_si256(
+      _mm256_and_si256(_mm256_cmpgt_epi64(a, lo), _mm256_cmpgt_epi64(hi, a)),
+      _mm256_and_si256(_mm256_cmpgt_epi64(b, lo), _mm256_cmpgt_epi64(hi, b))
+  );
+  return _mm256_movemask_pd(_mm256_castsi256_pd(fits)) == 0xF;
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static inline void AddCarries(__m256i &acc, __m256i &carries, __m256i v)
+{
+  // Lanes count their own carries, +1 if the sum wrapped to a negative value.
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi64x(1);
+  __m256i sum = _mm256_add_epi64(acc, v);
+  __m256i wrapped = _mm256_cmpgt_epi64(zero, Overflows(acc, v, sum));
+  __m256i dir = _mm256_or_si256(_mm256_cmpgt_epi64(zero, sum), one);
+  carries = _mm256_sub_epi64(carries, _mm256_and_si256(wrapped, dir));
+  acc = sum;
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static inline void Reduce(int64_t &total, int64_t &carries, __m256i acc, __m256i lanes)
+{
+  alignas(32) int64_t sums[4], counts[4];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(sums), acc);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(counts), lanes);
+  for (unsigned i = 0; i < 4; ++i) {
+    carries += counts[i];
+    AddCarry(total, carries, sums[i]);
+  }
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static inline __m256i Load(const int64_t *p)
+{
+  return _mm256_load_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static inline void Store(int64_t *p, __m256i v)
+{
+  _mm256_store_si256(reinterpret_cast<__m256i *>(p), v);
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static const char *AddAVX2(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  __m256i overflow = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = Load(a + i), y = Load(b + i);
+    __m256i sum = _mm256_add_epi64(x, y);
+    overflow = _mm256_or_si256(overflow, Overflows(x, y, sum));
+    Store(out + i, sum);
+  }
+  if (AnySign(overflow)) {
+    return kAddOverflow;
+  }
+  return AddScalar(out + i, a + i, b + i, n - i);
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static const char *MulAVX2(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  // Products of wider operands are rare, so they are checked one by one.
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = Load(a + i), y = Load(b + i);
+    if (Fits32(x, y)) {
+      Store(out + i, _mm256_mul_epi32(x, y));
+    } else if (auto *err = MulScalar(out + i, a + i, b + i, 4)) {
+      return err;
+    }
+  }
+  return MulScalar(out + i, a + i, b + i, n - i);
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static const char *SumAVX2(int64_t &sum, const int64_t *a, size_t n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  __m256i lanes = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    AddCarries(acc, lanes, Load(a + i));
+  }
+  int64_t total = 0, carries = 0;
+  Reduce(total, carries, acc, lanes);
+  Accumulate(total, carries, a + i, n - i);
+  sum = total;
+  return carries ? kAddOverflow : nullptr;
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static const char *DotAVX2(int64_t &dot, const int64_t *a, const int64_t *b, size_t n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  __m256i lanes = _mm256_setzero_si256();
+  int64_t total = 0, carries = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = Load(a + i), y = Load(b + i);
+    if (Fits32(x, y)) {
+      AddCarries(acc, lanes, _mm256_mul_epi32(x, y));
+    } else if (auto *err = AccumulateProducts(total, carries, a + i, b + i, 4)) {
+      return err;
+    }
+  }
+  Reduce(total, carries, acc, lanes);
+  if (auto *err = AccumulateProducts(total, carries, a + i, b + i, n - i)) {
+    return err;
+  }
+  dot = total;
+  return carries ? kAddOverflow : nullptr;
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static void EqAVX2(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  const __m256i one = _mm256_set1_epi64x(1);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    Store(out + i, _mm256_and_si256(_mm256_cmpeq_epi64(Load(a + i), Load(b + i)), one));
+  }
+  EqScalar(out + i, a + i, b + i, n - i);
+}
+
+// -----------------------------------------------------------------------------
+AVX2 static void LtAVX2(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  const __m256i one = _mm256_set1_epi64x(1);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    Store(out + i, _mm256_and_si256(_mm256_cmpgt_epi64(Load(b + i), Load(a + i)), one));
+  }
+  LtScalar(out + i, a + i, b + i, n - i);
+}
+
+// -----------------------------------------------------------------------------
+static const ArrayKernels kAVX2Kernels = {
+  "avx2",
+  AddAVX2,
+  MulAVX2,
+  SumAVX2,
+  DotAVX2,
+  EqAVX2,
+  LtAVX2,
+};
+
+#undef AVX2
+
+#endif
+
+
+#if IMP_HAS_NEON
+
+// -----------------------------------------------------------------------------
+static inline int64x2_t Overflows(int64x2_t a, int64x2_t b, int64x2_t sum)
+{
+  // Sums overflow if they differ in sign from both operands.
+  return vandq_s64(veorq_s64(a, sum), veorq_s64(b, sum));
+}
+
+// -----------------------------------------------------------------------------
+static inline bool Fits32(int64x2_t a, int64x2_t b)
+{
+  // Operands which survive narrowing are multiplied exactly by smull.
+  uint64x2_t fits = vandq_u64(
+      vceqq_s64(vmovl_s32(vmovn_s64(a)), a),
+      vceqq_s64(vmovl_s32(vmovn_s64(b)), b)
+  );
+  return (vgetq_lane_u64(fits, 0) & vgetq_lane_u64(fits, 1)) != 0;
+}
+
+// -----------------------------------------------------------------------------
+static inline int64x2_t Mul32(int64x2_t a, int64x2_t b)
+{
+  return vmull_s32(vmovn_s64(a), vmovn_s64(b));
+}
+
+// -----------------------------------------------------------------------------
+static inline void AddCarries(int64x2_t &acc, int64x2_t &carries, int64x2_t v)
+{
+  // Lanes count their own carries, +1 if the sum wrapped to a negative value.
+  const int64x2_t one = vdupq_n_s64(1);
+  int64x2_t sum = vaddq_s64(acc, v);
+  int64x2_t wrapped = vshrq_n_s64(Overflows(acc, v, sum), 63);
+  int64x2_t dir = vorrq_s64(vshrq_n_s64(sum, 63), one);
+  carries = vsubq_s64(carries, vandq_s64(wrapped, dir));
+  acc = sum;
+}
+
+// -----------------------------------------------------------------------------
+static inline void Reduce(int64_t &total, int64_t &carries, int64x2_t acc, int64x2_t lanes)
+{
+  carries += vgetq_lane_s64(lanes, 0) + vgetq_lane_s64(lanes, 1);
+  AddCarry(total, carries, vgetq_lane_s64(acc, 0));
+  AddCarry(total, carries, vgetq_lane_s64(acc, 1));
+}
+
+// -----------------------------------------------------------------------------
+static const char *AddNEON(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  int64x2_t overflow = vdupq_n_s64(0);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    int64x2_t x = vld1q_s64(a + i), y = vld1q_s64(b + i);
+    int64x2_t sum = vaddq_s64(x, y);
+    overflow = vorrq_s64(overflow, Overflows(x, y, sum));
+    vst1q_s64(out + i, sum);
+  }
+  if ((vgetq_lane_s64(overflow, 0) | vgetq_lane_s64(overflow, 1)) < 0) {
+    return kAddOverflow;
+  }
+  return AddScalar(out + i, a + i, b + i, n - i);
+}
+
+// -----------------------------------------------------------------------------
+static const char *MulNEON(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  // Products of wider operands are rare, so they are checked one by one.
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    int64x2_t x = vld1q_s64(a + i), y = vld1q_s64(b + i);
+    if (Fits32(x, y)) {
+      vst1q_s64(out + i, Mul32(x, y));
+    } else if (auto *err = MulScalar(out + i, a + i, b + i, 2)) {
+      return err;
+    }
+  }
+  return MulScalar(out + i, a + i, b + i, n - i);
+}
+
+// -----------------------------------------------------------------------------
+static const char *SumNEON(int64_t &sum, const int64_t *a, size_t n)
+{
+  int64x2_t acc = vdupq_n_s64(0);
+  int64x2_t lanes = vdupq_n_s64(0);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    AddCarries(acc, lanes, vld1q_s64(a + i));
+  }
+  int64_t total = 0, carries = 0;
+  Reduce(total, carries, acc, lanes);
+  Accumulate(total, carries, a + i, n - i);
+  sum = total;
+  return carries ? kAddOverflow : nullptr;
+}
+
+// -----------------------------------------------------------------------------
+static const char *DotNEON(int64_t &dot, const int64_t *a, const int64_t *b, size_t n)
+{
+  int64x2_t acc = vdupq_n_s64(0);
+  int64x2_t lanes = vdupq_n_s64(0);
+  int64_t total = 0, carries = 0;
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    int64x2_t x = vld1q_s64(a + i), y = vld1q_s64(b + i);
+    if (Fits32(x, y)) {
+      AddCarries(acc, lanes, Mul32(x, y));
+    } else if (auto *err = AccumulateProducts(total, carries, a + i, b + i, 2)) {
+      return err;
+    }
+  }
+  Reduce(total, carries, acc, lanes);
+  if (auto *err = AccumulateProducts(total, carries, a + i, b + i, n - i)) {
+    return err;
+  }
+  dot = total;
+  return carries ? kAddOverflow : nullptr;
+}
+
+// -----------------------------------------------------------------------------
+static void EqNEON(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  const int64x2_t one = vdupq_n_s64(1);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    uint64x2_t eq = vceqq_s64(vld1q_s64(a + i), vld1q_s64(b + i));
+    vst1q_s64(out + i, vandq_s64(vreinterpretq_s64_u64(eq), one));
+  }
+  EqScalar(out + i, a + i, b + i, n - i);
+}
+
+// -----------------------------------------------------------------------------
+static void LtNEON(int64_t *out, const int64_t *a, const int64_t *b, size_t n)
+{
+  const int64x2_t one = vdupq_n_s64(1);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    uint64x2_t lt = vcltq_s64(vld1q_s64(a + i), vld1q_s64(b + i));
+    vst1q_s64(out + i, vandq_s64(vreinterpretq_s64_u64(lt), one));
+  }
+  LtScalar(out + i, a + i, b + i, n - i);
+}
+
+// -----------------------------------------------------------------------------
+static const ArrayKernels kNEONKernels = {
+  "neon",
+  AddNEON,
+  MulNEON,
+  SumNEON,
+  DotNEON,
+  EqNEON,
+  LtNEON,
+};
+
+#endif
+
+
+// -----------------------------------------------------------------------------
+const ArrayKernels &GetArrayKernels()
+{
+#if IMP_HAS_AVX2
+  static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+  if (hasAVX2) {
+    return kAVX2Kernels;
+  }
+#endif
+#if IMP_HAS_NEON
+  return kNEONKernels;
+#else
+  return kScalarKernels;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+const ArrayKernels &GetScalarArrayKernels()
+{
+  return kScalarKernels;
+}
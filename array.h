@@ -0,0 +1,74 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+
+
+/**
+ * Array of integers, stored in a contiguous buffer aligned for vector loads.
+ *
+ * Arrays are allocated by the runtime methods on behalf of a program and are
+ * owned by the interpreter running it, which releases them once the run
+ * ends. Values refer to them through plain pointers.
+ */
+class Array final {
+public:
+  /// Alignment of the elements, matching the widest vector registers.
+  static constexpr size_t kAlignment = 64;
+
+  /// Allocates an array of zeros, returning null if memory runs out.
+  static std::unique_ptr<Array> New(size_t size);
+
+  ~Array();
+
+  size_t GetSize() const { return size_; }
+  int64_t *GetData() { return data_; }
+  const int64_t *GetData() const { return data_; }
+
+  int64_t &operator[](size_t i) { return data_[i]; }
+  int64_t operator[](size_t i) const { return data_[i]; }
+
+private:
+  Array(int64_t *data, size_t size) : data_(data), size_(size) {}
+
+private:
+  /// Elements of the array.
+  int64_t *data_;
+  /// Number of elements.
+  size_t size_;
+};
+
+/**
+ * Kernels implementing the bulk operations over arrays.
+ *
+ * Operands hold the same number of elements and are aligned to
+ * `Array::kAlignment`. Checked kernels return null on success, otherwise the
+ * error of the operation which failed, leaving the output undefined.
+ * Sums and dot products only fail if their exact result does not fit an
+ * integer, irrespective of the order in which elements are added up.
+ */
+struct ArrayKernels {
+  /// Name of the instruction set the kernels are written for.
+  const char *Name;
+  /// Element-wise checked sum.
+  const char *(*Add)(int64_t *out, const int64_t *a, const int64_t *b, size_t n);
+  /// Element-wise checked product.
+  const char *(*Mul)(int64_t *out, const int64_t *a, const int64_t *b, size_t n);
+  /// Checked sum of all elements.
+  const char *(*Sum)(int64_t &sum, const int64_t *a, size_t n);
+  /// Checked sum of the element-wise products.
+  const char *(*Dot)(int64_t &dot, const int64_t *a, const int64_t *b, size_t n);
+  /// Element-wise equality, yielding 1 or 0.
+  void (*Eq)(int64_t *out, const int64_t *a, const int64_t *b, size_t n);
+  /// Element-wise less-than comparison, yielding 1 or 0.
+  void (*Lt)(int64_t *out, const int64_t *a, const int64_t *b, size_t n);
+};
+
+/// Returns the kernels for the widest instruction set the host supports.
+const ArrayKernels &GetArrayKernels();
+/// Returns the portable kernels, operating on one element at a time.
+const ArrayKernels &GetScalarArrayKernels();
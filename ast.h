@@ -2,10 +2,16 @@
 
 #pragma once
 
+#include <cstdint>
+#include <string>
 #include <vector>
 #include <memory>
 #include <variant>
 
+#include "arena.h"
+#include "lexer.h"
+#include "symbol.h"
+
 
 /**
  * Base class for all AST nodes.
@@ -23,18 +29,24 @@ public:
     WHILE,
     IF,
     EXPR,
-    RETURN
+    RETURN,
+    LET,
+    ASSIGN
   };
 
 public:
   Kind GetKind() const { return kind_; }
+  /// Returns the location of the first token of the statement.
+  const Location &GetLocation() const { return loc_; }
 
 protected:
-  Stmt(Kind kind) : kind_(kind) { }
+  Stmt(Kind kind, const Location &loc) : kind_(kind), loc_(loc) { }
 
 private:
   /// Kind of the statement.
   Kind kind_;
+  /// Location of the statement in the source.
+  Location loc_;
 };
 
 /**
@@ -82,17 +94,43 @@ class IntExpr : public Expr {
  */
 class RefExpr : public Expr {
 public:
-  RefExpr(const std::string &name)
+  /// Kind of object a name refers to, resolved by the verifier.
+  enum class Target {
+    UNRESOLVED,
+    ARG,
+    LOCAL,
+    FUNC,
+    PROTO,
+  };
+
+public:
+  RefExpr(Symbol name)
     : Expr(Kind::REF)
     , name_(name)
   {
   }
 
-  const std::string &GetName() const { return name_; }
+  const std::string &GetName() const { return name_.GetName(); }
+  Symbol GetSymbol() const { return name_; }
+
+  Target GetTarget() const { return target_; }
+  unsigned GetArgIndex() const { return index_; }
+  unsigned GetSlot() const { return index_; }
+
+  /// Records the object the name was bound to.
+  void Resolve(Target target, unsigned index = 0) const
+  {
+    target_ = target;
+    index_ = index;
+  }
 
 private:
   /// Name of the identifier.
-  std::string name_;
+  Symbol name_;
+  /// Kind of object bound to the name, annotated by the verifier.
+  mutable Target target_ = Target::UNRESOLVED;
+  /// Index of the argument or slot of the local the name is bound to.
+  mutable unsigned index_ = 0;
 };
 
 /**
@@ -116,7 +154,7 @@ public:
   };
 
 public:
-  BinaryExpr(Kind kind, std::shared_ptr<Expr> lhs, std::shared_ptr<Expr> rhs)
+  BinaryExpr(Kind kind, Expr *lhs, Expr *rhs)
     : Expr(Expr::Kind::BINARY)
     , kind_(kind), lhs_(lhs), rhs_(rhs)
   {
@@ -127,13 +165,22 @@ public:
   const Expr &GetLHS() const { return *lhs_; }
   const Expr &GetRHS() const { return *rhs_; }
 
+  /// Checks whether the operator compares its operands.
+  bool IsComparison() const { return kind_ >= Kind::DEQ; }
+  /// Checks whether the arithmetic can neither overflow nor trap.
+  bool IsSafe() const { return safe_; }
+  /// Records that the operation cannot fail, as proven by the verifier.
+  void MarkSafe() const { safe_ = true; }
+
 private:
   /// Operator kind.
   Kind kind_;
   /// Left-hand operand.
-  std::shared_ptr<Expr> lhs_;
+  Expr *lhs_;
   /// Right-hand operand.
-  std::shared_ptr<Expr> rhs_;
+  Expr *rhs_;
+  /// Flag set if arithmetic does not need to be checked at runtime.
+  mutable bool safe_ = false;
 };
 
 /**
@@ -141,12 +188,12 @@ private:
  */
 class CallExpr : public Expr {
 public:
-  using ArgList = std::vector<std::shared_ptr<Expr>>;
+  using ArgList = std::vector<Expr *>;
 
 public:
   CallExpr(
-      std::shared_ptr<Expr> callee,
-      std::vector<std::shared_ptr<Expr>> &&args)
+      Expr *callee,
+      std::vector<Expr *> &&args)
     : Expr(Kind::CALL)
     , callee_(callee)
     , args_(std::move(args))
@@ -156,11 +203,13 @@ public:
   const Expr &GetCallee() const { return *callee_; }
 
   size_t arg_size() const { return args_.size(); }
+  ArgList::const_iterator arg_begin() const { return args_.begin(); }
+  ArgList::const_iterator arg_end() const { return args_.end(); }
   ArgList::const_reverse_iterator arg_rbegin() const { return args_.rbegin(); }
   ArgList::const_reverse_iterator arg_rend() const { return args_.rend(); }
 
 private:
-  std::shared_ptr<Expr> callee_;
+  Expr *callee_;
   ArgList args_;
 };
 
@@ -169,11 +218,11 @@ private:
  */
 class BlockStmt final : public Stmt {
 public:
-  using BlockList = std::vector<std::shared_ptr<Stmt>>;
+  using BlockList = std::vector<Stmt *>;
 
 public:
-  BlockStmt(std::vector<std::shared_ptr<Stmt>> &&body)
-    : Stmt(Kind::BLOCK)
+  BlockStmt(const Location &loc, std::vector<Stmt *> &&body)
+    : Stmt(Kind::BLOCK, loc)
     , body_(body)
   {
   }
@@ -191,8 +240,8 @@ private:
  */
 class ExprStmt final : public Stmt {
 public:
-  ExprStmt(std::shared_ptr<Expr> expr)
-    : Stmt(Kind::EXPR)
+  ExprStmt(const Location &loc, Expr *expr)
+    : Stmt(Kind::EXPR, loc)
     , expr_(expr)
   {
   }
@@ -201,7 +250,7 @@ public:
 
 private:
   /// Top-level expression.
-  std::shared_ptr<Expr> expr_;
+  Expr *expr_;
 };
 
 /**
@@ -209,8 +258,8 @@ private:
  */
 class ReturnStmt final : public Stmt {
 public:
-  ReturnStmt(std::shared_ptr<Expr> expr)
-    : Stmt(Kind::RETURN)
+  ReturnStmt(const Location &loc, Expr *expr)
+    : Stmt(Kind::RETURN, loc)
     , expr_(expr)
   {
   }
@@ -219,7 +268,68 @@ public:
 
 private:
   /// Expression to be returned.
-  std::shared_ptr<Expr> expr_;
+  Expr *expr_;
+};
+
+/**
+ * Declaration of a local variable, visible until the end of its block.
+ *
+ * let <name>: <type> = <expr>
+ */
+class LetStmt final : public Stmt {
+public:
+  LetStmt(const Location &loc, Symbol name, Symbol type, Expr *init)
+    : Stmt(Kind::LET, loc)
+    , name_(name)
+    , type_(type)
+    , init_(init)
+  {
+  }
+
+  const std::string &GetName() const { return name_.GetName(); }
+  Symbol GetSymbol() const { return name_; }
+  const std::string &GetType() const { return type_.GetName(); }
+  Symbol GetTypeSymbol() const { return type_; }
+  const Expr &GetInit() const { return *init_; }
+
+  /// Returns the frame slot of the variable, assigned by the verifier.
+  unsigned GetSlot() const { return slot_; }
+  /// Records the frame slot of the variable.
+  void Allocate(unsigned slot) const { slot_ = slot; }
+
+private:
+  /// Name of the variable.
+  Symbol name_;
+  /// Name of the type of the variable.
+  Symbol type_;
+  /// Initial value of the variable.
+  Expr *init_;
+  /// Slot of the variable among the live locals of the frame.
+  mutable unsigned slot_ = 0;
+};
+
+/**
+ * Assignment to a local variable.
+ *
+ * <name> = <expr>
+ */
+class AssignStmt final : public Stmt {
+public:
+  AssignStmt(const Location &loc, RefExpr *target, Expr *value)
+    : Stmt(Kind::ASSIGN, loc)
+    , target_(target)
+    , value_(value)
+  {
+  }
+
+  const RefExpr &GetTarget() const { return *target_; }
+  const Expr &GetValue() const { return *value_; }
+
+private:
+  /// Variable being assigned.
+  RefExpr *target_;
+  /// Value stored in the variable.
+  Expr *value_;
 };
 
 /**
@@ -229,8 +339,8 @@ private:
  */
 class WhileStmt final : public Stmt {
 public:
-  WhileStmt(std::shared_ptr<Expr> cond, std::shared_ptr<Stmt> stmt)
-    : Stmt(Kind::WHILE)
+  WhileStmt(const Location &loc, Expr *cond, Stmt *stmt)
+    : Stmt(Kind::WHILE, loc)
     , cond_(cond)
     , stmt_(stmt)
   {
@@ -241,9 +351,9 @@ public:
 
 private:
   /// Condition for the loop.
-  std::shared_ptr<Expr> cond_;
+  Expr *cond_;
   /// Expression to be executed in the loop body.
-  std::shared_ptr<Stmt> stmt_;
+  Stmt *stmt_;
 };
 
 /**
@@ -253,8 +363,8 @@ private:
  */
 class IfStmt final : public Stmt {
 public: 
-  IfStmt(std::shared_ptr<Expr> cond, std::shared_ptr<Stmt> stmt, std::shared_ptr<Stmt> elseStmt)
-    : Stmt(Kind::IF)
+  IfStmt(const Location &loc, Expr *cond, Stmt *stmt, Stmt *elseStmt)
+    : Stmt(Kind::IF, loc)
     , cond_(cond)
     , stmt_(stmt)
     , elseStmt_(elseStmt)
@@ -263,15 +373,15 @@ public:
 
   const Expr &GetCond() const { return *cond_; }
   const Stmt &GetStmt() const { return *stmt_; }
-  std::shared_ptr<Stmt> GetElseStmt() const { return elseStmt_; }
+  const Stmt *GetElseStmt() const { return elseStmt_; }
 
 private:
   /// Condition for then branch.
-  std::shared_ptr<Expr> cond_;
+  Expr *cond_;
   /// Expression to be executed in then branch.
-  std::shared_ptr<Stmt> stmt_;
+  Stmt *stmt_;
   /// Expression to be executed in else branch.
-  std::shared_ptr<Stmt> elseStmt_;
+  Stmt *elseStmt_;
 };
 
 
@@ -280,14 +390,13 @@ private:
  */
 class FuncOrProtoDecl : public Node {
 public:
-  using ArgList = std::vector<std::pair<std::string, std::string>>;
+  /// Names of the arguments, paired with the names of their types.
+  using ArgList = std::vector<std::pair<Symbol, Symbol>>;
 
 public:
-  FuncOrProtoDecl(
-      const std::string &name,
-      std::vector<std::pair<std::string, std::string>> &&args,
-      const std::string &type)
-    : name_(name)
+  FuncOrProtoDecl(const Location &loc, Symbol name, ArgList &&args, Symbol type)
+    : loc_(loc)
+    , name_(name)
     , args_(std::move(args))
     , type_(type)
   {
@@ -295,19 +404,25 @@ public:
 
   virtual ~FuncOrProtoDecl();
 
-  const std::string &GetName() const { return name_; }
+  const Location &GetLocation() const { return loc_; }
+  const std::string &GetName() const { return name_.GetName(); }
+  Symbol GetSymbol() const { return name_; }
+  const std::string &GetType() const { return type_.GetName(); }
+  Symbol GetTypeSymbol() const { return type_; }
 
   size_t arg_size() const { return args_.size(); }
   ArgList::const_iterator arg_begin() const { return args_.begin(); }
   ArgList::const_iterator arg_end() const { return args_.end(); }
 
 private:
+  /// Location of the declaration in the source.
+  const Location loc_;
   /// Name of the declaration.
-  const std::string name_;
+  const Symbol name_;
   /// Argument list.
   ArgList args_;
   /// Return type identifier.
-  const std::string &type_;
+  const Symbol type_;
 };
 
 /**
@@ -318,11 +433,12 @@ private:
 class ProtoDecl final : public FuncOrProtoDecl {
 public:
   ProtoDecl(
-      const std::string &name,
-      std::vector<std::pair<std::string, std::string>> &&args,
-      const std::string &type,
+      const Location &loc,
+      Symbol name,
+      ArgList &&args,
+      Symbol type,
       const std::string &primitive)
-    : FuncOrProtoDecl(name, std::move(args), type)
+    : FuncOrProtoDecl(loc, name, std::move(args), type)
     , primitive_(primitive)
   {
   }
@@ -341,11 +457,12 @@ private:
 class FuncDecl final : public FuncOrProtoDecl {
 public:
   FuncDecl(
-      const std::string &name,
-      std::vector<std::pair<std::string, std::string>> &&args,
-      const std::string &type,
-      std::shared_ptr<BlockStmt> body)
-    : FuncOrProtoDecl(name, std::move(args), type)
+      const Location &loc,
+      Symbol name,
+      ArgList &&args,
+      Symbol type,
+      BlockStmt *body)
+    : FuncOrProtoDecl(loc, name, std::move(args), type)
     , body_(body)
   {
   }
@@ -353,18 +470,21 @@ public:
   const BlockStmt &GetBody() const { return *body_; }
 
 private:
-  std::shared_ptr<BlockStmt> body_;
+  BlockStmt *body_;
 };
 
 /// Alternative for a toplevel construct.
 using TopLevelStmt = std::variant
-    < std::shared_ptr<FuncDecl>
-    , std::shared_ptr<ProtoDecl>
-    , std::shared_ptr<Stmt>
+    < FuncDecl *
+    , ProtoDecl *
+    , Stmt *
     >;
 
 /**
  * Main node of the AST, capturing information about the program.
+ *
+ * The module owns the arena all its nodes are allocated from, while nodes
+ * refer to each other through plain pointers.
  */
 class Module final : public Node {
 public:
@@ -372,8 +492,10 @@ public:
 
 public:
   Module(
+      std::unique_ptr<Arena> &&arena,
       std::vector<TopLevelStmt> &&body)
-    : body_(body)
+    : arena_(std::move(arena))
+    , body_(std::move(body))
   {
   }
 
@@ -381,5 +503,8 @@ public:
   BlockList::const_iterator end() const { return body_.end(); }
 
 private:
+  /// Storage for all nodes of the module.
+  std::unique_ptr<Arena> arena_;
+  /// Top-level declarations and statements.
   BlockList body_;
 };
@@ -0,0 +1,615 @@
+// This file is part of the IMP project.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "array.h"
+#include "ast.h"
+#include "codegen.h"
+#include "interp.h"
+#include "io.h"
+#include "lexer.h"
+#include "optimiser.h"
+#include "parser.h"
+#include "regcodegen.h"
+#include "verifier.h"
+
+
+
+/// Version of the layout of the report, to be bumped when records change.
+static constexpr unsigned kReportVersion = 1;
+/// Number of measurements, out of which the fastest one is reported.
+static constexpr unsigned kRepetitions = 5;
+
+/**
+ * Program run by the benchmark, along with the input fed to it.
+ */
+struct Workload {
+  /// Name of the example in the examples directory.
+  const char *Name;
+  /// Number of times the program is executed in a single measurement.
+  unsigned Runs;
+  /// Generator for the standard input of a single run.
+  std::function<std::string()> Input;
+};
+
+/**
+ * Sequence of instructions repeated by a dispatch microbenchmark.
+ *
+ * Kernels leave the stack as they found it, with the loop counter on top.
+ */
+struct Kernel {
+  /// Name of the benchmark.
+  const char *Name;
+  /// Emits a single copy of the sequence.
+  std::function<void(class Assembler &)> Body;
+};
+
+/**
+ * Redirects the streams of the runtime for the duration of a run.
+ */
+class Redirect final {
+public:
+  Redirect(const std::string &input)
+  {
+    IO::Get().Redirect(input, output_);
+  }
+
+  ~Redirect()
+  {
+    IO::Get().Reset();
+  }
+
+private:
+  std::string output_;
+};
+
+/**
+ * Builds stack bytecode by hand, bypassing the code generator.
+ */
+class Assembler final {
+public:
+  /// Returns the address of the next instruction.
+  size_t Here() const { return code_.size(); }
+
+  /// Emits an opcode followed by its operands.
+  template <typename... Ts>
+  void Emit(Opcode op, const Ts &...operands)
+  {
+    code_.push_back(static_cast<uint8_t>(op));
+    (Append(operands), ...);
+  }
+
+  /// Overwrites the address operand of the instruction at an address.
+  void Patch(size_t inst, size_t addr)
+  {
+    memcpy(code_.data() + inst + sizeof(Opcode), &addr, sizeof(addr));
+  }
+
+  /// Hands the code over to a program.
+  std::unique_ptr<Program> Finish()
+  {
+    return std::make_unique<Program>(std::move(code_));
+  }
+
+private:
+  template <typename T>
+  void Append(const T &t)
+  {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&t);
+    code_.insert(code_.end(), bytes, bytes + sizeof(T));
+  }
+
+private:
+  std::vector<uint8_t> code_;
+};
+
+/**
+ * Single line of the JSON report.
+ *
+ * Records list their fields in a fixed order, so reports of different
+ * builds can be compared line by line.
+ */
+class Record final {
+public:
+  Record(const char *suite, const std::string &name)
+  {
+    Add("suite", suite);
+    Add("name", name);
+  }
+
+  Record &Add(const char *key, const std::string &value)
+  {
+    Key(key);
+    os_ << '"';
+    for (char c : value) {
+      if (c == '"' || c == '\\') {
+        os_ << '\\';
+      }
+      os_ << c;
+    }
+    os_ << '"';
+    return *this;
+  }
+
+  Record &Add(const char *key, const char *value)
+  {
+    return Add(key, std::string(value));
+  }
+
+  Record &Add(const char *key, uint64_t value)
+  {
+    Key(key);
+    os_ << value;
+    return *this;
+  }
+
+  Record &Add(const char *key, double value)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", value);
+    Key(key);
+    os_ << buf;
+    return *this;
+  }
+
+  std::string str() const { return "{" + os_.str() + "}"; }
+
+private:
+  void Key(const char *key)
+  {
+    os_ << (os_.tellp() > 0 ? ", " : "") << '"' << key << "\": ";
+  }
+
+private:
+  std::ostringstream os_;
+};
+
+/**
+ * Collects the records of the report, writing them out as a JSON object.
+ */
+class Report final {
+public:
+  void Add(const Record &record) { records_.push_back(record.str()); }
+
+  void Write(std::ostream &os) const
+  {
+    os << "{" << std::endl;
+    os << "  \"version\": " << kReportVersion << "," << std::endl;
+    os << "  \"results\": [" << std::endl;
+    for (size_t i = 0; i < records_.size(); ++i) {
+      os << "    " << records_[i] << (i + 1 < records_.size() ? "," : "");
+      os << std::endl;
+    }
+    os << "  ]" << std::endl;
+    os << "}" << std::endl;
+  }
+
+private:
+  std::vector<std::string> records_;
+};
+
+// -----------------------------------------------------------------------------
+template <typename F>
+static double Time(F &&f)
+{
+  double best = 0.0;
+  for (unsigned rep = 0; rep < kRepetitions; ++rep) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    double time = std::chrono::duration<double>(end - start).count();
+    if (rep == 0 || time < best) {
+      best = time;
+    }
+  }
+  return best;
+}
+
+// -----------------------------------------------------------------------------
+static std::string RecordInput(unsigned n)
+{
+  std::ostringstream os;
+  for (unsigned i = 0; i < n; ++i) {
+    os << "1 " << i << " " << (n - i) << "\n";
+  }
+  os << "0\n";
+  return os.str();
+}
+
+// -----------------------------------------------------------------------------
+static std::string GenerateSource(unsigned funcs)
+{
+  // Functions call their predecessors, exercising all kinds of statements.
+  std::ostringstream os;
+  os << "func print_int(a: int): int = \"print_int\"\n";
+  os << "func read_int(): int = \"read_int\"\n\n";
+  for (unsigned i = 0; i < funcs; ++i) {
+    os << "func f" << i << "(a: int, b: int): int {\n";
+    os << "  if (a < b) { return a * 3 + b - " << i << " };\n";
+    os << "  while (a == b + 1) { print_int(a % 7) };\n";
+    if (i == 0) {
+      os << "  return f0(a - 1, b + 2)\n";
+    } else {
+      os << "  return f" << (i - 1) << "(a / 2, b) + 1\n";
+    }
+    os << "}\n\n";
+  }
+  os << "print_int(f" << (funcs - 1) << "(read_int(), read_int()))\n";
+  return os.str();
+}
+
+// -----------------------------------------------------------------------------
+static std::unique_ptr<Program> Compile(
+    const std::string &path,
+    const std::string &bytecode)
+{
+  Lexer lexer(path);
+  auto ast = Parser(lexer).ParseModule();
+  Verifier().Verify(*ast);
+  ast = Optimiser().Optimise(*ast);
+  if (bytecode == "register") {
+    return RegCodegen().Translate(*ast);
+  }
+  auto prog = Codegen().Translate(*ast);
+  if (bytecode == "decoded") {
+    prog->Decode();
+  }
+  return prog;
+}
+
+// -----------------------------------------------------------------------------
+static void BenchFrontend(Report &report)
+{
+  // The lexer maps its input from a file.
+  auto path = std::filesystem::temp_directory_path() /
+      ("imp_bench_" + std::to_string(getpid()) + ".imp");
+  const std::string source = GenerateSource(40000);
+  {
+    std::ofstream os(path);
+    os << source;
+    if (!os) {
+      throw std::runtime_error("cannot write " + path.string());
+    }
+  }
+
+  uint64_t tokens = 0;
+  double lex = Time([&] {
+    Lexer lexer(path);
+    tokens = 0;
+    for (const Token *tk = &lexer.GetToken(); *tk; tk = &lexer.Next()) {
+      ++tokens;
+    }
+  });
+  report.Add(Record("frontend", "lex")
+      .Add("bytes", static_cast<uint64_t>(source.size()))
+      .Add("tokens", tokens)
+      .Add("seconds", lex)
+      .Add("mb_per_s", source.size() / lex / 1e6));
+
+  // Each phase runs on the output of the previous one, built once.
+  std::unique_ptr<Module> ast;
+  double parse = Time([&] {
+    Lexer lexer(path);
+    ast = Parser(lexer).ParseModule();
+  });
+  double verify = Time([&] { Verifier().Verify(*ast); });
+  std::unique_ptr<Module> opt;
+  double optimise = Time([&] { opt = Optimiser().Optimise(*ast); });
+  std::unique_ptr<Program> prog;
+  double codegen = Time([&] { prog = Codegen().Translate(*opt); });
+  double serial = Time([&] {
+    Codegen codegen;
+    codegen.SetThreads(1);
+    codegen.Translate(*opt);
+  });
+  double lazy = Time([&] { Codegen().Translate(*opt, true); });
+  double regcodegen = Time([&] { RegCodegen().Translate(*opt); });
+  double decode = Time([&] { prog->Decode(); });
+  std::filesystem::remove(path);
+
+  const std::pair<const char *, double> phases[] = {
+    { "parse", parse },
+    { "verify", verify },
+    { "optimise", optimise },
+    { "codegen", codegen },
+    { "codegen_serial", serial },
+    { "codegen_lazy", lazy },
+    { "regcodegen", regcodegen },
+    { "decode", decode },
+  };
+  for (auto &[name, time] : phases) {
+    report.Add(Record("frontend", name)
+        .Add("bytes", static_cast<uint64_t>(source.size()))
+        .Add("seconds", time)
+        .Add("mb_per_s", source.size() / time / 1e6));
+  }
+}
+
+// -----------------------------------------------------------------------------
+static void BenchDispatch(Report &report)
+{
+  // Kernels are unrolled inside a counted loop, whose cost is measured by
+  // an empty kernel and subtracted from the others.
+  constexpr int64_t kIterations = 200000;
+  constexpr unsigned kUnroll = 16;
+  const Kernel kernels[] = {
+    { "loop", [] (Assembler &) {} },
+    { "push_pop", [] (Assembler &a) {
+        a.Emit(Opcode::PUSH_INT, int64_t(7));
+        a.Emit(Opcode::POP);
+    } },
+    { "peek_pop", [] (Assembler &a) {
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::POP);
+    } },
+    { "add", [] (Assembler &a) {
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::PEEK, 1u);
+        a.Emit(Opcode::ADD);
+        a.Emit(Opcode::POP);
+    } },
+    { "add_unchecked", [] (Assembler &a) {
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::PEEK, 1u);
+        a.Emit(Opcode::ADD_UNCHECKED);
+        a.Emit(Opcode::POP);
+    } },
+    { "peek_add", [] (Assembler &a) {
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::PEEK_ADD, 1u);
+        a.Emit(Opcode::POP);
+    } },
+    { "mul", [] (Assembler &a) {
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::PEEK, 1u);
+        a.Emit(Opcode::MUL);
+        a.Emit(Opcode::POP);
+    } },
+    { "div", [] (Assembler &a) {
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::PUSH_INT, int64_t(3));
+        a.Emit(Opcode::DIV);
+        a.Emit(Opcode::POP);
+    } },
+    { "compare", [] (Assembler &a) {
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::PUSH_INT, int64_t(3));
+        a.Emit(Opcode::SM);
+        a.Emit(Opcode::POP);
+    } },
+    { "jump", [] (Assembler &a) {
+        a.Emit(Opcode::JUMP, a.Here() + sizeof(Opcode) + sizeof(size_t));
+    } },
+    { "branch", [] (Assembler &a) {
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::PUSH_INT, int64_t(0));
+        a.Emit(Opcode::JUMP_IF_EQ, a.Here() + sizeof(Opcode) + sizeof(size_t));
+    } },
+    { "call_ret", [] (Assembler &a) {
+        // The callee is placed at address 0 and skipped on entry.
+        a.Emit(Opcode::CALL_DIRECT, size_t(9), 0u);
+        a.Emit(Opcode::POP);
+    } },
+  };
+
+  const std::pair<const char *, Interp::Dispatch> dispatches[] = {
+    { "switch", Interp::Dispatch::SWITCH },
+#if IMP_HAS_THREADED_DISPATCH
+    { "threaded", Interp::Dispatch::THREADED },
+#endif
+  };
+
+  for (auto &[dispatchName, dispatch] : dispatches) {
+    for (const char *bytecode : { "stack", "decoded" }) {
+      double baseline = 0.0;
+      for (auto &kernel : kernels) {
+        Assembler a;
+
+        // Shared callee, returning 0: JUMP over it, PUSH_INT and RET.
+        size_t skip = a.Here();
+        a.Emit(Opcode::JUMP, size_t(0));
+        a.Emit(Opcode::PUSH_INT, int64_t(0));
+        a.Emit(Opcode::RET, 0u, 0u);
+        a.Patch(skip, a.Here());
+
+        // Counted loop running the unrolled kernel.
+        a.Emit(Opcode::PUSH_INT, kIterations);
+        size_t loop = a.Here();
+        a.Emit(Opcode::PEEK, 0u);
+        a.Emit(Opcode::PUSH_INT, int64_t(0));
+        size_t exit = a.Here();
+        a.Emit(Opcode::JUMP_IF_EQ, size_t(0));
+        for (unsigned i = 0; i < kUnroll; ++i) {
+          kernel.Body(a);
+        }
+        a.Emit(Opcode::PUSH_INT, int64_t(1));
+        a.Emit(Opcode::SUB);
+        a.Emit(Opcode::JUMP, loop);
+        a.Patch(exit, a.Here());
+        a.Emit(Opcode::POP);
+        a.Emit(Opcode::STOP);
+
+        auto prog = a.Finish();
+        if (strcmp(bytecode, "decoded") == 0) {
+          prog->Decode();
+        }
+        uint64_t count = Interp(*prog).Count();
+        double time = Time([&] { Interp(*prog).Run(dispatch); });
+        if (strcmp(kernel.Name, "loop") == 0) {
+          baseline = time;
+        }
+        double ns = (time - baseline) * 1e9 / (kIterations * kUnroll);
+        report.Add(Record("dispatch", kernel.Name)
+            .Add("dispatch", dispatchName)
+            .Add("bytecode", bytecode)
+            .Add("instructions", count)
+            .Add("seconds", time)
+            .Add("ns_per_kernel", ns)
+            .Add("minstr_per_s", count / time / 1e6));
+      }
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+static void BenchExamples(Report &report, const std::string &dir)
+{
+  const Workload workloads[] = {
+    { "while", 1, [] { return RecordInput(200000); } },
+    { "P02", 20000, [] { return "4611686018427387903 1\n"; } },
+    { "func", 20000, [] { return "4611686018427387903 1\n"; } },
+  };
+
+  const std::pair<const char *, Interp::Dispatch> dispatches[] = {
+    { "switch", Interp::Dispatch::SWITCH },
+#if IMP_HAS_THREADED_DISPATCH
+    { "threaded", Interp::Dispatch::THREADED },
+#endif
+  };
+
+  for (const auto &w : workloads) {
+    const std::string input = w.Input();
+    for (const char *bytecode : { "stack", "decoded", "register" }) {
+      std::unique_ptr<Program> prog;
+      try {
+        prog = Compile(dir + "/" + w.Name + ".imp", bytecode);
+      } catch (const std::exception &ex) {
+        report.Add(Record("examples", w.Name)
+            .Add("bytecode", bytecode)
+            .Add("error", ex.what()));
+        break;
+      }
+
+      uint64_t count = 0;
+      for (unsigned i = 0; i < w.Runs; ++i) {
+        Redirect redirect(input);
+        count += Interp(*prog).Count();
+      }
+
+      for (const auto &[name, dispatch] : dispatches) {
+        double time = Time([&] {
+          for (unsigned i = 0; i < w.Runs; ++i) {
+            Redirect redirect(input);
+            Interp(*prog).Run(dispatch);
+          }
+        });
+        report.Add(Record("examples", w.Name)
+            .Add("dispatch", name)
+            .Add("bytecode", bytecode)
+            .Add("runs", static_cast<uint64_t>(w.Runs))
+            .Add("instructions", count)
+            .Add("seconds", time)
+            .Add("minstr_per_s", count / time / 1e6));
+      }
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+static void BenchArrays(Report &report)
+{
+  // Operands are small enough to stay in cache, with elements fitting the
+  // fast paths of the vector kernels which check for overflow.
+  constexpr size_t kElements = 1 << 14;
+  constexpr unsigned kRuns = 2000;
+  auto a = Array::New(kElements), b = Array::New(kElements);
+  auto out = Array::New(kElements);
+  if (!a || !b || !out) {
+    throw std::runtime_error("cannot allocate arrays");
+  }
+  for (size_t i = 0; i < kElements; ++i) {
+    (*a)[i] = static_cast<int64_t>(i % 1000) - 500;
+    (*b)[i] = static_cast<int64_t>(i * 7 % 1000) - 500;
+  }
+
+  using Op = std::function<const char *(const ArrayKernels &)>;
+  const std::pair<const char *, Op> ops[] = {
+    { "add", [&] (auto &k) {
+        return k.Add(out->GetData(), a->GetData(), b->GetData(), kElements);
+    } },
+    { "mul", [&] (auto &k) {
+        return k.Mul(out->GetData(), a->GetData(), b->GetData(), kElements);
+    } },
+    { "sum", [&] (auto &k) {
+        int64_t sum;
+        return k.Sum(sum, a->GetData(), kElements);
+    } },
+    { "dot", [&] (auto &k) {
+        int64_t dot;
+        return k.Dot(dot, a->GetData(), b->GetData(), kElements);
+    } },
+    { "eq", [&] (auto &k) {
+        k.Eq(out->GetData(), a->GetData(), b->GetData(), kElements);
+        return static_cast<const char *>(nullptr);
+    } },
+    { "lt", [&] (auto &k) {
+        k.Lt(out->GetData(), a->GetData(), b->GetData(), kElements);
+        return static_cast<const char *>(nullptr);
+    } },
+  };
+
+  // The portable kernels are measured even if they are the best available.
+  for (auto *kernels : { &GetScalarArrayKernels(), &GetArrayKernels() }) {
+    for (auto &[name, op] : ops) {
+      double time = Time([&] {
+        for (unsigned i = 0; i < kRuns; ++i) {
+          if (auto *err = op(*kernels)) {
+            throw std::runtime_error(err);
+          }
+        }
+      });
+      uint64_t elements = static_cast<uint64_t>(kElements) * kRuns;
+      report.Add(Record("arrays", name)
+          .Add("kernels", kernels->Name)
+          .Add("elements", elements)
+          .Add("seconds", time)
+          .Add("melem_per_s", elements / time / 1e6));
+    }
+    if (kernels == &GetArrayKernels()) {
+      break;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  // Suites can be selected by name, all of them running by default.
+  std::string suite;
+  int argi = 1;
+  if (argi + 1 < argc && strcmp(argv[argi], "--suite") == 0) {
+    suite = argv[argi + 1];
+    argi += 2;
+  }
+  const std::string dir = argi < argc ? argv[argi] : IMP_EXAMPLES_DIR;
+
+  Report report;
+  try {
+    if (suite.empty() || suite == "frontend") {
+      BenchFrontend(report);
+    }
+    if (suite.empty() || suite == "dispatch") {
+      BenchDispatch(report);
+    }
+    if (suite.empty() || suite == "examples") {
+      BenchExamples(report, dir);
+    }
+    if (suite.empty() || suite == "arrays") {
+      BenchArrays(report);
+    }
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  report.Write(std::cout);
+  return EXIT_SUCCESS;
+}
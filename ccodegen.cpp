@@ -0,0 +1,327 @@
+// This file is part of the IMP project.
+
+#include <cassert>
+
+#include "ccodegen.h"
+#include "arith.h"
+#include "ast.h"
+
+
+
+// -----------------------------------------------------------------------------
+void CCodegen::Translate(const Module &mod, std::ostream &os)
+{
+  os << "/* Generated by imp. */\n";
+  os << "#include <stdint.h>\n";
+  os << "\n";
+  os << "void *imp_runtime_lookup(const char *name);\n";
+  os << "int64_t imp_runtime_call(void *fn, const int64_t *args, uint32_t nargs);\n";
+  os << "__attribute__((noreturn)) void imp_runtime_error(const char *msg);\n";
+
+  // Checked arithmetic, used unless the verifier proved an operation safe.
+  for (auto [name, msg] : { std::pair{ "add", kAddOverflow },
+                            std::pair{ "sub", kSubOverflow },
+                            std::pair{ "mul", kMulOverflow } }) {
+    os << "\n";
+    os << "static inline int64_t imp_" << name << "(int64_t a, int64_t b)\n";
+    os << "{\n";
+    os << "  int64_t r;\n";
+    os << "  if (__builtin_" << name << "_overflow(a, b, &r)) ";
+    os << "imp_runtime_error(\"" << msg << "\");\n";
+    os << "  return r;\n";
+    os << "}\n";
+  }
+  os << "\n";
+  os << "static inline int64_t imp_div(int64_t a, int64_t b)\n";
+  os << "{\n";
+  os << "  if (b == 0) imp_runtime_error(\"" << kDivByZero << "\");\n";
+  os << "  if (b == -1 && a == INT64_MIN) imp_runtime_error(\"" << kDivOverflow << "\");\n";
+  os << "  return b == -1 ? -a : a / b;\n";
+  os << "}\n";
+  os << "\n";
+  os << "static inline int64_t imp_mod(int64_t a, int64_t b)\n";
+  os << "{\n";
+  os << "  if (b == 0) imp_runtime_error(\"" << kDivByZero << "\");\n";
+  os << "  return b == -1 ? 0 : a % b;\n";
+  os << "}\n";
+
+  // Wrap prototypes into functions invoking the runtime method they name.
+  for (auto item : mod) {
+    if (!std::holds_alternative<ProtoDecl *>(item)) {
+      continue;
+    }
+    auto &proto = *std::get<1>(item);
+    auto &name = proto.GetName();
+    protos_.emplace(name, &proto);
+
+    os << "\n";
+    os << "static void *imp_h_" << name << ";\n";
+    os << Signature(proto, "imp_p_") << "\n";
+    os << "{\n";
+    if (proto.arg_size() == 0) {
+      os << "  return imp_runtime_call(imp_h_" << name << ", 0, 0);\n";
+    } else {
+      os << "  const int64_t args[] = {";
+      for (auto it = proto.arg_begin(), end = proto.arg_end(); it != end; ++it) {
+        os << (it == proto.arg_begin() ? " " : ", ") << "imp_a_" << it->first;
+      }
+      os << " };\n";
+      os << "  return imp_runtime_call(imp_h_" << name << ", args, ";
+      os << proto.arg_size() << ");\n";
+    }
+    os << "}\n";
+  }
+
+  // Declare all functions, as they can be called before their definition.
+  os << "\n";
+  for (auto item : mod) {
+    if (std::holds_alternative<FuncDecl *>(item)) {
+      os << Signature(*std::get<0>(item), "imp_f_") << ";\n";
+    }
+  }
+
+  for (auto item : mod) {
+    if (!std::holds_alternative<FuncDecl *>(item)) {
+      continue;
+    }
+    LowerFuncDecl(*std::get<0>(item));
+    os << "\n" << out_.str();
+    out_.str("");
+  }
+
+  // Top-level statements run in main, once the prototypes are bound.
+  indent_ = 1;
+  for (auto &[name, proto] : protos_) {
+    Line("imp_h_" + name + " = imp_runtime_lookup(\"" + proto->GetPrimitiveName() + "\");");
+  }
+  for (auto item : mod) {
+    if (std::holds_alternative<Stmt *>(item)) {
+      LowerStmt(*std::get<2>(item));
+    }
+  }
+  Line("return 0;");
+  indent_ = 0;
+
+  os << "\n";
+  os << "int main(void)\n";
+  os << "{\n";
+  os << out_.str();
+  os << "}\n";
+  out_.str("");
+}
+
+// -----------------------------------------------------------------------------
+void CCodegen::LowerStmt(const Stmt &stmt)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      return LowerBlockStmt(static_cast<const BlockStmt &>(stmt));
+    }
+    case Stmt::Kind::WHILE: {
+      return LowerWhileStmt(static_cast<const WhileStmt &>(stmt));
+    }
+    case Stmt::Kind::EXPR: {
+      auto value = LowerExpr(static_cast<const ExprStmt &>(stmt).GetExpr());
+      Line("(void)" + value + ";");
+      return;
+    }
+    case Stmt::Kind::RETURN: {
+      auto value = LowerExpr(static_cast<const ReturnStmt &>(stmt).GetExpr());
+      Line("return " + value + ";");
+      return;
+    }
+    case Stmt::Kind::IF: {
+      return LowerIfStmt(static_cast<const IfStmt &>(stmt));
+    }
+    case Stmt::Kind::LET: {
+      return LowerLetStmt(static_cast<const LetStmt &>(stmt));
+    }
+    case Stmt::Kind::ASSIGN: {
+      auto &assign = static_cast<const AssignStmt &>(stmt);
+      auto &target = assign.GetTarget();
+      auto value = LowerExpr(assign.GetValue());
+      Line(Local(target.GetName(), target.GetSlot()) + " = " + value + ";");
+      return;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void CCodegen::LowerBlockStmt(const BlockStmt &blockStmt)
+{
+  Line("{");
+  ++indent_;
+  for (auto &stmt : blockStmt) {
+    LowerStmt(*stmt);
+  }
+  --indent_;
+  Line("}");
+}
+
+// -----------------------------------------------------------------------------
+void CCodegen::LowerWhileStmt(const WhileStmt &whileStmt)
+{
+  // The condition might need temporaries, so it is evaluated in the body.
+  Line("for (;;) {");
+  ++indent_;
+  auto cond = LowerExpr(whileStmt.GetCond());
+  Line("if (!" + cond + ") break;");
+  LowerBody(whileStmt.GetStmt());
+  --indent_;
+  Line("}");
+}
+
+// -----------------------------------------------------------------------------
+void CCodegen::LowerIfStmt(const IfStmt &ifStmt)
+{
+  auto cond = LowerExpr(ifStmt.GetCond());
+  Line("if (" + cond + ")");
+  LowerBody(ifStmt.GetStmt());
+  if (auto elseStmt = ifStmt.GetElseStmt()) {
+    Line("else");
+    LowerBody(*elseStmt);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void CCodegen::LowerLetStmt(const LetStmt &letStmt)
+{
+  auto init = LowerExpr(letStmt.GetInit());
+  Line("int64_t " + Local(letStmt.GetName(), letStmt.GetSlot()) + " = " + init + ";");
+}
+
+// -----------------------------------------------------------------------------
+void CCodegen::LowerBody(const Stmt &stmt)
+{
+  // Temporaries cannot be declared in an unbraced branch.
+  if (stmt.GetKind() == Stmt::Kind::BLOCK) {
+    return LowerBlockStmt(static_cast<const BlockStmt &>(stmt));
+  }
+  Line("{");
+  ++indent_;
+  LowerStmt(stmt);
+  --indent_;
+  Line("}");
+}
+
+// -----------------------------------------------------------------------------
+std::string CCodegen::LowerExpr(const Expr &expr)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      auto &ref = static_cast<const RefExpr &>(expr);
+      if (ref.GetTarget() == RefExpr::Target::LOCAL) {
+        return Local(ref.GetName(), ref.GetSlot());
+      }
+      assert(ref.GetTarget() == RefExpr::Target::ARG && "function as value");
+      return "imp_a_" + ref.GetName();
+    }
+    case Expr::Kind::BINARY: {
+      return LowerBinaryExpr(static_cast<const BinaryExpr &>(expr));
+    }
+    case Expr::Kind::CALL: {
+      return LowerCallExpr(static_cast<const CallExpr &>(expr));
+    }
+    case Expr::Kind::INT: {
+      // Literals are spelled as unsigned to allow the full 64-bit range.
+      auto value = static_cast<const IntExpr &>(expr).GetInt();
+      return "(int64_t)" + std::to_string(value) + "ull";
+    }
+  }
+  assert(!"invalid expression kind");
+  return "";
+}
+
+// -----------------------------------------------------------------------------
+std::string CCodegen::LowerBinaryExpr(const BinaryExpr &binary)
+{
+  auto lhs = LowerExpr(binary.GetLHS());
+  auto rhs = LowerExpr(binary.GetRHS());
+
+  auto wrap = [&] (const char *op) {
+    return Temp("(int64_t)((uint64_t)" + lhs + " " + op + " (uint64_t)" + rhs + ")");
+  };
+  auto cmp = [&] (const char *op) {
+    return Temp("(int64_t)(" + lhs + " " + op + " " + rhs + ")");
+  };
+  auto checked = [&] (const char *fn) {
+    return Temp(std::string("imp_") + fn + "(" + lhs + ", " + rhs + ")");
+  };
+  bool safe = binary.IsSafe();
+  switch (binary.GetKind()) {
+    case BinaryExpr::Kind::ADD: return safe ? wrap("+") : checked("add");
+    case BinaryExpr::Kind::SUB: return safe ? wrap("-") : checked("sub");
+    case BinaryExpr::Kind::MUL: return safe ? wrap("*") : checked("mul");
+    case BinaryExpr::Kind::DIV: return safe ? Temp(lhs + " / " + rhs) : checked("div");
+    case BinaryExpr::Kind::MOD: return safe ? Temp(lhs + " % " + rhs) : checked("mod");
+    case BinaryExpr::Kind::DEQ: return cmp("==");
+    case BinaryExpr::Kind::NEQ: return cmp("!=");
+    case BinaryExpr::Kind::SM: return cmp("<");
+    case BinaryExpr::Kind::SMEQ: return cmp("<=");
+    case BinaryExpr::Kind::GR: return cmp(">");
+    case BinaryExpr::Kind::GREQ: return cmp(">=");
+  }
+  assert(!"invalid binary operator");
+  return "";
+}
+
+// -----------------------------------------------------------------------------
+std::string CCodegen::LowerCallExpr(const CallExpr &call)
+{
+  // Arguments are evaluated from last to first, as in the interpreter.
+  std::vector<std::string> args(call.arg_size());
+  size_t i = call.arg_size();
+  for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+    args[--i] = LowerExpr(**it);
+  }
+
+  auto &ref = static_cast<const RefExpr &>(call.GetCallee());
+  assert(ref.GetTarget() != RefExpr::Target::ARG && "call to a value");
+  bool proto = ref.GetTarget() == RefExpr::Target::PROTO;
+  std::string callee = (proto ? "imp_p_" : "imp_f_") + ref.GetName() + "(";
+  for (size_t n = 0; n < args.size(); ++n) {
+    callee += (n ? ", " : "") + args[n];
+  }
+  return Temp(callee + ")");
+}
+
+// -----------------------------------------------------------------------------
+void CCodegen::LowerFuncDecl(const FuncDecl &decl)
+{
+  nextTemp_ = 0;
+  out_ << Signature(decl, "imp_f_") << "\n";
+  LowerBlockStmt(decl.GetBody());
+}
+
+// -----------------------------------------------------------------------------
+std::string CCodegen::Signature(const FuncOrProtoDecl &decl, const char *prefix)
+{
+  std::string sig = "static int64_t " + std::string(prefix) + decl.GetName() + "(";
+  if (decl.arg_size() == 0) {
+    sig += "void";
+  }
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    sig += (it == decl.arg_begin() ? "" : ", ") + std::string("int64_t imp_a_") + it->first.GetName();
+  }
+  return sig + ")";
+}
+
+// -----------------------------------------------------------------------------
+std::string CCodegen::Local(const std::string &name, unsigned slot)
+{
+  return "imp_l" + std::to_string(slot) + "_" + name;
+}
+
+// -----------------------------------------------------------------------------
+std::string CCodegen::Temp(const std::string &expr)
+{
+  auto name = "t" + std::to_string(nextTemp_++);
+  Line("const int64_t " + name + " = " + expr + ";");
+  return name;
+}
+
+// -----------------------------------------------------------------------------
+void CCodegen::Line(const std::string &line)
+{
+  out_ << std::string(2 * indent_, ' ') << line << "\n";
+}
@@ -0,0 +1,76 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+#include "ast.h"
+
+
+
+/**
+ * Translator from the AST to C source code.
+ *
+ * Every function becomes a C function over 64-bit integers. Expressions are
+ * split into temporaries, preserving the order in which the interpreter
+ * evaluates operands and arguments, and arithmetic is carried out on
+ * unsigned integers so that overflow wraps around as in the interpreter.
+ * Locals become C variables named after their frame slot, keeping shadowed
+ * names apart.
+ * Prototypes are bound at startup to the runtime methods in runtime.cpp,
+ * through the bridge declared in runtime.h.
+ */
+class CCodegen {
+public:
+  /// Entry point to the code generator: writes a C translation unit.
+  void Translate(const Module &mod, std::ostream &os);
+
+private:
+  /// Lowers a single statement.
+  void LowerStmt(const Stmt &stmt);
+  /// Lowers a block statement.
+  void LowerBlockStmt(const BlockStmt &blockStmt);
+  /// Lowers a while statement.
+  void LowerWhileStmt(const WhileStmt &whileStmt);
+  /// Lowers an if statement.
+  void LowerIfStmt(const IfStmt &ifStmt);
+  /// Lowers the declaration of a local.
+  void LowerLetStmt(const LetStmt &letStmt);
+  /// Lowers the body of a compound statement into a C block.
+  void LowerBody(const Stmt &stmt);
+
+  /// Lowers an expression, returning the C expression holding its value.
+  std::string LowerExpr(const Expr &expr);
+  /// Lowers a binary expression.
+  std::string LowerBinaryExpr(const BinaryExpr &expr);
+  /// Lowers a call expression.
+  std::string LowerCallExpr(const CallExpr &expr);
+
+  /// Lowers a function declaration.
+  void LowerFuncDecl(const FuncDecl &funcDecl);
+
+private:
+  /// Returns the signature of a function.
+  static std::string Signature(const FuncOrProtoDecl &decl, const char *prefix);
+
+  /// Returns the name of the C variable holding a local.
+  static std::string Local(const std::string &name, unsigned slot);
+
+  /// Binds an expression to a new temporary.
+  std::string Temp(const std::string &expr);
+  /// Emits a line of code at the current indentation.
+  void Line(const std::string &line);
+
+private:
+  /// Body of the function being lowered.
+  std::ostringstream out_;
+  /// Current indentation level.
+  unsigned indent_ = 0;
+  /// Identifier of the next temporary.
+  unsigned nextTemp_ = 0;
+  /// Prototypes of the module, indexed by name.
+  std::map<std::string, const ProtoDecl *> protos_;
+};
@@ -1,27 +1,35 @@
 // This file is part of the IMP project.
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
 
 #include "codegen.h"
 #include "ast.h"
+#include "parallel.h"
 
 
 
+/// Number of functions lowered together, by a single thread.
+static constexpr size_t kChunkFuncs = 256;
+
 // -----------------------------------------------------------------------------
 Codegen::Scope::~Scope()
 {
 }
 
 // -----------------------------------------------------------------------------
-Codegen::Binding Codegen::GlobalScope::Lookup(const std::string &name) const
+Codegen::Binding Codegen::GlobalScope::Lookup(Symbol name) const
 {
   // Find the name among functions.
   if (auto it = funcs_.find(name); it != funcs_.end()) {
     Binding b;
     b.Kind = Binding::Kind::FUNC;
     b.Entry = it->second;
+    if (auto jt = inlines_.find(name); jt != inlines_.end()) {
+      b.Inline = &jt->second;
+    }
     return b;
   }
 
@@ -38,7 +46,7 @@ Codegen::Binding Codegen::GlobalScope::Lookup(const std::string &name) const
 }
 
 // -----------------------------------------------------------------------------
-Codegen::Binding Codegen::FuncScope::Lookup(const std::string &name) const
+Codegen::Binding Codegen::FuncScope::Lookup(Symbol name) const
 {
   // Find the name among arguments.
   if (auto it = args_.find(name); it != args_.end()) {
@@ -51,62 +59,265 @@ Codegen::Binding Codegen::FuncScope::Lookup(const std::string &name) const
 }
 
 // -----------------------------------------------------------------------------
-Codegen::Binding Codegen::BlockScope::Lookup(const std::string &name) const
+Codegen::Binding Codegen::BlockScope::Lookup(Symbol name) const
 {
-  // TODO: nothing defined here yet.
+  // Find the name among the locals declared so far.
+  if (auto it = locals_.find(name); it != locals_.end()) {
+    Binding b;
+    b.Kind = Binding::Kind::LOCAL;
+    b.Index = it->second;
+    return b;
+  }
   return parent_->Lookup(name);
 }
 
 // -----------------------------------------------------------------------------
-std::unique_ptr<Program> Codegen::Translate(const Module &mod)
+std::unique_ptr<Program> Codegen::Translate(const Module &mod, bool lazy)
 {
   assert(code_.empty() && "expected empty code section");
+  lazy_ = lazy;
 
   // Traverse all the function & function prototype declarations and record
   // them in the global symbol table.
-  std::map<std::string, RuntimeFn> protos;
   for (auto item : mod) {
-    if (std::holds_alternative<std::shared_ptr<ProtoDecl>>(item)) {
+    if (std::holds_alternative<ProtoDecl *>(item)) {
       // The name of the prototype is mapped to the pointer
       // to the function implementing it.
       auto &proto = *std::get<1>(item);
       auto it = kRuntimeFns.find(proto.GetPrimitiveName());
       assert(it != kRuntimeFns.end() && "missing prototype");
-      protos.emplace(proto.GetName(), it->second);
+      protos_.emplace(proto.GetSymbol(), it->second);
     }
-    if (std::holds_alternative<std::shared_ptr<FuncDecl>>(item)) {
+    if (std::holds_alternative<FuncDecl *>(item)) {
       // Map the function to a newly created label, which will be used
       // as the address to be invoked by call instructions.
       auto &func = *std::get<0>(item);
-      funcs_.emplace(func.GetName(), MakeLabel());
+      funcs_.emplace(func.GetSymbol(), MakeLabel());
+
+      // Lazily lowered functions can be reloaded, so they are not expanded.
+      if (auto *body = GetInlineBody(func); body && !lazy) {
+        inlines_.emplace(func.GetSymbol(), InlineFunc{ &func, body });
+      }
     }
   }
 
   // Compile all top-level statements in the beginning, to ensure that the
   // instruction at the start of the bytecode stream starts the program.
-  GlobalScope global(funcs_, protos);
-  for (auto item : mod) {
-    if (!std::holds_alternative<std::shared_ptr<Stmt>>(item)) {
-      continue;
+  // Locals declared at the top level live in a frame of their own.
+  GlobalScope global(funcs_, protos_, inlines_);
+  BeginDebugFunc("<toplevel>", Location{});
+  {
+    unsigned slots = 0;
+    unsigned live = 0;
+    for (auto item : mod) {
+      if (std::holds_alternative<Stmt *>(item)) {
+        auto &stmt = *std::get<2>(item);
+        live += stmt.GetKind() == Stmt::Kind::LET;
+        slots = std::max(slots, live + CountSlots(stmt));
+      }
     }
-    LowerStmt(global, *std::get<2>(item));
+    frame_ = slots != 0;
+    if (frame_) {
+      EmitEnter(slots);
+    }
+
+    BlockScope topScope(&global);
+    for (auto item : mod) {
+      if (std::holds_alternative<Stmt *>(item)) {
+        LowerBlockItem(topScope, *std::get<2>(item));
+      }
+    }
+    frame_ = false;
+    slots_ = 0;
   }
   Emit<Opcode>(Opcode::STOP);
+  EndDebugFunc();
+
+  if (lazy) {
+    // Emit stubs lowering functions once called.
+    for (auto item : mod) {
+      if (!std::holds_alternative<FuncDecl *>(item)) {
+        continue;
+      }
+      auto &func = *std::get<0>(item);
+      BeginDebugFunc(func.GetName(), func.GetLocation());
+      auto entry = funcs_.find(func.GetSymbol())->second;
+      EmitLabel(entry);
+      EmitStub(stubs_.size());
+      EndDebugFunc();
+      stubIDs_.emplace(func.GetSymbol(), stubs_.size());
+      stubs_.push_back(Stub{ &func, false, entry });
+    }
 
-  // Emit code for all functions.
-  for (auto item : mod) {
-    if (!std::holds_alternative<std::shared_ptr<FuncDecl>>(item)) {
-      continue;
+    // Clean up the code once all labels are resolved.
+    std::vector<Label> entries;
+    for (auto &[name, label] : funcs_) {
+      entries.push_back(label);
+    }
+    Peephole(entries);
+    ResolveDebugInfo();
+  } else {
+    // Clean up the top level, then emit code for all functions after it.
+    Peephole({});
+    ResolveDebugInfo();
+    std::vector<const FuncDecl *> funcs;
+    for (auto item : mod) {
+      if (std::holds_alternative<FuncDecl *>(item)) {
+        funcs.push_back(std::get<0>(item));
+      }
     }
-    LowerFuncDecl(global, *std::get<0>(item));
+    LowerFuncs(global, funcs);
   }
+  fixups_.clear();
 
-  return std::make_unique<Program>(std::move(code_));
+  auto prog = std::make_unique<Program>(std::move(code_));
+  if (lazy) {
+    prog->SetLoader([this] (Program &prog, uint64_t func) {
+      LowerStub(prog, func);
+    });
+  }
+  return prog;
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::LowerStub(Program &prog, uint64_t func)
+{
+  assert(func < stubs_.size() && !stubs_[func].Lowered && "function already lowered");
+  stubs_[func].Lowered = true;
+  LowerBody(prog, func);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::LowerBody(Program &prog, uint64_t func)
+{
+  auto &decl = *stubs_[func].Decl;
+  auto stub = labelToAddress_[stubs_[func].Entry];
+
+  // The body is emitted at the end of the program, under a new label.
+  firstLabel_ = nextLabel_;
+  auto entry = MakeLabel();
+
+  code_.clear();
+  base_ = prog.GetCodeSize();
+  GlobalScope global(funcs_, protos_, inlines_);
+  LowerFuncDecl(global, decl, entry);
+  Peephole({ entry });
+  fixups_.clear();
+  ResolveDebugInfo();
+
+  prog.Append(code_);
+  prog.Patch(stub, labelToAddress_[entry]);
+  code_.clear();
+
+  // Labels within the body are no longer needed once it is encoded.
+  for (unsigned id = firstLabel_ + 1; id <= nextLabel_; ++id) {
+    labelToAddress_.erase(Label(id));
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::LowerFuncs(const Scope &scope, const std::vector<const FuncDecl *> &funcs)
+{
+  if (funcs.empty()) {
+    return;
+  }
+
+  // Functions are split into contiguous chunks, each lowered and cleaned up
+  // at address 0 by a code generator of its own, sharing the global scope.
+  // Calls to functions of other chunks are left as fixups. Chunks are kept
+  // small, as the clean-up takes more than linear time, but there are enough
+  // of them to keep all threads busy.
+  unsigned threads = threads_ ? threads_ : GetHardwareThreads();
+  size_t numChunks = std::max<size_t>(
+      (funcs.size() + kChunkFuncs - 1) / kChunkFuncs,
+      std::min<size_t>(funcs.size(), threads)
+  );
+  auto first = [&] (size_t chunk) { return funcs.size() * chunk / numChunks; };
+  std::vector<Codegen> chunks(numChunks);
+  ParallelFor(numChunks, threads, [&] (size_t i) {
+    auto &chunk = chunks[i];
+    chunk.debug_ = debug_;
+    chunk.firstLabel_ = chunk.nextLabel_ = nextLabel_;
+    std::vector<Label> entries;
+    for (size_t f = first(i); f < first(i + 1); ++f) {
+      auto entry = funcs_.find(funcs[f]->GetSymbol())->second;
+      chunk.LowerFuncDecl(scope, *funcs[f], entry);
+      entries.push_back(entry);
+    }
+    chunk.Peephole(entries);
+    chunk.ResolveDebugInfo();
+  });
+
+  // Laying out the chunks in order places the entries of all functions.
+  std::vector<size_t> bases(numChunks);
+  size_t size = base_ + code_.size();
+  for (size_t i = 0; i < numChunks; ++i) {
+    bases[i] = size;
+    for (size_t f = first(i); f < first(i + 1); ++f) {
+      auto entry = funcs_.find(funcs[f]->GetSymbol())->second;
+      labelToAddress_[entry] = chunks[i].labelToAddress_[entry] + size;
+    }
+    size += chunks[i].code_.size();
+  }
+
+  // Link the chunks, then the calls made by the code emitted before them.
+  code_.resize(size - base_);
+  ParallelFor(numChunks, threads, [&] (size_t i) {
+    chunks[i].Relocate(code_.data() + bases[i] - base_, bases[i], labelToAddress_);
+  });
+  for (auto &[label, locs] : fixups_) {
+    size_t address = labelToAddress_.find(label)->second;
+    for (auto loc : locs) {
+      memcpy(code_.data() + loc, &address, sizeof(size_t));
+    }
+  }
+  for (size_t i = 0; i < numChunks; ++i) {
+    debugTable_.Append(chunks[i].debugTable_, bases[i]);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::Relocate(
+    uint8_t *code,
+    size_t base,
+    const std::unordered_map<Label, unsigned, LabelHash> &labels) const
+{
+  // Pending fixups refer to other chunks, while all other addresses point
+  // into the code itself.
+  std::vector<std::pair<size_t, Label>> pending;
+  for (auto &[label, locs] : fixups_) {
+    for (auto loc : locs) {
+      pending.emplace_back(loc, label);
+    }
+  }
+  std::sort(pending.begin(), pending.end(), [] (auto &a, auto &b) {
+    return a.first < b.first;
+  });
+
+  memcpy(code, code_.data(), code_.size());
+  auto it = pending.begin();
+  for (size_t pc = 0; pc < code_.size(); ) {
+    auto op = static_cast<Opcode>(code_[pc]);
+    if (HasAddressOperand(op)) {
+      size_t loc = pc + sizeof(Opcode);
+      size_t address;
+      if (it != pending.end() && it->first == loc) {
+        address = labels.find((it++)->second)->second;
+      } else {
+        memcpy(&address, code_.data() + loc, sizeof(size_t));
+        address += base;
+      }
+      memcpy(code + loc, &address, sizeof(size_t));
+    }
+    pc += sizeof(Opcode) + GetOperandSize(op);
+  }
+  assert(it == pending.end() && "fixup not at an address operand");
 }
 
 // -----------------------------------------------------------------------------
 void Codegen::LowerStmt(const Scope &scope, const Stmt &stmt)
 {
+  MarkStmt(stmt);
   switch (stmt.GetKind()) {
     case Stmt::Kind::BLOCK: {
       return LowerBlockStmt(scope, static_cast<const BlockStmt &>(stmt));
@@ -123,6 +334,13 @@ void Codegen::LowerStmt(const Scope &scope, const Stmt &stmt)
     case Stmt::Kind::IF: {
       return LowerIfStmt(scope, static_cast<const IfStmt &>(stmt));
     }
+    case Stmt::Kind::LET: {
+      assert(!"declaration outside of a block");
+      return;
+    }
+    case Stmt::Kind::ASSIGN: {
+      return LowerAssignStmt(scope, static_cast<const AssignStmt &>(stmt));
+    }
   }
 }
 
@@ -130,15 +348,45 @@ void Codegen::LowerStmt(const Scope &scope, const Stmt &stmt)
 void Codegen::LowerBlockStmt(const Scope &scope, const BlockStmt &blockStmt)
 {
   unsigned depthIn = depth_;
+  unsigned slotsIn = slots_;
 
   BlockScope blockScope(&scope);
   for (auto &stmt : blockStmt) {
-    LowerStmt(blockScope, *stmt);
+    LowerBlockItem(blockScope, *stmt);
   }
 
+  // Slots of the locals of the block are re-used by the blocks following it.
+  slots_ = slotsIn;
   assert(depth_ == depthIn && "mismatched block depth on exit");
 }
 
+// -----------------------------------------------------------------------------
+void Codegen::LowerBlockItem(BlockScope &scope, const Stmt &stmt)
+{
+  if (stmt.GetKind() != Stmt::Kind::LET) {
+    return LowerStmt(scope, stmt);
+  }
+
+  // The name is bound once the initialiser is evaluated, as it might refer
+  // to an outer binding of the same name.
+  auto &letStmt = static_cast<const LetStmt &>(stmt);
+  MarkStmt(letStmt);
+  LowerExpr(scope, letStmt.GetInit());
+  uint32_t slot = slots_++;
+  assert(slot == letStmt.GetSlot() && "slot differs from the verifier");
+  EmitStoreLocal(slot);
+  scope.Declare(letStmt.GetSymbol(), slot);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::LowerAssignStmt(const Scope &scope, const AssignStmt &assignStmt)
+{
+  LowerExpr(scope, assignStmt.GetValue());
+  auto binding = scope.Lookup(assignStmt.GetTarget().GetSymbol());
+  assert(binding.Kind == Binding::Kind::LOCAL && "assignment to a non-local");
+  EmitStoreLocal(binding.Index);
+}
+
 // -----------------------------------------------------------------------------
 void Codegen::LowerWhileStmt(const Scope &scope, const WhileStmt &whileStmt)
 {
@@ -176,7 +424,26 @@ void Codegen::LowerIfStmt(const Scope &scope, const IfStmt &ifStmt) {
 // -----------------------------------------------------------------------------
 void Codegen::LowerReturnStmt(const Scope &scope, const ReturnStmt &retStmt)
 {
-  LowerExpr(scope, retStmt.GetExpr());
+  // Self-recursive calls in tail position re-use the frame of the function.
+  auto &expr = retStmt.GetExpr();
+  if (func_ && expr.GetKind() == Expr::Kind::CALL) {
+    auto &call = static_cast<const CallExpr &>(expr);
+    auto &callee = call.GetCallee();
+    if (callee.GetKind() == Expr::Kind::REF) {
+      // The verifier resolved the callee and checked its arity.
+      auto &ref = static_cast<const RefExpr &>(callee);
+      if (ref.GetTarget() == RefExpr::Target::FUNC &&
+          ref.GetSymbol() == func_->GetSymbol()) {
+        for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+          LowerExpr(scope, **it);
+        }
+        EmitTailCall(entry_, call.arg_size());
+        return;
+      }
+    }
+  }
+
+  LowerExpr(scope, expr);
   EmitReturn();
 }
 
@@ -209,7 +476,7 @@ void Codegen::LowerExpr(const Scope &scope, const Expr &expr)
 // -----------------------------------------------------------------------------
 void Codegen::LowerRefExpr(const Scope &scope, const RefExpr &expr)
 {
-  auto binding = scope.Lookup(expr.GetName());
+  auto binding = scope.Lookup(expr.GetSymbol());
   switch (binding.Kind) {
     case Binding::Kind::FUNC: {
       EmitPushFunc(binding.Entry);
@@ -220,7 +487,25 @@ void Codegen::LowerRefExpr(const Scope &scope, const RefExpr &expr)
       return;
     }
     case Binding::Kind::ARG: {
-      EmitPeek(depth_ + binding.Index + 1);
+      if (frame_) {
+        EmitLoadArg(binding.Index);
+      } else {
+        EmitPeek(depth_ + binding.Index + 1);
+      }
+      return;
+    }
+    case Binding::Kind::LOCAL: {
+      EmitLoadLocal(binding.Index);
+      return;
+    }
+    case Binding::Kind::INLINE: {
+      // Arguments are lowered in the context of the call, outside of the
+      // functions expanded since, which they may call again.
+      auto &arg = *binding.Arg;
+      std::vector<const FuncDecl *> inlined(inlined_.begin() + arg.Depth, inlined_.end());
+      inlined_.resize(arg.Depth);
+      LowerExpr(*arg.Caller, *arg.Value);
+      inlined_.insert(inlined_.end(), inlined.begin(), inlined.end());
       return;
     }
   }
@@ -233,19 +518,19 @@ void Codegen::LowerBinaryExpr(const Scope &scope, const BinaryExpr &binary)
   LowerExpr(scope, binary.GetRHS());
   switch (binary.GetKind()) {
     case BinaryExpr::Kind::ADD: {
-      return EmitAdd();
+      return EmitAdd(binary.IsSafe());
     }
     case BinaryExpr::Kind::SUB: {
-      return EmitSub();
+      return EmitSub(binary.IsSafe());
     }
     case BinaryExpr::Kind::MUL: {
-      return EmitMul();
+      return EmitMul(binary.IsSafe());
     }
     case BinaryExpr::Kind::DIV: {
-      return EmitDiv();
+      return EmitDiv(binary.IsSafe());
     }
     case BinaryExpr::Kind::MOD: {
-      return EmitMod();
+      return EmitMod(binary.IsSafe());
     }
     case BinaryExpr::Kind::DEQ: {
       return EmitDoubleEqual();
@@ -271,27 +556,59 @@ void Codegen::LowerBinaryExpr(const Scope &scope, const BinaryExpr &binary)
 // -----------------------------------------------------------------------------
 void Codegen::LowerCallExpr(const Scope &scope, const CallExpr &call)
 {
+  if (LowerInlineCall(scope, call)) {
+    return;
+  }
+
   for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
     LowerExpr(scope, **it);
   }
-  LowerExpr(scope, call.GetCallee());
+
+  // Statically known callees are invoked directly.
+  auto &callee = call.GetCallee();
+  if (callee.GetKind() == Expr::Kind::REF) {
+    auto binding = scope.Lookup(static_cast<const RefExpr &>(callee).GetSymbol());
+    switch (binding.Kind) {
+      case Binding::Kind::FUNC: {
+        return EmitCallDirect(binding.Entry, call.arg_size());
+      }
+      case Binding::Kind::PROTO: {
+        return EmitCallNative(binding.Fn, call.arg_size());
+      }
+      case Binding::Kind::ARG:
+      case Binding::Kind::LOCAL:
+      case Binding::Kind::INLINE: {
+        break;
+      }
+    }
+  }
+
+  LowerExpr(scope, callee);
   EmitCall(call.arg_size());
   depth_ -= call.arg_size();
 }
 
 // -----------------------------------------------------------------------------
-void Codegen::LowerFuncDecl(const Scope &scope, const FuncDecl &decl)
+void Codegen::LowerFuncDecl(
+    const Scope &scope,
+    const FuncDecl &decl,
+    Label entry)
 {
   // Emit the entry label of the function.
-  auto it = funcs_.find(decl.GetName());
-  assert(it != funcs_.end() && "missing function label");
-  EmitLabel(it->second);
+  BeginDebugFunc(decl.GetName(), decl.GetLocation());
+  EmitLabel(entry);
 
-  // Emit the function body.
+  // Emit the function body, setting up a frame if it declares locals.
   func_ = &decl;
+  entry_ = entry;
   assert(depth_ == 0 && "invalid stack depth in global scope");
+  unsigned slots = CountSlots(decl.GetBody());
+  frame_ = slots != 0;
+  if (frame_) {
+    EmitEnter(slots);
+  }
   {
-    std::map<std::string, uint32_t> args;
+    std::unordered_map<Symbol, uint32_t> args;
     for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
       args[it->first] = args.size();
     }
@@ -302,6 +619,98 @@ void Codegen::LowerFuncDecl(const Scope &scope, const FuncDecl &decl)
 
   assert(depth_ == 0 && "invalid stack depth on function exit");
   func_ = nullptr;
+  frame_ = false;
+  EndDebugFunc();
+}
+
+// -----------------------------------------------------------------------------
+unsigned Codegen::CountSlots(const Stmt &stmt)
+{
+  // Locals of sibling blocks share slots, so the frame holds the largest
+  // number of locals in scope at any point.
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      unsigned slots = 0;
+      unsigned live = 0;
+      for (auto *s : static_cast<const BlockStmt &>(stmt)) {
+        live += s->GetKind() == Stmt::Kind::LET;
+        slots = std::max(slots, live + CountSlots(*s));
+      }
+      return slots;
+    }
+    case Stmt::Kind::WHILE: {
+      return CountSlots(static_cast<const WhileStmt &>(stmt).GetStmt());
+    }
+    case Stmt::Kind::IF: {
+      auto &ifStmt = static_cast<const IfStmt &>(stmt);
+      auto *elseStmt = ifStmt.GetElseStmt();
+      return std::max(
+          CountSlots(ifStmt.GetStmt()),
+          elseStmt ? CountSlots(*elseStmt) : 0
+      );
+    }
+    case Stmt::Kind::EXPR:
+    case Stmt::Kind::RETURN:
+    case Stmt::Kind::LET:
+    case Stmt::Kind::ASSIGN: {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::BeginDebugFunc(const std::string &name, const Location &loc)
+{
+  if (!debug_) {
+    return;
+  }
+  auto start = MakeLabel();
+  EmitLabel(start);
+  debugFuncs_.push_back(DebugFunc{ start, start, name, loc });
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EndDebugFunc()
+{
+  if (!debug_) {
+    return;
+  }
+  auto end = MakeLabel();
+  EmitLabel(end);
+  debugFuncs_.back().End = end;
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::MarkStmt(const Stmt &stmt)
+{
+  // Blocks start with the statements they contain.
+  if (!debug_ || stmt.GetKind() == Stmt::Kind::BLOCK) {
+    return;
+  }
+  auto label = MakeLabel();
+  EmitLabel(label);
+  debugLines_.emplace_back(label, stmt.GetLocation());
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::ResolveDebugInfo()
+{
+  // Labels are only placed at their final addresses once the peephole
+  // optimiser is done with the code.
+  for (auto &func : debugFuncs_) {
+    debugTable_.AddFunc(
+        labelToAddress_[func.Start],
+        labelToAddress_[func.End],
+        func.Name,
+        func.Loc
+    );
+  }
+  for (auto &[label, loc] : debugLines_) {
+    debugTable_.AddLine(labelToAddress_[label], loc);
+  }
+  debugFuncs_.clear();
+  debugLines_.clear();
 }
 
 // -----------------------------------------------------------------------------
@@ -322,11 +731,14 @@ void Codegen::Emit(const T &t)
 // -----------------------------------------------------------------------------
 void Codegen::EmitLabel(Label label)
 {
-  size_t address = code_.size();
-  for (auto loc : fixups_[label]) {
-    memcpy(code_.data() + loc, &address, sizeof(unsigned));
+  size_t address = base_ + code_.size();
+  if (auto it = fixups_.find(label); it != fixups_.end()) {
+    for (auto loc : it->second) {
+      memcpy(code_.data() + loc, &address, sizeof(unsigned));
+    }
+    fixups_.erase(it);
   }
-  labelToAddress_.emplace(label, code_.size());
+  labelToAddress_.emplace(label, address);
 }
 
 // -----------------------------------------------------------------------------
@@ -352,6 +764,27 @@ void Codegen::EmitPop()
 void Codegen::EmitCall(unsigned nargs)
 {
   Emit<Opcode>(Opcode::CALL);
+  Emit<unsigned>(nargs);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitCallDirect(Label entry, unsigned nargs)
+{
+  assert(depth_ >= nargs && "no arguments on stack");
+  depth_ = depth_ - nargs + 1;
+  Emit<Opcode>(Opcode::CALL_DIRECT);
+  EmitFixup(entry);
+  Emit<unsigned>(nargs);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitCallNative(RuntimeFn fn, unsigned nargs)
+{
+  assert(depth_ >= nargs && "no arguments on stack");
+  depth_ = depth_ - nargs + 1;
+  Emit<Opcode>(Opcode::CALL_NATIVE);
+  Emit<RuntimeFn>(fn);
+  Emit<unsigned>(nargs);
 }
 
 // -----------------------------------------------------------------------------
@@ -382,6 +815,9 @@ void Codegen::EmitPeek(uint32_t index)
 void Codegen::EmitReturn()
 {
   assert(depth_ > 0 && "no elements on stack");
+  if (frame_) {
+    EmitLeave(1);
+  }
   depth_ -= 1;
   Emit<Opcode>(Opcode::RET);
   Emit<unsigned>(depth_);
@@ -389,40 +825,96 @@ void Codegen::EmitReturn()
 }
 
 // -----------------------------------------------------------------------------
-void Codegen::EmitAdd()
+void Codegen::EmitTailCall(Label entry, unsigned nargs)
+{
+  assert(depth_ >= nargs && "no arguments on stack");
+  assert(nargs <= UINT16_MAX && "too many arguments");
+  if (frame_) {
+    EmitLeave(nargs);
+  }
+  depth_ -= nargs;
+  Emit<Opcode>(Opcode::TAIL_CALL);
+  EmitFixup(entry);
+  Emit<unsigned>(depth_);
+  Emit<uint16_t>(nargs);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitEnter(unsigned slots)
+{
+  Emit<Opcode>(Opcode::ENTER);
+  Emit<unsigned>(slots);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitLeave(unsigned n)
+{
+  assert(depth_ >= n && "no elements on stack");
+  depth_ = n;
+  Emit<Opcode>(Opcode::LEAVE);
+  Emit<unsigned>(n);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitLoadLocal(uint32_t slot)
+{
+  depth_ += 1;
+  Emit<Opcode>(Opcode::LOAD_LOCAL);
+  Emit<uint32_t>(slot);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitStoreLocal(uint32_t slot)
+{
+  assert(depth_ > 0 && "no elements on stack");
+  depth_ -= 1;
+  Emit<Opcode>(Opcode::STORE_LOCAL);
+  Emit<uint32_t>(slot);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitLoadArg(uint32_t index)
+{
+  depth_ += 1;
+  Emit<Opcode>(Opcode::LOAD_ARG);
+  Emit<uint32_t>(index);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitAdd(bool safe)
 {
   assert(depth_ > 0 && "no elements on stack");
   depth_ -= 1;
-  Emit<Opcode>(Opcode::ADD);
+  Emit<Opcode>(safe ? Opcode::ADD_UNCHECKED : Opcode::ADD);
 }
 
 // -----------------------------------------------------------------------------
-void Codegen::EmitDiv() {
+void Codegen::EmitDiv(bool safe) {
   assert(depth_ > 0 && "no elements on stack");
   depth_ -= 1;
-  Emit<Opcode>(Opcode::DIV);
+  Emit<Opcode>(safe ? Opcode::DIV_UNCHECKED : Opcode::DIV);
 }
 
 // -----------------------------------------------------------------------------
-void Codegen::EmitMod() {
+void Codegen::EmitMod(bool safe) {
   assert(depth_ > 0 && "no elements on stack");
   depth_ -= 1;
-  Emit<Opcode>(Opcode::MOD);
+  Emit<Opcode>(safe ? Opcode::MOD_UNCHECKED : Opcode::MOD);
 }
 
 // -----------------------------------------------------------------------------
-void Codegen::EmitMul()
+void Codegen::EmitMul(bool safe)
 {
   assert(depth_ > 0 && "no elements on stack");
   depth_ -= 1;
-  Emit<Opcode>(Opcode::MUL);
+  Emit<Opcode>(safe ? Opcode::MUL_UNCHECKED : Opcode::MUL);
 }
 
 // -----------------------------------------------------------------------------
-void Codegen::EmitSub() {
+void Codegen::EmitSub(bool safe) {
   assert(depth_ > 0 && "no elements on stack");
   depth_ -= 1;
-  Emit<Opcode>(Opcode::SUB);
+  Emit<Opcode>(safe ? Opcode::SUB_UNCHECKED : Opcode::SUB);
 }
 
 // -----------------------------------------------------------------------------
@@ -483,6 +975,13 @@ void Codegen::EmitJump(Label label)
   EmitFixup(label);
 }
 
+// -----------------------------------------------------------------------------
+void Codegen::EmitStub(uint64_t func)
+{
+  Emit<Opcode>(Opcode::STUB);
+  Emit<uint64_t>(func);
+}
+
 // -----------------------------------------------------------------------------
 void Codegen::EmitInt(const Expr &expr) {
   depth_ += 1;
@@ -8,17 +8,53 @@
 
 #include "program.h"
 #include "ast.h"
+#include "debug.h"
 #include "runtime.h"
 
 
 
 /**
  * Translator from the AST to bytecode.
+ *
+ * In lazy mode, functions are initially represented by stubs and are only
+ * lowered once called, with their code appended to the program. The code
+ * generator and the module must then outlive the program. Calls always go
+ * through the stubs, which become jumps to the bodies, so functions can be
+ * replaced by reloading the module. Otherwise, calls to small functions are
+ * expanded into the bodies of the callees.
+ *
+ * Functions declaring locals set up a frame on entry, addressing locals and
+ * arguments relative to the frame pointer. Functions without locals reach
+ * their arguments relative to the top of the stack instead.
  */
 class Codegen {
 public:
   /// Entry point to the code generator: translated an entire module.
-  std::unique_ptr<Program> Translate(const Module &mod);
+  std::unique_ptr<Program> Translate(const Module &mod, bool lazy = false);
+
+  /**
+   * Updates a lazily lowered program to a new version of its module.
+   *
+   * Functions are compared by a hash of their contents. The ones which
+   * changed, along with the ones referring to names bound to a different
+   * function or method than before, are lowered again at the end of the
+   * program, with their stubs re-pointed to the new bodies, while new
+   * functions are given stubs of their own. Top-level statements are not run again and frames already
+   * on the stack keep executing the old code. The program can be reloaded
+   * from a runtime method, while it is running.
+   *
+   * Both modules must be alive during the call, after which only the new
+   * one is referenced. Returns the number of functions lowered again.
+   */
+  unsigned Reload(Program &prog, const Module &mod);
+
+  /// Lowers functions on a number of threads, all of the hardware ones if 0.
+  void SetThreads(unsigned threads) { threads_ = threads; }
+
+  /// Records the addresses of functions and statements in a debug table.
+  void EnableDebugInfo() { debug_ = true; }
+  /// Returns the table mapping addresses to the source, if enabled.
+  const DebugTable &GetDebugTable() const { return debugTable_; }
 
 private:
   /// Descriptor for a label.
@@ -33,20 +69,68 @@ private:
     size_t operator() (const Label &l) const { return l.ID; }
   };
 
+  /// Function whose code is being emitted, to be added to the debug table.
+  struct DebugFunc {
+    /// Label at the first instruction.
+    Label Start;
+    /// Label past the last instruction.
+    Label End;
+    /// Name of the function.
+    std::string Name;
+    /// Location of the declaration.
+    Location Loc;
+  };
+
+  /// Function of a lazily lowered program, indexed by the operand of its stub.
+  struct Stub {
+    /// Latest declaration of the function.
+    const FuncDecl *Decl;
+    /// Flag set once the function was lowered.
+    bool Lowered;
+    /// Label of the stub, kept even if the name is bound to a prototype.
+    Label Entry;
+  };
+
+  class Scope;
+
+  /// Function whose calls are expanded into its body.
+  struct InlineFunc {
+    /// Declaration of the function.
+    const FuncDecl *Decl;
+    /// Expression returned by the function.
+    const Expr *Body;
+  };
+
+  /// Argument of an expanded call, evaluated wherever it is referenced.
+  struct InlineArg {
+    /// Expression passed as the argument.
+    const Expr *Value;
+    /// Scope of the call.
+    const Scope *Caller;
+    /// Number of calls being expanded around the call.
+    size_t Depth;
+  };
+
   /// Specifies the location and kind of the object a name is bound to.
   struct Binding {
     enum class Kind {
       FUNC,
       PROTO,
       ARG,
+      LOCAL,
+      INLINE,
     } Kind;
 
     union {
       uint32_t Index;
       RuntimeFn Fn;
       Label Entry;
+      const InlineArg *Arg;
     };
 
+    /// Body of a function which can be expanded, if it is small enough.
+    const InlineFunc *Inline = nullptr;
+
     Binding() {}
   };
 
@@ -57,7 +141,13 @@ private:
 
     virtual ~Scope();
 
-    virtual Binding Lookup(const std::string &name) const = 0;
+    virtual Binding Lookup(Symbol name) const = 0;
+
+    /// Returns the scope of top-level globals.
+    const Scope &GetGlobal() const
+    {
+      return parent_ ? parent_->GetGlobal() : *this;
+    }
 
   protected:
     const Scope *parent_;
@@ -67,19 +157,22 @@ private:
   class GlobalScope final : public Scope {
   public:
     GlobalScope(
-        const std::map<std::string, Label> &funcs,
-        const std::map<std::string, RuntimeFn> &protos)
+        const std::unordered_map<Symbol, Label> &funcs,
+        const std::unordered_map<Symbol, RuntimeFn> &protos,
+        const std::unordered_map<Symbol, InlineFunc> &inlines)
       : Scope(nullptr)
       , funcs_(std::move(funcs))
       , protos_(std::move(protos))
+      , inlines_(inlines)
     {
     }
 
-    Binding Lookup(const std::string &name) const override;
+    Binding Lookup(Symbol name) const override;
 
   private:
-    const std::map<std::string, Label> &funcs_;
-    const std::map<std::string, RuntimeFn> &protos_;
+    const std::unordered_map<Symbol, Label> &funcs_;
+    const std::unordered_map<Symbol, RuntimeFn> &protos_;
+    const std::unordered_map<Symbol, InlineFunc> &inlines_;
   };
 
   /// Scope for the arguments of a function.
@@ -87,24 +180,47 @@ private:
   public:
     FuncScope(
         const Scope *parent,
-        const std::map<std::string, uint32_t> &args)
+        const std::unordered_map<Symbol, uint32_t> &args)
+      : Scope(parent)
+      , args_(args)
+    {
+    }
+
+    Binding Lookup(Symbol name) const override;
+
+  private:
+    const std::unordered_map<Symbol, uint32_t> &args_;
+  };
+
+  /// Scope for the arguments of an expanded call.
+  class InlineScope final : public Scope {
+  public:
+    InlineScope(
+        const Scope *parent,
+        const std::unordered_map<Symbol, InlineArg> &args)
       : Scope(parent)
       , args_(args)
     {
     }
 
-    Binding Lookup(const std::string &name) const override;
+    Binding Lookup(Symbol name) const override;
 
   private:
-    const std::map<std::string, uint32_t> &args_;
+    const std::unordered_map<Symbol, InlineArg> &args_;
   };
 
-  /// Scope for a block of statements.
+  /// Scope for a block of statements, binding locals to frame slots.
   class BlockScope final : public Scope {
   public:
     BlockScope(const Scope *parent) : Scope(parent) {}
 
-    Binding Lookup(const std::string &name) const override;
+    Binding Lookup(Symbol name) const override;
+
+    /// Binds a local declared in the block to a slot.
+    void Declare(Symbol name, uint32_t slot) { locals_[name] = slot; }
+
+  private:
+    std::unordered_map<Symbol, uint32_t> locals_;
   };
 
 private:
@@ -112,6 +228,10 @@ private:
   void LowerStmt(const Scope &scope, const Stmt &stmt);
   /// Lowers a block statement.
   void LowerBlockStmt(const Scope &scope, const BlockStmt &blockStmt);
+  /// Lowers a statement of a block, which may declare a local.
+  void LowerBlockItem(BlockScope &scope, const Stmt &stmt);
+  /// Lowers an assignment to a local.
+  void LowerAssignStmt(const Scope &scope, const AssignStmt &assignStmt);
   /// Lowers a while statement.
   void LowerWhileStmt(const Scope &scope, const WhileStmt &whileStmt);
   /// Lowers a return statement.
@@ -129,9 +249,42 @@ private:
   void LowerBinaryExpr(const Scope &scope, const BinaryExpr &expr);
   /// Lowers a call expression.
   void LowerCallExpr(const Scope &scope, const CallExpr &expr);
-
-  /// Lowers a function declaration.
-  void LowerFuncDecl(const Scope &scope, const FuncDecl &funcDecl);
+  /// Expands a call into the body of the callee, returning false if it cannot.
+  bool LowerInlineCall(const Scope &scope, const CallExpr &call);
+  /// Returns the expression returned by a function, if it can be expanded.
+  static const Expr *GetInlineBody(const FuncDecl &decl);
+  /// Checks whether an expression has no side effects and cannot fail.
+  static bool IsPure(const Scope &global, const Expr &expr, size_t depth);
+
+  /// Returns the number of slots taken up by the locals of a statement.
+  static unsigned CountSlots(const Stmt &stmt);
+
+  /// Lowers a function declaration, with its body placed at a label.
+  void LowerFuncDecl(const Scope &scope, const FuncDecl &funcDecl, Label entry);
+  /// Lowers the function behind a stub, appending it to the program.
+  void LowerStub(Program &prog, uint64_t func);
+  /// Appends the body of a function to the program, pointing its stub there.
+  void LowerBody(Program &prog, uint64_t func);
+  /// Lowers functions eagerly, in parallel, appending them to the code.
+  void LowerFuncs(const Scope &scope, const std::vector<const FuncDecl *> &funcs);
+  /// Copies the code to an address, resolving fixups through other labels.
+  void Relocate(
+      uint8_t *code,
+      size_t base,
+      const std::unordered_map<Label, unsigned, LabelHash> &labels
+  ) const;
+
+  /// Rewrites redundant sequences of the emitted code into shorter ones.
+  void Peephole(const std::vector<Label> &entries);
+
+  /// Marks the start of a function in the debug table.
+  void BeginDebugFunc(const std::string &name, const Location &loc);
+  /// Marks the end of the function started last.
+  void EndDebugFunc();
+  /// Marks the start of a statement in the debug table.
+  void MarkStmt(const Stmt &stmt);
+  /// Adds the functions and statements marked in the code to the table.
+  void ResolveDebugInfo();
 
 private:
   /// Create a new label.
@@ -141,6 +294,10 @@ private:
   void EmitPop();
   /// Emit a call instruction.
   void EmitCall(unsigned nargs);
+  /// Emit a call to a function.
+  void EmitCallDirect(Label entry, unsigned nargs);
+  /// Emit a call to a runtime method.
+  void EmitCallNative(RuntimeFn fn, unsigned nargs);
   /// Push a function address to the stack.
   void EmitPushFunc(Label entry);
   /// Push a prototype to the stack.
@@ -149,16 +306,28 @@ private:
   void EmitPeek(uint32_t index);
   /// Emit a return instruction.
   void EmitReturn();
-  /// Emit an add opcode.
-  void EmitAdd();
-  /// Emit a sub opcode.
-  void EmitSub();
-  /// Emit a mul opcode.
-  void EmitMul();
-  /// Emit a div opcode;
-  void EmitDiv();
-  /// Emit a mod opcode;
-  void EmitMod();
+  /// Emit a self-recursive tail call, replacing the arguments of the frame.
+  void EmitTailCall(Label entry, unsigned nargs);
+  /// Emit the set-up of a frame holding locals.
+  void EmitEnter(unsigned slots);
+  /// Emit the tear-down of the frame, keeping values from the top.
+  void EmitLeave(unsigned n);
+  /// Push a local of the frame to the stack.
+  void EmitLoadLocal(uint32_t slot);
+  /// Pop a value into a local of the frame.
+  void EmitStoreLocal(uint32_t slot);
+  /// Push an argument of a function with a frame to the stack.
+  void EmitLoadArg(uint32_t index);
+  /// Emit an add opcode, unchecked if proven safe.
+  void EmitAdd(bool safe);
+  /// Emit a sub opcode, unchecked if proven safe.
+  void EmitSub(bool safe);
+  /// Emit a mul opcode, unchecked if proven safe.
+  void EmitMul(bool safe);
+  /// Emit a div opcode, unchecked if proven safe.
+  void EmitDiv(bool safe);
+  /// Emit a mod opcode, unchecked if proven safe.
+  void EmitMod(bool safe);
   /// Emit a double equal opcode;
   void EmitDoubleEqual();
   /// Emit a not equal opcode;
@@ -177,6 +346,8 @@ private:
   void EmitJumpFalse(Label label);
   /// Emit an unconditional jump.
   void EmitJump(Label label);
+  /// Emit a stub standing in for the body of a function.
+  void EmitStub(uint64_t func);
 
   /// Emit some bytes of code.
   template<typename T>
@@ -190,12 +361,26 @@ private:
 private:
   /// Reference to the program constructed by the code generator.
   std::vector<uint8_t> code_;
-  /// Current stack depth.
+  /// Address of the first byte of the code being emitted.
+  size_t base_ = 0;
+  /// Current stack depth, above the frame holding locals.
   unsigned depth_ = 0;
+  /// Number of frame slots taken up by the locals in scope.
+  unsigned slots_ = 0;
+  /// Flag set if the current function or the top level has a frame.
+  bool frame_ = false;
   /// Current function being compiled.
   const FuncDecl *func_;
+  /// Label at the start of the body of the current function.
+  Label entry_ = Label(0);
+  /// Flag set if functions are lowered on demand.
+  bool lazy_ = false;
+  /// Number of threads lowering functions, 0 to use all of them.
+  unsigned threads_ = 0;
   /// Identifier of the next label.
   unsigned nextLabel_ = 0;
+  /// Labels with higher identifiers were created for the code being emitted.
+  unsigned firstLabel_ = 0;
 
   /**
    * A fixup keeps track of all the forward references which must
@@ -205,5 +390,23 @@ private:
   /// Mapping from labels to their addresses.
   std::unordered_map<Label, unsigned, LabelHash> labelToAddress_;
   /// Mapping from functions to their entry labels.
-  std::map<std::string, Label> funcs_;
+  std::unordered_map<Symbol, Label> funcs_;
+  /// Mapping from prototypes to the runtime methods implementing them.
+  std::unordered_map<Symbol, RuntimeFn> protos_;
+  /// Functions whose calls are expanded, empty if lowered on demand.
+  std::unordered_map<Symbol, InlineFunc> inlines_;
+  /// Functions being expanded into the code emitted.
+  std::vector<const FuncDecl *> inlined_;
+  /// Functions of a lazily lowered program, indexed by their stubs.
+  std::vector<Stub> stubs_;
+  /// Mapping from functions to the operands of their stubs.
+  std::unordered_map<Symbol, uint64_t> stubIDs_;
+  /// Flag set if the debug table is built.
+  bool debug_ = false;
+  /// Functions marked in the code being emitted.
+  std::vector<DebugFunc> debugFuncs_;
+  /// Statements marked in the code being emitted.
+  std::vector<std::pair<Label, Location>> debugLines_;
+  /// Mapping from addresses to the source.
+  DebugTable debugTable_;
 };
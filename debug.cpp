@@ -0,0 +1,69 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <cassert>
+
+#include "debug.h"
+
+
+
+// -----------------------------------------------------------------------------
+void DebugTable::AddFunc(
+    size_t start,
+    size_t end,
+    const std::string &name,
+    const Location &loc)
+{
+  assert((funcs_.empty() || funcs_.back().End <= start) && "overlapping functions");
+  funcs_.push_back(Func{ start, end, name, loc });
+}
+
+// -----------------------------------------------------------------------------
+void DebugTable::AddLine(size_t addr, const Location &loc)
+{
+  assert((lines_.empty() || lines_.back().Addr <= addr) && "unordered statements");
+  lines_.push_back(Line{ addr, loc });
+}
+
+// -----------------------------------------------------------------------------
+void DebugTable::Append(const DebugTable &table, size_t offset)
+{
+  for (auto &func : table.funcs_) {
+    AddFunc(func.Start + offset, func.End + offset, func.Name, func.Loc);
+  }
+  for (auto &line : table.lines_) {
+    AddLine(line.Addr + offset, line.Loc);
+  }
+}
+
+// -----------------------------------------------------------------------------
+const DebugTable::Func *DebugTable::FindFunc(size_t addr) const
+{
+  auto it = std::upper_bound(
+      funcs_.begin(),
+      funcs_.end(),
+      addr,
+      [] (size_t addr, const Func &func) { return addr < func.Start; }
+  );
+  if (it == funcs_.begin() || addr >= std::prev(it)->End) {
+    return nullptr;
+  }
+  return &*std::prev(it);
+}
+
+// -----------------------------------------------------------------------------
+const DebugTable::Line *DebugTable::FindLine(size_t addr) const
+{
+  // Nested statements starting at the same address were recorded after the
+  // enclosing ones, so the last candidate is the innermost.
+  auto it = std::upper_bound(
+      lines_.begin(),
+      lines_.end(),
+      addr,
+      [] (size_t addr, const Line &line) { return addr < line.Addr; }
+  );
+  if (it == lines_.begin()) {
+    return nullptr;
+  }
+  return &*std::prev(it);
+}
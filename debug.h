@@ -0,0 +1,62 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "lexer.h"
+
+
+
+/**
+ * Maps addresses of the stack bytecode back to the source.
+ *
+ * Functions are recorded as ranges of code, along with their names, while
+ * statements are recorded at the address of their first instruction. Code
+ * is only ever appended to a program, so records are added in the order of
+ * their addresses and looked up by binary search. Locations name the source
+ * through interned symbols, so the table can outlive the module.
+ */
+class DebugTable final {
+public:
+  /// Code range of a function.
+  struct Func {
+    /// Address of the first instruction.
+    size_t Start;
+    /// Address past the last instruction.
+    size_t End;
+    /// Name of the function.
+    std::string Name;
+    /// Location of the declaration.
+    Location Loc;
+  };
+
+  /// Start of the code of a statement.
+  struct Line {
+    /// Address of the first instruction.
+    size_t Addr;
+    /// Location of the statement.
+    Location Loc;
+  };
+
+public:
+  /// Records the code of a function, following all recorded so far.
+  void AddFunc(size_t start, size_t end, const std::string &name, const Location &loc);
+  /// Records the start of a statement, not preceding any recorded so far.
+  void AddLine(size_t addr, const Location &loc);
+  /// Records all entries of a table of code placed at an offset.
+  void Append(const DebugTable &table, size_t offset);
+
+  /// Returns the function containing an address, or null if there is none.
+  const Func *FindFunc(size_t addr) const;
+  /// Returns the innermost statement an address belongs to, or null.
+  const Line *FindLine(size_t addr) const;
+
+private:
+  /// Functions, ordered by their addresses.
+  std::vector<Func> funcs_;
+  /// Statements, ordered by their addresses.
+  std::vector<Line> lines_;
+};
@@ -0,0 +1,113 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+
+#include "ast.h"
+#include "codegen.h"
+#include "engine.h"
+#include "jit.h"
+#include "lexer.h"
+#include "optimiser.h"
+#include "parser.h"
+#include "regcodegen.h"
+#include "verifier.h"
+
+
+
+// -----------------------------------------------------------------------------
+std::unique_ptr<Module> LoadModule(const std::string &path)
+{
+  // The lexer splits the source into a stream of tokens.
+  Lexer lexer(path);
+
+  // The parser processes the tokens from the lexer to build the AST.
+  auto ast = Parser(lexer).ParseModule();
+
+  // The verifier checks the program and emits warnings/errors.
+  Verifier().Verify(*ast);
+
+  // The optimiser simplifies the AST prior to code generation.
+  return Optimiser().Optimise(*ast);
+}
+
+// -----------------------------------------------------------------------------
+std::shared_ptr<const Program> Compile(const std::string &path, Program::Format format)
+{
+  auto ast = LoadModule(path);
+  switch (format) {
+    case Program::Format::REGISTER: {
+      return RegCodegen().Translate(*ast);
+    }
+    case Program::Format::STACK: {
+      auto prog = Codegen().Translate(*ast);
+      prog->Decode();
+      return prog;
+    }
+  }
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+std::vector<std::string_view> ShardInput(std::string_view input, size_t count)
+{
+  // Even splits are moved past the next line break. Shards which would be
+  // left empty by long lines are dropped.
+  std::vector<std::string_view> shards;
+  size_t start = 0;
+  for (size_t i = 1; i <= count && start < input.size(); ++i) {
+    size_t end = std::max(start, input.size() * i / count);
+    if (i == count) {
+      end = input.size();
+    } else if (end > 0 && input[end - 1] != '\n') {
+      auto eol = input.find('\n', end);
+      end = eol == std::string_view::npos ? input.size() : eol + 1;
+    }
+    if (end > start) {
+      shards.push_back(input.substr(start, end - start));
+    }
+    start = end;
+  }
+  return shards;
+}
+
+// -----------------------------------------------------------------------------
+template <typename F>
+static std::string Capture(IO &io, std::string_view input, F run)
+{
+  // Output is collected even if the program fails, then dropped.
+  std::string output;
+  io.Redirect(input, output);
+  try {
+    run();
+  } catch (...) {
+    io.Reset();
+    throw;
+  }
+  io.Reset();
+  return output;
+}
+
+// -----------------------------------------------------------------------------
+Instance::Instance(std::shared_ptr<const Program> prog, size_t stackSize)
+  : prog_(std::move(prog))
+  , io_(std::make_unique<IO>())
+  , interp_(*prog_, stackSize)
+{
+  interp_.SetIO(*io_);
+  interp_.SetJitThreshold(Jit::kDefaultThreshold);
+}
+
+// -----------------------------------------------------------------------------
+std::string Instance::Run(std::string_view input)
+{
+  return Capture(*io_, input, [this] {
+    interp_.Reset();
+    interp_.Run();
+  });
+}
+
+// -----------------------------------------------------------------------------
+std::string Instance::Stream(std::string_view input)
+{
+  return Capture(*io_, input, [this] { interp_.Stream(); });
+}
@@ -0,0 +1,74 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "interp.h"
+#include "io.h"
+#include "program.h"
+
+class Module;
+
+
+
+/// Lexes, parses, verifies and optimises a source file.
+std::unique_ptr<Module> LoadModule(const std::string &path);
+
+/**
+ * Compiles a source file into a program which can be shared by threads.
+ *
+ * Functions are lowered eagerly and stack bytecode is decoded, so the
+ * program is never modified once returned.
+ */
+std::shared_ptr<const Program> Compile(
+    const std::string &path,
+    Program::Format format = Program::Format::STACK
+);
+
+/**
+ * Splits an input into up to a number of shards of similar sizes.
+ *
+ * Shards are cut after line breaks, so records on lines of their own can be
+ * streamed through separate instances, with their outputs concatenated in
+ * the order of the shards.
+ */
+std::vector<std::string_view> ShardInput(std::string_view input, size_t count);
+
+/**
+ * Embeddable instance of the interpreter, running a shared program.
+ *
+ * Each instance owns a stack, an I/O context and, if hot functions are
+ * compiled, native code of its own. Instances are meant to be used by a
+ * single thread at a time, while any number of them can run the same
+ * program concurrently. Errors are reported as exceptions, after which the
+ * instance can be run again.
+ */
+class Instance final {
+public:
+  Instance(
+      std::shared_ptr<const Program> prog,
+      size_t stackSize = Interp::kDefaultStackSize
+  );
+
+  /// Runs the program on an input, returning its output.
+  std::string Run(std::string_view input);
+  /// Runs the program once for each record of an input, returning the output.
+  std::string Stream(std::string_view input);
+
+  /// Returns the interpreter, to be configured before running the program.
+  Interp &GetInterp() { return interp_; }
+  /// Returns the I/O context, reading and writing the standard streams.
+  IO &GetIO() { return *io_; }
+
+private:
+  /// Program being run, kept alive by the instance.
+  std::shared_ptr<const Program> prog_;
+  /// Streams of the runtime methods.
+  std::unique_ptr<IO> io_;
+  /// Interpreter running the program.
+  Interp interp_;
+};
@@ -0,0 +1,181 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+
+#include "codegen.h"
+
+
+
+/// Maximal number of nodes in the expression returned by an expanded function.
+static constexpr unsigned kInlineBudget = 16;
+/// Maximal number of calls expanded into each other.
+static constexpr size_t kInlineDepth = 4;
+
+// -----------------------------------------------------------------------------
+static unsigned GetSize(const Expr &expr)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF:
+    case Expr::Kind::INT: {
+      return 1;
+    }
+    case Expr::Kind::BINARY: {
+      auto &binary = static_cast<const BinaryExpr &>(expr);
+      return 1 + GetSize(binary.GetLHS()) + GetSize(binary.GetRHS());
+    }
+    case Expr::Kind::CALL: {
+      auto &call = static_cast<const CallExpr &>(expr);
+      unsigned size = 1 + GetSize(call.GetCallee());
+      for (auto it = call.arg_begin(), end = call.arg_end(); it != end; ++it) {
+        size += GetSize(**it);
+      }
+      return size;
+    }
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+static unsigned CountUses(const Expr &expr, unsigned index)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      auto &ref = static_cast<const RefExpr &>(expr);
+      bool use = ref.GetTarget() == RefExpr::Target::ARG && ref.GetArgIndex() == index;
+      return use ? 1 : 0;
+    }
+    case Expr::Kind::INT: {
+      return 0;
+    }
+    case Expr::Kind::BINARY: {
+      auto &binary = static_cast<const BinaryExpr &>(expr);
+      return CountUses(binary.GetLHS(), index) + CountUses(binary.GetRHS(), index);
+    }
+    case Expr::Kind::CALL: {
+      auto &call = static_cast<const CallExpr &>(expr);
+      unsigned uses = CountUses(call.GetCallee(), index);
+      for (auto it = call.arg_begin(), end = call.arg_end(); it != end; ++it) {
+        uses += CountUses(**it, index);
+      }
+      return uses;
+    }
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+Codegen::Binding Codegen::InlineScope::Lookup(Symbol name) const
+{
+  // Find the name among the arguments of the call.
+  if (auto it = args_.find(name); it != args_.end()) {
+    Binding b;
+    b.Kind = Binding::Kind::INLINE;
+    b.Arg = &it->second;
+    return b;
+  }
+  return parent_->Lookup(name);
+}
+
+// -----------------------------------------------------------------------------
+const Expr *Codegen::GetInlineBody(const FuncDecl &decl)
+{
+  // Only functions returning a small expression straight away are expanded.
+  auto &body = decl.GetBody();
+  if (std::distance(body.begin(), body.end()) != 1) {
+    return nullptr;
+  }
+  auto &stmt = **body.begin();
+  if (stmt.GetKind() != Stmt::Kind::RETURN) {
+    return nullptr;
+  }
+  auto &expr = static_cast<const ReturnStmt &>(stmt).GetExpr();
+  return GetSize(expr) <= kInlineBudget ? &expr : nullptr;
+}
+
+// -----------------------------------------------------------------------------
+bool Codegen::IsPure(const Scope &global, const Expr &expr, size_t depth)
+{
+  // Checked arithmetic can fail, so it must happen exactly when the call
+  // would have.
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF:
+    case Expr::Kind::INT: {
+      return true;
+    }
+    case Expr::Kind::BINARY: {
+      auto &binary = static_cast<const BinaryExpr &>(expr);
+      if (!binary.IsSafe() && !binary.IsComparison()) {
+        return false;
+      }
+      return IsPure(global, binary.GetLHS(), depth) && IsPure(global, binary.GetRHS(), depth);
+    }
+    case Expr::Kind::CALL: {
+      // Calls to functions which can be expanded into pure expressions are
+      // pure as well. Names of functions are never shadowed by arguments.
+      auto &call = static_cast<const CallExpr &>(expr);
+      auto &callee = call.GetCallee();
+      if (depth >= kInlineDepth || callee.GetKind() != Expr::Kind::REF) {
+        return false;
+      }
+      auto &ref = static_cast<const RefExpr &>(callee);
+      if (ref.GetTarget() != RefExpr::Target::FUNC) {
+        return false;
+      }
+      auto *func = global.Lookup(ref.GetSymbol()).Inline;
+      if (!func || !IsPure(global, *func->Body, depth + 1)) {
+        return false;
+      }
+      for (auto it = call.arg_begin(), end = call.arg_end(); it != end; ++it) {
+        if (!IsPure(global, **it, depth)) {
+          return false;
+        }
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+bool Codegen::LowerInlineCall(const Scope &scope, const CallExpr &call)
+{
+  auto &callee = call.GetCallee();
+  if (callee.GetKind() != Expr::Kind::REF || inlined_.size() >= kInlineDepth) {
+    return false;
+  }
+  auto binding = scope.Lookup(static_cast<const RefExpr &>(callee).GetSymbol());
+  if (binding.Kind != Binding::Kind::FUNC || !binding.Inline) {
+    return false;
+  }
+
+  // Recursive calls are left in place, so expansion terminates.
+  auto &func = *binding.Inline;
+  if (func.Decl == func_ ||
+      std::find(inlined_.begin(), inlined_.end(), func.Decl) != inlined_.end()) {
+    return false;
+  }
+
+  // Arguments are evaluated where the body references them, so they must be
+  // free of side effects. Unless they are constants or references to other
+  // values, which are cheap to push again, they must be used at most once.
+  auto &global = scope.GetGlobal();
+  std::unordered_map<Symbol, InlineArg> args;
+  auto arg = call.arg_begin();
+  unsigned index = 0;
+  for (auto it = func.Decl->arg_begin(), end = func.Decl->arg_end(); it != end; ++it) {
+    auto &value = **arg++;
+    bool trivial = value.GetKind() == Expr::Kind::INT || value.GetKind() == Expr::Kind::REF;
+    if (!trivial && (!IsPure(global, value, 0) || CountUses(*func.Body, index) > 1)) {
+      return false;
+    }
+    args.emplace(it->first, InlineArg{ &value, &scope, inlined_.size() });
+    ++index;
+  }
+
+  // The body only refers to its arguments and to globals.
+  inlined_.push_back(func.Decl);
+  InlineScope inlineScope(&global, args);
+  LowerExpr(inlineScope, *func.Body);
+  inlined_.pop_back();
+  return true;
+}
@@ -1,188 +1,683 @@
 // This file is part of the IMP project.
 
+#include "arith.h"
+#include "array.h"
 #include "interp.h"
+#include "io.h"
+#include "jit.h"
+#include "metrics.h"
+#include "profiler.h"
 #include "program.h"
 
+#include <algorithm>
 #include <iostream>
 
 
 
 // -----------------------------------------------------------------------------
-void Interp::Run()
+Interp::Interp(Program &prog, size_t stackSize)
+  : Interp(static_cast<const Program &>(prog), stackSize)
 {
+  lazyProg_ = &prog;
+}
+
+// -----------------------------------------------------------------------------
+Interp::Interp(const Program &prog, size_t stackSize)
+  : prog_(prog)
+  , lazyProg_(nullptr)
+  , io_(&IO::Get())
+  , stack_(new Value[stackSize])
+  , sp_(stack_.get())
+  , limit_(stack_.get() + stackSize)
+{
+}
+
+// -----------------------------------------------------------------------------
+Interp::~Interp()
+{
+  if (metrics_) {
+    io_->SetMetrics(nullptr);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Interp::Run(Dispatch dispatch)
+{
+  Execute(dispatch);
+  io_->Flush();
+}
+
+// -----------------------------------------------------------------------------
+uint64_t Interp::Stream(Dispatch dispatch)
+{
+  auto &io = *io_;
+  uint64_t records = 0;
+  while (!io.AtEnd()) {
+    // Each record starts out on an empty stack, while the program, along
+    // with any native code generated for it, is kept.
+    auto offset = io.Tell();
+    Reset();
+    Execute(dispatch);
+    ++records;
+
+    // Handlers which do not read their records would never finish.
+    if (io.Tell() == offset) {
+      break;
+    }
+  }
+  io.Flush();
+  return records;
+}
+
+// -----------------------------------------------------------------------------
+void Interp::Execute(Dispatch dispatch)
+{
+  if (prog_.GetFormat() == Program::Format::REGISTER) {
+#if IMP_HAS_METRICS
+    if (metrics_) {
+      return RegLoop<kDefaultDispatch, true>();
+    }
+#endif
+    switch (dispatch) {
+      case Dispatch::SWITCH: {
+        return RegLoop<Dispatch::SWITCH, false>();
+      }
+      case Dispatch::THREADED: {
+        return RegLoop<Dispatch::THREADED, false>();
+      }
+    }
+  }
+
+  // Profiled and metered runs go through the instrumented loop, staying
+  // interpreted.
+  bool decoded = prog_.IsDecoded();
+  if (profiler_ || metrics_) {
+    if (profiler_) {
+      profiler_->Start();
+    }
+    if (decoded) {
+      Loop<kDefaultDispatch, true, true>();
+    } else {
+      Loop<kDefaultDispatch, false, true>();
+    }
+    if (profiler_) {
+      profiler_->Stop();
+    }
+    return;
+  }
+
+  // Native code is generated from the decoded stream.
+  if (!jit_ && decoded && jitThreshold_ && Jit::IsSupported()) {
+    jit_ = std::make_unique<Jit>(*this, prog_, jitThreshold_);
+  }
+  switch (dispatch) {
+    case Dispatch::SWITCH: {
+      return decoded
+          ? Loop<Dispatch::SWITCH, true, false>()
+          : Loop<Dispatch::SWITCH, false, false>();
+    }
+    case Dispatch::THREADED: {
+      return decoded
+          ? Loop<Dispatch::THREADED, true, false>()
+          : Loop<Dispatch::THREADED, false, false>();
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Interp::SetMetrics(Metrics *metrics)
+{
+  metrics_ = metrics;
+  io_->SetMetrics(metrics);
+}
+
+#if IMP_HAS_METRICS
+// -----------------------------------------------------------------------------
+void Interp::CallMetered(RuntimeFn fn)
+{
+  Metrics::Call call(*metrics_, fn, sp_ - stack_.get());
+  (*fn) (*this);
+}
+#endif
+
+// -----------------------------------------------------------------------------
+uint64_t Interp::Count()
+{
+  count_ = 0;
+  if (prog_.GetFormat() == Program::Format::REGISTER) {
+    RegLoop<kDefaultDispatch, true>();
+  } else if (prog_.IsDecoded()) {
+    Loop<kDefaultDispatch, true, true>();
+  } else {
+    Loop<kDefaultDispatch, false, true>();
+  }
+  io_->Flush();
+  return count_;
+}
+
+// -----------------------------------------------------------------------------
+void Interp::Reset()
+{
+  pc_ = 0;
+  sp_ = stack_.get();
+  fp_ = 0;
+  frames_.clear();
+  arrays_.clear();
+}
+
+// -----------------------------------------------------------------------------
+int64_t Interp::Invoke(RuntimeFn fn, const int64_t *args, size_t nargs, const RuntimeSig *sig)
+{
+  auto isArray = [] (const std::string &type) { return type == "int[]"; };
+
+  // Arguments are laid out as if pushed by a call, first one on top.
+  Value *top = sp_;
+  for (size_t i = nargs; i-- > 0; ) {
+    if (sig && isArray(sig->Args[i])) {
+      Push(reinterpret_cast<Array *>(args[i]));
+    } else {
+      Push<int64_t>(args[i]);
+    }
+  }
+  CallRuntime(fn, nargs);
+  int64_t result = 0;
+  if (sp_ != top) {
+    if (sig && isArray(sig->Ret)) {
+      result = reinterpret_cast<intptr_t>(sp_[-1].GetArray());
+    } else {
+      result = PeekInt();
+    }
+  }
+  sp_ = top;
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+Array *Interp::NewArray(int64_t size)
+{
+  if (size < 0) {
+    throw RuntimeError("invalid array size: " + std::to_string(size));
+  }
+  auto array = Array::New(size);
+  if (!array) {
+    throw RuntimeError("out of memory for an array of " + std::to_string(size) + " elements");
+  }
+  return arrays_.emplace_back(std::move(array)).get();
+}
+
+// -----------------------------------------------------------------------------
+#if IMP_HAS_THREADED_DISPATCH
+// Both the address-of-label operator and computed gotos are GNU extensions.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Wgnu-label-as-value"
+#endif
+
+/// Every handler is reachable both as a case and as a label.
+#define OPCODE(name) case Opcode::name: op_##name:
+
+/// Fetches the next opcode and jumps to its handler in threaded mode.
+#define NEXT()                                                          \
+  if constexpr (D == Dispatch::THREADED) {                              \
+    COUNT();                                                            \
+    goto *kTargets[static_cast<uint8_t>(FETCH())];                      \
+  } else {                                                              \
+    continue;                                                           \
+  }
+#else
+#define OPCODE(name) case Opcode::name:
+#define NEXT() continue
+#endif
+
+/// Accounts for the instruction about to be executed in counted runs.
+#define COUNT()                                                         \
+  if constexpr (Counted) {                                              \
+    ++count_;                                                           \
+    METER(Step());                                                      \
+    if (profiler_) {                                                    \
+      size_t at = pc_;                                                  \
+      auto op = Decoded ? insts[at].Op : prog_.Read<Opcode>(at);        \
+      profiler_->Step(op, pc_);                                         \
+    }                                                                   \
+  }
+
+/// Notifies the profiler of calls and returns in counted runs.
+#define PROFILE(event)                                                  \
+  if constexpr (Counted) {                                              \
+    if (profiler_) { profiler_->event; }                                \
+  }
+
+/// Feeds the metrics in counted runs, if they are compiled in.
+#if IMP_HAS_METRICS
+#define METER(event)                                                    \
+  if constexpr (Counted) {                                              \
+    if (metrics_) { metrics_->event; }                                  \
+  }
+#else
+#define METER(event)
+#endif
+
+/// Fetches the next opcode, from either the decoded or the raw stream.
+#define FETCH() \
+  (Decoded ? (inst = &insts[pc_++])->Op : prog_.Read<Opcode>(pc_))
+
+/// Reads the Nth operand of the current instruction.
+#define ARG(T, N) \
+  (Decoded ? inst->Operand<T, N>() : prog_.Read<T>(pc_))
+
+template <Interp::Dispatch D, bool Decoded, bool Counted>
+void Interp::Loop()
+{
+  const Inst *insts = prog_.GetInsts();
+  [[maybe_unused]] const Inst *inst = nullptr;
+
+#if IMP_HAS_THREADED_DISPATCH
+  /// Handler addresses, indexed by opcode.
+  [[maybe_unused]] static const void *kTargets[] = {
+    &&op_PUSH_FUNC,
+    &&op_PUSH_PROTO,
+    &&op_PUSH_INT,
+    &&op_PEEK,
+    &&op_POP,
+    &&op_CALL,
+    &&op_CALL_DIRECT,
+    &&op_CALL_NATIVE,
+    &&op_ADD,
+    &&op_SUB,
+    &&op_MUL,
+    &&op_DIV,
+    &&op_MOD,
+    &&op_ADD_UNCHECKED,
+    &&op_SUB_UNCHECKED,
+    &&op_MUL_UNCHECKED,
+    &&op_DIV_UNCHECKED,
+    &&op_MOD_UNCHECKED,
+    &&op_DEQ,
+    &&op_NEQ,
+    &&op_SM,
+    &&op_SMEQ,
+    &&op_GR,
+    &&op_GREQ,
+    &&op_RET,
+    &&op_JUMP_FALSE,
+    &&op_JUMP,
+    &&op_TAIL_CALL,
+    &&op_ENTER,
+    &&op_LEAVE,
+    &&op_LOAD_LOCAL,
+    &&op_STORE_LOCAL,
+    &&op_LOAD_ARG,
+    &&op_PEEK_ADD,
+    &&op_JUMP_IF_EQ,
+    &&op_JUMP_IF_NE,
+    &&op_JUMP_IF_LT,
+    &&op_JUMP_IF_LE,
+    &&op_JUMP_IF_GT,
+    &&op_JUMP_IF_GE,
+    &&op_STUB,
+    &&op_STOP,
+  };
+  static_assert(
+      sizeof(kTargets) / sizeof(kTargets[0]) == kNumOpcodes,
+      "missing handler in dispatch table"
+  );
+#endif
+
   for (;;) {
-    auto op = prog_.Read<Opcode>(pc_);
-    switch (op) {
-      case Opcode::PUSH_FUNC: {
-        Push(prog_.Read<size_t>(pc_));
-        continue;
-      }
-      case Opcode::PUSH_PROTO: {
-        Push(prog_.Read<RuntimeFn>(pc_));
-        continue;
-      }
-      case Opcode::PUSH_INT: {
-        auto val = prog_.Read<std::int64_t>(pc_); // signed/unsigned 
+    COUNT();
+    switch (FETCH()) {
+      OPCODE(PUSH_FUNC) {
+        Push(ARG(size_t, 0));
+        NEXT();
+      }
+      OPCODE(PUSH_PROTO) {
+        Push(ARG(RuntimeFn, 0));
+        NEXT();
+      }
+      OPCODE(PUSH_INT) {
+        auto val = ARG(std::int64_t, 0); // signed/unsigned 
         Push(val);
-        continue;
+        NEXT();
       }
-      case Opcode::PEEK: {
-        auto idx = prog_.Read<unsigned>(pc_);
-        Push(*(stack_.rbegin() + idx));
-        continue;
+      OPCODE(PEEK) {
+        auto idx = ARG(unsigned, 0);
+        Push(sp_[-1 - static_cast<ptrdiff_t>(idx)]);
+        NEXT();
       }
-      case Opcode::POP: {
+      OPCODE(POP) {
         Pop();
-        continue;
+        NEXT();
       }
-      case Opcode::CALL: {
+      OPCODE(CALL) {
+        auto nargs = ARG(unsigned, 0);
         auto callee = Pop();
-        switch (callee.Kind) {
+        switch (callee.GetKind()) {
           case Value::Kind::PROTO: {
-            (*callee.Val.Proto) (*this);
-            continue;
+            CallRuntime(callee.GetProto(), nargs);
+            insts = prog_.GetInsts();
+            NEXT();
           }
           case Value::Kind::ADDR: {
             Push(pc_);
-            pc_ = callee.Val.Addr;
-            continue;
+            pc_ = callee.GetAddr();
+            PROFILE(Enter(pc_));
+            METER(Enter(sp_ - stack_.get()));
+            NEXT();
           }
           case Value::Kind::INT: {
             throw RuntimeError("cannot call integer");
           }
+          case Value::Kind::ARRAY: {
+            throw RuntimeError("cannot call array");
+          }
         }
-        continue;
+        NEXT();
       }
-      case Opcode::ADD: {
+      OPCODE(CALL_DIRECT) {
+        auto addr = ARG(size_t, 0);
+        [[maybe_unused]] auto nargs = ARG(unsigned, 1);
+        assert(sp_ - stack_.get() >= nargs && "missing arguments");
+        Push(pc_);
+        if constexpr (Decoded && !Counted) {
+          if (jit_ && jit_->Enter(addr)) {
+            NEXT();
+          }
+        }
+        pc_ = addr;
+        PROFILE(Enter(addr));
+        METER(Enter(sp_ - stack_.get()));
+        NEXT();
+      }
+      OPCODE(CALL_NATIVE) {
+        auto fn = ARG(RuntimeFn, 0);
+        auto nargs = ARG(unsigned, 1);
+        assert(sp_ - stack_.get() >= nargs && "missing arguments");
+        CallRuntime(fn, nargs);
+        // Runtime methods can reload the program, moving the decoded stream.
+        insts = prog_.GetInsts();
+        NEXT();
+      }
+      OPCODE(ADD) {
         auto rhs = PopInt();
         auto lhs = PopInt();
-        int64_t result = uint64_t(rhs) + uint64_t(lhs);
-
-        if((rhs < 0 && lhs < 0 && result > 0) || (rhs > 0 && lhs > 0 && result < 0)) {
-          RuntimeError("overflow in sum for values '" + std::to_string(rhs) + "' and '" + std::to_string(lhs) + "'");
-        }
-
-        Push(result);
-        continue;
+        Push(CheckedAdd(lhs, rhs));
+        NEXT();
       }
-      case Opcode::SUB: {
+      OPCODE(SUB) {
         auto rhs = PopInt();
         auto lhs = PopInt();
-        int64_t result = lhs - rhs;
-
-        if((rhs < 0 && lhs < 0 && result > 0) || (rhs > 0 && lhs > 0 && result < 0)) {
-          RuntimeError("overflow in sum for values '" + std::to_string(rhs) + "' and '" + std::to_string(lhs) + "'");
-        }
-
-        Push(result);
-        continue;
+        Push(CheckedSub(lhs, rhs));
+        NEXT();
       }
-      case Opcode::MUL: {
+      OPCODE(MUL) {
         auto rhs = PopInt();
         auto lhs = PopInt();
-
-        int64_t result = lhs * rhs;
-
-        Push(result);
-        continue;
+        Push(CheckedMul(lhs, rhs));
+        NEXT();
       }
-      case Opcode::DIV: {
+      OPCODE(DIV) {
         auto rhs = PopInt();
         auto lhs = PopInt();
-
-        int64_t result = lhs / rhs;
-
-        Push(result);
-        continue;
+        Push(CheckedDiv(lhs, rhs));
+        NEXT();
       }
-      case Opcode::MOD: {
+      OPCODE(MOD) {
         auto rhs = PopInt();
         auto lhs = PopInt();
-
-        int64_t result = lhs % rhs;
-
-        Push(result);
-        continue;
+        Push(CheckedMod(lhs, rhs));
+        NEXT();
+      }
+      OPCODE(ADD_UNCHECKED) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        Push(lhs + rhs);
+        NEXT();
+      }
+      OPCODE(SUB_UNCHECKED) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        Push(lhs - rhs);
+        NEXT();
       }
-      case Opcode::DEQ: {
+      OPCODE(MUL_UNCHECKED) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        Push(lhs * rhs);
+        NEXT();
+      }
+      OPCODE(DIV_UNCHECKED) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        Push(lhs / rhs);
+        NEXT();
+      }
+      OPCODE(MOD_UNCHECKED) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        Push(lhs % rhs);
+        NEXT();
+      }
+      OPCODE(DEQ) {
         auto rhs = PopInt();
         auto lhs = PopInt();
 
         int64_t result = (lhs == rhs) ? 1 : 0;
 
         Push(result);
-        continue;
+        NEXT();
       }
-      case Opcode::NEQ: {
+      OPCODE(NEQ) {
         auto rhs = PopInt();
         auto lhs = PopInt();
 
         int64_t result = (lhs != rhs) ? 1 : 0;
 
         Push(result);
-        continue;
+        NEXT();
       }
-      case Opcode::SM: {
+      OPCODE(SM) {
         auto rhs = PopInt();
         auto lhs = PopInt();
 
         int64_t result = (lhs < rhs) ? 1 : 0;
 
         Push(result);
-        continue;
+        NEXT();
       }
-      case Opcode::SMEQ: {
+      OPCODE(SMEQ) {
         auto rhs = PopInt();
         auto lhs = PopInt();
 
         int64_t result = (lhs <= rhs) ? 1 : 0;
 
         Push(result);
-        continue;
+        NEXT();
       }
-      case Opcode::GR: {
+      OPCODE(GR) {
         auto rhs = PopInt();
         auto lhs = PopInt();
 
         int64_t result = (lhs > rhs) ? 1 : 0;
 
         Push(result);
-        continue;
+        NEXT();
       }
-      case Opcode::GREQ: {
+      OPCODE(GREQ) {
         auto rhs = PopInt();
         auto lhs = PopInt();
 
         int64_t result = (lhs >= rhs) ? 1 : 0;
 
         Push(result);
-        continue;
+        NEXT();
       }
-      case Opcode::RET: {
-        auto depth = prog_.Read<unsigned>(pc_);
-        auto nargs = prog_.Read<unsigned>(pc_);
+      OPCODE(RET) {
+        auto depth = ARG(unsigned, 0);
+        auto nargs = ARG(unsigned, 1);
         auto v = Pop();
-        stack_.resize(stack_.size() - depth);
+        sp_ -= depth;
         pc_ = PopAddr();
-        stack_.resize(stack_.size() - nargs);
+        sp_ -= nargs;
         Push(v);
-        continue;
+        PROFILE(Return());
+        METER(Return(sp_ - stack_.get()));
+        NEXT();
       }
-      case Opcode::JUMP_FALSE: {
+      OPCODE(JUMP_FALSE) {
         auto cond = Pop();
-        auto addr = prog_.Read<size_t>(pc_);
+        auto addr = ARG(size_t, 0);
         if (!cond) {
           pc_ = addr;
         }
-        continue;
+        NEXT();
+      }
+      OPCODE(JUMP) {
+        pc_ = ARG(size_t, 0);
+        NEXT();
+      }
+      OPCODE(TAIL_CALL) {
+        auto addr = ARG(size_t, 0);
+        auto depth = ARG(unsigned, 1);
+        auto nargs = ARG(uint16_t, 2);
+
+        // Move the new arguments, on top of the stack, over the arguments of
+        // the frame, below the temporaries and the return address.
+        Value *top = sp_ - 1;
+        size_t dist = nargs + depth + 1;
+        for (size_t i = 0; i < nargs; ++i) {
+          *(top - dist - i) = *(top - i);
+        }
+        sp_ -= nargs + depth;
+        pc_ = addr;
+        PROFILE(TailCall());
+        NEXT();
+      }
+      OPCODE(ENTER) {
+        // The frame pointer of the caller is saved above the return address,
+        // with the locals following it.
+        auto n = ARG(unsigned, 0);
+        if (static_cast<size_t>(limit_ - sp_) <= n) {
+          throw RuntimeError("stack overflow");
+        }
+        *sp_++ = Value(fp_);
+        fp_ = sp_ - stack_.get();
+        std::fill(sp_, sp_ + n, Value(int64_t(0)));
+        sp_ += n;
+        NEXT();
+      }
+      OPCODE(LEAVE) {
+        // Values kept from the top replace the frame, down to its saved
+        // frame pointer, leaving the return address on top of them.
+        auto n = ARG(unsigned, 0);
+        Value *frame = stack_.get() + fp_ - 1;
+        fp_ = frame->GetAddr();
+        std::copy(sp_ - n, sp_, frame);
+        sp_ = frame + n;
+        NEXT();
+      }
+      OPCODE(LOAD_LOCAL) {
+        Push(stack_[fp_ + ARG(unsigned, 0)]);
+        NEXT();
+      }
+      OPCODE(STORE_LOCAL) {
+        auto slot = ARG(unsigned, 0);
+        stack_[fp_ + slot] = Pop();
+        NEXT();
+      }
+      OPCODE(LOAD_ARG) {
+        // Arguments are below the return address and the saved frame pointer.
+        Push(stack_[fp_ - 3 - ARG(unsigned, 0)]);
+        NEXT();
+      }
+      OPCODE(PEEK_ADD) {
+        auto idx = ARG(unsigned, 0);
+        auto rhs = sp_[-1 - static_cast<ptrdiff_t>(idx)];
+        auto lhs = PopInt();
+        Push(CheckedAdd(lhs, rhs.GetInt()));
+        NEXT();
+      }
+      OPCODE(JUMP_IF_EQ) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        auto addr = ARG(size_t, 0);
+        if (lhs == rhs) {
+          pc_ = addr;
+        }
+        NEXT();
       }
-      case Opcode::JUMP: {
-        pc_ = prog_.Read<size_t>(pc_);
-        continue;
+      OPCODE(JUMP_IF_NE) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        auto addr = ARG(size_t, 0);
+        if (lhs != rhs) {
+          pc_ = addr;
+        }
+        NEXT();
       }
-      case Opcode::STOP: {
+      OPCODE(JUMP_IF_LT) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        auto addr = ARG(size_t, 0);
+        if (lhs < rhs) {
+          pc_ = addr;
+        }
+        NEXT();
+      }
+      OPCODE(JUMP_IF_LE) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        auto addr = ARG(size_t, 0);
+        if (lhs <= rhs) {
+          pc_ = addr;
+        }
+        NEXT();
+      }
+      OPCODE(JUMP_IF_GT) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        auto addr = ARG(size_t, 0);
+        if (lhs > rhs) {
+          pc_ = addr;
+        }
+        NEXT();
+      }
+      OPCODE(JUMP_IF_GE) {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        auto addr = ARG(size_t, 0);
+        if (lhs >= rhs) {
+          pc_ = addr;
+        }
+        NEXT();
+      }
+      OPCODE(STUB) {
+        // Lower the function, which replaces the stub with a jump to its
+        // body, then run the jump. The decoded stream may have moved.
+        size_t stub = pc_ - 1;
+        auto func = ARG(uint64_t, 0);
+        if (!lazyProg_) {
+          throw RuntimeError("cannot lower functions of a shared program");
+        }
+        lazyProg_->Resolve(func);
+        insts = prog_.GetInsts();
+        pc_ = stub;
+        NEXT();
+      }
+      OPCODE(STOP) {
         return;
       }
     }
   }
 }
+
+#undef OPCODE
+#undef NEXT
+#undef COUNT
+#undef PROFILE
+#undef METER
+#undef FETCH
+#undef ARG
+#if IMP_HAS_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
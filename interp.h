@@ -3,13 +3,37 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "metrics.h"
 #include "runtime.h"
 
+class Array;
+class IO;
+class Jit;
+class Profiler;
 class Program;
 
 
+/// Computed-goto dispatch relies on the labels-as-values GNU extension.
+#if defined(IMP_THREADED_DISPATCH) && defined(__GNUC__)
+#define IMP_HAS_THREADED_DISPATCH 1
+#else
+#define IMP_HAS_THREADED_DISPATCH 0
+#endif
+
+/// Compact values drop the tag of stack slots, halving their size.
+#ifdef IMP_COMPACT_VALUES
+#undef IMP_COMPACT_VALUES
+#define IMP_COMPACT_VALUES 1
+#else
+#define IMP_COMPACT_VALUES 0
+#endif
+
 
 /**
  * Represents a runtime error.
@@ -21,91 +45,310 @@ public:
 
 /**
  * Interpreter for the bytecode.
+ *
+ * An interpreter owns its stack and refers to its I/O context, so it must
+ * only be used by one thread at a time. Any number of interpreters can run
+ * the same program concurrently, provided it is not lowered on demand.
  */
 class Interp {
 public:
+#if IMP_COMPACT_VALUES
+  /**
+   * A single 8-byte word stored on the stack.
+   *
+   * Integers occupy the whole word, so the kind of a value cannot be
+   * recovered at runtime: the program is trusted to be well-typed and
+   * integer operations do not check their operands. Callees stay
+   * distinguishable, as addresses and prototypes are shifted left and
+   * prototypes are marked with the lowest bit. Arrays are stored as plain
+   * pointers, so they can be passed around as integers by compiled code.
+   */
+  struct Value {
+    enum class Kind {
+      PROTO,
+      ADDR,
+      INT,
+      ARRAY,
+    };
+
+    uint64_t Bits;
+
+    Value() = default;
+    Value(RuntimeFn val) : Bits((reinterpret_cast<uintptr_t>(val) << 1) | 1)
+    {
+      assert((reinterpret_cast<uintptr_t>(val) >> 63) == 0);
+    }
+    Value(size_t val) : Bits(val << 1) {}
+    Value(int64_t val) : Bits(val) {}
+    Value(Array *val) : Bits(reinterpret_cast<uintptr_t>(val)) {}
+
+    /// Kind of a value in callee position: integers cannot be told apart.
+    Kind GetKind() const { return (Bits & 1) ? Kind::PROTO : Kind::ADDR; }
+
+    RuntimeFn GetProto() const
+    {
+      return reinterpret_cast<RuntimeFn>(static_cast<uintptr_t>(Bits >> 1));
+    }
+    size_t GetAddr() const { return Bits >> 1; }
+    int64_t GetInt() const { return Bits; }
+    Array *GetArray() const { return reinterpret_cast<Array *>(static_cast<uintptr_t>(Bits)); }
+
+    operator bool () const { return Bits != 0; }
+  };
+
+  static_assert(sizeof(Value) == 8, "compact values must fit a word");
+#else
   /// A dynamically-typed value stored on top of the stack.
   struct Value {
     enum class Kind {
       PROTO,
       ADDR,
       INT,
-    } Kind;
+      ARRAY,
+    } Tag;
 
     union {
       RuntimeFn Proto;
       size_t Addr;
       int64_t Int;
+      Array *Arr;
     } Val;
 
-    Value() : Kind(Kind::INT) { Val.Int = 0; }
-    Value(RuntimeFn val) : Kind(Kind::PROTO) { Val.Proto = val; }
-    Value(size_t val) : Kind(Kind::ADDR) { Val.Addr = val; }
-    Value(int64_t val) : Kind(Kind::INT) { Val.Int = val; }
+    Value() = default;
+    Value(RuntimeFn val) : Tag(Kind::PROTO) { Val.Proto = val; }
+    Value(size_t val) : Tag(Kind::ADDR) { Val.Addr = val; }
+    Value(int64_t val) : Tag(Kind::INT) { Val.Int = val; }
+    Value(Array *val) : Tag(Kind::ARRAY) { Val.Arr = val; }
+
+    Kind GetKind() const { return Tag; }
+
+    RuntimeFn GetProto() const
+    {
+      assert(Tag == Kind::PROTO);
+      return Val.Proto;
+    }
+    size_t GetAddr() const
+    {
+      assert(Tag == Kind::ADDR);
+      return Val.Addr;
+    }
+    int64_t GetInt() const
+    {
+      assert(Tag == Kind::INT);
+      return Val.Int;
+    }
+    Array *GetArray() const
+    {
+      assert(Tag == Kind::ARRAY);
+      return Val.Arr;
+    }
 
     operator bool () const
     {
-      switch (Kind) {
+      switch (Tag) {
         case Kind::PROTO: return true;
         case Kind::ADDR: return true;
         case Kind::INT: return Val.Int != 0;
+        case Kind::ARRAY: return true;
       }
       return false;
     }
   };
+#endif
+
+  /// Strategy used to dispatch instructions in the main loop.
+  enum class Dispatch {
+    /// Portable loop, decoding each opcode in a switch.
+    SWITCH,
+    /// Direct-threaded loop, jumping through a table of label addresses.
+    THREADED,
+  };
+
+  /// Dispatch strategy selected at build time.
+  static constexpr Dispatch kDefaultDispatch = IMP_HAS_THREADED_DISPATCH
+      ? Dispatch::THREADED
+      : Dispatch::SWITCH;
+
+  /// Number of values the stack holds unless configured otherwise.
+  static constexpr size_t kDefaultStackSize = 1 << 20;
 
 public:
-  /// Creates an interpreter for a given program.
-  Interp(Program &prog) : prog_(prog) {}
+  /// Creates an interpreter for a given program, with a fixed-size stack.
+  Interp(Program &prog, size_t stackSize = kDefaultStackSize);
+  /// Creates an interpreter for a program which is never modified.
+  Interp(const Program &prog, size_t stackSize = kDefaultStackSize);
+  ~Interp();
+
+  /// Runs the runtime methods on an I/O context instead of the process one.
+  void SetIO(IO &io) { io_ = &io; }
+  /// Returns the I/O context of the runtime methods.
+  IO &GetIO() { return *io_; }
+
+  /// Compiles functions to native code once called a number of times.
+  void SetJitThreshold(uint64_t calls) { jitThreshold_ = calls; }
+  /// Profiles runs of the stack bytecode, which are then never compiled.
+  void SetProfiler(Profiler *profiler) { profiler_ = profiler; }
+  /// Feeds metrics from runs and from the I/O context, never compiling code.
+  void SetMetrics(Metrics *metrics);
+
+  /// Interpreter main loop, using the default dispatch strategy.
+  void Run() { Run(kDefaultDispatch); }
+  /// Interpreter main loop, using a specific dispatch strategy.
+  void Run(Dispatch dispatch);
+  /// Runs the program, returning the number of instructions executed.
+  uint64_t Count();
+  /// Rewinds to the start of the program, on an empty stack.
+  void Reset();
 
-  /// Interpreter main loop.
-  void Run();
+  /**
+   * Runs the program once for each record of the input, until it runs out.
+   *
+   * A record is whatever a single run of the program reads. The stack and
+   * the code, including any native code, are reused across records, while
+   * input is read and output written in large blocks. Returns the number of
+   * records processed.
+   */
+  uint64_t Stream() { return Stream(kDefaultDispatch); }
+  /// Runs the program over the records of the input, with a dispatch strategy.
+  uint64_t Stream(Dispatch dispatch);
+
+  /**
+   * Invokes a runtime method outside of the program, returning its result.
+   *
+   * Arguments and the result are plain words, arrays being passed as
+   * pointers, with their types given by the signature of the method if it
+   * takes or returns arrays.
+   */
+  int64_t Invoke(RuntimeFn fn, const int64_t *args, size_t nargs, const RuntimeSig *sig = nullptr);
+
+  /// Allocates an array of zeros, owned by the interpreter until reset.
+  Array *NewArray(int64_t size);
+
+  /// Returns the number of arguments passed to the runtime method being run.
+  unsigned GetNumArgs() const { return nargs_; }
 
   /// Pop a value from the stack.
   Value Pop()
   {
-    assert(!stack_.empty() && "stack empty");
-    auto t = *stack_.rbegin();
-    stack_.pop_back();
-    return t;
+    assert(sp_ != stack_.get() && "stack empty");
+    return *--sp_;
   }
 
   /// Pop an integer from the stack.
   int64_t PopInt()
   {
-    auto v = Pop();
-    assert(v.Kind == Value::Kind::INT);
-    return v.Val.Int;
+    return Pop().GetInt();
+  }
+
+  /// Pop an array from the stack.
+  Array *PopArray()
+  {
+    return Pop().GetArray();
   }
 
   /// Pop an address from the stack.
   int64_t PopAddr()
   {
-    auto v = Pop();
-    assert(v.Kind == Value::Kind::ADDR);
-    return v.Val.Addr;
+    return Pop().GetAddr();
   }
 
   /// Look at the integer on top of the stack.
   int64_t PeekInt()
   {
-    auto v = *stack_.rbegin();
-    assert(v.Kind == Value::Kind::INT);
-    return v.Val.Int;
+    assert(sp_ != stack_.get() && "stack empty");
+    return sp_[-1].GetInt();
   }
 
   /// Add a value to the stack.
   template <typename T>
   void Push(const T &t)
   {
-    stack_.emplace_back(std::forward<const T>(t));
+    if (sp_ == limit_) {
+      throw RuntimeError("stack overflow");
+    }
+    *sp_++ = Value(t);
+  }
+
+private:
+  /// Runs the main loop from the current instruction until the program stops.
+  void Execute(Dispatch dispatch);
+  /// Main loop, instantiated for each dispatch strategy and stream format.
+  template <Dispatch D, bool Decoded, bool Counted>
+  void Loop();
+  /// Main loop of the register machine.
+  template <Dispatch D, bool Counted>
+  void RegLoop();
+
+  /// Returns a register of the current frame.
+  Value &Reg(uint32_t reg)
+  {
+    assert(stack_.get() + fp_ + reg < sp_ && "register out of frame");
+    return stack_[fp_ + reg];
+  }
+
+  /// Invokes a runtime method on the arguments on top of the stack.
+  void CallRuntime(RuntimeFn fn, unsigned nargs)
+  {
+    nargs_ = nargs;
+#if IMP_HAS_METRICS
+    if (metrics_) {
+      return CallMetered(fn);
+    }
+#endif
+    (*fn) (*this);
   }
+#if IMP_HAS_METRICS
+  /// Invokes a runtime method, timing the call.
+  void CallMetered(RuntimeFn fn);
+#endif
+
+  /// Invokes a runtime function with arguments taken from registers.
+  Value CallProto(RuntimeFn fn, uint32_t base, uint32_t nargs);
+
+private:
+  /// Saved state of a caller in the register machine.
+  struct Frame {
+    /// Return address.
+    size_t PC;
+    /// Frame pointer of the caller.
+    size_t FP;
+    /// Register of the caller receiving the return value.
+    uint32_t Dst;
+  };
 
 private:
   /// Reference to the program being executed.
-  Program &prog_;
-  /// Program counter.
+  const Program &prog_;
+  /// Program functions are lowered into, null if it cannot be modified.
+  Program *lazyProg_;
+  /// Context of the runtime methods.
+  IO *io_;
+  /// Program counter: byte offset or index into the decoded stream.
   size_t pc_ = 0;
-  /// Evaluation stack.
-  std::vector<Value> stack_;
+  /// Evaluation stack, also holding the registers of the register machine.
+  std::unique_ptr<Value[]> stack_;
+  /// Pointer past the value on top of the stack.
+  Value *sp_;
+  /// Pointer past the last slot of the stack.
+  Value *limit_;
+  /// Frame pointer: first local of the stack machine or first register.
+  size_t fp_ = 0;
+  /// Call stack of the register machine.
+  std::vector<Frame> frames_;
+  /// Number of instructions executed by a counted run.
+  uint64_t count_ = 0;
+  /// Number of calls after which functions are compiled, 0 if disabled.
+  uint64_t jitThreshold_ = 0;
+  /// Compiler of hot functions, if enabled.
+  std::unique_ptr<Jit> jit_;
+  /// Profiler fed by the instrumented loop, if enabled.
+  Profiler *profiler_ = nullptr;
+  /// Metrics fed by the instrumented loops, if enabled.
+  Metrics *metrics_ = nullptr;
+  /// Arrays allocated by the program since the last reset.
+  std::vector<std::unique_ptr<Array>> arrays_;
+  /// Number of arguments of the last call to a runtime method.
+  unsigned nargs_ = 0;
+
+  friend class Jit;
 };
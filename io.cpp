@@ -0,0 +1,243 @@
+// This file is part of the IMP project.
+
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "metrics.h"
+
+
+
+// -----------------------------------------------------------------------------
+IO &IO::Get()
+{
+  static IO io;
+  return io;
+}
+
+// -----------------------------------------------------------------------------
+IO::~IO()
+{
+  Flush();
+  if (inOwned_) {
+    close(inFd_);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void IO::Open(const std::string &path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open '" + path + "'");
+  }
+  if (inOwned_) {
+    close(inFd_);
+  }
+  inFd_ = fd;
+  inOwned_ = true;
+  inPos_ = inEnd_ = in_;
+  inFailed_ = false;
+}
+
+// -----------------------------------------------------------------------------
+int64_t IO::ReadInt()
+{
+  // Integers which cannot be parsed put the stream into a failed state, in
+  // which all further reads return 0.
+  if (inFailed_) {
+    return 0;
+  }
+
+  if (!SkipSpace()) {
+    inFailed_ = true;
+    return 0;
+  }
+
+  bool negative = false;
+  if (*inPos_ == '-' || *inPos_ == '+') {
+    negative = *inPos_++ == '-';
+  }
+
+  // Accumulate digits, noting whether the magnitude goes out of range.
+  constexpr uint64_t kMax = std::numeric_limits<int64_t>::max();
+  const uint64_t limit = negative ? kMax + 1 : kMax;
+  uint64_t value = 0;
+  bool digits = false;
+  bool overflow = false;
+  for (;;) {
+    if (inPos_ == inEnd_ && !Refill()) {
+      break;
+    }
+    unsigned digit = static_cast<unsigned char>(*inPos_) - '0';
+    if (digit > 9) {
+      break;
+    }
+    ++inPos_;
+    digits = true;
+    if (value > (limit - digit) / 10) {
+      overflow = true;
+    } else {
+      value = value * 10 + digit;
+    }
+  }
+
+  if (!digits) {
+    inFailed_ = true;
+    return 0;
+  }
+  if (overflow) {
+    inFailed_ = true;
+    value = limit;
+  }
+  return negative ? static_cast<int64_t>(0 - value) : static_cast<int64_t>(value);
+}
+
+// -----------------------------------------------------------------------------
+bool IO::AtEnd()
+{
+  return inFailed_ || !SkipSpace();
+}
+
+// -----------------------------------------------------------------------------
+void IO::WriteInt(int64_t value)
+{
+  // Digits are formatted backwards into a scratch buffer.
+  char digits[20];
+  char *end = digits + sizeof(digits);
+  char *p = end;
+  uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : value;
+  do {
+    *--p = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+
+  size_t length = end - p;
+  char *out = Reserve(length + 1);
+  if (value < 0) {
+    *out++ = '-';
+    outSize_ += 1;
+  }
+  memcpy(out, p, length);
+  outSize_ += length;
+}
+
+// -----------------------------------------------------------------------------
+void IO::WriteChar(char c)
+{
+  *Reserve(1) = c;
+  outSize_ += 1;
+}
+
+// -----------------------------------------------------------------------------
+void IO::Flush()
+{
+  if (outSink_) {
+    outSink_->append(out_, outSize_);
+    outSize_ = 0;
+    return;
+  }
+
+#if IMP_HAS_METRICS
+  std::optional<Metrics::Block> block;
+  if (metrics_ && outSize_) {
+    block.emplace(*metrics_, Metrics::Stream::OUTPUT);
+  }
+#endif
+  for (size_t offset = 0; offset < outSize_; ) {
+    ssize_t n = write(outFd_, out_ + offset, outSize_ - offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Output is dropped if the descriptor went away.
+      break;
+    }
+    offset += n;
+  }
+  outSize_ = 0;
+}
+
+// -----------------------------------------------------------------------------
+void IO::Redirect(std::string_view input, std::string &output)
+{
+  Flush();
+  inPos_ = input.data();
+  inEnd_ = input.data() + input.size();
+  inRead_ = input.size();
+  inFailed_ = false;
+  inRedirected_ = true;
+  outSink_ = &output;
+}
+
+// -----------------------------------------------------------------------------
+void IO::Reset()
+{
+  Flush();
+  inPos_ = inEnd_ = in_;
+  inRead_ = 0;
+  inFailed_ = false;
+  inRedirected_ = false;
+  outSink_ = nullptr;
+}
+
+// -----------------------------------------------------------------------------
+bool IO::Refill()
+{
+  if (inRedirected_) {
+    return false;
+  }
+
+  // Prompts written so far must be visible before blocking on input.
+  Flush();
+
+#if IMP_HAS_METRICS
+  std::optional<Metrics::Block> block;
+  if (metrics_) {
+    block.emplace(*metrics_, Metrics::Stream::INPUT);
+  }
+#endif
+  for (;;) {
+    ssize_t n = read(inFd_, in_, sizeof(in_));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    inPos_ = in_;
+    inEnd_ = in_ + n;
+    inRead_ += n;
+    return true;
+  }
+}
+
+// -----------------------------------------------------------------------------
+bool IO::SkipSpace()
+{
+  // Whitespace may span multiple blocks.
+  for (;;) {
+    if (inPos_ == inEnd_ && !Refill()) {
+      return false;
+    }
+    if (*inPos_ != ' ' && (*inPos_ < '\t' || *inPos_ > '\r')) {
+      return true;
+    }
+    ++inPos_;
+  }
+}
+
+// -----------------------------------------------------------------------------
+char *IO::Reserve(size_t size)
+{
+  if (outSize_ + size > sizeof(out_)) {
+    Flush();
+  }
+  return out_ + outSize_;
+}
@@ -0,0 +1,101 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+class Metrics;
+
+
+/**
+ * Buffered streams used by the runtime methods.
+ *
+ * Input is read in large blocks and integers are parsed straight out of the
+ * buffer. Output is accumulated and written out once the buffer fills, when
+ * a program stops, before blocking on input and when the streams are closed.
+ * Streams can be redirected to memory, which is used by the benchmarks and
+ * by embedders. Each interpreter runs on a context of its own, which must
+ * not be shared between threads; by default, that is the standard streams.
+ */
+class IO {
+public:
+  /// Size of the input and output buffers.
+  static constexpr size_t kBufferSize = 1 << 16;
+
+public:
+  /// Returns the standard streams of the process.
+  static IO &Get();
+
+  /// Creates streams over descriptors, which remain owned by the caller.
+  IO(int inFd = 0, int outFd = 1) : inFd_(inFd), outFd_(outFd) {}
+  ~IO();
+
+  IO(const IO &) = delete;
+  IO &operator=(const IO &) = delete;
+
+  /// Reads input from a file instead of the standard input.
+  void Open(const std::string &path);
+
+  /// Reads a decimal integer, returning 0 at the end of the input or on error.
+  int64_t ReadInt();
+  /// Checks whether only whitespace is left in the input.
+  bool AtEnd();
+  /// Returns the number of bytes of input consumed so far.
+  uint64_t Tell() const { return inRead_ - (inEnd_ - inPos_); }
+  /// Writes an integer in decimal.
+  void WriteInt(int64_t value);
+  /// Writes a single character.
+  void WriteChar(char c);
+  /// Writes out the buffered output.
+  void Flush();
+
+  /**
+   * Reads from a string and writes to another one instead of the standard
+   * streams. The strings must outlive the redirection.
+   */
+  void Redirect(std::string_view input, std::string &output);
+  /// Switches back to the standard streams, flushing redirected output.
+  void Reset();
+
+  /// Charges the time spent blocked on the descriptors to metrics.
+  void SetMetrics(Metrics *metrics) { metrics_ = metrics; }
+
+private:
+  /// Refills the input buffer, returning false at the end of the input.
+  bool Refill();
+  /// Skips over whitespace, returning false at the end of the input.
+  bool SkipSpace();
+  /// Reserves space in the output buffer, flushing it if necessary.
+  char *Reserve(size_t size);
+
+private:
+  /// Next character to be read.
+  const char *inPos_ = in_;
+  /// End of the characters read.
+  const char *inEnd_ = in_;
+  /// Flag set once the input is exhausted, or if it held a malformed integer.
+  bool inFailed_ = false;
+  /// Flag set if input comes from memory instead of the standard input.
+  bool inRedirected_ = false;
+  /// Descriptor input is read from.
+  int inFd_;
+  /// Flag set if the input descriptor was opened by the streams.
+  bool inOwned_ = false;
+  /// Descriptor output is written to.
+  int outFd_;
+  /// Number of bytes read into the input buffer so far.
+  uint64_t inRead_ = 0;
+  /// Number of bytes waiting in the output buffer.
+  size_t outSize_ = 0;
+  /// String receiving output, if redirected.
+  std::string *outSink_ = nullptr;
+  /// Metrics charged with blocking reads and writes, if enabled.
+  Metrics *metrics_ = nullptr;
+  /// Buffer holding input.
+  char in_[kBufferSize];
+  /// Buffer holding output.
+  char out_[kBufferSize];
+};
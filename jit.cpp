@@ -0,0 +1,852 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <cstddef>
+#include <unordered_map>
+
+#include "arith.h"
+#include "jit.h"
+
+#if IMP_HAS_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+
+#if IMP_HAS_JIT
+
+// -----------------------------------------------------------------------------
+namespace {
+
+/// Registers used by the templates.
+enum Reg : uint8_t {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R12 = 12,
+};
+
+/// Condition codes of jumps and set instructions.
+enum Cond : uint8_t {
+  O = 0x0,
+  E = 0x4,
+  NE = 0x5,
+  A = 0x7,
+  L = 0xC,
+  GE = 0xD,
+  LE = 0xE,
+  G = 0xF,
+};
+
+/// Register holding the stack pointer of the interpreter.
+constexpr Reg kSP = RBX;
+/// Register holding the context of the compiler.
+constexpr Reg kCtx = R12;
+
+/**
+ * Encoder for the handful of x86-64 instructions used by the templates.
+ *
+ * All instructions operate on 64-bit registers, with memory operands
+ * addressed through a base register and a 32-bit displacement.
+ */
+class Assembler {
+public:
+  Assembler(std::vector<uint8_t> &code) : code_(code) {}
+
+  /// Returns the offset of the next instruction.
+  size_t Offset() const { return code_.size(); }
+
+  /// Emits raw bytes.
+  void Bytes(std::initializer_list<uint8_t> bytes)
+  {
+    code_.insert(code_.end(), bytes);
+  }
+
+  /// Emits an immediate.
+  template <typename T>
+  void Imm(T t)
+  {
+    size_t offset = code_.size();
+    code_.resize(offset + sizeof(T));
+    memcpy(code_.data() + offset, &t, sizeof(T));
+  }
+
+  /// <op> reg, [base + disp], with an optional 0x0F escape.
+  void RM(uint8_t op, uint8_t reg, Reg base, int32_t disp, bool escape = false)
+  {
+    Bytes({ static_cast<uint8_t>(0x48 | ((reg >> 3) << 2) | (base >> 3)) });
+    if (escape) {
+      Bytes({ 0x0F });
+    }
+    Bytes({ op, static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)) });
+    if ((base & 7) == RSP) {
+      Bytes({ 0x24 });
+    }
+    Imm<int32_t>(disp);
+  }
+
+  /// <op> rm, reg between registers.
+  void RR(uint8_t op, Reg rm, Reg reg)
+  {
+    Bytes({
+        static_cast<uint8_t>(0x48 | ((reg >> 3) << 2) | (rm >> 3)),
+        op,
+        static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7)),
+    });
+  }
+
+  void Load(Reg dst, Reg base, int32_t disp) { RM(0x8B, dst, base, disp); }
+  void Store(Reg base, int32_t disp, Reg src) { RM(0x89, src, base, disp); }
+  void Lea(Reg dst, Reg base, int32_t disp) { RM(0x8D, dst, base, disp); }
+  void Mov(Reg dst, Reg src) { RR(0x89, dst, src); }
+
+  void MovImm(Reg dst, uint64_t imm)
+  {
+    Bytes({ static_cast<uint8_t>(0x48 | (dst >> 3)), static_cast<uint8_t>(0xB8 | (dst & 7)) });
+    Imm<uint64_t>(imm);
+  }
+
+  void AddImm(Reg dst, int32_t imm)
+  {
+    Bytes({ static_cast<uint8_t>(0x48 | (dst >> 3)), 0x81, static_cast<uint8_t>(0xC0 | (dst & 7)) });
+    Imm<int32_t>(imm);
+  }
+
+  void Test(Reg reg) { RR(0x85, reg, reg); }
+  void CallReg(Reg reg) { Bytes({ 0xFF, static_cast<uint8_t>(0xD0 | reg) }); }
+  void JumpReg(Reg reg) { Bytes({ 0xFF, static_cast<uint8_t>(0xE0 | reg) }); }
+  void Ret() { Bytes({ 0xC3 }); }
+
+  /// Emits a relative jump, call or branch, returning the offset to patch.
+  size_t Jump() { Bytes({ 0xE9 }); return Rel(); }
+  size_t Call() { Bytes({ 0xE8 }); return Rel(); }
+  size_t Branch(Cond cc) { Bytes({ 0x0F, static_cast<uint8_t>(0x80 | cc) }); return Rel(); }
+
+  /// Points a relative operand to a target offset.
+  void Patch(size_t at, size_t target)
+  {
+    int32_t rel = static_cast<int32_t>(target - (at + 4));
+    memcpy(code_.data() + at, &rel, sizeof(rel));
+  }
+
+private:
+  size_t Rel()
+  {
+    size_t at = code_.size();
+    Imm<int32_t>(0);
+    return at;
+  }
+
+private:
+  std::vector<uint8_t> &code_;
+};
+
+/// Returns the displacement of the nth value below the top of the stack.
+constexpr int32_t Slot(size_t n)
+{
+  return -static_cast<int32_t>(sizeof(Interp::Value) * (n + 1));
+}
+
+/// Returns the condition computed by a comparison opcode.
+Cond GetCond(Opcode op)
+{
+  switch (op) {
+    case Opcode::DEQ: case Opcode::JUMP_IF_EQ: return E;
+    case Opcode::NEQ: case Opcode::JUMP_IF_NE: return NE;
+    case Opcode::SM: case Opcode::JUMP_IF_LT: return L;
+    case Opcode::SMEQ: case Opcode::JUMP_IF_LE: return LE;
+    case Opcode::GR: case Opcode::JUMP_IF_GT: return G;
+    case Opcode::GREQ: case Opcode::JUMP_IF_GE: return GE;
+    default: assert(!"not a comparison"); return E;
+  }
+}
+
+/// Extra memory mapped for runtime methods running on the machine stack.
+constexpr size_t kNativeStackSlack = 1 << 20;
+
+} // namespace
+
+// -----------------------------------------------------------------------------
+Jit::Jit(Interp &interp, const Program &prog, uint64_t threshold)
+  : interp_(interp)
+  , prog_(prog)
+  , insts_(prog.GetInsts())
+  , numInsts_(prog.GetNumInsts())
+  , revision_(prog.GetRevision())
+  , threshold_(threshold)
+  , counts_(numInsts_)
+  , native_(numInsts_)
+{
+  ctx_.Limit = interp_.limit_;
+  ctx_.SavedRSP = nullptr;
+  ctx_.NativeStack = nullptr;
+  ctx_.Owner = this;
+  ctx_.Error = nullptr;
+
+  // The stub switches to the machine stack of the compiler, keeping the
+  // stack pointer of the interpreter and the context in callee-saved
+  // registers. Returning or bailing out restores the stack of the caller.
+  std::vector<uint8_t> code;
+  Assembler as(code);
+  as.Bytes({ 0x53, 0x41, 0x54 });
+  as.Mov(kCtx, RDI);
+  as.Mov(kSP, RSI);
+  as.Store(kCtx, offsetof(Context, SavedRSP), RSP);
+  as.Load(RSP, kCtx, offsetof(Context, NativeStack));
+  as.CallReg(RDX);
+  size_t exit = as.Offset();
+  as.Load(RSP, kCtx, offsetof(Context, SavedRSP));
+  as.Mov(RAX, kSP);
+  as.Bytes({ 0x41, 0x5C, 0x5B });
+  as.Ret();
+
+  auto *stub = Install(code);
+  enter_ = reinterpret_cast<EnterFn>(const_cast<uint8_t *>(stub));
+  exit_ = stub + exit;
+}
+
+// -----------------------------------------------------------------------------
+Jit::~Jit()
+{
+  for (auto [addr, size] : regions_) {
+    munmap(addr, size);
+  }
+  if (stack_) {
+    munmap(stack_, stackSize_);
+  }
+}
+
+// -----------------------------------------------------------------------------
+bool Jit::Enter(size_t entry)
+{
+  if (prog_.GetNumInsts() != numInsts_ || prog_.GetRevision() != revision_) {
+    Sync();
+  }
+
+  entry = GetBody(entry);
+  const uint8_t *code = native_[entry];
+  if (!code) {
+    // Functions which failed to compile are never retried.
+    if (++counts_[entry] != threshold_ || !(code = Compile(entry))) {
+      return false;
+    }
+  }
+
+  auto *sp = enter_(&ctx_, interp_.sp_, code);
+  if (!sp) {
+    std::string msg = ctx_.Error ? ctx_.Error : error_.empty() ? "stack overflow" : error_;
+    ctx_.Error = nullptr;
+    error_.clear();
+    throw RuntimeError(msg);
+  }
+  interp_.sp_ = sp;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+void Jit::Sync()
+{
+  insts_ = prog_.GetInsts();
+  numInsts_ = prog_.GetNumInsts();
+  counts_.resize(numInsts_);
+  native_.resize(numInsts_);
+
+  // Native code follows stubs into the bodies of functions, so it is dropped
+  // once a stub is re-pointed. The regions holding it stay mapped, as it can
+  // still be running further up the stack.
+  if (prog_.GetRevision() != revision_) {
+    revision_ = prog_.GetRevision();
+    std::fill(native_.begin(), native_.end(), nullptr);
+    std::fill(counts_.begin(), counts_.end(), 0);
+    return;
+  }
+
+  // Functions reaching stubs failed to compile: give them another chance,
+  // as some of the stubs were resolved.
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    if (!native_[i] && counts_[i] >= threshold_) {
+      counts_[i] = 0;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+size_t Jit::GetBody(size_t entry) const
+{
+  // Resolved stubs are jumps to the bodies of lazily lowered functions.
+  auto &inst = insts_[entry];
+  return inst.Op == Opcode::JUMP ? inst.Operand<size_t, 0>() : entry;
+}
+
+// -----------------------------------------------------------------------------
+const uint8_t *Jit::Compile(size_t root)
+{
+  /// Instructions of a function, along with its highest stack depth.
+  struct Func {
+    size_t Entry;
+    std::vector<size_t> Body;
+    std::unordered_map<size_t, int64_t> Depth;
+    int64_t MaxDepth;
+  };
+
+  // Find all functions reachable from the hot one, following the control
+  // flow of each to find its instructions and the depth of the stack.
+  std::vector<Func> funcs;
+  std::unordered_map<size_t, size_t> batch;
+  std::vector<size_t> work{ root };
+  while (!work.empty()) {
+    size_t entry = work.back();
+    work.pop_back();
+    if (native_[entry] || batch.count(entry)) {
+      continue;
+    }
+
+    std::unordered_map<size_t, int64_t> depth{ { entry, 0 } };
+    std::vector<size_t> queue{ entry };
+    int64_t maxDepth = 0;
+    // Number of locals, if the function sets up a frame on entry.
+    int64_t frame = -1;
+    auto visit = [&] (size_t i, int64_t d) {
+      if (i >= numInsts_ || d < 0) {
+        return false;
+      }
+      maxDepth = std::max(maxDepth, d);
+      auto [it, inserted] = depth.emplace(i, d);
+      if (inserted) {
+        queue.push_back(i);
+      }
+      return it->second == d;
+    };
+
+    while (!queue.empty()) {
+      size_t i = queue.back();
+      queue.pop_back();
+      auto &inst = insts_[i];
+      int64_t d = depth[i];
+      bool ok;
+      switch (inst.Op) {
+        case Opcode::PUSH_INT:
+        case Opcode::PEEK: {
+          ok = visit(i + 1, d + 1);
+          break;
+        }
+        case Opcode::POP:
+        case Opcode::ADD:
+        case Opcode::SUB:
+        case Opcode::MUL:
+        case Opcode::DIV:
+        case Opcode::MOD:
+        case Opcode::ADD_UNCHECKED:
+        case Opcode::SUB_UNCHECKED:
+        case Opcode::MUL_UNCHECKED:
+        case Opcode::DIV_UNCHECKED:
+        case Opcode::MOD_UNCHECKED:
+        case Opcode::DEQ:
+        case Opcode::NEQ:
+        case Opcode::SM:
+        case Opcode::SMEQ:
+        case Opcode::GR:
+        case Opcode::GREQ: {
+          ok = visit(i + 1, d - 1);
+          break;
+        }
+        case Opcode::PEEK_ADD: {
+          ok = visit(i + 1, d);
+          break;
+        }
+        case Opcode::JUMP_FALSE: {
+          ok = visit(i + 1, d - 1) && visit(inst.Operand<size_t, 0>(), d - 1);
+          break;
+        }
+        case Opcode::JUMP_IF_EQ:
+        case Opcode::JUMP_IF_NE:
+        case Opcode::JUMP_IF_LT:
+        case Opcode::JUMP_IF_LE:
+        case Opcode::JUMP_IF_GT:
+        case Opcode::JUMP_IF_GE: {
+          ok = visit(i + 1, d - 2) && visit(inst.Operand<size_t, 0>(), d - 2);
+          break;
+        }
+        case Opcode::JUMP: {
+          ok = visit(inst.Operand<size_t, 0>(), d);
+          break;
+        }
+        case Opcode::CALL_DIRECT: {
+          // The return address is pushed, then replaced by the result.
+          maxDepth = std::max(maxDepth, d + 1);
+          work.push_back(GetBody(inst.Operand<size_t, 0>()));
+          ok = visit(i + 1, d - inst.Operand<unsigned, 1>());
+          break;
+        }
+        case Opcode::CALL_NATIVE: {
+          ok = visit(i + 1, d - inst.Operand<unsigned, 1>());
+          break;
+        }
+        case Opcode::RET: {
+          ok = d >= 1;
+          break;
+        }
+        case Opcode::TAIL_CALL: {
+          ok = inst.Operand<size_t, 0>() == entry;
+          break;
+        }
+        case Opcode::ENTER: {
+          // The frame pointer is implied by the depth: locals start above
+          // the slot of the saved frame pointer.
+          frame = inst.Operand<unsigned, 0>();
+          ok = i == entry && visit(i + 1, frame + 1);
+          break;
+        }
+        case Opcode::LEAVE: {
+          auto n = inst.Operand<unsigned, 0>();
+          ok = frame >= 0 && d >= frame + 1 + n && visit(i + 1, n);
+          break;
+        }
+        case Opcode::LOAD_LOCAL: {
+          auto slot = inst.Operand<unsigned, 0>();
+          ok = slot < frame && d >= frame + 1 && visit(i + 1, d + 1);
+          break;
+        }
+        case Opcode::STORE_LOCAL: {
+          auto slot = inst.Operand<unsigned, 0>();
+          ok = slot < frame && d >= frame + 2 && visit(i + 1, d - 1);
+          break;
+        }
+        case Opcode::LOAD_ARG: {
+          ok = frame >= 0 && d >= frame + 1 && visit(i + 1, d + 1);
+          break;
+        }
+        default: {
+          // Calls to unknown values and stray instructions are interpreted.
+          ok = false;
+          break;
+        }
+      }
+      if (!ok) {
+        return nullptr;
+      }
+    }
+
+    Func func{ entry, {}, {}, maxDepth };
+    for (auto [i, d] : depth) {
+      func.Body.push_back(i);
+    }
+    std::sort(func.Body.begin(), func.Body.end());
+    func.Depth = std::move(depth);
+    batch.emplace(entry, funcs.size());
+    funcs.push_back(std::move(func));
+  }
+
+  // Emit the templates of all functions, followed by the overflow handler.
+  std::vector<uint8_t> code;
+  Assembler as(code);
+  std::unordered_map<size_t, size_t> funcOffset;
+  std::unordered_map<size_t, size_t> loopOffset;
+  std::unordered_map<size_t, size_t> instOffset;
+  std::vector<std::pair<size_t, size_t>> instFixups;
+  std::vector<std::pair<size_t, size_t>> funcFixups;
+  std::vector<std::pair<size_t, size_t>> loopFixups;
+  std::vector<size_t> overflowFixups;
+  std::vector<std::pair<size_t, const char *>> errorFixups;
+
+  const int32_t kValue = sizeof(Interp::Value);
+  for (auto &func : funcs) {
+    // Keep the machine stack aligned for calls to runtime methods, then
+    // check that the frame fits the stack. Tail calls repeat the check,
+    // as runtime methods might have left values on the stack.
+    funcOffset[func.Entry] = as.Offset();
+    as.AddImm(RSP, -8);
+    loopOffset[func.Entry] = as.Offset();
+    as.Lea(RAX, kSP, kValue * func.MaxDepth);
+    as.RM(0x3B, RAX, kCtx, offsetof(Context, Limit));
+    overflowFixups.push_back(as.Branch(A));
+    if (func.Body[0] != func.Entry) {
+      instFixups.emplace_back(as.Jump(), func.Entry);
+    }
+
+    for (size_t n = 0; n < func.Body.size(); ++n) {
+      size_t i = func.Body[n];
+      auto &inst = insts_[i];
+      int64_t d = func.Depth[i];
+      instOffset[i] = as.Offset();
+
+      bool fallthrough = true;
+      switch (inst.Op) {
+        case Opcode::PUSH_INT: {
+          as.MovImm(RAX, inst.Operand<int64_t, 0>());
+          as.Store(kSP, 0, RAX);
+          as.AddImm(kSP, kValue);
+          break;
+        }
+        case Opcode::PEEK: {
+          as.Load(RAX, kSP, Slot(inst.Operand<unsigned, 0>()));
+          as.Store(kSP, 0, RAX);
+          as.AddImm(kSP, kValue);
+          break;
+        }
+        case Opcode::POP: {
+          as.AddImm(kSP, -kValue);
+          break;
+        }
+        case Opcode::ADD:
+        case Opcode::SUB:
+        case Opcode::MUL:
+        case Opcode::ADD_UNCHECKED:
+        case Opcode::SUB_UNCHECKED:
+        case Opcode::MUL_UNCHECKED: {
+          // Checked forms branch on the overflow flag set by the operation.
+          as.Load(RAX, kSP, Slot(1));
+          switch (inst.Op) {
+            case Opcode::ADD:
+            case Opcode::ADD_UNCHECKED: {
+              as.RM(0x03, RAX, kSP, Slot(0));
+              break;
+            }
+            case Opcode::SUB:
+            case Opcode::SUB_UNCHECKED: {
+              as.RM(0x2B, RAX, kSP, Slot(0));
+              break;
+            }
+            default: {
+              as.RM(0xAF, RAX, kSP, Slot(0), true);
+              break;
+            }
+          }
+          switch (inst.Op) {
+            case Opcode::ADD: errorFixups.emplace_back(as.Branch(O), kAddOverflow); break;
+            case Opcode::SUB: errorFixups.emplace_back(as.Branch(O), kSubOverflow); break;
+            case Opcode::MUL: errorFixups.emplace_back(as.Branch(O), kMulOverflow); break;
+            default: break;
+          }
+          as.Store(kSP, Slot(1), RAX);
+          as.AddImm(kSP, -kValue);
+          break;
+        }
+        case Opcode::DIV:
+        case Opcode::MOD: {
+          // The divisor is tested for zero and -1, which idiv traps on.
+          as.Load(RCX, kSP, Slot(0));
+          as.Test(RCX);
+          errorFixups.emplace_back(as.Branch(E), kDivByZero);
+          as.Load(RAX, kSP, Slot(1));
+          // cmp rcx, -1
+          as.Bytes({ 0x48, 0x83, 0xF9, 0xFF });
+          size_t divide = as.Branch(NE);
+          if (inst.Op == Opcode::DIV) {
+            // neg rax
+            as.Bytes({ 0x48, 0xF7, 0xD8 });
+            errorFixups.emplace_back(as.Branch(O), kDivOverflow);
+          } else {
+            // xor eax, eax
+            as.Bytes({ 0x31, 0xC0 });
+          }
+          size_t done = as.Jump();
+          // cqo; idiv rcx
+          as.Patch(divide, as.Offset());
+          as.Bytes({ 0x48, 0x99, 0x48, 0xF7, 0xF9 });
+          if (inst.Op == Opcode::MOD) {
+            as.Mov(RAX, RDX);
+          }
+          as.Patch(done, as.Offset());
+          as.Store(kSP, Slot(1), RAX);
+          as.AddImm(kSP, -kValue);
+          break;
+        }
+        case Opcode::DIV_UNCHECKED:
+        case Opcode::MOD_UNCHECKED: {
+          // cqo; idiv qword [sp - 8]
+          as.Load(RAX, kSP, Slot(1));
+          as.Bytes({ 0x48, 0x99 });
+          as.RM(0xF7, 7, kSP, Slot(0));
+          as.Store(kSP, Slot(1), inst.Op == Opcode::DIV_UNCHECKED ? RAX : RDX);
+          as.AddImm(kSP, -kValue);
+          break;
+        }
+        case Opcode::DEQ:
+        case Opcode::NEQ:
+        case Opcode::SM:
+        case Opcode::SMEQ:
+        case Opcode::GR:
+        case Opcode::GREQ: {
+          // cmp rax, [sp - 8]; setcc al; movzx eax, al
+          as.Load(RAX, kSP, Slot(1));
+          as.RM(0x3B, RAX, kSP, Slot(0));
+          as.Bytes({ 0x0F, static_cast<uint8_t>(0x90 | GetCond(inst.Op)), 0xC0 });
+          as.Bytes({ 0x0F, 0xB6, 0xC0 });
+          as.Store(kSP, Slot(1), RAX);
+          as.AddImm(kSP, -kValue);
+          break;
+        }
+        case Opcode::PEEK_ADD: {
+          as.Load(RAX, kSP, Slot(0));
+          as.RM(0x03, RAX, kSP, Slot(inst.Operand<unsigned, 0>()));
+          errorFixups.emplace_back(as.Branch(O), kAddOverflow);
+          as.Store(kSP, Slot(0), RAX);
+          break;
+        }
+        case Opcode::JUMP_FALSE: {
+          as.AddImm(kSP, -kValue);
+          as.Load(RAX, kSP, 0);
+          as.Test(RAX);
+          instFixups.emplace_back(as.Branch(E), inst.Operand<size_t, 0>());
+          break;
+        }
+        case Opcode::JUMP_IF_EQ:
+        case Opcode::JUMP_IF_NE:
+        case Opcode::JUMP_IF_LT:
+        case Opcode::JUMP_IF_LE:
+        case Opcode::JUMP_IF_GT:
+        case Opcode::JUMP_IF_GE: {
+          as.AddImm(kSP, -2 * kValue);
+          as.Load(RAX, kSP, 0);
+          as.RM(0x3B, RAX, kSP, kValue);
+          auto cc = GetCond(inst.Op);
+          instFixups.emplace_back(as.Branch(cc), inst.Operand<size_t, 0>());
+          break;
+        }
+        case Opcode::JUMP: {
+          instFixups.emplace_back(as.Jump(), inst.Operand<size_t, 0>());
+          fallthrough = false;
+          break;
+        }
+        case Opcode::CALL_DIRECT: {
+          // The slot of the return address is only skipped over by RET.
+          size_t callee = GetBody(inst.Operand<size_t, 0>());
+          as.AddImm(kSP, kValue);
+          if (batch.count(callee)) {
+            funcFixups.emplace_back(as.Call(), callee);
+          } else {
+            as.MovImm(RAX, reinterpret_cast<uintptr_t>(native_[callee]));
+            as.CallReg(RAX);
+          }
+          break;
+        }
+        case Opcode::CALL_NATIVE: {
+          as.Mov(RDI, kCtx);
+          as.Mov(RSI, kSP);
+          as.MovImm(RDX, reinterpret_cast<uintptr_t>(inst.Operand<RuntimeFn, 0>()));
+          as.MovImm(RCX, func.MaxDepth);
+          as.MovImm(R8, inst.Operand<unsigned, 1>());
+          as.MovImm(RAX, reinterpret_cast<uintptr_t>(&Jit::CallNative));
+          as.CallReg(RAX);
+          as.Test(RAX);
+          overflowFixups.push_back(as.Branch(E));
+          as.Mov(kSP, RAX);
+          break;
+        }
+        case Opcode::RET: {
+          auto depth = inst.Operand<unsigned, 0>();
+          auto nargs = inst.Operand<unsigned, 1>();
+          as.Load(RAX, kSP, Slot(0));
+          as.Lea(kSP, kSP, -kValue * static_cast<int32_t>(depth + nargs + 1));
+          as.Store(kSP, Slot(0), RAX);
+          as.AddImm(RSP, 8);
+          as.Ret();
+          fallthrough = false;
+          break;
+        }
+        case Opcode::TAIL_CALL: {
+          // Move the arguments over those of the frame, as the interpreter.
+          auto depth = inst.Operand<unsigned, 1>();
+          auto nargs = inst.Operand<uint16_t, 2>();
+          size_t dist = nargs + depth + 1;
+          for (size_t k = 0; k < nargs; ++k) {
+            as.Load(RAX, kSP, Slot(k));
+            as.Store(kSP, Slot(dist + k), RAX);
+          }
+          as.AddImm(kSP, -kValue * static_cast<int32_t>(nargs + depth));
+          loopFixups.emplace_back(as.Jump(), func.Entry);
+          fallthrough = false;
+          break;
+        }
+        case Opcode::ENTER: {
+          // Native code never reads the saved frame pointer, so the slot
+          // reserved for it is left as is, along with those of the locals.
+          as.AddImm(kSP, kValue * static_cast<int32_t>(inst.Operand<unsigned, 0>() + 1));
+          break;
+        }
+        case Opcode::LEAVE: {
+          // Copy the values upwards, from the slot of the saved frame pointer.
+          int64_t keep = inst.Operand<unsigned, 0>();
+          for (int64_t k = 0; k < keep; ++k) {
+            as.Load(RAX, kSP, Slot(keep - 1 - k));
+            as.Store(kSP, Slot(d - 1 - k), RAX);
+          }
+          as.AddImm(kSP, -kValue * static_cast<int32_t>(d - keep));
+          break;
+        }
+        case Opcode::LOAD_LOCAL: {
+          as.Load(RAX, kSP, Slot(d - 2 - inst.Operand<unsigned, 0>()));
+          as.Store(kSP, 0, RAX);
+          as.AddImm(kSP, kValue);
+          break;
+        }
+        case Opcode::STORE_LOCAL: {
+          as.Load(RAX, kSP, Slot(0));
+          as.Store(kSP, Slot(d - 2 - inst.Operand<unsigned, 0>()), RAX);
+          as.AddImm(kSP, -kValue);
+          break;
+        }
+        case Opcode::LOAD_ARG: {
+          as.Load(RAX, kSP, Slot(d + 1 + inst.Operand<unsigned, 0>()));
+          as.Store(kSP, 0, RAX);
+          as.AddImm(kSP, kValue);
+          break;
+        }
+        default: {
+          assert(!"unsupported instruction");
+          return nullptr;
+        }
+      }
+
+      bool adjacent = n + 1 < func.Body.size() && func.Body[n + 1] == i + 1;
+      if (fallthrough && !adjacent) {
+        instFixups.emplace_back(as.Jump(), i + 1);
+      }
+    }
+  }
+
+  // Bail out to the stub, which restores the machine stack of the caller.
+  size_t overflow = as.Offset();
+  as.Bytes({ 0x31, 0xDB });
+  as.MovImm(RAX, reinterpret_cast<uintptr_t>(exit_));
+  as.JumpReg(RAX);
+
+  // Arithmetic errors record their message before bailing out.
+  std::unordered_map<const char *, size_t> errorOffset;
+  for (auto [at, msg] : errorFixups) {
+    auto it = errorOffset.find(msg);
+    if (it == errorOffset.end()) {
+      it = errorOffset.emplace(msg, as.Offset()).first;
+      as.MovImm(RAX, reinterpret_cast<uintptr_t>(msg));
+      as.Store(kCtx, offsetof(Context, Error), RAX);
+      overflowFixups.push_back(as.Jump());
+    }
+    as.Patch(at, it->second);
+  }
+
+  for (auto [at, i] : instFixups) {
+    as.Patch(at, instOffset[i]);
+  }
+  for (auto [at, entry] : funcFixups) {
+    as.Patch(at, funcOffset[entry]);
+  }
+  for (auto [at, entry] : loopFixups) {
+    as.Patch(at, loopOffset[entry]);
+  }
+  for (auto at : overflowFixups) {
+    as.Patch(at, overflow);
+  }
+
+  // Map a machine stack large enough to hold a native frame for each slot
+  // of the stack of the interpreter, so it cannot overflow before it does.
+  if (!stack_) {
+    size_t slots = interp_.limit_ - interp_.stack_.get();
+    size_t page = sysconf(_SC_PAGESIZE);
+    stackSize_ = (slots * 16 + kNativeStackSlack + page - 1) / page * page;
+    stack_ = mmap(
+        nullptr,
+        stackSize_,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (stack_ == MAP_FAILED) {
+      stack_ = nullptr;
+      return nullptr;
+    }
+    mprotect(stack_, page, PROT_NONE);
+    ctx_.NativeStack = static_cast<uint8_t *>(stack_) + stackSize_;
+  }
+
+  auto *base = Install(code);
+  if (!base) {
+    return nullptr;
+  }
+  for (auto &func : funcs) {
+    native_[func.Entry] = base + funcOffset[func.Entry];
+  }
+  return native_[root];
+}
+
+// -----------------------------------------------------------------------------
+const uint8_t *Jit::Install(const std::vector<uint8_t> &code)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (code.size() + page - 1) / page * page;
+  void *addr = mmap(
+      nullptr,
+      size,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0
+  );
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  memcpy(addr, code.data(), code.size());
+  if (mprotect(addr, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(addr, size);
+    return nullptr;
+  }
+  regions_.emplace_back(addr, size);
+  return static_cast<const uint8_t *>(addr);
+}
+
+// -----------------------------------------------------------------------------
+Interp::Value *Jit::CallNative(
+    Context *ctx,
+    Interp::Value *sp,
+    RuntimeFn fn,
+    uint64_t reserve,
+    uint64_t nargs)
+{
+  // Exceptions cannot unwind through native frames: they are reported to
+  // the stub, which re-raises them once the stack of the caller is restored.
+  auto &interp = ctx->Owner->interp_;
+  interp.sp_ = sp;
+  try {
+    interp.CallRuntime(fn, nargs);
+  } catch (const std::exception &ex) {
+    ctx->Owner->error_ = ex.what();
+    return nullptr;
+  }
+  if (static_cast<uint64_t>(interp.limit_ - interp.sp_) < reserve) {
+    return nullptr;
+  }
+  return interp.sp_;
+}
+
+#else
+
+// -----------------------------------------------------------------------------
+Jit::Jit(Interp &interp, const Program &prog, uint64_t threshold)
+  : interp_(interp)
+  , prog_(prog)
+  , insts_(prog.GetInsts())
+  , numInsts_(prog.GetNumInsts())
+  , revision_(prog.GetRevision())
+  , threshold_(threshold)
+{
+}
+
+// -----------------------------------------------------------------------------
+Jit::~Jit()
+{
+}
+
+// -----------------------------------------------------------------------------
+bool Jit::Enter(size_t entry)
+{
+  return false;
+}
+
+#endif
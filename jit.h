@@ -0,0 +1,127 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "interp.h"
+#include "program.h"
+
+
+/// The JIT emits x86-64 code operating on compact stack values.
+#if defined(IMP_JIT) && defined(__x86_64__) && \
+    (defined(__linux__) || defined(__APPLE__)) && IMP_COMPACT_VALUES
+#define IMP_HAS_JIT 1
+#else
+#define IMP_HAS_JIT 0
+#endif
+
+
+
+/**
+ * Baseline compiler from decoded stack bytecode to native code.
+ *
+ * Calls to functions are counted and, once a function becomes hot, it is
+ * translated along with all the functions it calls, one template of machine
+ * code per instruction. Native code keeps the stack pointer of the
+ * interpreter in a register and manipulates the same stack, so the frames
+ * it builds are identical to those of the interpreter. Runtime methods are
+ * invoked through a trampoline which hands the stack over to them.
+ *
+ * Functions containing instructions without a template are left to the
+ * interpreter, as are all functions on platforms without JIT support.
+ * Functions reaching stubs which were not yet lowered are retried once the
+ * program grows, while all native code is discarded once a function is
+ * replaced.
+ */
+class Jit {
+public:
+  /// Number of calls after which functions are compiled by default.
+  static constexpr uint64_t kDefaultThreshold = 1000;
+
+public:
+  /// Sets up the compiler for the decoded stream of a program.
+  Jit(Interp &interp, const Program &prog, uint64_t threshold);
+  ~Jit();
+
+  /// Checks whether native code can be generated on this platform.
+  static bool IsSupported() { return IMP_HAS_JIT; }
+
+  /**
+   * Counts a call to a function, running its native code once it is hot.
+   *
+   * The caller must have already pushed the return address. Returns false
+   * if the function must be interpreted instead.
+   */
+  bool Enter(size_t entry);
+
+private:
+  /// State shared with native code, addressed through a register.
+  struct Context {
+    /// End of the stack of the interpreter.
+    Interp::Value *Limit;
+    /// Stack pointer of the caller, restored on exit.
+    void *SavedRSP;
+    /// Top of the machine stack used by native code.
+    void *NativeStack;
+    /// Owner of the context.
+    Jit *Owner;
+    /// Error raised by checked arithmetic in native code.
+    const char *Error;
+  };
+
+  /// Signature of the stub entering native code.
+  using EnterFn = Interp::Value *(*)(Context *, Interp::Value *, const void *);
+
+  /// Picks up code appended or re-pointed since the last call.
+  void Sync();
+  /// Returns the entry of a function, skipping over the stub it is called by.
+  size_t GetBody(size_t entry) const;
+  /// Translates a function and the functions it calls.
+  const uint8_t *Compile(size_t entry);
+  /// Maps a block of code into executable memory.
+  const uint8_t *Install(const std::vector<uint8_t> &code);
+
+  /// Invokes a runtime method on behalf of native code.
+  static Interp::Value *CallNative(
+      Context *ctx,
+      Interp::Value *sp,
+      RuntimeFn fn,
+      uint64_t reserve,
+      uint64_t nargs
+  );
+
+private:
+  /// Interpreter owning the stack.
+  Interp &interp_;
+  /// Program being compiled, which may grow as stubs are resolved.
+  const Program &prog_;
+  /// Decoded instructions of the program.
+  const Inst *insts_;
+  /// Number of decoded instructions.
+  size_t numInsts_;
+  /// Revision of the program the native code was generated from.
+  uint64_t revision_;
+  /// Number of calls after which a function is compiled.
+  uint64_t threshold_;
+  /// Number of calls to each function, indexed by entry.
+  std::vector<uint64_t> counts_;
+  /// Native code of each compiled function, indexed by entry.
+  std::vector<const uint8_t *> native_;
+  /// Context passed to native code.
+  Context ctx_;
+  /// Stub entering and leaving native code.
+  EnterFn enter_ = nullptr;
+  /// Address of the exit path of the stub.
+  const uint8_t *exit_ = nullptr;
+  /// Machine stack used by native code.
+  void *stack_ = nullptr;
+  /// Size of the machine stack.
+  size_t stackSize_ = 0;
+  /// Executable regions holding native code.
+  std::vector<std::pair<void *, size_t>> regions_;
+  /// Error raised by a runtime method called from native code.
+  std::string error_;
+};
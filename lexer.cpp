@@ -3,98 +3,35 @@
 #include <sstream>
 #include <limits>
 
-#include "lexer.h"
-
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "lexer.h"
 
-// -----------------------------------------------------------------------------
-Token::Token(const Token &that)
-  : loc_(that.loc_)
-  , kind_(that.kind_)
-{
-  switch (kind_) {
-    case Kind::STRING:
-    case Kind::IDENT: {
-      value_.StringValue = new std::string(*that.value_.StringValue);
-      break;
-    }
-    case Kind::INT: {
-      value_.IntValue = that.value_.IntValue;
-      break;
-    }
-    default: {
-      break;
-    }
-  }
-}
-
-// -----------------------------------------------------------------------------
-Token &Token::operator=(const Token &that)
-{
-  switch (kind_) {
-    case Kind::STRING:
-    case Kind::IDENT: {
-      delete value_.StringValue;
-      break;
-    }
-    default: {
-      break;
-    }
-  }
-  loc_ = that.loc_;
-  kind_ = that.kind_;
-  switch (kind_) {
-    case Kind::STRING:
-    case Kind::IDENT: {
-      value_.StringValue = new std::string(*that.value_.StringValue);
-      break;
-    }
-    case Kind::INT: {
-      value_.IntValue = that.value_.IntValue;
-      break;
-    }
-    default: {
-      break;
-    }
-  }
-  return *this;
-}
 
-// -----------------------------------------------------------------------------
-Token::~Token()
-{
-  switch (kind_) {
-    case Kind::STRING:
-    case Kind::IDENT: {
-      delete value_.StringValue;
-      break;
-    }
-    default: {
-      break;
-    }
-  }
-}
 
 // -----------------------------------------------------------------------------
-Token Token::Ident(const Location &l, const std::string &str)
+Token Token::Ident(const Location &l, std::string_view str)
 {
   Token tk(l, Kind::IDENT);
-  tk.value_.StringValue = new std::string(str);
+  tk.str_ = str;
   return tk;
 }
 
 // -----------------------------------------------------------------------------
-Token Token::String(const Location &l, const std::string &str)
+Token Token::String(const Location &l, std::string_view str)
 {
   Token tk(l, Kind::STRING);
-  tk.value_.StringValue = new std::string(str);
+  tk.str_ = str;
   return tk;
 }
 
 // -----------------------------------------------------------------------------
 Token Token::Int(const Location &l, const std::uint64_t integer) {
   Token tk(l, Kind::INT);
-  tk.value_.IntValue = integer;
+  tk.int_ = integer;
   return tk;
 }
 
@@ -104,15 +41,15 @@ void Token::Print(std::ostream &os) const
   os << kind_;
   switch (kind_) {
     case Kind::INT: {
-      os << "(" << value_.IntValue << ")";
+      os << "(" << int_ << ")";
       break;
     }
     case Kind::STRING: {
-      os << "(\"" << *value_.StringValue << "\")";
+      os << "(\"" << str_ << "\")";
       break;
     }
     case Kind::IDENT: {
-      os << "(" << *value_.StringValue << ")";
+      os << "(" << str_ << ")";
       break;
     }
     default: {
@@ -132,6 +69,8 @@ std::ostream &operator<<(std::ostream &os, const Token::Kind kind)
     case Token::Kind::RPAREN: return os << ")";
     case Token::Kind::LBRACE: return os << "{";
     case Token::Kind::RBRACE: return os << "}";
+    case Token::Kind::LBRACKET: return os << "[";
+    case Token::Kind::RBRACKET: return os << "]";
     case Token::Kind::COLON: return os << ":";
     case Token::Kind::SEMI: return os << ";";
     case Token::Kind::EQUAL: return os << "=";
@@ -153,6 +92,7 @@ std::ostream &operator<<(std::ostream &os, const Token::Kind kind)
     case Token::Kind::SMALLER_OR_EQUAL: return os << "<=";
     case Token::Kind::IF: return os << "if";
     case Token::Kind::ELSE: return os << "else";
+    case Token::Kind::LET: return os << "let";
   }
   return os;
 }
@@ -174,12 +114,42 @@ LexerError::LexerError(const Location &loc, const std::string &msg)
 // -----------------------------------------------------------------------------
 Lexer::Lexer(const std::string &name)
   : name_(name)
-  , is_(name)
 {
-  NextChar();
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open '" + name + "'");
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("cannot read '" + name + "'");
+  }
+
+  // Empty files cannot be mapped, but need not be.
+  size_ = st.st_size;
+  if (size_ != 0) {
+    void *buf = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("cannot read '" + name + "'");
+    }
+    buf_ = static_cast<const char *>(buf);
+    madvise(buf, size_, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  chr_ = size_ ? buf_[0] : '\0';
   Next();
 }
 
+// -----------------------------------------------------------------------------
+Lexer::~Lexer()
+{
+  if (buf_) {
+    munmap(const_cast<char *>(buf_), size_);
+  }
+}
+
 // -----------------------------------------------------------------------------
 static bool IsIdentStart(char chr)
 {
@@ -206,6 +176,8 @@ const Token &Lexer::Next()
     case ')': return NextChar(), tk_ = Token::RParen(loc);
     case '{': return NextChar(), tk_ = Token::LBrace(loc);
     case '}': return NextChar(), tk_ = Token::RBrace(loc);
+    case '[': return NextChar(), tk_ = Token::LBracket(loc);
+    case ']': return NextChar(), tk_ = Token::RBracket(loc);
     case ':': return NextChar(), tk_ = Token::Colon(loc);
     case ';': return NextChar(), tk_ = Token::Semi(loc);
     case '=': {
@@ -248,30 +220,31 @@ const Token &Lexer::Next()
       return tk_ = Token::Greater(loc);
     }
     case '"': {
-      std::string word;
       NextChar();
+      size_t start = pos_;
       while (chr_ != '"') {
-        word.push_back(chr_);
         NextChar();
         if (chr_ == '\0') {
           Error("string not terminated");
         }
       }
+      std::string_view word(buf_ + start, pos_ - start);
       NextChar();
       return tk_ = Token::String(loc, word);
     }
     default: {
       if (IsIdentStart(chr_)) {
-        std::string word;
+        size_t start = pos_;
         do {
-          word.push_back(chr_);
           NextChar();
         } while (IsIdentLetter(chr_));
+        std::string_view word(buf_ + start, pos_ - start);
         if (word == "func") return tk_ = Token::Func(loc);
         if (word == "return") return tk_ = Token::Return(loc);
         if (word == "while") return tk_ = Token::While(loc);
         if (word == "if") return tk_ = Token::If(loc);
         if (word == "else") return tk_ = Token::Else(loc);
+        if (word == "let") return tk_ = Token::Let(loc);
         return tk_ = Token::Ident(loc, word);
       } else if(isdigit(chr_)) {
         std::uint64_t number = 0;
@@ -294,7 +267,7 @@ const Token &Lexer::Next()
 // -----------------------------------------------------------------------------
 void Lexer::NextChar()
 {
-  if (is_.eof()) {
+  if (pos_ >= size_) {
     chr_ = '\0';
   } else {
     if (chr_ == '\n') {
@@ -303,7 +276,8 @@ void Lexer::NextChar()
     } else {
       charNo_++;
     }
-    is_.get(chr_);
+    ++pos_;
+    chr_ = pos_ < size_ ? buf_[pos_] : '\0';
   }
 }
 
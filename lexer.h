@@ -3,9 +3,11 @@
 #pragma once
 
 #include <cassert>
-#include <fstream>
+#include <cstdint>
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 
 
 /**
@@ -28,7 +30,9 @@ inline std::ostream &operator<<(std::ostream &os, const Location &loc)
  * Represents a single token of the source language.
  *
  * Tokens are identified through their kind.
- * Certain kinds, such as integers, carry an additional payload.
+ * Certain kinds, such as integers, carry an additional payload. Identifiers
+ * and strings refer to the source text held by the lexer, so they must not
+ * outlive it.
  */
 class Token final {
 public:
@@ -39,12 +43,15 @@ public:
     WHILE,
     IF, 
     ELSE,
+    LET,
 
     // Symbols.
     LPAREN,
     RPAREN,
     LBRACE,
     RBRACE,
+    LBRACKET,
+    RBRACKET,
     COLON,
     SEMI,
     EQUAL,
@@ -73,12 +80,8 @@ public:
   };
 
 public:
-  /// Copy constructor.
-  Token(const Token &that);
   /// Default constructor, EOF token.
   Token() : kind_(Kind::END) {}
-  /// Cleanup.
-  ~Token();
 
   /// Returns the kind of the token.
   Kind GetKind() const { return kind_; }
@@ -95,31 +98,30 @@ public:
   std::string_view GetIdent() const
   {
     assert(Is(Kind::IDENT) && "not an identifier");
-    return *value_.StringValue;
+    return str_;
   }
 
   /// Return the integer value.
   std::uint64_t GetInt() const {
     assert(Is(Kind::INT) && "not an identifier");
-    return value_.IntValue;
+    return int_;
   }
 
   /// Return the string value.
   std::string_view GetString() const
   {
     assert(Is(Kind::STRING) && "not an identifier");
-    return *value_.StringValue;
+    return str_;
   }
 
-  /// Copy operator.
-  Token &operator=(const Token &that);
-
   // Helpers to build tokens.
   static Token End(const Location &l) { return Token(l, Kind::END); }
   static Token LParen(const Location &l) { return Token(l, Kind::LPAREN); }
   static Token RParen(const Location &l) { return Token(l, Kind::RPAREN); }
   static Token LBrace(const Location &l) { return Token(l, Kind::LBRACE); }
   static Token RBrace(const Location &l) { return Token(l, Kind::RBRACE); }
+  static Token LBracket(const Location &l) { return Token(l, Kind::LBRACKET); }
+  static Token RBracket(const Location &l) { return Token(l, Kind::RBRACKET); }
   static Token Colon(const Location &l) { return Token(l, Kind::COLON); }
   static Token Semi(const Location &l) { return Token(l, Kind::SEMI); }
   static Token Equal(const Location &l) { return Token(l, Kind::EQUAL); }
@@ -128,8 +130,8 @@ public:
   static Token Func(const Location &l) { return Token(l, Kind::FUNC); }
   static Token Return(const Location &l) { return Token(l, Kind::RETURN); }
   static Token While(const Location &l) { return Token(l, Kind::WHILE); }
-  static Token Ident(const Location &l, const std::string &str);
-  static Token String(const Location &l, const std::string &str);
+  static Token Ident(const Location &l, std::string_view str);
+  static Token String(const Location &l, std::string_view str);
   static Token Int(const Location &l, const std::uint64_t integer);
   static Token DoubleEqual(const Location &l) { return Token(l, Kind::DOUBLE_EQUAL); }
   static Token NotEqual(const Location &l) { return Token(l, Kind::NOT_EQUAL); }
@@ -143,6 +145,7 @@ public:
   static Token SmallerOrEqual(const Location &l) { return Token(l, Kind::SMALLER_OR_EQUAL); }
   static Token If(const Location &l) { return Token(l, Kind::IF); }
   static Token Else(const Location &l) { return Token(l, Kind::ELSE); }
+  static Token Let(const Location &l) { return Token(l, Kind::LET); }
 
   /// Print the token to a stream.
   void Print(std::ostream &os) const;
@@ -157,11 +160,10 @@ private:
   /// Kind of the token.
   Kind kind_;
 
-  /// Union of all payloads.
-  union {
-    uint64_t IntValue;
-    std::string *StringValue;
-  } value_;
+  /// Value of integers.
+  uint64_t int_ = 0;
+  /// Slice of the source spelling identifiers and strings.
+  std::string_view str_;
 };
 
 /// Helper to print a token kind to a stream.
@@ -183,11 +185,18 @@ public:
 
 /**
  * Splits a stream of characters into a stream of tokens.
+ *
+ * The source file is mapped into memory and scanned in place.
  */
 class Lexer final {
 public:
-  /// Initialise the lexer, reading the file located at 'name'.
+  /// Initialise the lexer, mapping the file located at 'name'.
   Lexer(const std::string &name);
+  /// Unmaps the source.
+  ~Lexer();
+
+  Lexer(const Lexer &) = delete;
+  Lexer &operator=(const Lexer &) = delete;
 
   /// Advance the stream to the next token.
   const Token &Next();
@@ -211,8 +220,12 @@ private:
   int charNo_ = 1;
   /// Current character.
   char chr_ = '\0';
-  /// Current stream.
-  std::ifstream is_;
+  /// Mapping of the source file.
+  const char *buf_ = nullptr;
+  /// Size of the source file.
+  size_t size_ = 0;
+  /// Offset of the current character.
+  size_t pos_ = 0;
   /// Current token.
   Token tk_;
 };
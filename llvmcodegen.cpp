@@ -0,0 +1,439 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#include "llvmcodegen.h"
+#include "arith.h"
+#include "ast.h"
+
+
+
+// -----------------------------------------------------------------------------
+static void EmitCheckedArith(std::ostream &os)
+{
+  // Errors are reported by the runtime, with messages shared by all backends.
+  os << "declare void @imp_runtime_error(ptr) noreturn\n";
+  const std::pair<const char *, const char *> msgs[] = {
+    { "add", kAddOverflow },
+    { "sub", kSubOverflow },
+    { "mul", kMulOverflow },
+    { "div", kDivOverflow },
+    { "zero", kDivByZero },
+  };
+  for (auto [name, msg] : msgs) {
+    os << "@imp.e." << name << " = private unnamed_addr constant [";
+    os << strlen(msg) + 1 << " x i8] c\"" << msg << "\\00\"\n";
+  }
+
+  // Overflows are detected by the intrinsics.
+  for (auto name : { "add", "sub", "mul" }) {
+    auto type = "{ i64, i1 }";
+    os << "\n";
+    os << "declare " << type << " @llvm.s" << name << ".with.overflow.i64(i64, i64)\n";
+    os << "define internal i64 @imp." << name << "(i64 %a, i64 %b) {\n";
+    os << "entry:\n";
+    os << "  %r = call " << type << " @llvm.s" << name << ".with.overflow.i64(i64 %a, i64 %b)\n";
+    os << "  %o = extractvalue " << type << " %r, 1\n";
+    os << "  br i1 %o, label %fail, label %ok\n";
+    os << "fail:\n";
+    os << "  call void @imp_runtime_error(ptr @imp.e." << name << ")\n";
+    os << "  unreachable\n";
+    os << "ok:\n";
+    os << "  %v = extractvalue " << type << " %r, 0\n";
+    os << "  ret i64 %v\n";
+    os << "}\n";
+  }
+
+  // Division by zero and the overflowing division by -1 are tested for.
+  for (auto [name, op] : { std::pair{ "div", "sdiv" }, std::pair{ "mod", "srem" } }) {
+    bool div = op == std::string("sdiv");
+    os << "\n";
+    os << "define internal i64 @imp." << name << "(i64 %a, i64 %b) {\n";
+    os << "entry:\n";
+    os << "  %z = icmp eq i64 %b, 0\n";
+    os << "  br i1 %z, label %zero, label %nonzero\n";
+    os << "zero:\n";
+    os << "  call void @imp_runtime_error(ptr @imp.e.zero)\n";
+    os << "  unreachable\n";
+    os << "nonzero:\n";
+    os << "  %m = icmp eq i64 %b, -1\n";
+    os << "  br i1 %m, label %minus, label %op\n";
+    os << "minus:\n";
+    if (div) {
+      os << "  %o = icmp eq i64 %a, " << std::numeric_limits<int64_t>::min() << "\n";
+      os << "  br i1 %o, label %fail, label %neg\n";
+      os << "fail:\n";
+      os << "  call void @imp_runtime_error(ptr @imp.e.div)\n";
+      os << "  unreachable\n";
+      os << "neg:\n";
+      os << "  %n = sub i64 0, %a\n";
+      os << "  ret i64 %n\n";
+    } else {
+      os << "  ret i64 0\n";
+    }
+    os << "op:\n";
+    os << "  %r = " << op << " i64 %a, %b\n";
+    os << "  ret i64 %r\n";
+    os << "}\n";
+  }
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::Translate(const Module &mod, std::ostream &os)
+{
+  os << "; Generated by imp.\n";
+  os << "\n";
+  os << "declare ptr @imp_runtime_lookup(ptr)\n";
+  os << "declare i64 @imp_runtime_call(ptr, ptr, i32)\n";
+  EmitCheckedArith(os);
+
+  for (auto item : mod) {
+    if (std::holds_alternative<ProtoDecl *>(item)) {
+      LowerProtoDecl(*std::get<1>(item));
+      os << "\n" << out_.str();
+      out_.str("");
+    }
+  }
+
+  for (auto item : mod) {
+    if (std::holds_alternative<FuncDecl *>(item)) {
+      LowerFuncDecl(*std::get<0>(item));
+      os << "\n" << out_.str();
+      out_.str("");
+    }
+  }
+
+  // Top-level statements run in main, once the prototypes are bound.
+  nextTemp_ = nextBlock_ = slots_ = 0;
+  terminated_ = false;
+  for (auto item : mod) {
+    if (std::holds_alternative<ProtoDecl *>(item)) {
+      auto &name = std::get<1>(item)->GetName();
+      auto handle = MakeTemp();
+      Emit(handle + " = call ptr @imp_runtime_lookup(ptr @imp.s." + name + ")");
+      Emit("store ptr " + handle + ", ptr @imp.h." + name);
+    }
+  }
+  for (auto item : mod) {
+    if (std::holds_alternative<Stmt *>(item)) {
+      LowerStmt(*std::get<2>(item));
+    }
+  }
+  EmitTerminator("ret i32 0");
+
+  os << "\n";
+  os << "define i32 @main() {\n";
+  EmitEntry(os);
+  os << out_.str();
+  os << "}\n";
+  out_.str("");
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::LowerStmt(const Stmt &stmt)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      for (auto &inner : static_cast<const BlockStmt &>(stmt)) {
+        LowerStmt(*inner);
+      }
+      return;
+    }
+    case Stmt::Kind::WHILE: {
+      return LowerWhileStmt(static_cast<const WhileStmt &>(stmt));
+    }
+    case Stmt::Kind::EXPR: {
+      LowerExpr(static_cast<const ExprStmt &>(stmt).GetExpr());
+      return;
+    }
+    case Stmt::Kind::RETURN: {
+      // Returned calls are marked so that llc turns them into jumps.
+      auto &expr = static_cast<const ReturnStmt &>(stmt).GetExpr();
+      auto value = expr.GetKind() == Expr::Kind::CALL
+          ? LowerCallExpr(static_cast<const CallExpr &>(expr), true)
+          : LowerExpr(expr);
+      EmitTerminator("ret i64 " + value);
+      return;
+    }
+    case Stmt::Kind::IF: {
+      return LowerIfStmt(static_cast<const IfStmt &>(stmt));
+    }
+    case Stmt::Kind::LET: {
+      return LowerLetStmt(static_cast<const LetStmt &>(stmt));
+    }
+    case Stmt::Kind::ASSIGN: {
+      auto &assign = static_cast<const AssignStmt &>(stmt);
+      auto value = LowerExpr(assign.GetValue());
+      Emit("store i64 " + value + ", ptr " + Slot(assign.GetTarget().GetSlot()));
+      return;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::LowerWhileStmt(const WhileStmt &whileStmt)
+{
+  auto head = MakeBlock();
+  auto body = MakeBlock();
+  auto exit = MakeBlock();
+
+  EmitTerminator("br label %" + head);
+  EmitBlock(head);
+  auto cond = LowerCond(whileStmt.GetCond());
+  EmitTerminator("br i1 " + cond + ", label %" + body + ", label %" + exit);
+  EmitBlock(body);
+  LowerStmt(whileStmt.GetStmt());
+  if (!terminated_) {
+    EmitTerminator("br label %" + head);
+  }
+  EmitBlock(exit);
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::LowerIfStmt(const IfStmt &ifStmt)
+{
+  auto then = MakeBlock();
+  auto else_ = MakeBlock();
+  auto exit = MakeBlock();
+
+  auto cond = LowerCond(ifStmt.GetCond());
+  EmitTerminator("br i1 " + cond + ", label %" + then + ", label %" + else_);
+  EmitBlock(then);
+  LowerStmt(ifStmt.GetStmt());
+  if (!terminated_) {
+    EmitTerminator("br label %" + exit);
+  }
+  EmitBlock(else_);
+  if (auto elseStmt = ifStmt.GetElseStmt()) {
+    LowerStmt(*elseStmt);
+  }
+  if (!terminated_) {
+    EmitTerminator("br label %" + exit);
+  }
+  EmitBlock(exit);
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::LowerLetStmt(const LetStmt &letStmt)
+{
+  auto value = LowerExpr(letStmt.GetInit());
+  slots_ = std::max(slots_, letStmt.GetSlot() + 1);
+  Emit("store i64 " + value + ", ptr " + Slot(letStmt.GetSlot()));
+}
+
+// -----------------------------------------------------------------------------
+std::string LLVMCodegen::LowerExpr(const Expr &expr)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      auto &ref = static_cast<const RefExpr &>(expr);
+      if (ref.GetTarget() == RefExpr::Target::LOCAL) {
+        auto t = MakeTemp();
+        Emit(t + " = load i64, ptr " + Slot(ref.GetSlot()));
+        return t;
+      }
+      assert(ref.GetTarget() == RefExpr::Target::ARG && "function as value");
+      return "%a." + ref.GetName();
+    }
+    case Expr::Kind::BINARY: {
+      return LowerBinaryExpr(static_cast<const BinaryExpr &>(expr));
+    }
+    case Expr::Kind::CALL: {
+      return LowerCallExpr(static_cast<const CallExpr &>(expr));
+    }
+    case Expr::Kind::INT: {
+      auto value = static_cast<const IntExpr &>(expr).GetInt();
+      return std::to_string(static_cast<int64_t>(value));
+    }
+  }
+  assert(!"invalid expression kind");
+  return "";
+}
+
+// -----------------------------------------------------------------------------
+std::string LLVMCodegen::LowerBinaryExpr(const BinaryExpr &binary)
+{
+  auto lhs = LowerExpr(binary.GetLHS());
+  auto rhs = LowerExpr(binary.GetRHS());
+
+  // Operations proven safe by the verifier are emitted inline, with
+  // no signed wrap, while the others call the checked helpers.
+  auto arith = [&] (const char *op, const char *fn) {
+    auto t = MakeTemp();
+    if (binary.IsSafe()) {
+      Emit(t + " = " + op + " i64 " + lhs + ", " + rhs);
+    } else {
+      Emit(t + " = call i64 @imp." + fn + "(i64 " + lhs + ", i64 " + rhs + ")");
+    }
+    return t;
+  };
+  auto cmp = [&] (const char *op) {
+    auto c = MakeTemp();
+    Emit(c + " = icmp " + op + " i64 " + lhs + ", " + rhs);
+    auto t = MakeTemp();
+    Emit(t + " = zext i1 " + c + " to i64");
+    return t;
+  };
+  switch (binary.GetKind()) {
+    case BinaryExpr::Kind::ADD: return arith("add nsw", "add");
+    case BinaryExpr::Kind::SUB: return arith("sub nsw", "sub");
+    case BinaryExpr::Kind::MUL: return arith("mul nsw", "mul");
+    case BinaryExpr::Kind::DIV: return arith("sdiv", "div");
+    case BinaryExpr::Kind::MOD: return arith("srem", "mod");
+    case BinaryExpr::Kind::DEQ: return cmp("eq");
+    case BinaryExpr::Kind::NEQ: return cmp("ne");
+    case BinaryExpr::Kind::SM: return cmp("slt");
+    case BinaryExpr::Kind::SMEQ: return cmp("sle");
+    case BinaryExpr::Kind::GR: return cmp("sgt");
+    case BinaryExpr::Kind::GREQ: return cmp("sge");
+  }
+  assert(!"invalid binary operator");
+  return "";
+}
+
+// -----------------------------------------------------------------------------
+std::string LLVMCodegen::LowerCallExpr(const CallExpr &call, bool tail)
+{
+  // Arguments are evaluated from last to first, as in the interpreter.
+  std::vector<std::string> args(call.arg_size());
+  size_t i = call.arg_size();
+  for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+    args[--i] = LowerExpr(**it);
+  }
+
+  auto &ref = static_cast<const RefExpr &>(call.GetCallee());
+  assert(ref.GetTarget() != RefExpr::Target::ARG && "call to a value");
+  bool proto = ref.GetTarget() == RefExpr::Target::PROTO;
+
+  auto t = MakeTemp();
+  std::string inst = t + (tail ? " = tail call" : " = call");
+  inst += std::string(" i64 @imp.") + (proto ? "p." : "f.");
+  inst += ref.GetName() + "(";
+  for (size_t n = 0; n < args.size(); ++n) {
+    inst += (n ? ", i64 " : "i64 ") + args[n];
+  }
+  Emit(inst + ")");
+  return t;
+}
+
+// -----------------------------------------------------------------------------
+std::string LLVMCodegen::LowerCond(const Expr &expr)
+{
+  auto value = LowerExpr(expr);
+  auto c = MakeTemp();
+  Emit(c + " = icmp ne i64 " + value + ", 0");
+  return c;
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::LowerFuncDecl(const FuncDecl &decl)
+{
+  nextTemp_ = nextBlock_ = slots_ = 0;
+  terminated_ = false;
+  LowerStmt(decl.GetBody());
+
+  // The verifier ensures that all paths return.
+  if (!terminated_) {
+    EmitTerminator("unreachable");
+  }
+
+  auto body = out_.str();
+  out_.str("");
+  out_ << "define internal i64 @imp.f." << decl.GetName() << Params(decl) << " {\n";
+  EmitEntry(out_);
+  out_ << body;
+  out_ << "}\n";
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::LowerProtoDecl(const ProtoDecl &decl)
+{
+  auto &name = decl.GetName();
+  auto &prim = decl.GetPrimitiveName();
+  out_ << "@imp.h." << name << " = internal global ptr null\n";
+  out_ << "@imp.s." << name << " = private unnamed_addr constant [";
+  out_ << prim.size() + 1 << " x i8] c\"" << prim << "\\00\"\n";
+  out_ << "\n";
+
+  // Arguments are passed to the runtime through an array.
+  auto n = std::to_string(decl.arg_size());
+  out_ << "define internal i64 @imp.p." << name << Params(decl) << " {\n";
+  out_ << "entry:\n";
+  out_ << "  %args = alloca [" << n << " x i64]\n";
+  size_t i = 0;
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it, ++i) {
+    auto slot = "%p" + std::to_string(i);
+    out_ << "  " << slot << " = getelementptr inbounds [" << n << " x i64], ";
+    out_ << "ptr %args, i64 0, i64 " << i << "\n";
+    out_ << "  store i64 %a." << it->first << ", ptr " << slot << "\n";
+  }
+  out_ << "  %h = load ptr, ptr @imp.h." << name << "\n";
+  out_ << "  %r = call i64 @imp_runtime_call(ptr %h, ptr %args, i32 " << n << ")\n";
+  out_ << "  ret i64 %r\n";
+  out_ << "}\n";
+}
+
+// -----------------------------------------------------------------------------
+std::string LLVMCodegen::Params(const FuncOrProtoDecl &decl)
+{
+  std::string params = "(";
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    params += (it == decl.arg_begin() ? "i64 %a." : ", i64 %a.") + it->first.GetName();
+  }
+  return params + ")";
+}
+
+// -----------------------------------------------------------------------------
+std::string LLVMCodegen::Slot(unsigned slot)
+{
+  return "%l." + std::to_string(slot);
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::EmitEntry(std::ostream &os) const
+{
+  os << "entry:\n";
+  for (unsigned i = 0; i < slots_; ++i) {
+    os << "  " << Slot(i) << " = alloca i64\n";
+  }
+}
+
+// -----------------------------------------------------------------------------
+std::string LLVMCodegen::MakeTemp()
+{
+  return "%t" + std::to_string(nextTemp_++);
+}
+
+// -----------------------------------------------------------------------------
+std::string LLVMCodegen::MakeBlock()
+{
+  return "b" + std::to_string(nextBlock_++);
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::EmitBlock(const std::string &block)
+{
+  out_ << block << ":\n";
+  terminated_ = false;
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::Emit(const std::string &inst)
+{
+  // Code following a terminator is unreachable, but must still be placed
+  // in a block of its own.
+  if (terminated_) {
+    EmitBlock(MakeBlock());
+  }
+  out_ << "  " << inst << "\n";
+}
+
+// -----------------------------------------------------------------------------
+void LLVMCodegen::EmitTerminator(const std::string &inst)
+{
+  Emit(inst);
+  terminated_ = true;
+}
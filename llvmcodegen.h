@@ -0,0 +1,83 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <ostream>
+#include <sstream>
+#include <string>
+
+#include "ast.h"
+
+
+
+/**
+ * Translator from the AST to textual LLVM IR.
+ *
+ * Every function becomes an LLVM function over `i64` values, with arguments
+ * and temporaries in SSA form and statements lowered to basic blocks.
+ * Locals are given a stack slot each, allocated in the entry block, which
+ * `mem2reg` promotes back to SSA values.
+ * Operands and arguments are evaluated in the same order as in the
+ * interpreter. As with the C backend, prototypes are bound at startup to
+ * the runtime methods in runtime.cpp through the bridge in runtime.h.
+ */
+class LLVMCodegen {
+public:
+  /// Entry point to the code generator: writes an LLVM module.
+  void Translate(const Module &mod, std::ostream &os);
+
+private:
+  /// Lowers a single statement.
+  void LowerStmt(const Stmt &stmt);
+  /// Lowers a while statement.
+  void LowerWhileStmt(const WhileStmt &whileStmt);
+  /// Lowers an if statement.
+  void LowerIfStmt(const IfStmt &ifStmt);
+  /// Lowers the declaration of a local.
+  void LowerLetStmt(const LetStmt &letStmt);
+
+  /// Lowers an expression, returning the value holding its result.
+  std::string LowerExpr(const Expr &expr);
+  /// Lowers a binary expression.
+  std::string LowerBinaryExpr(const BinaryExpr &expr);
+  /// Lowers a call expression, marking calls in tail position.
+  std::string LowerCallExpr(const CallExpr &expr, bool tail = false);
+  /// Converts an integer to a branch condition.
+  std::string LowerCond(const Expr &expr);
+
+  /// Lowers a function declaration.
+  void LowerFuncDecl(const FuncDecl &funcDecl);
+  /// Lowers a prototype into a function invoking the runtime.
+  void LowerProtoDecl(const ProtoDecl &protoDecl);
+
+private:
+  /// Returns the list of parameters of a function.
+  static std::string Params(const FuncOrProtoDecl &decl);
+  /// Returns the stack slot of a local.
+  static std::string Slot(unsigned slot);
+  /// Emits the entry block, allocating the stack slots of the locals.
+  void EmitEntry(std::ostream &os) const;
+
+  /// Create a new temporary.
+  std::string MakeTemp();
+  /// Create a new basic block.
+  std::string MakeBlock();
+  /// Emit the label starting a basic block.
+  void EmitBlock(const std::string &block);
+  /// Emit an instruction, starting a new block after a terminator.
+  void Emit(const std::string &inst);
+  /// Emit a terminator.
+  void EmitTerminator(const std::string &inst);
+
+private:
+  /// Body of the function being lowered.
+  std::ostringstream out_;
+  /// Identifier of the next temporary.
+  unsigned nextTemp_ = 0;
+  /// Identifier of the next basic block.
+  unsigned nextBlock_ = 0;
+  /// Set if the current block was terminated.
+  bool terminated_ = false;
+  /// Number of stack slots used by the locals of the function.
+  unsigned slots_ = 0;
+};
@@ -1,41 +1,313 @@
 // This file is part of the IMP project.
 
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include "ast.h"
+#include "ccodegen.h"
 #include "codegen.h"
+#include "engine.h"
 #include "interp.h"
-#include "lexer.h"
-#include "parser.h"
-#include "verifier.h"
+#include "io.h"
+#include "jit.h"
+#include "llvmcodegen.h"
+#include "metrics.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "regcodegen.h"
 
 
 
+// -----------------------------------------------------------------------------
+static std::string GetCachePath(const std::string &path)
+{
+  // Sources named foo.imp are cached in foo.impc.
+  const std::string ext = ".imp";
+  if (path.size() > ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0) {
+    return path + "c";
+  }
+  return path + ".impc";
+}
+
+// -----------------------------------------------------------------------------
+static std::string ReadInput(const char *path)
+{
+  // Input is read from the standard input unless a file is named.
+  std::ifstream file;
+  if (path) {
+    file.open(path, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error(std::string("cannot open '") + path + "'");
+    }
+  }
+  std::ostringstream os;
+  os << (path ? file.rdbuf() : std::cin.rdbuf());
+  return os.str();
+}
+
 // -----------------------------------------------------------------------------
 int main(int argc, char **argv)
 {
   const char *exeName = argc < 1 ? "imp" : argv[0];
 
-  if (argc != 2) {
-    std::cerr << "Usage: " << exeName << " path-to-file" << std::endl;
+  // Parse the command-line options preceding the path to the source.
+  bool registers = false;
+  size_t stackSize = Interp::kDefaultStackSize;
+  uint64_t jitThreshold = Jit::kDefaultThreshold;
+  unsigned compileThreads = 0;
+  const char *emitC = nullptr;
+  const char *emitLLVM = nullptr;
+  bool cache = false;
+  bool lazy = false;
+  bool stream = false;
+  unsigned parallel = 0;
+  const char *input = nullptr;
+  bool profile = false;
+  const char *profileStacks = nullptr;
+  uint64_t profilePeriod = Profiler::kDefaultPeriod;
+  const char *metricsPath = nullptr;
+  unsigned metricsPeriod = Metrics::kDefaultPeriod;
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; ++argi) {
+    if (strcmp(argv[argi], "--register") == 0) {
+      registers = true;
+      continue;
+    }
+    if (strcmp(argv[argi], "--cache") == 0) {
+      cache = true;
+      continue;
+    }
+    if (strcmp(argv[argi], "--lazy") == 0) {
+      lazy = true;
+      continue;
+    }
+    if (strcmp(argv[argi], "--stream") == 0) {
+      stream = true;
+      continue;
+    }
+    if (strcmp(argv[argi], "--parallel") == 0 && argi + 1 < argc) {
+      char *end;
+      parallel = strtoul(argv[++argi], &end, 10);
+      if (*end != '\0' || parallel == 0) {
+        std::cerr << "Invalid number of threads: " << argv[argi] << std::endl;
+        return EXIT_FAILURE;
+      }
+      stream = true;
+      continue;
+    }
+    if (strcmp(argv[argi], "--input") == 0 && argi + 1 < argc) {
+      input = argv[++argi];
+      continue;
+    }
+    if (strcmp(argv[argi], "--profile") == 0) {
+      profile = true;
+      continue;
+    }
+    if (strcmp(argv[argi], "--profile-stacks") == 0 && argi + 1 < argc) {
+      profile = true;
+      profileStacks = argv[++argi];
+      continue;
+    }
+    if (strcmp(argv[argi], "--profile-period") == 0 && argi + 1 < argc) {
+      char *end;
+      profilePeriod = strtoull(argv[++argi], &end, 10);
+      if (*end != '\0' || profilePeriod == 0) {
+        std::cerr << "Invalid profile period: " << argv[argi] << std::endl;
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (strcmp(argv[argi], "--metrics") == 0 && argi + 1 < argc) {
+      metricsPath = argv[++argi];
+      continue;
+    }
+    if (strcmp(argv[argi], "--metrics-period") == 0 && argi + 1 < argc) {
+      char *end;
+      metricsPeriod = strtoul(argv[++argi], &end, 10);
+      if (*end != '\0') {
+        std::cerr << "Invalid metrics period: " << argv[argi] << std::endl;
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (strcmp(argv[argi], "--stack-size") == 0 && argi + 1 < argc) {
+      char *end;
+      stackSize = strtoull(argv[++argi], &end, 10);
+      if (*end != '\0' || stackSize == 0) {
+        std::cerr << "Invalid stack size: " << argv[argi] << std::endl;
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (strcmp(argv[argi], "--jit-threshold") == 0 && argi + 1 < argc) {
+      char *end;
+      jitThreshold = strtoull(argv[++argi], &end, 10);
+      if (*end != '\0') {
+        std::cerr << "Invalid JIT threshold: " << argv[argi] << std::endl;
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (strcmp(argv[argi], "--compile-threads") == 0 && argi + 1 < argc) {
+      char *end;
+      compileThreads = strtoul(argv[++argi], &end, 10);
+      if (*end != '\0') {
+        std::cerr << "Invalid number of threads: " << argv[argi] << std::endl;
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (strcmp(argv[argi], "--emit-c") == 0 && argi + 1 < argc) {
+      emitC = argv[++argi];
+      continue;
+    }
+    if (strcmp(argv[argi], "--emit-llvm") == 0 && argi + 1 < argc) {
+      emitLLVM = argv[++argi];
+      continue;
+    }
+    std::cerr << "Unknown option: " << argv[argi] << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (argi + 1 != argc) {
+    std::cerr << "Usage: " << exeName << " [--register] [--cache] [--lazy] [--stream] [--parallel N] [--input path] [--profile] [--profile-stacks out.txt] [--profile-period N] [--metrics out.txt] [--metrics-period ms] [--stack-size N] [--jit-threshold N] [--compile-threads N] [--emit-c out.c] [--emit-llvm out.ll] path-to-file" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (profile && registers) {
+    std::cerr << "Profiling requires the stack backend" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (parallel && (lazy || profile)) {
+    std::cerr << "Parallel runs cannot lower functions lazily or profile them" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (metricsPath && !IMP_HAS_METRICS) {
+    std::cerr << "Metrics are not supported by this build" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (metricsPath && parallel) {
+    std::cerr << "Parallel runs cannot collect metrics" << std::endl;
     return EXIT_FAILURE;
   }
 
   try {
-    // The lexer splits the source into a stream of tokens.
-    Lexer lexer(argv[1]);
+    // Stack bytecode can be mapped from a cache, skipping compilation.
+    // Lazily lowered programs are incomplete and profiled ones need the
+    // debug table of the code generator, so neither is cached.
+    const std::string path = argv[argi];
+    const bool useCache = cache && !lazy && !profile && !registers && !emitC && !emitLLVM;
+    std::string cachePath;
+    uint64_t hash = 0;
+
+    // Functions lowered on demand refer to the AST and the code generator.
+    std::unique_ptr<Module> ast;
+    Codegen codegen;
+    std::unique_ptr<Program> prog;
+    if (useCache) {
+      cachePath = GetCachePath(path);
+      hash = Program::HashSource(path);
+      prog = Program::Load(cachePath, hash);
+    }
+
+    if (!prog) {
+      // The front end turns the source into a verified, optimised AST.
+      ast = LoadModule(path);
+
+      // Native backends write out the program instead of running it.
+      if (emitC || emitLLVM) {
+        if (emitC) {
+          std::ofstream os(emitC);
+          CCodegen().Translate(*ast, os);
+          if (!os) {
+            throw std::runtime_error(std::string("cannot write ") + emitC);
+          }
+        }
+        if (emitLLVM) {
+          std::ofstream os(emitLLVM);
+          LLVMCodegen().Translate(*ast, os);
+          if (!os) {
+            throw std::runtime_error(std::string("cannot write ") + emitLLVM);
+          }
+        }
+        return EXIT_SUCCESS;
+      }
+
+      // The code generator translates the AST into bytecode.
+      if (registers) {
+        prog = RegCodegen().Translate(*ast);
+      } else {
+        if (profile) {
+          codegen.EnableDebugInfo();
+        }
+        codegen.SetThreads(compileThreads);
+        prog = codegen.Translate(*ast, lazy);
+
+        // Decode the bytecode into fixed-width instructions to speed up dispatch.
+        prog->Decode();
+      }
 
-    // The parser processes the tokens from the lexer to build the AST.
-    auto ast = Parser(lexer).ParseModule();
+      if (useCache && !prog->Save(cachePath, hash)) {
+        std::cerr << "Cannot write cache: " << cachePath << std::endl;
+      }
+    }
 
-    // The verifier checks the program and emits warnings/errors.
-    Verifier().Verify(*ast);
+    // Shards of the input are streamed through instances on worker threads,
+    // sharing the program, with their outputs written out in order.
+    if (parallel) {
+      std::string text = ReadInput(input);
+      auto shards = ShardInput(text, parallel);
+      std::vector<std::string> outputs(shards.size());
+      std::shared_ptr<const Program> shared = std::move(prog);
+      ParallelFor(shards.size(), parallel, [&] (size_t i) {
+        Instance instance(shared, stackSize);
+        instance.GetInterp().SetJitThreshold(jitThreshold);
+        outputs[i] = instance.Stream(shards[i]);
+      });
+      for (auto &output : outputs) {
+        std::cout.write(output.data(), output.size());
+      }
+      std::cout.flush();
+      return EXIT_SUCCESS;
+    }
 
-    // The code generator translates the AST into bytecode.
-    auto prog = Codegen().Translate(*ast);
+    // The bytecode interpreter runs the bytecode, once or for each record.
+    if (input) {
+      IO::Get().Open(input);
+    }
+    // Metrics outlive the interpreter, so the file is written once it is done.
+    std::unique_ptr<Metrics> metrics;
+    Interp interp(*prog, stackSize);
+    interp.SetJitThreshold(jitThreshold);
+    if (metricsPath) {
+      metrics = std::make_unique<Metrics>();
+      metrics->Serve(metricsPath, metricsPeriod);
+      interp.SetMetrics(metrics.get());
+    }
+    std::unique_ptr<Profiler> profiler;
+    if (profile) {
+      profiler = std::make_unique<Profiler>(profilePeriod);
+      interp.SetProfiler(profiler.get());
+    }
+    if (stream) {
+      interp.Stream();
+    } else {
+      interp.Run();
+    }
 
-    // The bytecode interpreter runs the bytecode.
-    Interp(*prog).Run();
+    // The flat profile goes to the standard error, after the output.
+    if (profiler) {
+      profiler->WriteFlat(std::cerr, *prog, codegen.GetDebugTable());
+      if (profileStacks) {
+        std::ofstream os(profileStacks);
+        profiler->WriteStacks(os, *prog, codegen.GetDebugTable());
+        if (!os) {
+          throw std::runtime_error(std::string("cannot write ") + profileStacks);
+        }
+      }
+    }
 
   } catch (const std::exception &ex) {
     // Report any exceptions (parser, lexer, verification, runtime errors).
@@ -0,0 +1,234 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+
+
+/// Write end of the pipe of the served metrics, woken up by SIGUSR1.
+static std::atomic<int> gWakeFd{ -1 };
+
+// -----------------------------------------------------------------------------
+static void OnSignal(int)
+{
+  // Only async-signal-safe calls are allowed: the thread does the rest.
+  int saved = errno;
+  int fd = gWakeFd.load();
+  if (fd >= 0) {
+    char c = 's';
+    [[maybe_unused]] auto n = write(fd, &c, 1);
+  }
+  errno = saved;
+}
+
+// -----------------------------------------------------------------------------
+static double Seconds(uint64_t ns)
+{
+  return ns / 1e9;
+}
+
+
+// -----------------------------------------------------------------------------
+Metrics::Call::Call(Metrics &metrics, RuntimeFn fn, size_t stack)
+  : metrics_(metrics)
+  , start_(Now())
+{
+  auto it = metrics.index_.find(fn);
+  method_ = it == metrics.index_.end() ? -1 : it->second;
+  metrics.SetStack(stack);
+  metrics.activeStart_.store(start_, std::memory_order_relaxed);
+  metrics.active_.store(method_, std::memory_order_relaxed);
+}
+
+// -----------------------------------------------------------------------------
+Metrics::Call::~Call()
+{
+  metrics_.active_.store(-1, std::memory_order_relaxed);
+  if (method_ < 0) {
+    return;
+  }
+
+  // Bucket i counts calls shorter than 2^i nanoseconds.
+  auto &method = metrics_.methods_[method_];
+  uint64_t ns = Now() - start_;
+  unsigned bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (bucket < kBuckets) {
+    Add(method.Buckets[bucket], 1);
+  }
+  Add(method.Time, ns);
+  Add(method.Calls, 1);
+}
+
+// -----------------------------------------------------------------------------
+Metrics::Block::Block(Metrics &metrics, Stream stream)
+  : metrics_(metrics)
+  , stream_(stream)
+{
+  auto &blocking = metrics.blocking_[static_cast<size_t>(stream)];
+  blocking.Start.store(Now(), std::memory_order_relaxed);
+}
+
+// -----------------------------------------------------------------------------
+Metrics::Block::~Block()
+{
+  auto &blocking = metrics_.blocking_[static_cast<size_t>(stream_)];
+  uint64_t start = blocking.Start.load(std::memory_order_relaxed);
+  Add(blocking.Time, Now() - start);
+  blocking.Start.store(0, std::memory_order_relaxed);
+}
+
+
+// -----------------------------------------------------------------------------
+Metrics::Metrics()
+  : methods_(new Method[kRuntimeFns.size()])
+  , numMethods_(kRuntimeFns.size())
+{
+  int i = 0;
+  for (auto &[name, fn] : kRuntimeFns) {
+    methods_[i].Name = name;
+    index_.emplace(fn, i++);
+  }
+}
+
+// -----------------------------------------------------------------------------
+Metrics::~Metrics()
+{
+  if (!thread_.joinable()) {
+    return;
+  }
+  gWakeFd.store(-1);
+  signal(SIGUSR1, SIG_DFL);
+  stop_.store(true);
+  char c = 'q';
+  [[maybe_unused]] auto n = write(wake_[1], &c, 1);
+  thread_.join();
+  close(wake_[0]);
+  close(wake_[1]);
+}
+
+// -----------------------------------------------------------------------------
+void Metrics::Write(std::ostream &os) const
+{
+  auto now = Now();
+  auto relaxed = std::memory_order_relaxed;
+
+  auto gauge = [&] (const char *name, const char *help, uint64_t value) {
+    os << "# HELP " << name << " " << help << "\n";
+    os << "# TYPE " << name << " gauge\n";
+    os << name << " " << value << "\n";
+  };
+
+  os << "# HELP imp_instructions_total Instructions executed.\n";
+  os << "# TYPE imp_instructions_total counter\n";
+  os << "imp_instructions_total " << instructions_.load(relaxed) << "\n";
+  gauge("imp_call_depth", "Frames of functions on the stack.", depth_.load(relaxed));
+  gauge("imp_call_depth_max", "Deepest nesting of calls.", maxDepth_.load(relaxed));
+  gauge("imp_stack_values", "Values on the stack at the last call or return.", stack_.load(relaxed));
+  gauge("imp_stack_values_max", "Most values on the stack at a call or return.", maxStack_.load(relaxed));
+
+  // Buckets are cumulative in the format, while they are counted separately.
+  os << "# HELP imp_runtime_call_seconds Latency of the calls to runtime methods.\n";
+  os << "# TYPE imp_runtime_call_seconds histogram\n";
+  for (size_t i = 0; i < numMethods_; ++i) {
+    auto &method = methods_[i];
+    uint64_t calls = method.Calls.load(relaxed);
+    if (calls == 0) {
+      continue;
+    }
+    const std::string label = "method=\"" + method.Name + "\"";
+    uint64_t total = 0;
+    for (unsigned b = 0; b < kBuckets; ++b) {
+      total += method.Buckets[b].load(relaxed);
+      os << "imp_runtime_call_seconds_bucket{" << label << ",le=\"";
+      os << Seconds(uint64_t(1) << b) << "\"} " << std::min(total, calls) << "\n";
+    }
+    os << "imp_runtime_call_seconds_bucket{" << label << ",le=\"+Inf\"} " << calls << "\n";
+    os << "imp_runtime_call_seconds_sum{" << label << "} " << Seconds(method.Time.load(relaxed)) << "\n";
+    os << "imp_runtime_call_seconds_count{" << label << "} " << calls << "\n";
+  }
+
+  os << "# HELP imp_runtime_active_seconds Time spent so far in the method being run.\n";
+  os << "# TYPE imp_runtime_active_seconds gauge\n";
+  int active = active_.load(relaxed);
+  if (active >= 0) {
+    uint64_t start = activeStart_.load(relaxed);
+    os << "imp_runtime_active_seconds{method=\"" << methods_[active].Name << "\"} ";
+    os << Seconds(now > start ? now - start : 0) << "\n";
+  }
+
+  // Operations in progress are charged up to now.
+  os << "# HELP imp_io_blocked_seconds_total Time spent blocked on input or output.\n";
+  os << "# TYPE imp_io_blocked_seconds_total counter\n";
+  const char *streams[] = { "input", "output" };
+  for (size_t i = 0; i < 2; ++i) {
+    uint64_t time = blocking_[i].Time.load(relaxed);
+    uint64_t start = blocking_[i].Start.load(relaxed);
+    if (start && now > start) {
+      time += now - start;
+    }
+    os << "imp_io_blocked_seconds_total{stream=\"" << streams[i] << "\"} ";
+    os << Seconds(time) << "\n";
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Metrics::Serve(const std::string &path, unsigned period)
+{
+  path_ = path;
+  if (pipe(wake_) != 0) {
+    throw std::runtime_error("cannot create the pipe of the metrics");
+  }
+  // Signals must never block on a full pipe, while one pending byte suffices.
+  fcntl(wake_[1], F_SETFL, O_NONBLOCK);
+  gWakeFd.store(wake_[1]);
+
+  struct sigaction sa = {};
+  sa.sa_handler = OnSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, nullptr);
+
+  // The file is written once on startup and once more after stopping.
+  thread_ = std::thread([this, period] {
+    struct pollfd fd = { wake_[0], POLLIN, 0 };
+    for (;;) {
+      Dump();
+      if (stop_.load()) {
+        break;
+      }
+      if (poll(&fd, 1, period ? static_cast<int>(period) : -1) > 0) {
+        char buf[64];
+        [[maybe_unused]] auto n = read(wake_[0], buf, sizeof(buf));
+      }
+    }
+  });
+}
+
+// -----------------------------------------------------------------------------
+void Metrics::Dump()
+{
+  // Readers never see a partially written file.
+  const std::string tmp = path_ + ".tmp";
+  {
+    std::ofstream os(tmp);
+    Write(os);
+    if (!os) {
+      std::cerr << "cannot write metrics to " << tmp << std::endl;
+      return;
+    }
+  }
+  if (rename(tmp.c_str(), path_.c_str()) != 0) {
+    std::cerr << "cannot write metrics to " << path_ << std::endl;
+  }
+}
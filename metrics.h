@@ -0,0 +1,200 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "runtime.h"
+
+
+/// Metrics are fed by hooks which are compiled in only if enabled.
+#ifdef IMP_METRICS
+#define IMP_HAS_METRICS 1
+#else
+#define IMP_HAS_METRICS 0
+#endif
+
+
+
+/**
+ * Live counters of a running program, which other threads can read.
+ *
+ * The metrics are fed by the thread running the program, which is their
+ * only writer, so counters are relaxed atomics updated by plain loads and
+ * stores: reading them never stops the program, while updating them costs
+ * no more than an increment. Runtime methods are timed into histograms
+ * with one bucket per power of two of nanoseconds, and time spent blocked
+ * on the descriptors behind the I/O context is accumulated. Calls and
+ * blocking operations still in progress are reported along with their
+ * elapsed time, telling apart programs waiting for input from ones looping.
+ */
+class Metrics final {
+public:
+  /// Number of buckets of the latency histograms.
+  static constexpr unsigned kBuckets = 32;
+  /// Default interval between periodic dumps, in milliseconds.
+  static constexpr unsigned kDefaultPeriod = 1000;
+
+  /// Direction of a blocking I/O operation.
+  enum class Stream {
+    INPUT,
+    OUTPUT,
+  };
+
+  /**
+   * Times a call to a runtime method for the duration of its scope.
+   */
+  class Call final {
+  public:
+    Call(Metrics &metrics, RuntimeFn fn, size_t stack);
+    ~Call();
+
+  private:
+    /// Metrics the call is charged to.
+    Metrics &metrics_;
+    /// Index of the method, -1 if not a method of the runtime.
+    int method_;
+    /// Start time of the call.
+    uint64_t start_;
+  };
+
+  /**
+   * Times a blocking operation for the duration of its scope.
+   */
+  class Block final {
+  public:
+    Block(Metrics &metrics, Stream stream);
+    ~Block();
+
+  private:
+    /// Metrics the operation is charged to.
+    Metrics &metrics_;
+    /// Direction of the operation.
+    Stream stream_;
+  };
+
+public:
+  Metrics();
+  ~Metrics();
+
+  /// Counts an instruction.
+  void Step() { Add(instructions_, 1); }
+  /// Accounts for a call to a function, with the stack after the call.
+  void Enter(size_t stack)
+  {
+    auto depth = depth_.load(std::memory_order_relaxed) + 1;
+    depth_.store(depth, std::memory_order_relaxed);
+    Max(maxDepth_, depth);
+    SetStack(stack);
+  }
+  /// Accounts for a return from a function, with the stack after the return.
+  void Return(size_t stack)
+  {
+    auto depth = depth_.load(std::memory_order_relaxed);
+    depth_.store(depth ? depth - 1 : 0, std::memory_order_relaxed);
+    SetStack(stack);
+  }
+
+  /// Writes the metrics in the text exposition format of Prometheus.
+  void Write(std::ostream &os) const;
+
+  /**
+   * Writes the metrics to a file from a thread of their own.
+   *
+   * The file is replaced every period, unless the period is 0, and whenever
+   * the process receives SIGUSR1. It is written one last time once the
+   * metrics are destroyed.
+   */
+  void Serve(const std::string &path, unsigned period = kDefaultPeriod);
+
+private:
+  /// Method of the runtime, with its histogram of latencies.
+  struct Method {
+    /// Name of the method.
+    std::string Name;
+    /// Number of completed calls.
+    std::atomic<uint64_t> Calls{ 0 };
+    /// Total time spent in completed calls, in nanoseconds.
+    std::atomic<uint64_t> Time{ 0 };
+    /// Number of calls, by the power of two above their latency.
+    std::atomic<uint64_t> Buckets[kBuckets] = {};
+  };
+
+  /// Counters of a direction of I/O.
+  struct Blocking {
+    /// Total time spent blocked in completed operations, in nanoseconds.
+    std::atomic<uint64_t> Time{ 0 };
+    /// Start time of the operation in progress, 0 if none.
+    std::atomic<uint64_t> Start{ 0 };
+  };
+
+  /// Reads the monotonic clock, in nanoseconds.
+  static uint64_t Now()
+  {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+  }
+
+  /// Adds to a counter which has no other writer.
+  static void Add(std::atomic<uint64_t> &counter, uint64_t n)
+  {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  /// Raises a high-water mark which has no other writer.
+  static void Max(std::atomic<uint64_t> &mark, uint64_t n)
+  {
+    if (n > mark.load(std::memory_order_relaxed)) {
+      mark.store(n, std::memory_order_relaxed);
+    }
+  }
+
+  /// Records the number of values on the stack.
+  void SetStack(size_t stack)
+  {
+    stack_.store(stack, std::memory_order_relaxed);
+    Max(maxStack_, stack);
+  }
+
+  /// Writes the metrics to the file, replacing it atomically.
+  void Dump();
+
+private:
+  /// Number of instructions executed.
+  std::atomic<uint64_t> instructions_{ 0 };
+  /// Number of frames of functions on the stack.
+  std::atomic<uint64_t> depth_{ 0 };
+  /// Deepest nesting of calls.
+  std::atomic<uint64_t> maxDepth_{ 0 };
+  /// Number of values on the stack at the last call or return.
+  std::atomic<uint64_t> stack_{ 0 };
+  /// Largest number of values on the stack seen at a call or return.
+  std::atomic<uint64_t> maxStack_{ 0 };
+  /// Methods of the runtime, in the order of the table.
+  std::unique_ptr<Method[]> methods_;
+  /// Number of methods.
+  size_t numMethods_;
+  /// Indices of the methods, by address.
+  std::unordered_map<RuntimeFn, int> index_;
+  /// Index of the method being run, -1 if none.
+  std::atomic<int> active_{ -1 };
+  /// Start time of the method being run.
+  std::atomic<uint64_t> activeStart_{ 0 };
+  /// Counters of input and output.
+  Blocking blocking_[2];
+  /// File the metrics are written to.
+  std::string path_;
+  /// Thread writing out the metrics, if served.
+  std::thread thread_;
+  /// Flag set to stop the thread.
+  std::atomic<bool> stop_{ false };
+  /// Pipe waking up the thread, written to by signals and on shutdown.
+  int wake_[2] = { -1, -1 };
+};
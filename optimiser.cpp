@@ -0,0 +1,373 @@
+// This file is part of the IMP project.
+
+#include <cassert>
+#include <limits>
+
+#include "optimiser.h"
+
+
+
+// -----------------------------------------------------------------------------
+std::unique_ptr<Module> Optimiser::Optimise(const Module &mod)
+{
+  // The rewritten module owns a new arena, so prototypes are copied over.
+  arena_ = std::make_unique<Arena>();
+  std::vector<TopLevelStmt> body;
+  for (auto item : mod) {
+    if (std::holds_alternative<FuncDecl *>(item)) {
+      body.push_back(OptimiseFuncDecl(*std::get<0>(item)));
+      continue;
+    }
+    if (std::holds_alternative<Stmt *>(item)) {
+      body.push_back(OptimiseStmt(*std::get<2>(item)));
+      continue;
+    }
+    body.push_back(arena_->New<ProtoDecl>(*std::get<1>(item)));
+  }
+  return std::make_unique<Module>(std::move(arena_), std::move(body));
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Optimiser::OptimiseStmt(const Stmt &stmt)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      return OptimiseBlockStmt(static_cast<const BlockStmt &>(stmt));
+    }
+    case Stmt::Kind::WHILE: {
+      return OptimiseWhileStmt(static_cast<const WhileStmt &>(stmt));
+    }
+    case Stmt::Kind::EXPR: {
+      return OptimiseExprStmt(static_cast<const ExprStmt &>(stmt));
+    }
+    case Stmt::Kind::RETURN: {
+      return OptimiseReturnStmt(static_cast<const ReturnStmt &>(stmt));
+    }
+    case Stmt::Kind::IF: {
+      return OptimiseIfStmt(static_cast<const IfStmt &>(stmt));
+    }
+    case Stmt::Kind::LET: {
+      return OptimiseLetStmt(static_cast<const LetStmt &>(stmt));
+    }
+    case Stmt::Kind::ASSIGN: {
+      return OptimiseAssignStmt(static_cast<const AssignStmt &>(stmt));
+    }
+  }
+  assert(!"invalid statement kind");
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+BlockStmt *Optimiser::OptimiseBlockStmt(const BlockStmt &block)
+{
+  std::vector<Stmt *> body;
+  for (auto &stmt : block) {
+    auto opt = OptimiseStmt(*stmt);
+
+    // Drop statements which were simplified to nothing.
+    if (opt->GetKind() == Stmt::Kind::BLOCK) {
+      auto &inner = static_cast<const BlockStmt &>(*opt);
+      if (inner.begin() == inner.end()) {
+        continue;
+      }
+    }
+    body.push_back(opt);
+  }
+  return arena_->New<BlockStmt>(block.GetLocation(), std::move(body));
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Optimiser::OptimiseWhileStmt(const WhileStmt &whileStmt)
+{
+  auto cond = OptimiseExpr(whileStmt.GetCond());
+  if (auto val = GetConstant(*cond); val && *val == 0) {
+    return MakeEmpty(whileStmt.GetLocation());
+  }
+  return arena_->New<WhileStmt>(
+      whileStmt.GetLocation(),
+      cond,
+      OptimiseStmt(whileStmt.GetStmt())
+  );
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Optimiser::OptimiseIfStmt(const IfStmt &ifStmt)
+{
+  auto cond = OptimiseExpr(ifStmt.GetCond());
+  auto elseStmt = ifStmt.GetElseStmt();
+  if (auto val = GetConstant(*cond)) {
+    if (*val != 0) {
+      return OptimiseStmt(ifStmt.GetStmt());
+    }
+    return elseStmt ? OptimiseStmt(*elseStmt) : MakeEmpty(ifStmt.GetLocation());
+  }
+  return arena_->New<IfStmt>(
+      ifStmt.GetLocation(),
+      cond,
+      OptimiseStmt(ifStmt.GetStmt()),
+      elseStmt ? OptimiseStmt(*elseStmt) : nullptr
+  );
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Optimiser::OptimiseReturnStmt(const ReturnStmt &retStmt)
+{
+  return arena_->New<ReturnStmt>(
+      retStmt.GetLocation(),
+      OptimiseExpr(retStmt.GetExpr())
+  );
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Optimiser::OptimiseExprStmt(const ExprStmt &exprStmt)
+{
+  auto expr = OptimiseExpr(exprStmt.GetExpr());
+  if (IsPure(*expr)) {
+    return MakeEmpty(exprStmt.GetLocation());
+  }
+  return arena_->New<ExprStmt>(exprStmt.GetLocation(), expr);
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Optimiser::OptimiseLetStmt(const LetStmt &letStmt)
+{
+  // Slots were allocated by the verifier, so they are carried over.
+  auto opt = arena_->New<LetStmt>(
+      letStmt.GetLocation(),
+      letStmt.GetSymbol(),
+      letStmt.GetTypeSymbol(),
+      OptimiseExpr(letStmt.GetInit())
+  );
+  opt->Allocate(letStmt.GetSlot());
+  return opt;
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Optimiser::OptimiseAssignStmt(const AssignStmt &assignStmt)
+{
+  return arena_->New<AssignStmt>(
+      assignStmt.GetLocation(),
+      arena_->New<RefExpr>(assignStmt.GetTarget()),
+      OptimiseExpr(assignStmt.GetValue())
+  );
+}
+
+// -----------------------------------------------------------------------------
+Expr *Optimiser::OptimiseExpr(const Expr &expr)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      auto &ref = static_cast<const RefExpr &>(expr);
+      return arena_->New<RefExpr>(ref);
+    }
+    case Expr::Kind::BINARY: {
+      return OptimiseBinaryExpr(static_cast<const BinaryExpr &>(expr));
+    }
+    case Expr::Kind::CALL: {
+      return OptimiseCallExpr(static_cast<const CallExpr &>(expr));
+    }
+    case Expr::Kind::INT: {
+      auto &val = static_cast<const IntExpr &>(expr);
+      return arena_->New<IntExpr>(val.GetInt());
+    }
+  }
+  assert(!"invalid expression kind");
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+Expr *Optimiser::OptimiseBinaryExpr(const BinaryExpr &binary)
+{
+  auto lhs = OptimiseExpr(binary.GetLHS());
+  auto rhs = OptimiseExpr(binary.GetRHS());
+
+  auto lval = GetConstant(*lhs);
+  auto rval = GetConstant(*rhs);
+  if (lval && rval) {
+    if (auto val = Fold(binary.GetKind(), *lval, *rval)) {
+      return MakeInt(*val);
+    }
+  }
+  return Simplify(binary, lhs, rhs);
+}
+
+// -----------------------------------------------------------------------------
+Expr *Optimiser::OptimiseCallExpr(const CallExpr &call)
+{
+  std::vector<Expr *> args;
+  for (auto it = call.arg_begin(), end = call.arg_end(); it != end; ++it) {
+    args.push_back(OptimiseExpr(**it));
+  }
+  return arena_->New<CallExpr>(
+      OptimiseExpr(call.GetCallee()),
+      std::move(args)
+  );
+}
+
+// -----------------------------------------------------------------------------
+FuncDecl *Optimiser::OptimiseFuncDecl(const FuncDecl &decl)
+{
+  FuncOrProtoDecl::ArgList args(decl.arg_begin(), decl.arg_end());
+  return arena_->New<FuncDecl>(
+      decl.GetLocation(),
+      decl.GetSymbol(),
+      std::move(args),
+      decl.GetTypeSymbol(),
+      OptimiseBlockStmt(decl.GetBody())
+  );
+}
+
+// -----------------------------------------------------------------------------
+std::optional<int64_t> Optimiser::Fold(
+    BinaryExpr::Kind kind,
+    int64_t lhs,
+    int64_t rhs)
+{
+  // Leave overflows and traps to the runtime.
+  int64_t result;
+  switch (kind) {
+    case BinaryExpr::Kind::ADD: {
+      if (__builtin_add_overflow(lhs, rhs, &result)) {
+        return std::nullopt;
+      }
+      return result;
+    }
+    case BinaryExpr::Kind::SUB: {
+      if (__builtin_sub_overflow(lhs, rhs, &result)) {
+        return std::nullopt;
+      }
+      return result;
+    }
+    case BinaryExpr::Kind::MUL: {
+      if (__builtin_mul_overflow(lhs, rhs, &result)) {
+        return std::nullopt;
+      }
+      return result;
+    }
+    case BinaryExpr::Kind::DIV:
+    case BinaryExpr::Kind::MOD: {
+      if (rhs == 0) {
+        return std::nullopt;
+      }
+      if (lhs == std::numeric_limits<int64_t>::min() && rhs == -1) {
+        return std::nullopt;
+      }
+      return kind == BinaryExpr::Kind::DIV ? lhs / rhs : lhs % rhs;
+    }
+    case BinaryExpr::Kind::DEQ: return lhs == rhs;
+    case BinaryExpr::Kind::NEQ: return lhs != rhs;
+    case BinaryExpr::Kind::SM: return lhs < rhs;
+    case BinaryExpr::Kind::SMEQ: return lhs <= rhs;
+    case BinaryExpr::Kind::GR: return lhs > rhs;
+    case BinaryExpr::Kind::GREQ: return lhs >= rhs;
+  }
+  return std::nullopt;
+}
+
+// -----------------------------------------------------------------------------
+Expr *Optimiser::Simplify(
+    const BinaryExpr &binary,
+    Expr *lhs,
+    Expr *rhs)
+{
+  auto kind = binary.GetKind();
+  auto lval = GetConstant(*lhs);
+  auto rval = GetConstant(*rhs);
+
+  // Rewritten nodes keep the ranges of the originals, so they stay safe.
+  auto make = [&] (BinaryExpr::Kind kind, Expr *lhs, Expr *rhs) {
+    auto *node = arena_->New<BinaryExpr>(kind, lhs, rhs);
+    if (binary.IsSafe()) {
+      node->MarkSafe();
+    }
+    return node;
+  };
+
+  switch (kind) {
+    case BinaryExpr::Kind::ADD: {
+      // x + 0 = 0 + x = x
+      if (rval == 0) return lhs;
+      if (lval == 0) return rhs;
+      break;
+    }
+    case BinaryExpr::Kind::SUB: {
+      // x - 0 = x
+      if (rval == 0) return lhs;
+      break;
+    }
+    case BinaryExpr::Kind::MUL: {
+      // x *1 = 1 *x = x
+      if (rval == 1) return lhs;
+      if (lval == 1) return rhs;
+      // x *0 = 0 *x = 0, unless x must be evaluated.
+      if (rval == 0 && IsPure(*lhs)) return MakeInt(0);
+      if (lval == 0 && IsPure(*rhs)) return MakeInt(0);
+      // x *2 = x + x, as the sum of references fuses into fewer opcodes.
+      if (rval == 2 && lhs->GetKind() == Expr::Kind::REF) {
+        return make(BinaryExpr::Kind::ADD, lhs, lhs);
+      }
+      if (lval == 2 && rhs->GetKind() == Expr::Kind::REF) {
+        return make(BinaryExpr::Kind::ADD, rhs, rhs);
+      }
+      break;
+    }
+    case BinaryExpr::Kind::DIV: {
+      // x / 1 = x
+      if (rval == 1) return lhs;
+      break;
+    }
+    case BinaryExpr::Kind::MOD: {
+      // x % 1 = 0, unless x must be evaluated.
+      if (rval == 1 && IsPure(*lhs)) return MakeInt(0);
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+  return make(kind, lhs, rhs);
+}
+
+// -----------------------------------------------------------------------------
+std::optional<int64_t> Optimiser::GetConstant(const Expr &expr)
+{
+  if (expr.GetKind() != Expr::Kind::INT) {
+    return std::nullopt;
+  }
+  return static_cast<int64_t>(static_cast<const IntExpr &>(expr).GetInt());
+}
+
+// -----------------------------------------------------------------------------
+bool Optimiser::IsPure(const Expr &expr)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF:
+    case Expr::Kind::INT: {
+      return true;
+    }
+    case Expr::Kind::BINARY: {
+      auto &binary = static_cast<const BinaryExpr &>(expr);
+      // Checked arithmetic might fail, which must be preserved.
+      if (!binary.IsSafe() && !binary.IsComparison()) {
+        return false;
+      }
+      return IsPure(binary.GetLHS()) && IsPure(binary.GetRHS());
+    }
+    case Expr::Kind::CALL: {
+      return false;
+    }
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+Expr *Optimiser::MakeInt(int64_t value)
+{
+  return arena_->New<IntExpr>(static_cast<uint64_t>(value));
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Optimiser::MakeEmpty(const Location &loc)
+{
+  return arena_->New<BlockStmt>(loc, std::vector<Stmt *>{});
+}
@@ -0,0 +1,78 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <memory>
+#include <optional>
+
+#include "ast.h"
+
+
+
+/**
+ * Simplifies the AST before code generation.
+ *
+ * The tree is rebuilt bottom-up: constant sub-expressions are folded,
+ * algebraic identities are applied and branches guarded by constant
+ * conditions are resolved. Further transformations of the AST should be
+ * added as steps of this traversal.
+ */
+class Optimiser {
+public:
+  /// Entry point to the optimiser: rewrites an entire module.
+  std::unique_ptr<Module> Optimise(const Module &mod);
+
+private:
+  /// Rewrites a single statement.
+  Stmt *OptimiseStmt(const Stmt &stmt);
+  /// Rewrites a block statement.
+  BlockStmt *OptimiseBlockStmt(const BlockStmt &blockStmt);
+  /// Rewrites a while statement.
+  Stmt *OptimiseWhileStmt(const WhileStmt &whileStmt);
+  /// Rewrites an if statement.
+  Stmt *OptimiseIfStmt(const IfStmt &ifStmt);
+  /// Rewrites a return statement.
+  Stmt *OptimiseReturnStmt(const ReturnStmt &retStmt);
+  /// Rewrites an expression statement.
+  Stmt *OptimiseExprStmt(const ExprStmt &exprStmt);
+  /// Rewrites the declaration of a local.
+  Stmt *OptimiseLetStmt(const LetStmt &letStmt);
+  /// Rewrites an assignment.
+  Stmt *OptimiseAssignStmt(const AssignStmt &assignStmt);
+
+  /// Rewrites a single expression.
+  Expr *OptimiseExpr(const Expr &expr);
+  /// Rewrites a binary expression.
+  Expr *OptimiseBinaryExpr(const BinaryExpr &binary);
+  /// Rewrites a call expression.
+  Expr *OptimiseCallExpr(const CallExpr &call);
+
+  /// Rewrites a function declaration.
+  FuncDecl *OptimiseFuncDecl(const FuncDecl &funcDecl);
+
+private:
+  /// Evaluates a binary operator, unless the operation would trap.
+  static std::optional<int64_t> Fold(
+      BinaryExpr::Kind kind,
+      int64_t lhs,
+      int64_t rhs
+  );
+  /// Applies algebraic identities to an expression with a constant operand.
+  Expr *Simplify(
+      const BinaryExpr &binary,
+      Expr *lhs,
+      Expr *rhs
+  );
+  /// Returns the value of a constant expression.
+  static std::optional<int64_t> GetConstant(const Expr &expr);
+  /// Checks whether an expression can be evaluated without side effects.
+  static bool IsPure(const Expr &expr);
+  /// Builds an integer literal.
+  Expr *MakeInt(int64_t value);
+  /// Builds an empty statement, standing in for one at a location.
+  Stmt *MakeEmpty(const Location &loc);
+
+private:
+  /// Arena holding the nodes of the rewritten module.
+  std::unique_ptr<Arena> arena_;
+};
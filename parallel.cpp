@@ -0,0 +1,52 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+
+
+// -----------------------------------------------------------------------------
+unsigned GetHardwareThreads()
+{
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// -----------------------------------------------------------------------------
+void ParallelFor(size_t count, unsigned threads, const std::function<void(size_t)> &task)
+{
+  std::atomic<size_t> next(0);
+  std::mutex lock;
+  std::exception_ptr error;
+  auto worker = [&] {
+    for (size_t i; (i = next.fetch_add(1)) < count; ) {
+      try {
+        task(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!error) {
+          error = std::current_exception();
+        }
+        next = count;
+      }
+    }
+  };
+
+  std::vector<std::thread> pool;
+  size_t n = std::min<size_t>(std::max(threads, 1u), count);
+  for (size_t i = 1; i < n; ++i) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
@@ -0,0 +1,21 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+
+
+/// Returns the number of threads the hardware runs at the same time.
+unsigned GetHardwareThreads();
+
+/**
+ * Runs a task for each index below a count, on up to a number of threads.
+ *
+ * Indices are handed out in increasing order to the threads as they become
+ * free, the calling thread being one of them. Returns once all tasks are
+ * done; if any of them throws, no further ones are started and the first
+ * exception is rethrown.
+ */
+void ParallelFor(size_t count, unsigned threads, const std::function<void(size_t)> &task);
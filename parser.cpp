@@ -26,39 +26,44 @@ ParserError::ParserError(const Location &loc, const std::string &msg)
 // -----------------------------------------------------------------------------
 Parser::Parser(Lexer &lexer)
   : lexer_(lexer)
+  , file_(Symbol::Intern(lexer.GetToken().GetLocation().Name).GetName())
 {
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<Module> Parser::ParseModule()
+std::unique_ptr<Module> Parser::ParseModule()
 {
+  // All nodes are allocated from the arena handed over to the module.
+  arena_ = std::make_unique<Arena>();
   std::vector<TopLevelStmt> body;
   while (auto tk = Current()) {
     if (tk.Is(Token::Kind::FUNC)) {
       // Parse a function prototype or declaration.
-      std::string name(Expect(Token::Kind::IDENT).GetIdent());
+      auto loc = Locate(tk);
+      auto name = Symbol::Intern(Expect(Token::Kind::IDENT).GetIdent());
       Expect(Token::Kind::LPAREN);
 
-      std::vector<std::pair<std::string, std::string>> args;
+      FuncOrProtoDecl::ArgList args;
       while (!lexer_.Next().Is(Token::Kind::RPAREN)) {
-        std::string arg(Current().GetIdent());
+        auto arg = Symbol::Intern(Current().GetIdent());
         Expect(Token::Kind::COLON);
-        std::string type(Expect(Token::Kind::IDENT).GetIdent());
+        auto type = ParseType();
         args.emplace_back(arg, type);
 
-        if (!lexer_.Next().Is(Token::Kind::COMMA)) {
+        if (!Current().Is(Token::Kind::COMMA)) {
           break;
         }
       }
       Check(Token::Kind::RPAREN);
 
       Expect(Token::Kind::COLON);
-      std::string type(Expect(Token::Kind::IDENT).GetIdent());
+      auto type = ParseType();
 
-      if (lexer_.Next().Is(Token::Kind::EQUAL)) {
+      if (Current().Is(Token::Kind::EQUAL)) {
         std::string primitive(Expect(Token::Kind::STRING).GetString());
         lexer_.Next();
-        body.push_back(std::make_shared<ProtoDecl>(
+        body.push_back(arena_->New<ProtoDecl>(
+            loc,
             name,
             std::move(args),
             type,
@@ -66,7 +71,8 @@ std::shared_ptr<Module> Parser::ParseModule()
         ));
       } else {
         auto block = ParseBlockStmt();
-        body.push_back(std::make_shared<FuncDecl>(
+        body.push_back(arena_->New<FuncDecl>(
+            loc,
             name,
             std::move(args),
             type,
@@ -78,11 +84,11 @@ std::shared_ptr<Module> Parser::ParseModule()
       body.push_back(ParseStmt());
     }
   }
-  return std::make_unique<Module>(std::move(body));
+  return std::make_unique<Module>(std::move(arena_), std::move(body));
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<Stmt> Parser::ParseStmt()
+Stmt *Parser::ParseStmt()
 {
   auto tk = Current();
   switch (tk.GetKind()) {
@@ -90,16 +96,17 @@ std::shared_ptr<Stmt> Parser::ParseStmt()
     case Token::Kind::WHILE: return ParseWhileStmt();
     case Token::Kind::LBRACE: return ParseBlockStmt();
     case Token::Kind::IF: return ParseIfStmt();
-    default: return std::make_shared<ExprStmt>(ParseExpr());
+    case Token::Kind::LET: return ParseLetStmt();
+    default: return ParseExprStmt();
   }
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<BlockStmt> Parser::ParseBlockStmt()
+BlockStmt *Parser::ParseBlockStmt()
 {
-  Check(Token::Kind::LBRACE);
+  auto loc = Locate(Check(Token::Kind::LBRACE));
 
-  std::vector<std::shared_ptr<Stmt>> body;
+  std::vector<Stmt *> body;
   while (!lexer_.Next().Is(Token::Kind::RBRACE)) {
     body.push_back(ParseStmt());  
     if (!Current().Is(Token::Kind::SEMI)) {
@@ -108,34 +115,34 @@ std::shared_ptr<BlockStmt> Parser::ParseBlockStmt()
   }
   Check(Token::Kind::RBRACE);
   lexer_.Next();
-  return std::make_shared<BlockStmt>(std::move(body));
+  return arena_->New<BlockStmt>(loc, std::move(body));
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<ReturnStmt> Parser::ParseReturnStmt()
+ReturnStmt *Parser::ParseReturnStmt()
 {
-  Check(Token::Kind::RETURN);
+  auto loc = Locate(Check(Token::Kind::RETURN));
   lexer_.Next();
   auto expr = ParseExpr();
-  return std::make_shared<ReturnStmt>(expr);
+  return arena_->New<ReturnStmt>(loc, expr);
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<WhileStmt> Parser::ParseWhileStmt()
+WhileStmt *Parser::ParseWhileStmt()
 {
-  Check(Token::Kind::WHILE);
+  auto loc = Locate(Check(Token::Kind::WHILE));
   Expect(Token::Kind::LPAREN);
   lexer_.Next();
   auto cond = ParseExpr();
   Check(Token::Kind::RPAREN);
   lexer_.Next();
   auto stmt = ParseStmt();
-  return std::make_shared<WhileStmt>(cond, stmt);
+  return arena_->New<WhileStmt>(loc, cond, stmt);
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<IfStmt> Parser::ParseIfStmt() {
-  Check(Token::Kind::IF);
+IfStmt *Parser::ParseIfStmt() {
+  auto loc = Locate(Check(Token::Kind::IF));
   Expect(Token::Kind::LPAREN);
   lexer_.Next();
   auto cond = ParseExpr();
@@ -147,31 +154,71 @@ std::shared_ptr<IfStmt> Parser::ParseIfStmt() {
     lexer_.Next();
     auto elseStmt = ParseStmt();
 
-    return std::make_shared<IfStmt>(cond, stmt, elseStmt);
+    return arena_->New<IfStmt>(loc, cond, stmt, elseStmt);
   }
 
-  return std::make_shared<IfStmt>(cond, stmt, nullptr);
+  return arena_->New<IfStmt>(loc, cond, stmt, nullptr);
 }
 
+// -----------------------------------------------------------------------------
+LetStmt *Parser::ParseLetStmt()
+{
+  auto loc = Locate(Check(Token::Kind::LET));
+  auto name = Symbol::Intern(Expect(Token::Kind::IDENT).GetIdent());
+  Expect(Token::Kind::COLON);
+  auto type = ParseType();
+  Check(Token::Kind::EQUAL);
+  lexer_.Next();
+  auto init = ParseExpr();
+  return arena_->New<LetStmt>(loc, name, type, init);
+}
+
+// -----------------------------------------------------------------------------
+Stmt *Parser::ParseExprStmt()
+{
+  auto tk = Current();
+  auto loc = Locate(tk);
+  auto expr = ParseExpr();
+  if (!Current().Is(Token::Kind::EQUAL)) {
+    return arena_->New<ExprStmt>(loc, expr);
+  }
+
+  // Only names can be assigned to.
+  if (expr->GetKind() != Expr::Kind::REF) {
+    Error(tk.GetLocation(), "expression cannot be assigned to");
+  }
+  lexer_.Next();
+  auto value = ParseExpr();
+  return arena_->New<AssignStmt>(loc, static_cast<RefExpr *>(expr), value);
+}
+
+// -----------------------------------------------------------------------------
+Symbol Parser::ParseType()
+{
+  // Array types are named after their element type, followed by brackets.
+  std::string name(Expect(Token::Kind::IDENT).GetIdent());
+  if (lexer_.Next().Is(Token::Kind::LBRACKET)) {
+    Expect(Token::Kind::RBRACKET);
+    lexer_.Next();
+    name += "[]";
+  }
+  return Symbol::Intern(name);
+}
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<Expr> Parser::ParseTermExpr()
+Expr *Parser::ParseTermExpr()
 {
   auto tk = Current();
   switch (tk.GetKind()) {
     case Token::Kind::IDENT: {
-      std::string ident(tk.GetIdent());
+      auto ident = Symbol::Intern(tk.GetIdent());
       lexer_.Next();
-      return std::static_pointer_cast<Expr>(
-          std::make_shared<RefExpr>(ident)
-      );
+      return arena_->New<RefExpr>(ident);
     }
     case Token::Kind::INT: {
       std::uint64_t integer(tk.GetInt());
       lexer_.Next();
-      return std::static_pointer_cast<Expr>(
-        std::make_shared<IntExpr>(integer)
-      );
+      return arena_->New<IntExpr>(integer);
     }
     case Token::Kind::LPAREN: { 
       lexer_.Next();
@@ -189,11 +236,11 @@ std::shared_ptr<Expr> Parser::ParseTermExpr()
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<Expr> Parser::ParseCallExpr()
+Expr *Parser::ParseCallExpr()
 {
-  std::shared_ptr<Expr> callee = ParseTermExpr();
+  Expr *callee = ParseTermExpr();
   while (Current().Is(Token::Kind::LPAREN)) {
-    std::vector<std::shared_ptr<Expr>> args;
+    std::vector<Expr *> args;
     while (!lexer_.Next().Is(Token::Kind::RPAREN)) {
       args.push_back(ParseExpr());
       if (!Current().Is(Token::Kind::COMMA)) {
@@ -202,22 +249,22 @@ std::shared_ptr<Expr> Parser::ParseCallExpr()
     }
     Check(Token::Kind::RPAREN);
     lexer_.Next();
-    callee = std::make_shared<CallExpr>(callee, std::move(args));
+    callee = arena_->New<CallExpr>(callee, std::move(args));
   }
   return callee;
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<Expr> Parser::ParseMulDivExpr()
+Expr *Parser::ParseMulDivExpr()
 {
-  std::shared_ptr<Expr> term = ParseCallExpr();
+  Expr *term = ParseCallExpr();
   while(Current().Is(Token::Kind::MULTIPLY) || Current().Is(Token::Kind::DIVIDE) || Current().Is(Token::Kind::MODULO)) {
     auto tk = Current();
 
     lexer_.Next();
     auto rhs = ParseCallExpr();
 
-    term = std::make_shared<BinaryExpr>(
+    term = arena_->New<BinaryExpr>(
       tk.Is(Token::Kind::MULTIPLY) ?  BinaryExpr::Kind::MUL : (
                                       tk.Is(Token::Kind::DIVIDE) ?  BinaryExpr::Kind::DIV : 
                                                                     BinaryExpr::Kind::MOD), term, rhs);
@@ -227,25 +274,25 @@ std::shared_ptr<Expr> Parser::ParseMulDivExpr()
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<Expr> Parser::ParseAddSubExpr()
+Expr *Parser::ParseAddSubExpr()
 {
-  std::shared_ptr<Expr> term = ParseMulDivExpr();
+  Expr *term = ParseMulDivExpr();
   while (Current().Is(Token::Kind::PLUS) || Current().Is(Token::Kind::MINUS)) {
     auto tk = Current();
 
     lexer_.Next();
     auto rhs = ParseMulDivExpr();
 
-    term = std::make_shared<BinaryExpr>(tk.Is(Token::Kind::PLUS) ? BinaryExpr::Kind::ADD : BinaryExpr::Kind::SUB, term, rhs);
+    term = arena_->New<BinaryExpr>(tk.Is(Token::Kind::PLUS) ? BinaryExpr::Kind::ADD : BinaryExpr::Kind::SUB, term, rhs);
   }
 
   return term;
 }
 
 // -----------------------------------------------------------------------------
-std::shared_ptr<Expr> Parser::ParseCompExpr() 
+Expr *Parser::ParseCompExpr() 
 {
-  std::shared_ptr<Expr> term = ParseAddSubExpr();
+  Expr *term = ParseAddSubExpr();
   while(Current().Is(Token::Kind::DOUBLE_EQUAL) ||
         Current().Is(Token::Kind::NOT_EQUAL) ||
         Current().Is(Token::Kind::SMALLER) ||
@@ -258,7 +305,7 @@ std::shared_ptr<Expr> Parser::ParseCompExpr()
     lexer_.Next();
     auto rhs = ParseAddSubExpr();
 
-    term = std::make_shared<BinaryExpr>(tk.Is(Token::Kind::DOUBLE_EQUAL) ? BinaryExpr::Kind::DEQ : 
+    term = arena_->New<BinaryExpr>(tk.Is(Token::Kind::DOUBLE_EQUAL) ? BinaryExpr::Kind::DEQ : 
                                        (tk.Is(Token::Kind::NOT_EQUAL) ? BinaryExpr::Kind::NEQ :
                                        (tk.Is(Token::Kind::SMALLER) ? BinaryExpr::Kind::SM : 
                                        (tk.Is(Token::Kind::SMALLER_OR_EQUAL) ? BinaryExpr::Kind::SMEQ : 
@@ -292,3 +339,11 @@ void Parser::Error(const Location &loc, const std::string &msg)
 {
   throw ParserError(loc, msg);
 }
+
+// -----------------------------------------------------------------------------
+Location Parser::Locate(const Token &tk) const
+{
+  auto loc = tk.GetLocation();
+  loc.Name = file_;
+  return loc;
+}
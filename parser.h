@@ -28,32 +28,39 @@ public:
   /**
    * Parse the top-level node, which consists of a series of statements.
    */
-  std::shared_ptr<Module> ParseModule();
+  std::unique_ptr<Module> ParseModule();
 
 private:
   /// Parse a single statement.
-  std::shared_ptr<Stmt> ParseStmt();
+  Stmt *ParseStmt();
   /// Parse a block of statements.
-  std::shared_ptr<BlockStmt> ParseBlockStmt();
+  BlockStmt *ParseBlockStmt();
   /// Parse a return statement: return <expr>
-  std::shared_ptr<ReturnStmt> ParseReturnStmt();
+  ReturnStmt *ParseReturnStmt();
   /// Parse a while loop.
-  std::shared_ptr<WhileStmt> ParseWhileStmt();
+  WhileStmt *ParseWhileStmt();
   /// Parse an if statement.
-  std::shared_ptr<IfStmt> ParseIfStmt();
+  IfStmt *ParseIfStmt();
+  /// Parse a declaration of a local: let <name>: <type> = <expr>
+  LetStmt *ParseLetStmt();
+  /// Parse an expression statement or an assignment: <name> = <expr>
+  Stmt *ParseExprStmt();
+
+  /// Parse the name of a type following the current token: int or int[]
+  Symbol ParseType();
 
   /// Parse a single expression.
-  std::shared_ptr<Expr> ParseExpr() { return ParseCompExpr(); }
+  Expr *ParseExpr() { return ParseCompExpr(); }
   /// Parse an expression which has no operators.
-  std::shared_ptr<Expr> ParseTermExpr();
+  Expr *ParseTermExpr();
   /// Parse a call expression.
-  std::shared_ptr<Expr> ParseCallExpr();
+  Expr *ParseCallExpr();
   /// Parse an add/sub expression.
-  std::shared_ptr<Expr> ParseAddSubExpr();
+  Expr *ParseAddSubExpr();
   /// Parse a comparison expression.
-  std::shared_ptr<Expr> ParseCompExpr();
+  Expr *ParseCompExpr();
   /// parse a mul/div expression.
-  std::shared_ptr<Expr> ParseMulDivExpr();
+  Expr *ParseMulDivExpr();
 
   /// Helper to get the current token.
   inline const Token &Current() { return lexer_.GetToken(); }
@@ -63,7 +70,13 @@ private:
   const Token &Check(Token::Kind kind);
   /// Report an error.
   [[noreturn]] void Error(const Location &loc, const std::string &msg);
+  /// Returns the location of a token, to be stored in the AST.
+  Location Locate(const Token &tk) const;
 
 private:
   Lexer &lexer_;
+  /// Name of the source, interned so that nodes can outlive the lexer.
+  std::string_view file_;
+  /// Arena holding the nodes of the module being parsed.
+  std::unique_ptr<Arena> arena_;
 };
@@ -0,0 +1,281 @@
+// This file is part of the IMP project.
+
+#include <cassert>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "codegen.h"
+
+
+
+/**
+ * Instruction of the code being optimised.
+ */
+struct PeepholeInst {
+  /// Opcode of the instruction.
+  Opcode Op;
+  /// Raw bytes of the operands, following the code address if there is one.
+  std::vector<uint8_t> Operands;
+  /// Index of the instruction targeted by the address operand.
+  size_t Target = 0;
+  /// Flag set if the target lies outside of the code, keeping its address.
+  bool External = false;
+  /// Flag set if the instruction was deleted.
+  bool Removed = false;
+
+  /// Reads the first operand.
+  template<typename T>
+  T Operand() const
+  {
+    T t;
+    assert(sizeof(T) <= Operands.size() && "missing operand");
+    memcpy(&t, Operands.data(), sizeof(T));
+    return t;
+  }
+};
+
+// -----------------------------------------------------------------------------
+static std::optional<Opcode> FuseJumpFalse(Opcode op)
+{
+  switch (op) {
+    case Opcode::DEQ: return Opcode::JUMP_IF_NE;
+    case Opcode::NEQ: return Opcode::JUMP_IF_EQ;
+    case Opcode::SM: return Opcode::JUMP_IF_GE;
+    case Opcode::SMEQ: return Opcode::JUMP_IF_GT;
+    case Opcode::GR: return Opcode::JUMP_IF_LE;
+    case Opcode::GREQ: return Opcode::JUMP_IF_LT;
+    default: return std::nullopt;
+  }
+}
+
+// -----------------------------------------------------------------------------
+static bool IsJump(Opcode op)
+{
+  switch (op) {
+    case Opcode::PUSH_FUNC:
+    case Opcode::CALL_DIRECT: {
+      return false;
+    }
+    default: {
+      return HasAddressOperand(op);
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::Peephole(const std::vector<Label> &entries)
+{
+  // Split the code into instructions, indexed by their address. The end of
+  // the code is also given an index, as labels can be placed there.
+  std::vector<PeepholeInst> insts;
+  std::unordered_map<size_t, size_t> index;
+  for (size_t pc = 0; pc < code_.size(); ) {
+    index.emplace(base_ + pc, insts.size());
+
+    PeepholeInst inst;
+    inst.Op = static_cast<Opcode>(code_[pc++]);
+    size_t size = GetOperandSize(inst.Op);
+    size_t start = pc;
+    if (HasAddressOperand(inst.Op)) {
+      memcpy(&inst.Target, code_.data() + pc, sizeof(size_t));
+      start += sizeof(size_t);
+    }
+    inst.Operands.assign(code_.begin() + start, code_.begin() + pc + size);
+    pc += size;
+    insts.push_back(std::move(inst));
+  }
+  index.emplace(base_ + code_.size(), insts.size());
+
+  // Calls to functions lowered earlier refer to code preceding this chunk,
+  // while those yet to be placed are left to the pending fixups.
+  for (auto &[label, locs] : fixups_) {
+    for (auto loc : locs) {
+      insts[index[base_ + loc - sizeof(Opcode)]].External = true;
+    }
+  }
+  for (auto &inst : insts) {
+    if (HasAddressOperand(inst.Op) && !inst.External) {
+      if (inst.Target < base_) {
+        inst.External = true;
+        continue;
+      }
+      auto it = index.find(inst.Target);
+      assert(it != index.end() && "jump into the middle of an instruction");
+      inst.Target = it->second;
+    }
+  }
+
+  // Instructions which can be reached other than by falling through to them
+  // cannot be merged into their predecessors.
+  std::unordered_set<size_t> targets{ 0 };
+  for (auto &inst : insts) {
+    if (HasAddressOperand(inst.Op) && !inst.External) {
+      targets.insert(inst.Target);
+    }
+  }
+  for (auto label : entries) {
+    targets.insert(index[labelToAddress_[label]]);
+  }
+
+  // Returns the first instruction at or after an index which was not deleted.
+  auto live = [&insts] (size_t i) {
+    while (i < insts.size() && insts[i].Removed) {
+      ++i;
+    }
+    return i;
+  };
+  // Deletes an instruction, handing over the label to the next one.
+  auto remove = [&] (size_t i) {
+    insts[i].Removed = true;
+    if (targets.count(i)) {
+      targets.insert(live(i));
+    }
+  };
+
+  for (bool changed = true; changed; ) {
+    changed = false;
+
+    for (size_t i = live(0); i < insts.size(); i = live(i + 1)) {
+      auto &inst = insts[i];
+
+      if (IsJump(inst.Op) && !inst.External) {
+        // Thread jumps to unconditional jumps, guarding against cycles.
+        for (unsigned hops = 0; hops < insts.size(); ++hops) {
+          auto to = live(inst.Target);
+          if (to == insts.size() || insts[to].Op != Opcode::JUMP) {
+            break;
+          }
+          if (insts[to].Target == inst.Target || to == i) {
+            break;
+          }
+          inst.Target = insts[to].Target;
+          changed = true;
+        }
+
+        // Drop jumps to the next instruction.
+        if (inst.Op == Opcode::JUMP && live(inst.Target) == live(i + 1)) {
+          remove(i);
+          changed = true;
+          continue;
+        }
+      }
+
+      size_t j = live(i + 1);
+      if (j == insts.size() || targets.count(j)) {
+        continue;
+      }
+      auto &next = insts[j];
+
+      switch (inst.Op) {
+        case Opcode::PUSH_FUNC:
+        case Opcode::PUSH_PROTO:
+        case Opcode::PUSH_INT:
+        case Opcode::PEEK:
+        case Opcode::LOAD_LOCAL:
+        case Opcode::LOAD_ARG: {
+          // Values pushed only to be discarded.
+          if (next.Op == Opcode::POP) {
+            remove(j);
+            remove(i);
+            changed = true;
+            continue;
+          }
+          // Constant conditions become unconditional.
+          if (inst.Op == Opcode::PUSH_INT && next.Op == Opcode::JUMP_FALSE) {
+            if (inst.Operand<int64_t>() == 0) {
+              inst.Op = Opcode::JUMP;
+              inst.Operands.clear();
+              inst.Target = next.Target;
+              remove(j);
+            } else {
+              remove(j);
+              remove(i);
+            }
+            changed = true;
+            continue;
+          }
+          // Adding a value from the stack, always checked.
+          if (inst.Op == Opcode::PEEK &&
+              (next.Op == Opcode::ADD || next.Op == Opcode::ADD_UNCHECKED)) {
+            inst.Op = Opcode::PEEK_ADD;
+            remove(j);
+            changed = true;
+            continue;
+          }
+          break;
+        }
+        default: {
+          // Comparisons feeding a conditional branch.
+          if (auto fused = FuseJumpFalse(inst.Op)) {
+            if (next.Op == Opcode::JUMP_FALSE) {
+              inst.Op = *fused;
+              inst.Target = next.Target;
+              remove(j);
+              changed = true;
+              continue;
+            }
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  // Assign addresses to the remaining instructions. Deleted ones are given
+  // the address of the instruction following them.
+  std::vector<size_t> address(insts.size() + 1);
+  size_t pc = 0;
+  for (size_t i = 0; i < insts.size(); ++i) {
+    address[i] = base_ + pc;
+    if (!insts[i].Removed) {
+      pc += sizeof(Opcode) + GetOperandSize(insts[i].Op);
+    }
+  }
+  address[insts.size()] = base_ + pc;
+
+  // Re-encode the code, resolving addresses again.
+  std::vector<uint8_t> code;
+  code.reserve(pc);
+  for (size_t i = 0; i < insts.size(); ++i) {
+    auto &inst = insts[i];
+    if (inst.Removed) {
+      continue;
+    }
+    code.push_back(static_cast<uint8_t>(inst.Op));
+    if (HasAddressOperand(inst.Op)) {
+      size_t addr = inst.External ? inst.Target : address[inst.Target];
+      const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&addr);
+      code.insert(code.end(), bytes, bytes + sizeof(size_t));
+    }
+    code.insert(code.end(), inst.Operands.begin(), inst.Operands.end());
+  }
+  assert(code.size() == pc && "mismatched code size");
+
+  // Re-point labels and pending fixups to the rewritten code. Only labels
+  // created along with the code, or entries of functions emitted into it,
+  // can be placed in it.
+  for (unsigned id = firstLabel_ + 1; id <= nextLabel_; ++id) {
+    if (auto it = labelToAddress_.find(Label(id)); it != labelToAddress_.end()) {
+      it->second = address[index[it->second]];
+    }
+  }
+  for (auto label : entries) {
+    if (label.ID <= firstLabel_) {
+      auto &addr = labelToAddress_[label];
+      addr = address[index[addr]];
+    }
+  }
+  for (auto &[label, locs] : fixups_) {
+    std::vector<size_t> relocated;
+    for (auto loc : locs) {
+      auto i = index[base_ + loc - sizeof(Opcode)];
+      if (!insts[i].Removed && HasAddressOperand(insts[i].Op)) {
+        relocated.push_back(address[i] - base_ + sizeof(Opcode));
+      }
+    }
+    locs = std::move(relocated);
+  }
+  code_ = std::move(code);
+}
@@ -0,0 +1,339 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "profiler.h"
+
+
+
+/**
+ * Maps positions in the interpreted stream back to the source.
+ *
+ * Decoded programs are profiled by instruction index, which is translated
+ * back to the address of the instruction in the bytecode first.
+ */
+class Profiler::Symbolizer {
+public:
+  Symbolizer(const Program &prog, const DebugTable &table)
+    : table_(table)
+  {
+    if (prog.IsDecoded()) {
+      addrs_ = prog.GetAddresses();
+    }
+  }
+
+  /// Returns the function an instruction belongs to, if known.
+  const DebugTable::Func *GetFunc(size_t pc) const
+  {
+    return table_.FindFunc(GetAddr(pc));
+  }
+
+  /// Returns the statement an instruction belongs to, if known.
+  const DebugTable::Line *GetLine(size_t pc) const
+  {
+    auto addr = GetAddr(pc);
+    auto *func = table_.FindFunc(addr);
+    auto *line = table_.FindLine(addr);
+    if (!func || !line || line->Addr < func->Start) {
+      return nullptr;
+    }
+    return line;
+  }
+
+  /// Returns the name of the function at an entry address.
+  std::string GetName(size_t entry) const
+  {
+    if (auto *func = GetFunc(entry)) {
+      return func->Name;
+    }
+    std::ostringstream os;
+    os << "<" << GetAddr(entry) << ">";
+    return os.str();
+  }
+
+private:
+  /// Returns the bytecode address of a position in the stream.
+  size_t GetAddr(size_t pc) const
+  {
+    return pc < addrs_.size() ? addrs_[pc] : pc;
+  }
+
+private:
+  /// Table mapping addresses to the source.
+  const DebugTable &table_;
+  /// Addresses of the decoded instructions, if the program was decoded.
+  std::vector<size_t> addrs_;
+};
+
+// -----------------------------------------------------------------------------
+template <typename N, typename Enter, typename Leave>
+static void Walk(const N &root, Enter enter, Leave leave)
+{
+  // Trees can be deep under mutual recursion, so they are walked with an
+  // explicit stack.
+  using Iterator = decltype(root.Children.begin());
+  std::vector<std::pair<const N *, Iterator>> stack;
+  enter(root);
+  stack.emplace_back(&root, root.Children.begin());
+  while (!stack.empty()) {
+    auto &[node, it] = stack.back();
+    if (it == node->Children.end()) {
+      leave(*node);
+      stack.pop_back();
+      continue;
+    }
+    const N &child = *(it++)->second;
+    enter(child);
+    stack.emplace_back(&child, child.Children.begin());
+  }
+}
+
+// -----------------------------------------------------------------------------
+static double Percent(uint64_t part, uint64_t whole)
+{
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+// -----------------------------------------------------------------------------
+Profiler::Profiler(uint64_t period)
+  : period_(period)
+  , countdown_(period)
+  , lastNode_(&root_)
+  , root_(0, nullptr)
+  , node_(&root_)
+{
+}
+
+// -----------------------------------------------------------------------------
+Profiler::~Profiler()
+{
+}
+
+// -----------------------------------------------------------------------------
+void Profiler::Start()
+{
+  // Runs start at the top level, even if an earlier one was interrupted.
+  node_ = &root_;
+  node_->Depth = 0;
+  node_->Calls += 1;
+  lastNode_ = node_;
+  lastOp_ = Opcode::STOP;
+  last_ = ReadClock();
+}
+
+// -----------------------------------------------------------------------------
+void Profiler::Stop()
+{
+  uint64_t now = ReadClock();
+  ops_[static_cast<size_t>(lastOp_)].Cycles += now - last_;
+  lastNode_->Cycles += now - last_;
+  last_ = now;
+}
+
+// -----------------------------------------------------------------------------
+void Profiler::Enter(size_t entry)
+{
+  if (node_ != &root_ && node_->Entry == entry) {
+    node_->Depth += 1;
+  } else {
+    auto &child = node_->Children[entry];
+    if (!child) {
+      child = std::make_unique<Node>(entry, node_);
+    }
+    node_ = child.get();
+  }
+  node_->Calls += 1;
+}
+
+// -----------------------------------------------------------------------------
+void Profiler::Return()
+{
+  if (node_->Depth) {
+    node_->Depth -= 1;
+  } else if (node_->Parent) {
+    node_ = node_->Parent;
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Profiler::WriteFlat(
+    std::ostream &os,
+    const Program &prog,
+    const DebugTable &table) const
+{
+  Symbolizer symbols(prog, table);
+
+  // Aggregate contexts by function. Cycles spent in a context include those
+  // of its callees, but are only added to the total of a function at its
+  // outermost activation, so recursion is not counted twice.
+  struct FuncStats {
+    size_t Entry;
+    uint64_t Calls = 0;
+    uint64_t Cycles = 0;
+    uint64_t Total = 0;
+    uint64_t Samples = 0;
+  };
+  std::unordered_map<size_t, FuncStats> funcs;
+  std::unordered_map<const Node *, uint64_t> inclusive;
+  std::unordered_map<size_t, unsigned> active;
+  uint64_t samples = 0;
+  Walk(
+      root_,
+      [&] (const Node &node) {
+        auto &stats = funcs.emplace(node.Entry, FuncStats{ node.Entry }).first->second;
+        stats.Calls += node.Calls;
+        stats.Cycles += node.Cycles;
+        stats.Samples += node.Samples;
+        samples += node.Samples;
+        active[node.Entry] += 1;
+      },
+      [&] (const Node &node) {
+        uint64_t total = node.Cycles;
+        for (auto &[entry, child] : node.Children) {
+          total += inclusive[child.get()];
+        }
+        inclusive[&node] = total;
+        if (--active[node.Entry] == 0) {
+          funcs[node.Entry].Total += total;
+        }
+      }
+  );
+  uint64_t cycles = inclusive[&root_];
+  uint64_t count = 0;
+  for (auto &op : ops_) {
+    count += op.Count;
+  }
+
+  os << "Flat profile: " << count << " instructions, " << cycles << " cycles, "
+     << samples << " samples every " << period_ << " instructions" << std::endl;
+  os << std::fixed << std::setprecision(2);
+
+  // Functions, by the cycles spent in their own code.
+  std::vector<FuncStats> byFunc;
+  for (auto &[entry, stats] : funcs) {
+    byFunc.push_back(stats);
+  }
+  std::sort(byFunc.begin(), byFunc.end(), [] (auto &a, auto &b) {
+    return a.Cycles != b.Cycles ? a.Cycles > b.Cycles : a.Entry < b.Entry;
+  });
+  os << std::endl << "Functions:" << std::endl;
+  os << std::setw(12) << "calls"
+     << std::setw(16) << "self cycles"
+     << std::setw(9) << "self%"
+     << std::setw(16) << "total cycles"
+     << std::setw(9) << "total%"
+     << std::setw(10) << "samples"
+     << "  function" << std::endl;
+  for (auto &stats : byFunc) {
+    os << std::setw(12) << stats.Calls
+       << std::setw(16) << stats.Cycles
+       << std::setw(9) << Percent(stats.Cycles, cycles)
+       << std::setw(16) << stats.Total
+       << std::setw(9) << Percent(stats.Total, cycles)
+       << std::setw(10) << stats.Samples
+       << "  " << symbols.GetName(stats.Entry);
+    if (auto *func = symbols.GetFunc(stats.Entry); func && func->Loc.Line) {
+      os << " " << func->Loc;
+    }
+    os << std::endl;
+  }
+
+  // Opcodes, by the cycles spent executing them.
+  std::vector<size_t> byOp;
+  for (size_t i = 0; i < kNumOpcodes; ++i) {
+    if (ops_[i].Count) {
+      byOp.push_back(i);
+    }
+  }
+  std::sort(byOp.begin(), byOp.end(), [this] (size_t a, size_t b) {
+    return ops_[a].Cycles != ops_[b].Cycles ? ops_[a].Cycles > ops_[b].Cycles : a < b;
+  });
+  os << std::endl << "Opcodes:" << std::endl;
+  os << std::setw(12) << "count"
+     << std::setw(16) << "cycles"
+     << std::setw(9) << "cycles%"
+     << std::setw(12) << "cycles/op"
+     << "  opcode" << std::endl;
+  for (auto i : byOp) {
+    auto &op = ops_[i];
+    os << std::setw(12) << op.Count
+       << std::setw(16) << op.Cycles
+       << std::setw(9) << Percent(op.Cycles, cycles)
+       << std::setw(12) << static_cast<double>(op.Cycles) / op.Count
+       << "  " << GetOpcodeName(static_cast<Opcode>(i)) << std::endl;
+  }
+
+  // Statements, by the samples taken in them.
+  std::unordered_map<const DebugTable::Line *, std::pair<uint64_t, size_t>> lines;
+  for (auto &[pc, n] : pcs_) {
+    auto &line = lines.emplace(symbols.GetLine(pc), std::make_pair(0, pc)).first->second;
+    line.first += n;
+  }
+  std::vector<std::pair<const DebugTable::Line *, std::pair<uint64_t, size_t>>> byLine(
+      lines.begin(),
+      lines.end()
+  );
+  std::sort(byLine.begin(), byLine.end(), [] (auto &a, auto &b) {
+    return a.second.first != b.second.first
+        ? a.second.first > b.second.first
+        : a.second.second < b.second.second;
+  });
+  os << std::endl << "Statements:" << std::endl;
+  os << std::setw(12) << "samples"
+     << std::setw(9) << "samples%"
+     << "  location" << std::endl;
+  for (auto &[line, stats] : byLine) {
+    os << std::setw(12) << stats.first
+       << std::setw(9) << Percent(stats.first, samples) << "  ";
+    if (line) {
+      os << line->Loc;
+    } else {
+      os << "<no statement>";
+    }
+    if (auto *func = symbols.GetFunc(stats.second)) {
+      os << " in " << func->Name;
+    }
+    os << std::endl;
+  }
+  os << std::defaultfloat;
+}
+
+// -----------------------------------------------------------------------------
+void Profiler::WriteStacks(
+    std::ostream &os,
+    const Program &prog,
+    const DebugTable &table) const
+{
+  Symbolizer symbols(prog, table);
+
+  // Each sampled context is written out as the names of the functions on
+  // its path from the top level, followed by the number of samples.
+  std::unordered_map<size_t, std::string> names;
+  std::vector<const Node *> path;
+  Walk(
+      root_,
+      [&] (const Node &node) {
+        path.push_back(&node);
+        if (!node.Samples) {
+          return;
+        }
+        for (size_t i = 0; i < path.size(); ++i) {
+          auto entry = path[i]->Entry;
+          auto it = names.find(entry);
+          if (it == names.end()) {
+            it = names.emplace(entry, symbols.GetName(entry)).first;
+          }
+          os << (i ? ";" : "") << it->second;
+        }
+        os << " " << node.Samples << std::endl;
+      },
+      [&] (const Node &node) {
+        path.pop_back();
+      }
+  );
+}
@@ -0,0 +1,140 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <unordered_map>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "program.h"
+
+class DebugTable;
+
+
+
+/**
+ * Profiler of the stack bytecode, fed by the instrumented interpreter loop.
+ *
+ * Every instruction is counted and charged the cycles elapsed until the
+ * next one, both by opcode and by the function it runs in. Functions are
+ * kept in a tree of calling contexts, with direct recursion folded into a
+ * single frame. Every few instructions, the context and the program counter
+ * are sampled, attributing execution to stacks and to statements. Addresses
+ * are recorded as they appear in the stream being interpreted and are only
+ * mapped back to the source when the profile is written.
+ */
+class Profiler final {
+public:
+  /// Number of instructions between samples, prime not to alias with loops.
+  static constexpr uint64_t kDefaultPeriod = 1009;
+
+public:
+  Profiler(uint64_t period = kDefaultPeriod);
+  ~Profiler();
+
+  /// Starts accounting for a run of the program, at its top level.
+  void Start();
+  /// Charges the last instruction of a run.
+  void Stop();
+
+  /// Accounts for an instruction about to be executed.
+  void Step(Opcode op, size_t pc)
+  {
+    uint64_t now = ReadClock();
+    uint64_t cycles = now - last_;
+    last_ = now;
+    ops_[static_cast<size_t>(lastOp_)].Cycles += cycles;
+    lastNode_->Cycles += cycles;
+
+    ops_[static_cast<size_t>(op)].Count += 1;
+    lastOp_ = op;
+    lastNode_ = node_;
+
+    if (--countdown_ == 0) {
+      countdown_ = period_;
+      node_->Samples += 1;
+      pcs_[pc] += 1;
+    }
+  }
+
+  /// Enters the function at an entry address.
+  void Enter(size_t entry);
+  /// Returns from the current function.
+  void Return();
+  /// Accounts for a self-recursive call re-using the frame.
+  void TailCall() { node_->Calls += 1; }
+
+  /// Writes the profile of functions, opcodes and statements.
+  void WriteFlat(std::ostream &os, const Program &prog, const DebugTable &table) const;
+  /// Writes the sampled stacks in the collapsed format of flame graph tools.
+  void WriteStacks(std::ostream &os, const Program &prog, const DebugTable &table) const;
+
+private:
+  /// Reads the timestamp counter, or a fine-grained clock elsewhere.
+  static uint64_t ReadClock()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+#endif
+  }
+
+  /// Function in a calling context.
+  struct Node {
+    Node(size_t entry, Node *parent) : Entry(entry), Parent(parent) {}
+
+    /// Entry address of the function.
+    size_t Entry;
+    /// Calling context, null at the top level.
+    Node *Parent;
+    /// Number of directly recursive calls folded into the node.
+    uint64_t Depth = 0;
+    /// Number of calls.
+    uint64_t Calls = 0;
+    /// Cycles spent in the function itself.
+    uint64_t Cycles = 0;
+    /// Number of samples taken in the function itself.
+    uint64_t Samples = 0;
+    /// Callees, by entry address.
+    std::unordered_map<size_t, std::unique_ptr<Node>> Children;
+  };
+
+  /// Counters of an opcode.
+  struct OpStats {
+    /// Number of executions.
+    uint64_t Count = 0;
+    /// Cycles spent executing the opcode.
+    uint64_t Cycles = 0;
+  };
+
+  /// Helper mapping stream positions to the source.
+  class Symbolizer;
+
+private:
+  /// Number of instructions between samples.
+  const uint64_t period_;
+  /// Number of instructions left until the next sample.
+  uint64_t countdown_;
+  /// Clock reading at the start of the last instruction.
+  uint64_t last_ = 0;
+  /// Opcode of the last instruction.
+  Opcode lastOp_ = Opcode::STOP;
+  /// Context of the last instruction.
+  Node *lastNode_;
+  /// Context of the top level.
+  Node root_;
+  /// Current context.
+  Node *node_;
+  /// Counters, by opcode.
+  OpStats ops_[kNumOpcodes];
+  /// Number of samples, by program counter.
+  std::unordered_map<size_t, uint64_t> pcs_;
+};
@@ -1,5 +1,272 @@
 // This file is part of the IMP project.
 
+#include <algorithm>
+
 #include "program.h"
+#include "runtime.h"
+
+
+
+// -----------------------------------------------------------------------------
+template<typename T>
+static void Store(void *slot, const T &t)
+{
+  memcpy(slot, &t, sizeof(T));
+}
+
+// -----------------------------------------------------------------------------
+size_t GetOperandSize(Opcode op)
+{
+  switch (op) {
+    case Opcode::PUSH_FUNC: return sizeof(size_t);
+    case Opcode::PUSH_PROTO: return sizeof(RuntimeFn);
+    case Opcode::PUSH_INT: return sizeof(int64_t);
+    case Opcode::STUB: return sizeof(size_t);
+    case Opcode::PEEK: return sizeof(unsigned);
+    case Opcode::CALL: return sizeof(unsigned);
+    case Opcode::PEEK_ADD: return sizeof(unsigned);
+    case Opcode::RET: return 2 * sizeof(unsigned);
+    case Opcode::ENTER: return sizeof(unsigned);
+    case Opcode::LEAVE: return sizeof(unsigned);
+    case Opcode::LOAD_LOCAL: return sizeof(unsigned);
+    case Opcode::STORE_LOCAL: return sizeof(unsigned);
+    case Opcode::LOAD_ARG: return sizeof(unsigned);
+    case Opcode::CALL_DIRECT: return sizeof(size_t) + sizeof(unsigned);
+    case Opcode::CALL_NATIVE: return sizeof(RuntimeFn) + sizeof(unsigned);
+    case Opcode::TAIL_CALL: {
+      return sizeof(size_t) + sizeof(unsigned) + sizeof(uint16_t);
+    }
+    default: return HasAddressOperand(op) ? sizeof(size_t) : 0;
+  }
+}
+
+// -----------------------------------------------------------------------------
+const char *GetOpcodeName(Opcode op)
+{
+  switch (op) {
+    case Opcode::PUSH_FUNC: return "PUSH_FUNC";
+    case Opcode::PUSH_PROTO: return "PUSH_PROTO";
+    case Opcode::PUSH_INT: return "PUSH_INT";
+    case Opcode::PEEK: return "PEEK";
+    case Opcode::POP: return "POP";
+    case Opcode::CALL: return "CALL";
+    case Opcode::CALL_DIRECT: return "CALL_DIRECT";
+    case Opcode::CALL_NATIVE: return "CALL_NATIVE";
+    case Opcode::ADD: return "ADD";
+    case Opcode::SUB: return "SUB";
+    case Opcode::MUL: return "MUL";
+    case Opcode::DIV: return "DIV";
+    case Opcode::MOD: return "MOD";
+    case Opcode::ADD_UNCHECKED: return "ADD_UNCHECKED";
+    case Opcode::SUB_UNCHECKED: return "SUB_UNCHECKED";
+    case Opcode::MUL_UNCHECKED: return "MUL_UNCHECKED";
+    case Opcode::DIV_UNCHECKED: return "DIV_UNCHECKED";
+    case Opcode::MOD_UNCHECKED: return "MOD_UNCHECKED";
+    case Opcode::DEQ: return "DEQ";
+    case Opcode::NEQ: return "NEQ";
+    case Opcode::SM: return "SM";
+    case Opcode::SMEQ: return "SMEQ";
+    case Opcode::GR: return "GR";
+    case Opcode::GREQ: return "GREQ";
+    case Opcode::RET: return "RET";
+    case Opcode::JUMP_FALSE: return "JUMP_FALSE";
+    case Opcode::JUMP: return "JUMP";
+    case Opcode::TAIL_CALL: return "TAIL_CALL";
+    case Opcode::ENTER: return "ENTER";
+    case Opcode::LEAVE: return "LEAVE";
+    case Opcode::LOAD_LOCAL: return "LOAD_LOCAL";
+    case Opcode::STORE_LOCAL: return "STORE_LOCAL";
+    case Opcode::LOAD_ARG: return "LOAD_ARG";
+    case Opcode::PEEK_ADD: return "PEEK_ADD";
+    case Opcode::JUMP_IF_EQ: return "JUMP_IF_EQ";
+    case Opcode::JUMP_IF_NE: return "JUMP_IF_NE";
+    case Opcode::JUMP_IF_LT: return "JUMP_IF_LT";
+    case Opcode::JUMP_IF_LE: return "JUMP_IF_LE";
+    case Opcode::JUMP_IF_GT: return "JUMP_IF_GT";
+    case Opcode::JUMP_IF_GE: return "JUMP_IF_GE";
+    case Opcode::STUB: return "STUB";
+    case Opcode::STOP: return "STOP";
+  }
+  return "?";
+}
+
+// -----------------------------------------------------------------------------
+bool HasAddressOperand(Opcode op)
+{
+  switch (op) {
+    case Opcode::PUSH_FUNC:
+    case Opcode::CALL_DIRECT:
+    case Opcode::JUMP_FALSE:
+    case Opcode::JUMP:
+    case Opcode::JUMP_IF_EQ:
+    case Opcode::JUMP_IF_NE:
+    case Opcode::JUMP_IF_LT:
+    case Opcode::JUMP_IF_LE:
+    case Opcode::JUMP_IF_GT:
+    case Opcode::JUMP_IF_GE:
+    case Opcode::TAIL_CALL: {
+      return true;
+    }
+    default: {
+      return false;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Program::Decode()
+{
+  assert(format_ == Format::STACK && "only stack bytecode can be decoded");
+
+  ownedInsts_.clear();
+  addrs_.clear();
+  DecodeFrom(0);
+}
+
+// -----------------------------------------------------------------------------
+void Program::Append(const std::vector<uint8_t> &code)
+{
+  assert(!mapping_ && "cannot extend a mapped program");
+
+  size_t start = codeSize_;
+  ownedCode_.insert(ownedCode_.end(), code.begin(), code.end());
+  code_ = ownedCode_.data();
+  codeSize_ = ownedCode_.size();
+  if (IsDecoded()) {
+    DecodeFrom(start);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Program::Patch(size_t stub, size_t addr)
+{
+  assert(!mapping_ && "cannot patch a mapped program");
+
+  // Re-pointing a resolved stub invalidates code derived from the old target.
+  switch (static_cast<Opcode>(code_[stub])) {
+    case Opcode::STUB: {
+      break;
+    }
+    case Opcode::JUMP: {
+      ++revision_;
+      break;
+    }
+    default: {
+      assert(!"not a stub");
+    }
+  }
+
+  // The stub and the jump take up the same number of bytes.
+  ownedCode_[stub] = static_cast<uint8_t>(Opcode::JUMP);
+  Store(ownedCode_.data() + stub + 1, addr);
+  if (IsDecoded()) {
+    Inst inst{ Opcode::JUMP, 0, 0, 0 };
+    Store(&inst.Arg, GetIndex(addr));
+    ownedInsts_[GetIndex(stub)] = inst;
+  }
+}
+
+// -----------------------------------------------------------------------------
+std::vector<size_t> Program::GetAddresses() const
+{
+  if (!addrs_.empty()) {
+    return addrs_;
+  }
+  std::vector<size_t> addrs;
+  for (size_t pc = 0; pc < codeSize_; ) {
+    addrs.push_back(pc);
+    pc += sizeof(Opcode) + GetOperandSize(static_cast<Opcode>(code_[pc]));
+  }
+  return addrs;
+}
+
+// -----------------------------------------------------------------------------
+uint64_t Program::GetIndex(size_t addr) const
+{
+  // Labels at the end of the code, following a function ending in a branch,
+  // are valid and refer to the instruction which would follow.
+  if (addr == codeSize_) {
+    return addrs_.size();
+  }
+  auto it = std::lower_bound(addrs_.begin(), addrs_.end(), addr);
+  assert(it != addrs_.end() && *it == addr && "jump into the middle of an instruction");
+  return it - addrs_.begin();
+}
+
+// -----------------------------------------------------------------------------
+void Program::DecodeFrom(size_t start)
+{
+  // Find the address of each instruction, skipping over operands. Addresses
+  // are increasing, so they can be mapped to indices by a binary search.
+  for (size_t pc = start; pc < codeSize_; ) {
+    addrs_.push_back(pc);
+    pc += GetOperandSize(Read<Opcode>(pc));
+  }
+
+  // Re-decode the stream, mapping addresses to instruction indices.
+  if (start == 0) {
+    ownedInsts_.reserve(addrs_.size());
+  }
+  for (size_t pc = start; pc < codeSize_; ) {
+    Inst inst{ Read<Opcode>(pc), 0, 0, 0 };
+    if (HasAddressOperand(inst.Op)) {
+      Store(&inst.Arg, GetIndex(Read<size_t>(pc)));
+      if (inst.Op == Opcode::CALL_DIRECT) {
+        Store(&inst.Aux, Read<unsigned>(pc));
+      }
+      if (inst.Op == Opcode::TAIL_CALL) {
+        Store(&inst.Aux, Read<unsigned>(pc));
+        Store(&inst.Extra, Read<uint16_t>(pc));
+      }
+      ownedInsts_.push_back(inst);
+      continue;
+    }
+    switch (inst.Op) {
+      case Opcode::PUSH_PROTO: {
+        Store(&inst.Arg, Read<RuntimeFn>(pc));
+        break;
+      }
+      case Opcode::CALL_NATIVE: {
+        Store(&inst.Arg, Read<RuntimeFn>(pc));
+        Store(&inst.Aux, Read<unsigned>(pc));
+        break;
+      }
+      case Opcode::PUSH_INT: {
+        Store(&inst.Arg, Read<int64_t>(pc));
+        break;
+      }
+      case Opcode::STUB: {
+        Store(&inst.Arg, Read<uint64_t>(pc));
+        break;
+      }
+      case Opcode::PEEK:
+      case Opcode::CALL:
+      case Opcode::PEEK_ADD:
+      case Opcode::ENTER:
+      case Opcode::LEAVE:
+      case Opcode::LOAD_LOCAL:
+      case Opcode::STORE_LOCAL:
+      case Opcode::LOAD_ARG: {
+        Store(&inst.Arg, Read<unsigned>(pc));
+        break;
+      }
+      case Opcode::RET: {
+        Store(&inst.Arg, Read<unsigned>(pc));
+        Store(&inst.Aux, Read<unsigned>(pc));
+        break;
+      }
+      default: {
+        break;
+      }
+    }
+    ownedInsts_.push_back(inst);
+  }
 
+  insts_ = ownedInsts_.data();
+  numInsts_ = ownedInsts_.size();
 
+  // Addresses are only needed to decode code appended later on.
+  if (!loader_) {
+    addrs_ = std::vector<size_t>();
+  }
+}
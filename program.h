@@ -5,6 +5,9 @@
 #include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
 
@@ -19,13 +22,25 @@ enum class Opcode : uint8_t {
 
   PEEK,
   POP,
+  /// CALL nargs: call to the value on top of the stack.
   CALL,
+  /// CALL_DIRECT addr, nargs: call to a statically known function.
+  CALL_DIRECT,
+  /// CALL_NATIVE fn, nargs: call to a statically known runtime method.
+  CALL_NATIVE,
 
+  /// Checked arithmetic, raising an error on overflow or division by zero.
   ADD,
   SUB, 
   MUL, 
   DIV, 
   MOD, 
+  /// Arithmetic which the verifier proved to never fail.
+  ADD_UNCHECKED,
+  SUB_UNCHECKED,
+  MUL_UNCHECKED,
+  DIV_UNCHECKED,
+  MOD_UNCHECKED,
 
   DEQ,
   NEQ,
@@ -38,29 +53,285 @@ enum class Opcode : uint8_t {
 
   JUMP_FALSE,
   JUMP,
+
+  /// TAIL_CALL addr, depth, nargs: self-recursive call re-using the frame.
+  TAIL_CALL,
+
+  /// ENTER n: saves the frame pointer, reserving n locals above it.
+  ENTER,
+  /// LEAVE n: restores the frame pointer, keeping n values from the top.
+  LEAVE,
+  /// LOAD_LOCAL slot, STORE_LOCAL slot: locals relative to the frame pointer.
+  LOAD_LOCAL,
+  STORE_LOCAL,
+  /// LOAD_ARG index: argument of a function with a frame.
+  LOAD_ARG,
+
+  /// Superinstructions formed by the peephole optimiser.
+  PEEK_ADD,
+  JUMP_IF_EQ,
+  JUMP_IF_NE,
+  JUMP_IF_LT,
+  JUMP_IF_LE,
+  JUMP_IF_GT,
+  JUMP_IF_GE,
+
+  /// STUB func: entry of a function lowered on its first call.
+  STUB,
+
+  STOP
+};
+
+/// Returns the number of bytes of operands following an opcode.
+size_t GetOperandSize(Opcode op);
+/// Returns the mnemonic of an opcode.
+const char *GetOpcodeName(Opcode op);
+/// Checks whether the first operand of an opcode is a code address.
+bool HasAddressOperand(Opcode op);
+
+/// Number of opcodes: STOP must remain the last entry of the enumeration.
+constexpr size_t kNumOpcodes = static_cast<size_t>(Opcode::STOP) + 1;
+
+/**
+ * Enumeration of the opcodes of the register-based bytecode.
+ *
+ * Registers are 32-bit indices relative to the frame of the current function,
+ * with the arguments of the function occupying the first registers.
+ */
+enum class RegOpcode : uint8_t {
+  /// ENTER n: reserve n registers for the frame.
+  ENTER,
+  /// MOV dst, src
+  MOV,
+  /// LOAD_INT dst, imm
+  LOAD_INT,
+  /// LOAD_FUNC dst, addr
+  LOAD_FUNC,
+  /// LOAD_PROTO dst, fn
+  LOAD_PROTO,
+
+  /// <op> dst, lhs, rhs
+  ADD,
+  SUB,
+  MUL,
+  DIV,
+  MOD,
+
+  DEQ,
+  NEQ,
+  SM,
+  SMEQ,
+  GR,
+  GREQ,
+
+  /// <op>_IMM dst, lhs, imm: binary operators with a constant operand.
+  ADD_IMM,
+  SUB_IMM,
+  MUL_IMM,
+  DIV_IMM,
+  MOD_IMM,
+
+  DEQ_IMM,
+  NEQ_IMM,
+  SM_IMM,
+  SMEQ_IMM,
+  GR_IMM,
+  GREQ_IMM,
+
+  /// CALL dst, base, nargs, addr: arguments are in registers base...
+  CALL,
+  /// CALL_PROTO dst, base, nargs, fn
+  CALL_PROTO,
+  /// CALL_VALUE dst, base, nargs, callee
+  CALL_VALUE,
+  /// RET src
+  RET,
+  /// TAIL_CALL base, nargs, addr: self-recursive call re-using the frame.
+  TAIL_CALL,
+
+  /// JUMP_FALSE cond, addr
+  JUMP_FALSE,
+  /// JUMP addr
+  JUMP,
   STOP
 };
 
+/// Number of register opcodes: STOP must remain the last entry.
+constexpr size_t kNumRegOpcodes = static_cast<size_t>(RegOpcode::STOP) + 1;
+
+
+/**
+ * Fixed-width instruction, decoded from the bytecode at load time.
+ *
+ * Operands are stored in aligned slots, with jump targets and function
+ * addresses pre-resolved to indices into the decoded stream.
+ */
+struct Inst {
+  /// Opcode of the instruction.
+  Opcode Op;
+  /// Third operand, if any.
+  uint16_t Extra;
+  /// Second operand, if any.
+  uint32_t Aux;
+  /// First operand, if any.
+  uint64_t Arg;
+
+  /// Returns an operand, given its position in the instruction.
+  template<typename T, unsigned N>
+  T Operand() const
+  {
+    static_assert(N < 3, "invalid operand");
+    const void *slot = N == 0 ? (const void *)&Arg
+                     : N == 1 ? (const void *)&Aux
+                     : (const void *)&Extra;
+    static_assert(sizeof(T) <= (N == 0 ? 8 : N == 1 ? 4 : 2), "invalid slot");
+    T t;
+    memcpy(&t, slot, sizeof(T));
+    return t;
+  }
+};
 
 /**
  * Holds the bytecode for a program.
+ *
+ * The code is either owned by the program or, for programs loaded from a
+ * cache, mapped from the file holding its serialised form.
  */
 class Program {
 public:
+  /// Instruction set the bytecode is encoded in.
+  enum class Format {
+    STACK,
+    REGISTER,
+  };
+
+  /// Version of the serialised format, to be bumped on any change to it.
+  static constexpr uint32_t kCacheVersion = 4;
+
+  /// Callback lowering a function whose stub was reached.
+  using Loader = std::function<void(Program &, uint64_t)>;
+
+public:
+  Program(std::vector<uint8_t> &&code, Format format = Format::STACK)
+    : ownedCode_(std::move(code))
+    , code_(ownedCode_.data())
+    , codeSize_(ownedCode_.size())
+    , format_(format)
+  {
+  }
+
+  Program(const Program &) = delete;
+  Program &operator=(const Program &) = delete;
+
+  /// Returns the instruction set of the program.
+  Format GetFormat() const { return format_; }
+
+  /// Translates stack bytecode into the decoded instruction stream.
+  void Decode();
 
-  Program(std::vector<uint8_t> &&code) : code_(std::move(code)) {}
+  /**
+   * Installs the callback lowering functions on demand.
+   *
+   * Programs with a loader start out with STUB instructions in place of the
+   * bodies of functions, which are appended to the code once called.
+   */
+  void SetLoader(Loader &&loader) { loader_ = std::move(loader); }
+
+  /// Lowers the function behind a stub, turning the stub into a jump.
+  void Resolve(uint64_t func)
+  {
+    assert(loader_ && "stub without a loader");
+    loader_(*this, func);
+  }
+
+  /// Returns the size of the bytecode, which is the address of appended code.
+  size_t GetCodeSize() const { return codeSize_; }
+
+  /// Appends code to the program, decoding it if the program was decoded.
+  void Append(const std::vector<uint8_t> &code);
+
+  /// Replaces the stub at an address with a jump to another address.
+  void Patch(size_t stub, size_t addr);
+
+  /// Returns the number of times a resolved stub was re-pointed.
+  uint64_t GetRevision() const { return revision_; }
+
+  /// Checks whether the decoded stream is available.
+  bool IsDecoded() const { return numInsts_ != 0; }
+
+  /// Returns the start of the decoded stream.
+  const Inst *GetInsts() const { return insts_; }
+  /// Returns the number of decoded instructions.
+  size_t GetNumInsts() const { return numInsts_; }
+  /// Returns the address of each decoded instruction, by index.
+  std::vector<size_t> GetAddresses() const;
 
   /// Read a value from a specific location.
   template<typename T>
-  T Read(size_t &pc)
+  T Read(size_t &pc) const
   {
     T t;
-    assert(pc + sizeof(T) <= code_.size());
-    memcpy(&t, code_.data() + pc, sizeof(T));
+    assert(pc + sizeof(T) <= codeSize_);
+    memcpy(&t, code_ + pc, sizeof(T));
     pc += sizeof(T);
     return t;
   }
 
+  /**
+   * Writes the stack bytecode and its decoded form to a cache file.
+   *
+   * Pointers to runtime methods are replaced by their names. Returns false
+   * if the file could not be written.
+   */
+  bool Save(const std::string &path, uint64_t sourceHash) const;
+
+  /**
+   * Maps a program from a cache file, relocating runtime methods.
+   *
+   * Returns null if the file is missing, malformed, written by another
+   * version of the interpreter or built from a different source.
+   */
+  static std::unique_ptr<Program> Load(const std::string &path, uint64_t sourceHash);
+
+  /// Hashes the contents of a source file, identifying its cached program.
+  static uint64_t HashSource(const std::string &path);
+
+private:
+  /// Decodes the instructions starting at an address.
+  void DecodeFrom(size_t start);
+  /// Returns the index of the decoded instruction at an address.
+  uint64_t GetIndex(size_t addr) const;
+
+private:
+  /// Mapping of a cache file, released with the program.
+  struct Mapping {
+    Mapping(void *base, size_t size) : Base(base), Size(size) {}
+    ~Mapping();
+    void *Base;
+    size_t Size;
+  };
+
 private:
-  std::vector<uint8_t> code_;
+  /// Bytecode, unless mapped from a cache.
+  std::vector<uint8_t> ownedCode_;
+  /// Start of the bytecode.
+  const uint8_t *code_;
+  /// Size of the bytecode, in bytes.
+  size_t codeSize_;
+  /// Instruction set of the bytecode.
+  Format format_;
+  /// Decoded instructions, unless mapped from a cache.
+  std::vector<Inst> ownedInsts_;
+  /// Start of the decoded stream, if the program was decoded.
+  const Inst *insts_ = nullptr;
+  /// Number of decoded instructions.
+  size_t numInsts_ = 0;
+  /// Addresses of the decoded instructions, kept if code can be appended.
+  std::vector<size_t> addrs_;
+  /// Callback lowering functions on demand, if any.
+  Loader loader_;
+  /// Number of times a resolved stub was re-pointed.
+  uint64_t revision_ = 0;
+  /// Cache file the program was loaded from, if any.
+  std::unique_ptr<Mapping> mapping_;
 };
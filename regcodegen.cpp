@@ -0,0 +1,527 @@
+// This file is part of the IMP project.
+
+#include <cassert>
+#include <cstring>
+
+#include "regcodegen.h"
+#include "ast.h"
+
+
+
+// -----------------------------------------------------------------------------
+std::unique_ptr<Program> RegCodegen::Translate(const Module &mod)
+{
+  assert(code_.empty() && "expected empty code section");
+
+  // Record all functions and prototypes in the global symbol table.
+  for (auto item : mod) {
+    if (std::holds_alternative<ProtoDecl *>(item)) {
+      auto &proto = *std::get<1>(item);
+      auto it = kRuntimeFns.find(proto.GetPrimitiveName());
+      assert(it != kRuntimeFns.end() && "missing prototype");
+      protos_.emplace(proto.GetSymbol(), it->second);
+    }
+    if (std::holds_alternative<FuncDecl *>(item)) {
+      auto &func = *std::get<0>(item);
+      funcs_.emplace(func.GetSymbol(), MakeLabel());
+    }
+  }
+
+  // Top-level statements are lowered into the frame of the program entry,
+  // forming a block which holds the top-level locals.
+  {
+    auto enter = EmitEnter();
+    locals_.emplace_back();
+    for (auto item : mod) {
+      if (!std::holds_alternative<Stmt *>(item)) {
+        continue;
+      }
+      LowerStmt(*std::get<2>(item));
+    }
+    Emit(RegOpcode::STOP);
+    PatchEnter(enter);
+    locals_.clear();
+  }
+
+  // Emit code for all functions.
+  for (auto item : mod) {
+    if (!std::holds_alternative<FuncDecl *>(item)) {
+      continue;
+    }
+    LowerFuncDecl(*std::get<0>(item));
+  }
+
+  return std::make_unique<Program>(std::move(code_), Program::Format::REGISTER);
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerStmt(const Stmt &stmt)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      return LowerBlockStmt(static_cast<const BlockStmt &>(stmt));
+    }
+    case Stmt::Kind::WHILE: {
+      return LowerWhileStmt(static_cast<const WhileStmt &>(stmt));
+    }
+    case Stmt::Kind::EXPR: {
+      return LowerExprStmt(static_cast<const ExprStmt &>(stmt));
+    }
+    case Stmt::Kind::RETURN: {
+      return LowerReturnStmt(static_cast<const ReturnStmt &>(stmt));
+    }
+    case Stmt::Kind::IF: {
+      return LowerIfStmt(static_cast<const IfStmt &>(stmt));
+    }
+    case Stmt::Kind::LET: {
+      return LowerLetStmt(static_cast<const LetStmt &>(stmt));
+    }
+    case Stmt::Kind::ASSIGN: {
+      return LowerAssignStmt(static_cast<const AssignStmt &>(stmt));
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerBlockStmt(const BlockStmt &blockStmt)
+{
+  // Registers of the locals of the block are freed at its end.
+  auto mark = next_;
+  locals_.emplace_back();
+  for (auto &stmt : blockStmt) {
+    LowerStmt(*stmt);
+  }
+  locals_.pop_back();
+  Release(mark);
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerWhileStmt(const WhileStmt &whileStmt)
+{
+  auto entry = MakeLabel();
+  auto exit = MakeLabel();
+
+  EmitLabel(entry);
+  {
+    auto mark = next_;
+    auto cond = LowerExpr(whileStmt.GetCond());
+    Release(mark);
+    Emit(RegOpcode::JUMP_FALSE);
+    Emit<uint32_t>(cond);
+    EmitFixup(exit);
+  }
+  LowerStmt(whileStmt.GetStmt());
+  Emit(RegOpcode::JUMP);
+  EmitFixup(entry);
+  EmitLabel(exit);
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerIfStmt(const IfStmt &ifStmt)
+{
+  auto exit = MakeLabel();
+  auto else_ = MakeLabel();
+
+  {
+    auto mark = next_;
+    auto cond = LowerExpr(ifStmt.GetCond());
+    Release(mark);
+    Emit(RegOpcode::JUMP_FALSE);
+    Emit<uint32_t>(cond);
+    EmitFixup(else_);
+  }
+  LowerStmt(ifStmt.GetStmt());
+  Emit(RegOpcode::JUMP);
+  EmitFixup(exit);
+  EmitLabel(else_);
+
+  if (auto elseStmt = ifStmt.GetElseStmt()) {
+    LowerStmt(*elseStmt);
+  }
+
+  EmitLabel(exit);
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerReturnStmt(const ReturnStmt &retStmt)
+{
+  auto mark = next_;
+
+  // Self-recursive calls in tail position re-use the frame of the function.
+  auto &expr = retStmt.GetExpr();
+  if (func_ && expr.GetKind() == Expr::Kind::CALL) {
+    auto &call = static_cast<const CallExpr &>(expr);
+    auto &callee = call.GetCallee();
+    if (callee.GetKind() == Expr::Kind::REF) {
+      // The verifier resolved the callee and checked its arity.
+      auto &ref = static_cast<const RefExpr &>(callee);
+      if (ref.GetTarget() == RefExpr::Target::FUNC &&
+          ref.GetSymbol() == func_->GetSymbol()) {
+        // Evaluate all arguments before overwriting any of the current ones.
+        auto base = next_;
+        auto nargs = static_cast<uint32_t>(call.arg_size());
+        for (uint32_t i = 0; i < nargs; ++i) {
+          Alloc();
+        }
+        uint32_t i = nargs;
+        for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+          LowerExprTo(**it, base + --i);
+        }
+        Release(mark);
+        Emit(RegOpcode::TAIL_CALL);
+        Emit<uint32_t>(base);
+        Emit<uint32_t>(nargs);
+        EmitFixup(body_);
+        return;
+      }
+    }
+  }
+
+  auto reg = LowerExpr(expr);
+  Release(mark);
+  Emit(RegOpcode::RET);
+  Emit<uint32_t>(reg);
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerLetStmt(const LetStmt &letStmt)
+{
+  // The initialiser may refer to a shadowed name, so it is lowered first.
+  auto reg = Alloc();
+  LowerExprTo(letStmt.GetInit(), reg);
+  locals_.back()[letStmt.GetSymbol()] = reg;
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerAssignStmt(const AssignStmt &assignStmt)
+{
+  auto binding = Lookup(assignStmt.GetTarget().GetSymbol());
+  assert(binding.Kind == Binding::Kind::LOCAL && "invalid assignment");
+  LowerExprTo(assignStmt.GetValue(), binding.Reg);
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerExprStmt(const ExprStmt &exprStmt)
+{
+  auto mark = next_;
+  LowerExpr(exprStmt.GetExpr());
+  Release(mark);
+}
+
+// -----------------------------------------------------------------------------
+uint32_t RegCodegen::LowerExpr(const Expr &expr)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      return LowerRefExpr(static_cast<const RefExpr &>(expr));
+    }
+    case Expr::Kind::BINARY: {
+      return LowerBinaryExpr(static_cast<const BinaryExpr &>(expr));
+    }
+    case Expr::Kind::CALL: {
+      return LowerCallExpr(static_cast<const CallExpr &>(expr));
+    }
+    case Expr::Kind::INT: {
+      return LowerIntExpr(static_cast<const IntExpr &>(expr));
+    }
+  }
+  assert(!"invalid expression kind");
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerExprTo(const Expr &expr, uint32_t dst)
+{
+  auto mark = next_;
+  auto reg = LowerExpr(expr);
+  Release(mark);
+  if (reg != dst) {
+    Emit(RegOpcode::MOV);
+    Emit<uint32_t>(dst);
+    Emit<uint32_t>(reg);
+  }
+}
+
+// -----------------------------------------------------------------------------
+uint32_t RegCodegen::LowerRefExpr(const RefExpr &expr)
+{
+  auto binding = Lookup(expr.GetSymbol());
+  switch (binding.Kind) {
+    case Binding::Kind::ARG:
+    case Binding::Kind::LOCAL: {
+      return binding.Reg;
+    }
+    case Binding::Kind::FUNC: {
+      auto dst = Alloc();
+      Emit(RegOpcode::LOAD_FUNC);
+      Emit<uint32_t>(dst);
+      EmitFixup(binding.Entry);
+      return dst;
+    }
+    case Binding::Kind::PROTO: {
+      auto dst = Alloc();
+      Emit(RegOpcode::LOAD_PROTO);
+      Emit<uint32_t>(dst);
+      Emit<RuntimeFn>(binding.Fn);
+      return dst;
+    }
+  }
+  assert(!"invalid binding kind");
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+uint32_t RegCodegen::LowerBinaryExpr(const BinaryExpr &binary)
+{
+  // Constant right-hand operands are encoded as immediates.
+  const Expr &rhsExpr = binary.GetRHS();
+  bool imm = rhsExpr.GetKind() == Expr::Kind::INT;
+
+  auto mark = next_;
+  auto lhs = LowerExpr(binary.GetLHS());
+  auto rhs = imm ? 0 : LowerExpr(rhsExpr);
+  Release(mark);
+
+  auto op = [imm] (RegOpcode reg, RegOpcode withImm) {
+    return imm ? withImm : reg;
+  };
+  switch (binary.GetKind()) {
+    case BinaryExpr::Kind::ADD: {
+      Emit(op(RegOpcode::ADD, RegOpcode::ADD_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::SUB: {
+      Emit(op(RegOpcode::SUB, RegOpcode::SUB_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::MUL: {
+      Emit(op(RegOpcode::MUL, RegOpcode::MUL_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::DIV: {
+      Emit(op(RegOpcode::DIV, RegOpcode::DIV_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::MOD: {
+      Emit(op(RegOpcode::MOD, RegOpcode::MOD_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::DEQ: {
+      Emit(op(RegOpcode::DEQ, RegOpcode::DEQ_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::NEQ: {
+      Emit(op(RegOpcode::NEQ, RegOpcode::NEQ_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::SM: {
+      Emit(op(RegOpcode::SM, RegOpcode::SM_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::SMEQ: {
+      Emit(op(RegOpcode::SMEQ, RegOpcode::SMEQ_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::GR: {
+      Emit(op(RegOpcode::GR, RegOpcode::GR_IMM));
+      break;
+    }
+    case BinaryExpr::Kind::GREQ: {
+      Emit(op(RegOpcode::GREQ, RegOpcode::GREQ_IMM));
+      break;
+    }
+  }
+
+  // The result can overwrite the temporaries of the operands.
+  auto dst = Alloc();
+  Emit<uint32_t>(dst);
+  Emit<uint32_t>(lhs);
+  if (imm) {
+    Emit<int64_t>(static_cast<const IntExpr &>(rhsExpr).GetInt());
+  } else {
+    Emit<uint32_t>(rhs);
+  }
+  return dst;
+}
+
+// -----------------------------------------------------------------------------
+uint32_t RegCodegen::LowerCallExpr(const CallExpr &call)
+{
+  // Arguments are evaluated right-to-left into consecutive registers, where
+  // they become the first registers of the frame of the callee.
+  auto base = next_;
+  auto nargs = static_cast<uint32_t>(call.arg_size());
+  for (uint32_t i = 0; i < nargs; ++i) {
+    Alloc();
+  }
+  uint32_t i = nargs;
+  for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+    LowerExprTo(**it, base + --i);
+  }
+
+  // Statically known callees are invoked directly.
+  const Expr &callee = call.GetCallee();
+  if (callee.GetKind() == Expr::Kind::REF) {
+    auto binding = Lookup(static_cast<const RefExpr &>(callee).GetSymbol());
+    switch (binding.Kind) {
+      case Binding::Kind::FUNC: {
+        Emit(RegOpcode::CALL);
+        Emit<uint32_t>(base);
+        Emit<uint32_t>(base);
+        Emit<uint32_t>(nargs);
+        EmitFixup(binding.Entry);
+        Release(base);
+        return Alloc();
+      }
+      case Binding::Kind::PROTO: {
+        Emit(RegOpcode::CALL_PROTO);
+        Emit<uint32_t>(base);
+        Emit<uint32_t>(base);
+        Emit<uint32_t>(nargs);
+        Emit<RuntimeFn>(binding.Fn);
+        Release(base);
+        return Alloc();
+      }
+      case Binding::Kind::ARG:
+      case Binding::Kind::LOCAL: {
+        break;
+      }
+    }
+  }
+
+  auto reg = LowerExpr(callee);
+  Emit(RegOpcode::CALL_VALUE);
+  Emit<uint32_t>(base);
+  Emit<uint32_t>(base);
+  Emit<uint32_t>(nargs);
+  Emit<uint32_t>(reg);
+  Release(base);
+  return Alloc();
+}
+
+// -----------------------------------------------------------------------------
+uint32_t RegCodegen::LowerIntExpr(const IntExpr &expr)
+{
+  auto dst = Alloc();
+  Emit(RegOpcode::LOAD_INT);
+  Emit<uint32_t>(dst);
+  Emit<int64_t>(expr.GetInt());
+  return dst;
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::LowerFuncDecl(const FuncDecl &decl)
+{
+  auto it = funcs_.find(decl.GetSymbol());
+  assert(it != funcs_.end() && "missing function label");
+  EmitLabel(it->second);
+
+  // Arguments occupy the first registers of the frame.
+  args_.clear();
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    args_[it->first] = args_.size();
+  }
+  next_ = frameSize_ = args_.size();
+
+  // Tail calls jump past the frame setup, which is already in place.
+  func_ = &decl;
+  auto enter = EmitEnter();
+  body_ = MakeLabel();
+  EmitLabel(body_);
+  LowerBlockStmt(decl.GetBody());
+  PatchEnter(enter);
+  func_ = nullptr;
+
+  args_.clear();
+}
+
+// -----------------------------------------------------------------------------
+RegCodegen::Binding RegCodegen::Lookup(Symbol name) const
+{
+  Binding b;
+  for (auto it = locals_.rbegin(), end = locals_.rend(); it != end; ++it) {
+    if (auto local = it->find(name); local != it->end()) {
+      b.Kind = Binding::Kind::LOCAL;
+      b.Reg = local->second;
+      return b;
+    }
+  }
+  if (auto it = args_.find(name); it != args_.end()) {
+    b.Kind = Binding::Kind::ARG;
+    b.Reg = it->second;
+    return b;
+  }
+  if (auto it = funcs_.find(name); it != funcs_.end()) {
+    b.Kind = Binding::Kind::FUNC;
+    b.Entry = it->second;
+    return b;
+  }
+  if (auto it = protos_.find(name); it != protos_.end()) {
+    b.Kind = Binding::Kind::PROTO;
+    b.Fn = it->second;
+    return b;
+  }
+  // The verifier should assert all names are bound.
+  assert(!"name not bound");
+  return b;
+}
+
+// -----------------------------------------------------------------------------
+uint32_t RegCodegen::Alloc()
+{
+  auto reg = next_++;
+  frameSize_ = std::max(frameSize_, next_);
+  return reg;
+}
+
+// -----------------------------------------------------------------------------
+RegCodegen::Label RegCodegen::MakeLabel()
+{
+  return Label(++nextLabel_);
+}
+
+// -----------------------------------------------------------------------------
+template<typename T>
+void RegCodegen::Emit(const T &t)
+{
+  size_t offset = code_.size();
+  code_.resize(offset + sizeof(T));
+  memcpy(code_.data() + offset, &t, sizeof(T));
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::EmitLabel(Label label)
+{
+  size_t address = code_.size();
+  for (auto loc : fixups_[label]) {
+    memcpy(code_.data() + loc, &address, sizeof(size_t));
+  }
+  fixups_.erase(label);
+  labelToAddress_.emplace(label, address);
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::EmitFixup(Label label)
+{
+  if (auto it = labelToAddress_.find(label); it != labelToAddress_.end()) {
+    Emit<size_t>(it->second);
+  } else {
+    fixups_[label].push_back(code_.size());
+    Emit<size_t>(0);
+  }
+}
+
+// -----------------------------------------------------------------------------
+size_t RegCodegen::EmitEnter()
+{
+  Emit(RegOpcode::ENTER);
+  size_t offset = code_.size();
+  Emit<uint32_t>(0);
+  return offset;
+}
+
+// -----------------------------------------------------------------------------
+void RegCodegen::PatchEnter(size_t offset)
+{
+  memcpy(code_.data() + offset, &frameSize_, sizeof(uint32_t));
+}
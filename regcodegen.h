@@ -0,0 +1,146 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+
+#include "program.h"
+#include "ast.h"
+#include "runtime.h"
+
+
+
+/**
+ * Translator from the AST to register-based bytecode.
+ *
+ * Each function is given a frame of registers: arguments are bound to the
+ * first registers, while temporaries are allocated above them in a stack-like
+ * fashion. References to arguments do not emit any code, as the instructions
+ * of the enclosing expression name the registers of the arguments directly.
+ * Locals are given a register for the rest of their block, below the
+ * temporaries of the statements following their declaration.
+ */
+class RegCodegen {
+public:
+  /// Entry point to the code generator: translates an entire module.
+  std::unique_ptr<Program> Translate(const Module &mod);
+
+private:
+  /// Descriptor for a label.
+  struct Label {
+    explicit Label(unsigned id) : ID(id) {}
+    bool operator==(const Label &that) const { return ID == that.ID; }
+    unsigned ID;
+  };
+
+  /// Helper hash function for the label.
+  struct LabelHash {
+    size_t operator() (const Label &l) const { return l.ID; }
+  };
+
+  /// Specifies the location and kind of the object a name is bound to.
+  struct Binding {
+    enum class Kind {
+      FUNC,
+      PROTO,
+      ARG,
+      LOCAL,
+    } Kind;
+
+    union {
+      uint32_t Reg;
+      RuntimeFn Fn;
+      Label Entry;
+    };
+
+    Binding() {}
+  };
+
+private:
+  /// Lowers a single statement.
+  void LowerStmt(const Stmt &stmt);
+  /// Lowers a block statement.
+  void LowerBlockStmt(const BlockStmt &blockStmt);
+  /// Lowers a while statement.
+  void LowerWhileStmt(const WhileStmt &whileStmt);
+  /// Lowers a return statement.
+  void LowerReturnStmt(const ReturnStmt &returnStmt);
+  /// Lowers a standalone expression statement.
+  void LowerExprStmt(const ExprStmt &exprStmt);
+  /// Lowers an if statement.
+  void LowerIfStmt(const IfStmt &ifStmt);
+  /// Lowers the declaration of a local.
+  void LowerLetStmt(const LetStmt &letStmt);
+  /// Lowers an assignment to a local.
+  void LowerAssignStmt(const AssignStmt &assignStmt);
+
+  /// Lowers an expression, returning the register holding its value.
+  uint32_t LowerExpr(const Expr &expr);
+  /// Lowers an expression into a specific register.
+  void LowerExprTo(const Expr &expr, uint32_t dst);
+  /// Lowers a reference to an identifier.
+  uint32_t LowerRefExpr(const RefExpr &expr);
+  /// Lowers a binary expression.
+  uint32_t LowerBinaryExpr(const BinaryExpr &expr);
+  /// Lowers a call expression.
+  uint32_t LowerCallExpr(const CallExpr &expr);
+  /// Lowers an integer literal.
+  uint32_t LowerIntExpr(const IntExpr &expr);
+
+  /// Lowers a function declaration.
+  void LowerFuncDecl(const FuncDecl &funcDecl);
+
+private:
+  /// Looks up a name among locals and arguments, then among globals.
+  Binding Lookup(Symbol name) const;
+
+  /// Allocates a temporary register.
+  uint32_t Alloc();
+  /// Releases all temporaries allocated after a mark.
+  void Release(uint32_t mark) { next_ = mark; }
+
+  /// Create a new label.
+  Label MakeLabel();
+  /// Emit a label.
+  void EmitLabel(Label label);
+  /// Emit the frame setup instruction, returning the offset of its operand.
+  size_t EmitEnter();
+  /// Fills in the size of the frame once its body was lowered.
+  void PatchEnter(size_t offset);
+
+  /// Emit an opcode.
+  void Emit(RegOpcode op) { Emit<RegOpcode>(op); }
+  /// Emit some bytes of code.
+  template<typename T>
+  void Emit(const T &t);
+  /// Emit an address or create a fixup for later.
+  void EmitFixup(Label label);
+
+private:
+  /// Bytecode of the program.
+  std::vector<uint8_t> code_;
+  /// Current function being compiled.
+  const FuncDecl *func_ = nullptr;
+  /// Label following the frame setup of the current function.
+  Label body_ = Label(0);
+  /// Mapping from the arguments of the current function to registers.
+  std::unordered_map<Symbol, uint32_t> args_;
+  /// Registers of the locals declared in each enclosing block.
+  std::vector<std::unordered_map<Symbol, uint32_t>> locals_;
+  /// Next free register.
+  uint32_t next_ = 0;
+  /// Highest number of registers used by the current frame.
+  uint32_t frameSize_ = 0;
+  /// Identifier of the next label.
+  unsigned nextLabel_ = 0;
+
+  /// Forward references to be patched once a label is emitted.
+  std::unordered_map<Label, std::vector<size_t>, LabelHash> fixups_;
+  /// Mapping from labels to their addresses.
+  std::unordered_map<Label, size_t, LabelHash> labelToAddress_;
+  /// Mapping from functions to their entry labels.
+  std::unordered_map<Symbol, Label> funcs_;
+  /// Mapping from prototypes to their implementation.
+  std::unordered_map<Symbol, RuntimeFn> protos_;
+};
@@ -0,0 +1,270 @@
+// This file is part of the IMP project.
+
+#include "arith.h"
+#include "interp.h"
+#include "metrics.h"
+#include "program.h"
+
+
+
+// -----------------------------------------------------------------------------
+Interp::Value Interp::CallProto(RuntimeFn fn, uint32_t base, uint32_t nargs)
+{
+  // Runtime functions expect their arguments on top of the stack, with the
+  // first argument on top, as laid out by the stack machine.
+  Value *top = sp_;
+  for (uint32_t i = nargs; i-- > 0; ) {
+    Push(Reg(base + i));
+  }
+  CallRuntime(fn, nargs);
+  auto v = Pop();
+  sp_ = top;
+  return v;
+}
+
+// -----------------------------------------------------------------------------
+#if IMP_HAS_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Wgnu-label-as-value"
+#endif
+
+#define OPCODE(name) case RegOpcode::name: op_##name:
+
+#define NEXT()                                                          \
+  if constexpr (D == Dispatch::THREADED) {                              \
+    if constexpr (Counted) { ++count_; METER(Step()); }                 \
+    goto *kTargets[static_cast<uint8_t>(prog_.Read<RegOpcode>(pc_))];   \
+  } else {                                                              \
+    continue;                                                           \
+  }
+#else
+#define OPCODE(name) case RegOpcode::name:
+#define NEXT() continue
+#endif
+
+/// Feeds the metrics in counted runs, if they are compiled in.
+#if IMP_HAS_METRICS
+#define METER(event)                                                    \
+  if constexpr (Counted) {                                              \
+    if (metrics_) { metrics_->event; }                                  \
+  }
+#else
+#define METER(event)
+#endif
+
+/// Reads a register operand.
+#define REG() Reg(prog_.Read<uint32_t>(pc_))
+
+/// Handlers for a binary operator: <op> dst, lhs, rhs and <op>_IMM.
+#define BINARY(name, expr)                                              \
+  OPCODE(name) {                                                        \
+    auto &dst = REG();                                                  \
+    auto lhs = REG().GetInt();                                           \
+    auto rhs = REG().GetInt();                                           \
+    dst = Value(static_cast<int64_t>(expr));                            \
+    NEXT();                                                             \
+  }                                                                     \
+  OPCODE(name##_IMM) {                                                  \
+    auto &dst = REG();                                                  \
+    auto lhs = REG().GetInt();                                           \
+    auto rhs = prog_.Read<int64_t>(pc_);                                \
+    dst = Value(static_cast<int64_t>(expr));                            \
+    NEXT();                                                             \
+  }
+
+template <Interp::Dispatch D, bool Counted>
+void Interp::RegLoop()
+{
+#if IMP_HAS_THREADED_DISPATCH
+  [[maybe_unused]] static const void *kTargets[] = {
+    &&op_ENTER,
+    &&op_MOV,
+    &&op_LOAD_INT,
+    &&op_LOAD_FUNC,
+    &&op_LOAD_PROTO,
+    &&op_ADD,
+    &&op_SUB,
+    &&op_MUL,
+    &&op_DIV,
+    &&op_MOD,
+    &&op_DEQ,
+    &&op_NEQ,
+    &&op_SM,
+    &&op_SMEQ,
+    &&op_GR,
+    &&op_GREQ,
+    &&op_ADD_IMM,
+    &&op_SUB_IMM,
+    &&op_MUL_IMM,
+    &&op_DIV_IMM,
+    &&op_MOD_IMM,
+    &&op_DEQ_IMM,
+    &&op_NEQ_IMM,
+    &&op_SM_IMM,
+    &&op_SMEQ_IMM,
+    &&op_GR_IMM,
+    &&op_GREQ_IMM,
+    &&op_CALL,
+    &&op_CALL_PROTO,
+    &&op_CALL_VALUE,
+    &&op_RET,
+    &&op_TAIL_CALL,
+    &&op_JUMP_FALSE,
+    &&op_JUMP,
+    &&op_STOP,
+  };
+  static_assert(
+      sizeof(kTargets) / sizeof(kTargets[0]) == kNumRegOpcodes,
+      "missing handler in dispatch table"
+  );
+#endif
+
+  for (;;) {
+    if constexpr (Counted) { ++count_; METER(Step()); }
+    switch (prog_.Read<RegOpcode>(pc_)) {
+      OPCODE(ENTER) {
+        auto size = prog_.Read<uint32_t>(pc_);
+        Value *top = stack_.get() + fp_ + size;
+        if (top > limit_) {
+          throw RuntimeError("stack overflow");
+        }
+        if (sp_ < top) {
+          sp_ = top;
+        }
+        NEXT();
+      }
+      OPCODE(MOV) {
+        auto &dst = REG();
+        dst = REG();
+        NEXT();
+      }
+      OPCODE(LOAD_INT) {
+        auto &dst = REG();
+        dst = Value(prog_.Read<int64_t>(pc_));
+        NEXT();
+      }
+      OPCODE(LOAD_FUNC) {
+        auto &dst = REG();
+        dst = Value(prog_.Read<size_t>(pc_));
+        NEXT();
+      }
+      OPCODE(LOAD_PROTO) {
+        auto &dst = REG();
+        dst = Value(prog_.Read<RuntimeFn>(pc_));
+        NEXT();
+      }
+      BINARY(ADD, CheckedAdd(lhs, rhs))
+      BINARY(SUB, CheckedSub(lhs, rhs))
+      BINARY(MUL, CheckedMul(lhs, rhs))
+      BINARY(DIV, CheckedDiv(lhs, rhs))
+      BINARY(MOD, CheckedMod(lhs, rhs))
+      BINARY(DEQ, lhs == rhs)
+      BINARY(NEQ, lhs != rhs)
+      BINARY(SM, lhs < rhs)
+      BINARY(SMEQ, lhs <= rhs)
+      BINARY(GR, lhs > rhs)
+      BINARY(GREQ, lhs >= rhs)
+      OPCODE(CALL) {
+        auto dst = prog_.Read<uint32_t>(pc_);
+        auto base = prog_.Read<uint32_t>(pc_);
+        prog_.Read<uint32_t>(pc_);
+        auto addr = prog_.Read<size_t>(pc_);
+        frames_.push_back({ pc_, fp_, dst });
+        fp_ += base;
+        pc_ = addr;
+        METER(Enter(fp_));
+        NEXT();
+      }
+      OPCODE(CALL_PROTO) {
+        auto dst = prog_.Read<uint32_t>(pc_);
+        auto base = prog_.Read<uint32_t>(pc_);
+        auto nargs = prog_.Read<uint32_t>(pc_);
+        auto fn = prog_.Read<RuntimeFn>(pc_);
+        auto v = CallProto(fn, base, nargs);
+        Reg(dst) = v;
+        NEXT();
+      }
+      OPCODE(CALL_VALUE) {
+        auto dst = prog_.Read<uint32_t>(pc_);
+        auto base = prog_.Read<uint32_t>(pc_);
+        auto nargs = prog_.Read<uint32_t>(pc_);
+        auto callee = REG();
+        switch (callee.GetKind()) {
+          case Value::Kind::PROTO: {
+            auto v = CallProto(callee.GetProto(), base, nargs);
+            Reg(dst) = v;
+            NEXT();
+          }
+          case Value::Kind::ADDR: {
+            frames_.push_back({ pc_, fp_, dst });
+            fp_ += base;
+            pc_ = callee.GetAddr();
+            METER(Enter(fp_));
+            NEXT();
+          }
+          case Value::Kind::INT: {
+            throw RuntimeError("cannot call integer");
+          }
+          case Value::Kind::ARRAY: {
+            throw RuntimeError("cannot call array");
+          }
+        }
+        NEXT();
+      }
+      OPCODE(RET) {
+        auto v = REG();
+        if (frames_.empty()) {
+          return;
+        }
+        auto frame = frames_.back();
+        frames_.pop_back();
+        fp_ = frame.FP;
+        pc_ = frame.PC;
+        Reg(frame.Dst) = v;
+        METER(Return(fp_));
+        NEXT();
+      }
+      OPCODE(TAIL_CALL) {
+        auto base = prog_.Read<uint32_t>(pc_);
+        auto nargs = prog_.Read<uint32_t>(pc_);
+        auto addr = prog_.Read<size_t>(pc_);
+        for (uint32_t i = 0; i < nargs; ++i) {
+          Reg(i) = Reg(base + i);
+        }
+        pc_ = addr;
+        NEXT();
+      }
+      OPCODE(JUMP_FALSE) {
+        auto cond = REG();
+        auto addr = prog_.Read<size_t>(pc_);
+        if (!cond) {
+          pc_ = addr;
+        }
+        NEXT();
+      }
+      OPCODE(JUMP) {
+        pc_ = prog_.Read<size_t>(pc_);
+        NEXT();
+      }
+      OPCODE(STOP) {
+        return;
+      }
+    }
+  }
+}
+
+#undef OPCODE
+#undef NEXT
+#undef REG
+#undef BINARY
+#undef METER
+#if IMP_HAS_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+template void Interp::RegLoop<Interp::Dispatch::SWITCH, false>();
+template void Interp::RegLoop<Interp::Dispatch::SWITCH, true>();
+template void Interp::RegLoop<Interp::Dispatch::THREADED, false>();
+template void Interp::RegLoop<Interp::Dispatch::THREADED, true>();
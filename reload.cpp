@@ -0,0 +1,308 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_set>
+
+#include "codegen.h"
+
+
+
+/**
+ * Hash of the contents of a function, accumulated over a traversal of its
+ * declaration.
+ */
+class FuncHash {
+public:
+  /// Returns the hash of a function declaration.
+  uint64_t operator() (const FuncDecl &decl)
+  {
+    Add(decl.GetName());
+    Add(decl.GetType());
+    Add(decl.arg_size());
+    for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+      Add(it->first.GetName());
+      Add(it->second.GetName());
+    }
+    AddStmt(decl.GetBody());
+    return hash_;
+  }
+
+private:
+  /// Mixes a statement into the hash.
+  void AddStmt(const Stmt &stmt)
+  {
+    Add(static_cast<unsigned>(stmt.GetKind()));
+    switch (stmt.GetKind()) {
+      case Stmt::Kind::BLOCK: {
+        uint64_t count = 0;
+        for (auto *s : static_cast<const BlockStmt &>(stmt)) {
+          AddStmt(*s);
+          ++count;
+        }
+        Add(count);
+        return;
+      }
+      case Stmt::Kind::WHILE: {
+        auto &whileStmt = static_cast<const WhileStmt &>(stmt);
+        AddExpr(whileStmt.GetCond());
+        AddStmt(whileStmt.GetStmt());
+        return;
+      }
+      case Stmt::Kind::EXPR: {
+        AddExpr(static_cast<const ExprStmt &>(stmt).GetExpr());
+        return;
+      }
+      case Stmt::Kind::RETURN: {
+        AddExpr(static_cast<const ReturnStmt &>(stmt).GetExpr());
+        return;
+      }
+      case Stmt::Kind::IF: {
+        auto &ifStmt = static_cast<const IfStmt &>(stmt);
+        AddExpr(ifStmt.GetCond());
+        AddStmt(ifStmt.GetStmt());
+        auto *elseStmt = ifStmt.GetElseStmt();
+        Add(elseStmt != nullptr);
+        if (elseStmt) {
+          AddStmt(*elseStmt);
+        }
+        return;
+      }
+      case Stmt::Kind::LET: {
+        auto &letStmt = static_cast<const LetStmt &>(stmt);
+        Add(letStmt.GetName());
+        Add(letStmt.GetType());
+        AddExpr(letStmt.GetInit());
+        return;
+      }
+      case Stmt::Kind::ASSIGN: {
+        auto &assignStmt = static_cast<const AssignStmt &>(stmt);
+        AddExpr(assignStmt.GetTarget());
+        AddExpr(assignStmt.GetValue());
+        return;
+      }
+    }
+  }
+
+  /// Mixes an expression into the hash.
+  void AddExpr(const Expr &expr)
+  {
+    Add(static_cast<unsigned>(expr.GetKind()));
+    switch (expr.GetKind()) {
+      case Expr::Kind::REF: {
+        Add(static_cast<const RefExpr &>(expr).GetName());
+        return;
+      }
+      case Expr::Kind::BINARY: {
+        auto &binary = static_cast<const BinaryExpr &>(expr);
+        Add(static_cast<unsigned>(binary.GetKind()));
+        AddExpr(binary.GetLHS());
+        AddExpr(binary.GetRHS());
+        return;
+      }
+      case Expr::Kind::CALL: {
+        auto &call = static_cast<const CallExpr &>(expr);
+        AddExpr(call.GetCallee());
+        Add(call.arg_size());
+        for (auto it = call.arg_begin(), end = call.arg_end(); it != end; ++it) {
+          AddExpr(**it);
+        }
+        return;
+      }
+      case Expr::Kind::INT: {
+        Add(static_cast<const IntExpr &>(expr).GetInt());
+        return;
+      }
+    }
+  }
+
+  /// Mixes an integer into the hash.
+  void Add(uint64_t value)
+  {
+    for (unsigned i = 0; i < sizeof(value); ++i) {
+      AddByte(value >> (i * 8));
+    }
+  }
+
+  /// Mixes a name into the hash, followed by a terminator.
+  void Add(const std::string &name)
+  {
+    for (char c : name) {
+      AddByte(c);
+    }
+    AddByte(0);
+  }
+
+  /// 64-bit FNV-1a step.
+  void AddByte(uint8_t byte)
+  {
+    hash_ = (hash_ ^ byte) * 0x100000001b3ull;
+  }
+
+private:
+  /// Hash accumulated so far.
+  uint64_t hash_ = 0xcbf29ce484222325ull;
+};
+
+// -----------------------------------------------------------------------------
+static bool References(const Expr &expr, const std::unordered_set<Symbol> &names)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      auto &ref = static_cast<const RefExpr &>(expr);
+      switch (ref.GetTarget()) {
+        case RefExpr::Target::FUNC:
+        case RefExpr::Target::PROTO: {
+          return names.count(ref.GetSymbol()) != 0;
+        }
+        default: {
+          return false;
+        }
+      }
+    }
+    case Expr::Kind::BINARY: {
+      auto &binary = static_cast<const BinaryExpr &>(expr);
+      return References(binary.GetLHS(), names) || References(binary.GetRHS(), names);
+    }
+    case Expr::Kind::CALL: {
+      auto &call = static_cast<const CallExpr &>(expr);
+      if (References(call.GetCallee(), names)) {
+        return true;
+      }
+      for (auto it = call.arg_begin(), end = call.arg_end(); it != end; ++it) {
+        if (References(**it, names)) {
+          return true;
+        }
+      }
+      return false;
+    }
+    case Expr::Kind::INT: {
+      return false;
+    }
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+static bool References(const Stmt &stmt, const std::unordered_set<Symbol> &names)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      for (auto *s : static_cast<const BlockStmt &>(stmt)) {
+        if (References(*s, names)) {
+          return true;
+        }
+      }
+      return false;
+    }
+    case Stmt::Kind::WHILE: {
+      auto &whileStmt = static_cast<const WhileStmt &>(stmt);
+      return References(whileStmt.GetCond(), names) || References(whileStmt.GetStmt(), names);
+    }
+    case Stmt::Kind::EXPR: {
+      return References(static_cast<const ExprStmt &>(stmt).GetExpr(), names);
+    }
+    case Stmt::Kind::RETURN: {
+      return References(static_cast<const ReturnStmt &>(stmt).GetExpr(), names);
+    }
+    case Stmt::Kind::IF: {
+      auto &ifStmt = static_cast<const IfStmt &>(stmt);
+      auto *elseStmt = ifStmt.GetElseStmt();
+      return References(ifStmt.GetCond(), names) ||
+             References(ifStmt.GetStmt(), names) ||
+             (elseStmt && References(*elseStmt, names));
+    }
+    case Stmt::Kind::LET: {
+      return References(static_cast<const LetStmt &>(stmt).GetInit(), names);
+    }
+    case Stmt::Kind::ASSIGN: {
+      auto &assignStmt = static_cast<const AssignStmt &>(stmt);
+      return References(assignStmt.GetTarget(), names) || References(assignStmt.GetValue(), names);
+    }
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+unsigned Codegen::Reload(Program &prog, const Module &mod)
+{
+  assert(lazy_ && "only lazily lowered programs can be reloaded");
+
+  // Prototypes of the new version are bound to their methods, replacing
+  // functions of the same name. Names bound to something else than before
+  // are recorded, as code referencing them must be lowered again.
+  std::unordered_set<Symbol> rebound;
+  for (auto item : mod) {
+    if (!std::holds_alternative<ProtoDecl *>(item)) {
+      continue;
+    }
+    auto &proto = *std::get<1>(item);
+    auto it = kRuntimeFns.find(proto.GetPrimitiveName());
+    assert(it != kRuntimeFns.end() && "missing prototype");
+    auto name = proto.GetSymbol();
+    if (auto jt = protos_.find(name); jt == protos_.end() || jt->second != it->second) {
+      rebound.insert(name);
+    }
+    protos_.insert_or_assign(name, it->second);
+    funcs_.erase(name);
+    stubIDs_.erase(name);
+  }
+
+  // New functions are given stubs at the end of the program, while existing
+  // ones are re-bound to their new declarations. Functions removed from the
+  // module keep their code, as it can still be referenced.
+  code_.clear();
+  base_ = prog.GetCodeSize();
+  std::vector<uint64_t> changed;
+  for (auto item : mod) {
+    if (!std::holds_alternative<FuncDecl *>(item)) {
+      continue;
+    }
+    auto &func = *std::get<0>(item);
+    if (protos_.erase(func.GetSymbol())) {
+      rebound.insert(func.GetSymbol());
+    }
+    auto it = stubIDs_.find(func.GetSymbol());
+    if (it == stubIDs_.end()) {
+      auto entry = MakeLabel();
+      funcs_.emplace(func.GetSymbol(), entry);
+      BeginDebugFunc(func.GetName(), func.GetLocation());
+      EmitLabel(entry);
+      EmitStub(stubs_.size());
+      EndDebugFunc();
+      stubIDs_.emplace(func.GetSymbol(), stubs_.size());
+      stubs_.push_back(Stub{ &func, false, entry });
+      continue;
+    }
+
+    // Functions not yet lowered pick up the new version once called.
+    auto &stub = stubs_[it->second];
+    if (stub.Lowered && FuncHash()(*stub.Decl) != FuncHash()(func)) {
+      changed.push_back(it->second);
+    }
+    stub.Decl = &func;
+  }
+  prog.Append(code_);
+  code_.clear();
+  ResolveDebugInfo();
+
+  // Unchanged functions which were lowered against the old bindings are
+  // lowered again, to call the new targets.
+  for (auto item : mod) {
+    if (rebound.empty() || !std::holds_alternative<FuncDecl *>(item)) {
+      continue;
+    }
+    auto id = stubIDs_.find(std::get<0>(item)->GetSymbol())->second;
+    auto &stub = stubs_[id];
+    if (stub.Lowered && References(stub.Decl->GetBody(), rebound) &&
+        std::find(changed.begin(), changed.end(), id) == changed.end()) {
+      changed.push_back(id);
+    }
+  }
+
+  // Bodies are lowered once all new functions can be referenced.
+  for (auto func : changed) {
+    LowerBody(prog, func);
+  }
+  return changed.size();
+}
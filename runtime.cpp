@@ -1,30 +1,270 @@
 // This file is part of the IMP project.
 
-#include <iostream>
-
 #include "runtime.h"
+#include "array.h"
 #include "interp.h"
+#include "io.h"
+#include "program.h"
+
+#include <cstdlib>
+#include <iostream>
 
 
 
 // -----------------------------------------------------------------------------
 static void PrintInt(Interp &interp)
 {
-  auto v = interp.PeekInt();
-  std::cout << v;
+  auto v = interp.PopInt();
+  interp.GetIO().WriteInt(v);
   interp.Push<int64_t>(v);
 }
 
 // -----------------------------------------------------------------------------
 static void ReadInt(Interp &interp)
 {
-  int64_t val;
-  std::cin >> val;
-  interp.Push<int64_t>(val);
+  interp.Push<int64_t>(interp.GetIO().ReadInt());
+}
+
+// -----------------------------------------------------------------------------
+static void PrintInts(Interp &interp)
+{
+  // The first argument counts the values following it, which are written
+  // on a line of their own. It must match the arguments actually passed,
+  // as values past them belong to the caller.
+  int64_t expected = static_cast<int64_t>(interp.GetNumArgs()) - 1;
+  if (expected < 0) {
+    throw RuntimeError("missing number of values");
+  }
+  auto n = interp.PopInt();
+  if (n != expected) {
+    throw RuntimeError(
+        "invalid number of values: " + std::to_string(n) +
+        ", expecting " + std::to_string(expected)
+    );
+  }
+  auto &io = interp.GetIO();
+  for (int64_t i = 0; i < n; ++i) {
+    if (i != 0) {
+      io.WriteChar(' ');
+    }
+    io.WriteInt(interp.PopInt());
+  }
+  io.WriteChar('\n');
+  interp.Push<int64_t>(n);
+}
+
+// -----------------------------------------------------------------------------
+static void ArrayNew(Interp &interp)
+{
+  interp.Push(interp.NewArray(interp.PopInt()));
+}
+
+// -----------------------------------------------------------------------------
+static void ArrayLen(Interp &interp)
+{
+  interp.Push<int64_t>(interp.PopArray()->GetSize());
+}
+
+// -----------------------------------------------------------------------------
+static size_t CheckIndex(const Array &array, int64_t index)
+{
+  if (index < 0 || static_cast<uint64_t>(index) >= array.GetSize()) {
+    throw RuntimeError(
+        "index " + std::to_string(index) + " out of bounds for array of " +
+        std::to_string(array.GetSize()) + " elements"
+    );
+  }
+  return index;
+}
+
+// -----------------------------------------------------------------------------
+static void ArrayGet(Interp &interp)
+{
+  auto &array = *interp.PopArray();
+  auto index = CheckIndex(array, interp.PopInt());
+  interp.Push<int64_t>(array[index]);
+}
+
+// -----------------------------------------------------------------------------
+static void ArraySet(Interp &interp)
+{
+  auto &array = *interp.PopArray();
+  auto index = CheckIndex(array, interp.PopInt());
+  auto v = interp.PopInt();
+  array[index] = v;
+  interp.Push<int64_t>(v);
 }
 
 // -----------------------------------------------------------------------------
-std::map<std::string, RuntimeFn> kRuntimeFns = {
+static void ReadInts(Interp &interp)
+{
+  auto &array = *interp.NewArray(interp.PopInt());
+  auto &io = interp.GetIO();
+  for (size_t i = 0, n = array.GetSize(); i < n; ++i) {
+    array[i] = io.ReadInt();
+  }
+  interp.Push(&array);
+}
+
+// -----------------------------------------------------------------------------
+static void PrintArray(Interp &interp)
+{
+  // Elements are written on a line of their own, as by print_ints.
+  auto &array = *interp.PopArray();
+  auto &io = interp.GetIO();
+  for (size_t i = 0, n = array.GetSize(); i < n; ++i) {
+    if (i != 0) {
+      io.WriteChar(' ');
+    }
+    io.WriteInt(array[i]);
+  }
+  io.WriteChar('\n');
+  interp.Push<int64_t>(array.GetSize());
+}
+
+// -----------------------------------------------------------------------------
+static std::pair<const Array *, const Array *> PopOperands(Interp &interp)
+{
+  auto *a = interp.PopArray();
+  auto *b = interp.PopArray();
+  if (a->GetSize() != b->GetSize()) {
+    throw RuntimeError(
+        "mismatched arrays of " + std::to_string(a->GetSize()) + " and " +
+        std::to_string(b->GetSize()) + " elements"
+    );
+  }
+  return { a, b };
+}
+
+// -----------------------------------------------------------------------------
+template <const char *(*ArrayKernels::*Kernel)(int64_t *, const int64_t *, const int64_t *, size_t)>
+static void ArrayChecked(Interp &interp)
+{
+  auto [a, b] = PopOperands(interp);
+  auto *out = interp.NewArray(a->GetSize());
+  auto *err = (GetArrayKernels().*Kernel)(out->GetData(), a->GetData(), b->GetData(), a->GetSize());
+  if (err) {
+    throw RuntimeError(err);
+  }
+  interp.Push(out);
+}
+
+// -----------------------------------------------------------------------------
+template <void (*ArrayKernels::*Kernel)(int64_t *, const int64_t *, const int64_t *, size_t)>
+static void ArrayCompare(Interp &interp)
+{
+  auto [a, b] = PopOperands(interp);
+  auto *out = interp.NewArray(a->GetSize());
+  (GetArrayKernels().*Kernel)(out->GetData(), a->GetData(), b->GetData(), a->GetSize());
+  interp.Push(out);
+}
+
+// -----------------------------------------------------------------------------
+static void ArraySum(Interp &interp)
+{
+  auto &array = *interp.PopArray();
+  int64_t sum;
+  if (auto *err = GetArrayKernels().Sum(sum, array.GetData(), array.GetSize())) {
+    throw RuntimeError(err);
+  }
+  interp.Push<int64_t>(sum);
+}
+
+// -----------------------------------------------------------------------------
+static void ArrayDot(Interp &interp)
+{
+  auto [a, b] = PopOperands(interp);
+  int64_t dot;
+  if (auto *err = GetArrayKernels().Dot(dot, a->GetData(), b->GetData(), a->GetSize())) {
+    throw RuntimeError(err);
+  }
+  interp.Push<int64_t>(dot);
+}
+
+// -----------------------------------------------------------------------------
+const std::map<std::string, RuntimeFn> kRuntimeFns = {
+  { "array_add", ArrayChecked<&ArrayKernels::Add> },
+  { "array_dot", ArrayDot },
+  { "array_eq", ArrayCompare<&ArrayKernels::Eq> },
+  { "array_get", ArrayGet },
+  { "array_len", ArrayLen },
+  { "array_lt", ArrayCompare<&ArrayKernels::Lt> },
+  { "array_mul", ArrayChecked<&ArrayKernels::Mul> },
+  { "array_new", ArrayNew },
+  { "array_set", ArraySet },
+  { "array_sum", ArraySum },
+  { "print_array", PrintArray },
   { "print_int", PrintInt },
-  { "read_int", ReadInt }
+  { "print_ints", PrintInts },
+  { "read_int", ReadInt },
+  { "read_ints", ReadInts }
 };
+
+// -----------------------------------------------------------------------------
+const std::map<std::string, RuntimeSig> kRuntimeSigs = {
+  { "array_add", { { "int[]", "int[]" }, "int[]" } },
+  { "array_dot", { { "int[]", "int[]" }, "int" } },
+  { "array_eq", { { "int[]", "int[]" }, "int[]" } },
+  { "array_get", { { "int[]", "int" }, "int" } },
+  { "array_len", { { "int[]" }, "int" } },
+  { "array_lt", { { "int[]", "int[]" }, "int[]" } },
+  { "array_mul", { { "int[]", "int[]" }, "int[]" } },
+  { "array_new", { { "int" }, "int[]" } },
+  { "array_set", { { "int[]", "int", "int" }, "int" } },
+  { "array_sum", { { "int[]" }, "int" } },
+  { "print_array", { { "int[]" }, "int" } },
+  { "read_ints", { { "int" }, "int[]" } }
+};
+
+namespace {
+/// Method bound by compiled code, along with its signature.
+struct Handle {
+  RuntimeFn Fn;
+  const RuntimeSig *Sig;
+};
+}
+
+// -----------------------------------------------------------------------------
+void *imp_runtime_lookup(const char *name)
+{
+  // Handles are built on first use, pairing methods with their signatures.
+  static const auto handles = [] {
+    std::map<std::string, Handle> handles;
+    for (auto &[name, fn] : kRuntimeFns) {
+      auto it = kRuntimeSigs.find(name);
+      handles.emplace(name, Handle{ fn, it == kRuntimeSigs.end() ? nullptr : &it->second });
+    }
+    return handles;
+  }();
+  auto it = handles.find(name);
+  // Handles are only ever read through.
+  return it == handles.end() ? nullptr : const_cast<Handle *>(&it->second);
+}
+
+// -----------------------------------------------------------------------------
+int64_t imp_runtime_call(void *fn, const int64_t *args, uint32_t nargs)
+{
+  // Runtime methods operate on the stack of an interpreter without code,
+  // one for each thread calling into the runtime. It is never reset, as
+  // compiled code can hold on to any array, so arrays live until the thread
+  // exits.
+  static const Program prog(std::vector<uint8_t>{});
+  thread_local Interp interp(prog, 1 << 10);
+  auto &handle = *static_cast<const Handle *>(fn);
+  // Exceptions cannot unwind through the frames of compiled code, so errors
+  // end the program as failed checks do.
+  try {
+    return interp.Invoke(handle.Fn, args, nargs, handle.Sig);
+  } catch (const std::exception &ex) {
+    imp_runtime_error(ex.what());
+  }
+}
+
+// -----------------------------------------------------------------------------
+void imp_runtime_error(const char *msg)
+{
+  // Output written before the error is kept, as in the interpreter.
+  IO::Get().Flush();
+  std::cerr << msg << std::endl;
+  std::exit(EXIT_FAILURE);
+}
@@ -2,7 +2,10 @@
 
 #pragma once
 
+#include <cstdint>
 #include <map>
+#include <string>
+#include <vector>
 
 class Interp;
 
@@ -11,5 +14,30 @@ class Interp;
 /// Signature of runtime methods.
 typedef void (*RuntimeFn) (Interp &);
 
-/// Map of all runtime functions.
-extern std::map<std::string, RuntimeFn> kRuntimeFns;
+/// Map of all runtime functions, never modified after startup.
+extern const std::map<std::string, RuntimeFn> kRuntimeFns;
+
+/// Types of the arguments and of the result of a runtime method.
+struct RuntimeSig {
+  std::vector<std::string> Args;
+  std::string Ret;
+};
+
+/// Signatures of the methods taking or returning arrays, which prototypes
+/// must match exactly. All other methods take and return integers.
+extern const std::map<std::string, RuntimeSig> kRuntimeSigs;
+
+/**
+ * Bridge to the runtime for natively compiled programs.
+ *
+ * Methods are looked up by name once, then invoked with their arguments
+ * in an array, the first argument being at index zero.
+ */
+extern "C" {
+/// Returns a handle to a runtime method, or null if it does not exist.
+void *imp_runtime_lookup(const char *name);
+/// Invokes a runtime method, returning its result or reporting its error.
+int64_t imp_runtime_call(void *fn, const int64_t *args, uint32_t nargs);
+/// Reports an error raised by compiled code and terminates the program.
+[[noreturn]] void imp_runtime_error(const char *msg);
+}
@@ -0,0 +1,249 @@
+// This file is part of the IMP project.
+
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "program.h"
+#include "runtime.h"
+
+
+
+/**
+ * Header of a cache file.
+ *
+ * The header is followed by the bytecode, the decoded instructions, the
+ * relocations and the names of the runtime methods they refer to, with
+ * the offsets of the sections recorded in the header. Sections are aligned
+ * to 8 bytes, so the file can be used directly once mapped.
+ */
+struct CacheHeader {
+  /// Magic identifying the file.
+  char Magic[4];
+  /// Version of the format.
+  uint32_t Version;
+  /// Hash of the source the program was built from.
+  uint64_t SourceHash;
+  /// Number of opcodes known to the interpreter which wrote the file.
+  uint32_t NumOpcodes;
+  /// Number of relocations.
+  uint32_t NumRelocs;
+  /// Size of the bytecode.
+  uint64_t CodeSize;
+  /// Number of decoded instructions.
+  uint64_t NumInsts;
+  /// Offset of the relocations.
+  uint64_t RelocOffset;
+  /// Offset of the name table.
+  uint64_t NamesOffset;
+  /// Total size of the file.
+  uint64_t Size;
+};
+
+/**
+ * Location of a pointer to a runtime method in a cache file.
+ */
+struct CacheReloc {
+  /// Offset of the pointer from the start of the file.
+  uint64_t Offset;
+  /// Offset of the name of the method into the name table.
+  uint32_t Name;
+  /// Padding.
+  uint32_t Reserved;
+};
+
+/// Magic at the start of all cache files.
+static const char kCacheMagic[4] = { 'I', 'M', 'P', 'C' };
+
+
+// -----------------------------------------------------------------------------
+static size_t Align(size_t offset)
+{
+  return (offset + 7) & ~size_t(7);
+}
+
+// -----------------------------------------------------------------------------
+Program::Mapping::~Mapping()
+{
+  munmap(Base, Size);
+}
+
+// -----------------------------------------------------------------------------
+bool Program::Save(const std::string &path, uint64_t sourceHash) const
+{
+  assert(format_ == Format::STACK && "only stack bytecode can be cached");
+
+  // Lay out the sections following the header.
+  const size_t codeOffset = Align(sizeof(CacheHeader));
+  const size_t instOffset = Align(codeOffset + codeSize_);
+  const size_t relocOffset = instOffset + numInsts_ * sizeof(Inst);
+
+  std::vector<uint8_t> data(relocOffset);
+  if (codeSize_) {
+    memcpy(data.data() + codeOffset, code_, codeSize_);
+  }
+  if (numInsts_) {
+    memcpy(data.data() + instOffset, insts_, numInsts_ * sizeof(Inst));
+  }
+
+  // Replace pointers to runtime methods by references to their names.
+  std::unordered_map<RuntimeFn, std::string> names;
+  for (auto &[name, fn] : kRuntimeFns) {
+    names.emplace(fn, name);
+  }
+  std::vector<CacheReloc> relocs;
+  std::string table;
+  std::unordered_map<RuntimeFn, uint32_t> offsets;
+  auto relocate = [&] (size_t offset) {
+    RuntimeFn fn;
+    memcpy(&fn, data.data() + offset, sizeof(fn));
+    memset(data.data() + offset, 0, sizeof(fn));
+
+    auto it = offsets.find(fn);
+    if (it == offsets.end()) {
+      auto name = names.find(fn);
+      assert(name != names.end() && "unknown runtime method");
+      it = offsets.emplace(fn, table.size()).first;
+      table.append(name->second);
+      table.push_back('\0');
+    }
+    relocs.push_back(CacheReloc{ offset, it->second, 0 });
+  };
+
+  for (size_t pc = 0; pc < codeSize_; ) {
+    auto op = static_cast<Opcode>(code_[pc]);
+    if (op == Opcode::PUSH_PROTO || op == Opcode::CALL_NATIVE) {
+      relocate(codeOffset + pc + 1);
+    }
+    pc += 1 + GetOperandSize(op);
+  }
+  for (size_t i = 0; i < numInsts_; ++i) {
+    auto op = insts_[i].Op;
+    if (op == Opcode::PUSH_PROTO || op == Opcode::CALL_NATIVE) {
+      relocate(instOffset + i * sizeof(Inst) + offsetof(Inst, Arg));
+    }
+  }
+
+  CacheHeader header;
+  memcpy(header.Magic, kCacheMagic, sizeof(kCacheMagic));
+  header.Version = kCacheVersion;
+  header.SourceHash = sourceHash;
+  header.NumOpcodes = kNumOpcodes;
+  header.NumRelocs = relocs.size();
+  header.CodeSize = codeSize_;
+  header.NumInsts = numInsts_;
+  header.RelocOffset = relocOffset;
+  header.NamesOffset = relocOffset + relocs.size() * sizeof(CacheReloc);
+  header.Size = header.NamesOffset + table.size();
+  memcpy(data.data(), &header, sizeof(header));
+
+  // Write to a temporary file first, so concurrent readers never observe a
+  // partially written cache.
+  auto tmp = path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+    os.write(reinterpret_cast<const char *>(data.data()), data.size());
+    os.write(reinterpret_cast<const char *>(relocs.data()), relocs.size() * sizeof(CacheReloc));
+    os.write(table.data(), table.size());
+    if (!os) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+std::unique_ptr<Program> Program::Load(const std::string &path, uint64_t sourceHash)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(CacheHeader)) {
+    close(fd);
+    return nullptr;
+  }
+
+  // Map a private copy: only the pages holding relocations are copied.
+  size_t size = st.st_size;
+  void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return nullptr;
+  }
+  auto mapping = std::make_unique<Mapping>(base, size);
+  auto *data = static_cast<uint8_t *>(base);
+
+  // Validate the header and the extent of the sections.
+  CacheHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.Magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+      header.Version != kCacheVersion ||
+      header.SourceHash != sourceHash ||
+      header.NumOpcodes != kNumOpcodes ||
+      header.Size != size) {
+    return nullptr;
+  }
+  const size_t codeOffset = Align(sizeof(CacheHeader));
+  const size_t instOffset = Align(codeOffset + header.CodeSize);
+  if (header.CodeSize > size ||
+      header.NumInsts > size / sizeof(Inst) ||
+      header.RelocOffset != instOffset + header.NumInsts * sizeof(Inst) ||
+      header.NumRelocs > size / sizeof(CacheReloc) ||
+      header.NamesOffset != header.RelocOffset + header.NumRelocs * sizeof(CacheReloc) ||
+      header.NamesOffset > size) {
+    return nullptr;
+  }
+
+  // Bind the runtime methods, which move between builds and runs.
+  const char *names = reinterpret_cast<const char *>(data + header.NamesOffset);
+  const size_t namesSize = size - header.NamesOffset;
+  for (uint32_t i = 0; i < header.NumRelocs; ++i) {
+    CacheReloc reloc;
+    memcpy(&reloc, data + header.RelocOffset + i * sizeof(reloc), sizeof(reloc));
+    if (reloc.Name >= namesSize || reloc.Offset < codeOffset ||
+        reloc.Offset + sizeof(RuntimeFn) > header.RelocOffset) {
+      return nullptr;
+    }
+    const char *name = names + reloc.Name;
+    auto it = kRuntimeFns.find(std::string(name, strnlen(name, namesSize - reloc.Name)));
+    if (it == kRuntimeFns.end()) {
+      return nullptr;
+    }
+    memcpy(data + reloc.Offset, &it->second, sizeof(RuntimeFn));
+  }
+
+  auto prog = std::make_unique<Program>(std::vector<uint8_t>{});
+  prog->code_ = data + codeOffset;
+  prog->codeSize_ = header.CodeSize;
+  prog->insts_ = reinterpret_cast<const Inst *>(data + instOffset);
+  prog->numInsts_ = header.NumInsts;
+  prog->mapping_ = std::move(mapping);
+  return prog;
+}
+
+// -----------------------------------------------------------------------------
+uint64_t Program::HashSource(const std::string &path)
+{
+  // 64-bit FNV-1a over the contents of the file.
+  std::ifstream is(path, std::ios::binary);
+  uint64_t hash = 0xcbf29ce484222325ull;
+  std::istreambuf_iterator<char> it(is), end;
+  for (; it != end; ++it) {
+    hash = (hash ^ static_cast<uint8_t>(*it)) * 0x100000001b3ull;
+  }
+  return hash;
+}
@@ -0,0 +1,27 @@
+// This file is part of the IMP project.
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#include "symbol.h"
+
+
+
+// -----------------------------------------------------------------------------
+Symbol Symbol::Intern(std::string_view name)
+{
+  // Entries are kept in a deque, so they do not move as the table grows and
+  // the keys of the index can refer to their names.
+  static std::mutex lock;
+  static std::deque<Entry> entries;
+  static std::unordered_map<std::string_view, const Entry *> index;
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (auto it = index.find(name); it != index.end()) {
+    return Symbol(it->second);
+  }
+  auto &entry = entries.emplace_back(Entry{ std::string(name), uint32_t(entries.size()) });
+  index.emplace(entry.Name, &entry);
+  return Symbol(&entry);
+}
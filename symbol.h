@@ -0,0 +1,62 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+
+
+/**
+ * Interned identifier.
+ *
+ * All occurrences of a name share a single entry in a global table, so
+ * symbols are compared and hashed through their compact integer IDs.
+ * Interning is thread-safe and entries are never released, so reading the
+ * name of a symbol does not require any locking.
+ */
+class Symbol final {
+public:
+  /// Returns the unique symbol of a name, creating it if necessary.
+  static Symbol Intern(std::string_view name);
+
+  /// Returns the identifier of the symbol, dense from zero.
+  uint32_t GetID() const { return entry_->ID; }
+  /// Returns the name of the symbol.
+  const std::string &GetName() const { return entry_->Name; }
+
+  bool operator==(const Symbol &that) const { return entry_ == that.entry_; }
+  bool operator!=(const Symbol &that) const { return entry_ != that.entry_; }
+
+private:
+  /// Entry in the table of interned names.
+  struct Entry {
+    /// Spelling of the name.
+    std::string Name;
+    /// Index of the entry.
+    uint32_t ID;
+  };
+
+  explicit Symbol(const Entry *entry) : entry_(entry) {}
+
+private:
+  /// Entry of the symbol.
+  const Entry *entry_;
+};
+
+/// Helper to print a symbol to a stream.
+inline std::ostream &operator<<(std::ostream &os, const Symbol &sym)
+{
+  return os << sym.GetName();
+}
+
+namespace std {
+/// Symbols are hashed by their identifiers.
+template <>
+struct hash<Symbol> {
+  size_t operator() (const Symbol &sym) const { return sym.GetID(); }
+};
+}
@@ -0,0 +1,188 @@
+// This file is part of the IMP project.
+
+#include <cstdio>
+#include <filesystem>
+
+#include <sys/wait.h>
+
+#include "test.h"
+
+
+
+/// Backend a program is compiled ahead of time with.
+enum class Backend {
+  C,
+  LLVM,
+};
+
+/// Output and exit status of a compiled program.
+struct Result {
+  /// Standard output followed by the standard error.
+  std::string Output;
+  /// Exit status of the process.
+  int Status;
+};
+
+// -----------------------------------------------------------------------------
+static std::string TempPath(const std::string &name)
+{
+  auto path = std::filesystem::temp_directory_path() /
+      ("imp_test_" + std::to_string(getpid()) + "_" + name);
+  return path;
+}
+
+// -----------------------------------------------------------------------------
+static bool Shell(const std::string &command)
+{
+  return std::system((command + " >/dev/null 2>&1").c_str()) == 0;
+}
+
+// -----------------------------------------------------------------------------
+static bool HasLLC()
+{
+  const std::string llc = IMP_LLC;
+  return !llc.empty() && llc.find("NOTFOUND") == std::string::npos;
+}
+
+// -----------------------------------------------------------------------------
+static std::string Build(const std::string &source, Backend backend)
+{
+  auto src = WriteSource("aot", source);
+  auto out = TempPath(backend == Backend::C ? "aot.c" : "aot.ll");
+  auto obj = TempPath("aot.o");
+  auto exe = TempPath("aot");
+  auto cleanup = [&] {
+    std::filesystem::remove(src);
+    std::filesystem::remove(out);
+    std::filesystem::remove(obj);
+  };
+
+  bool ok = false;
+  switch (backend) {
+    case Backend::C: {
+      ok = Shell(std::string(IMP_PATH) + " --emit-c " + out + " " + src) &&
+           Shell(std::string(IMP_CC) + " -O2 -c " + out + " -o " + obj);
+      break;
+    }
+    case Backend::LLVM: {
+      // Opaque pointers must be enabled explicitly before LLVM 15.
+      auto llc = std::string(IMP_LLC) + " -O2 -relocation-model=pic -filetype=obj ";
+      ok = Shell(std::string(IMP_PATH) + " --emit-llvm " + out + " " + src) &&
+          (Shell(llc + out + " -o " + obj) ||
+           Shell(llc + "-opaque-pointers " + out + " -o " + obj));
+      break;
+    }
+  }
+  ok = ok && Shell(std::string(IMP_CXX) + " " + obj + " " + IMP_RUNTIME + " -lpthread -o " + exe);
+  cleanup();
+  if (!ok) {
+    throw std::runtime_error("cannot build " + source);
+  }
+  return exe;
+}
+
+// -----------------------------------------------------------------------------
+static Result Exec(const std::string &exe)
+{
+  Result result;
+  auto *pipe = popen((exe + " </dev/null 2>&1").c_str(), "r");
+  if (!pipe) {
+    throw std::runtime_error("cannot run " + exe);
+  }
+  char buf[256];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), pipe)) != 0) {
+    result.Output.append(buf, n);
+  }
+  int status = pclose(pipe);
+  result.Status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  std::filesystem::remove(exe);
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+static void CheckBackends(
+    const std::string &source,
+    const std::string &output,
+    int status)
+{
+  std::vector<Backend> backends{ Backend::C };
+  if (HasLLC()) {
+    backends.push_back(Backend::LLVM);
+  }
+  for (auto backend : backends) {
+    auto result = Exec(Build(source, backend));
+    CHECK(result.Output == output);
+    CHECK(result.Status == status);
+  }
+}
+
+// -----------------------------------------------------------------------------
+static void TestRuntimeError()
+{
+  // Errors of runtime methods end the program after flushing its output.
+  auto source =
+      "func print_int(a: int): int = \"print_int\"\n"
+      "func print_ints(n: int, a: int, b: int): int = \"print_ints\"\n"
+      "print_int(7)\n"
+      "print_ints(3, 1, 2)\n";
+  CHECK_THROWS(RunSource(source), "invalid number of values: 3, expecting 2");
+  CheckBackends(source, "7invalid number of values: 3, expecting 2\n", EXIT_FAILURE);
+}
+
+// -----------------------------------------------------------------------------
+static void TestSuccess()
+{
+  auto source =
+      "func print_ints(n: int, a: int, b: int): int = \"print_ints\"\n"
+      "print_ints(2, 1, 2)\n";
+  CheckBackends(source, "1 2\n", EXIT_SUCCESS);
+}
+
+/// Prototypes of the array methods used by the tests.
+static const std::string kArrays =
+    "func print_int(a: int): int = \"print_int\"\n"
+    "func print_array(a: int[]): int = \"print_array\"\n"
+    "func array_new(n: int): int[] = \"array_new\"\n"
+    "func array_get(a: int[], i: int): int = \"array_get\"\n"
+    "func array_set(a: int[], i: int, v: int): int = \"array_set\"\n"
+    "func array_add(a: int[], b: int[]): int[] = \"array_add\"\n";
+
+// -----------------------------------------------------------------------------
+static void TestArrayBounds()
+{
+  auto source = kArrays +
+      "let a: int[] = array_new(4)\n"
+      "let i: int = 0\n"
+      "while (i < 5) { array_set(a, i % 4, i); print_array(a); print_int(array_get(a, i)); i = i + 1 }\n";
+  std::string output =
+      "0 0 0 0\n0"
+      "0 1 0 0\n1"
+      "0 1 2 0\n2"
+      "0 1 2 3\n3"
+      "4 1 2 3\n";
+  CHECK_THROWS(RunSource(source), "index 4 out of bounds for array of 4 elements");
+  CheckBackends(source, output + "index 4 out of bounds for array of 4 elements\n", EXIT_FAILURE);
+}
+
+// -----------------------------------------------------------------------------
+static void TestArrayMismatch()
+{
+  auto source = kArrays +
+      "let a: int[] = array_new(2)\n"
+      "print_array(array_add(a, a))\n"
+      "print_array(array_add(a, array_new(3)))\n";
+  CHECK_THROWS(RunSource(source), "mismatched arrays of 2 and 3 elements");
+  CheckBackends(source, "0 0\nmismatched arrays of 2 and 3 elements\n", EXIT_FAILURE);
+}
+
+// -----------------------------------------------------------------------------
+int main()
+{
+  return RunTests({
+    { "success", TestSuccess },
+    { "runtime_error", TestRuntimeError },
+    { "array_bounds", TestArrayBounds },
+    { "array_mismatch", TestArrayMismatch },
+  });
+}
@@ -0,0 +1,101 @@
+// This file is part of the IMP project.
+
+#include <filesystem>
+
+#include "ast.h"
+#include "codegen.h"
+#include "test.h"
+
+
+
+/// First version of the module, calling through all kinds of names.
+static const char *kBefore =
+    "func print_int(a: int): int = \"print_int\"\n"
+    "func out(a: int): int = \"print_int\"\n"
+    "func show(a: int): int = \"print_int\"\n"
+    "func g(a: int): int { return a + 1 }\n"
+    "func f(a: int): int { out(0); show(a); print_int(g(a)); return 0 }\n"
+    "f(1)\n";
+
+/// Second version, re-binding the names called by the unchanged function.
+static const char *kAfter =
+    "func print_int(a: int): int = \"print_int\"\n"
+    "func print_ints(n: int): int = \"print_ints\"\n"
+    "func out(a: int): int = \"print_ints\"\n"
+    "func show(a: int): int { return print_int(a * k(a)) }\n"
+    "func k(a: int): int { return a + 9 }\n"
+    "func g(a: int): int = \"print_int\"\n"
+    "func f(a: int): int { out(0); show(a); print_int(g(a)); return 0 }\n"
+    "f(1)\n";
+
+// -----------------------------------------------------------------------------
+static std::unique_ptr<Module> Load(const char *name, const std::string &source)
+{
+  auto path = WriteSource(name, source);
+  std::unique_ptr<Module> mod;
+  try {
+    mod = LoadModule(path);
+  } catch (...) {
+    std::filesystem::remove(path);
+    throw;
+  }
+  std::filesystem::remove(path);
+  return mod;
+}
+
+// -----------------------------------------------------------------------------
+static std::string Run(Interp &interp)
+{
+  IO io;
+  std::string output;
+  io.Redirect("", output);
+  interp.SetIO(io);
+  interp.Reset();
+  interp.Run();
+  io.Reset();
+  return output;
+}
+
+// -----------------------------------------------------------------------------
+static void TestRebind()
+{
+  auto before = Load("before", kBefore);
+  auto after = Load("after", kAfter);
+
+  Codegen codegen;
+  auto prog = codegen.Translate(*before, true);
+  prog->Decode();
+  Interp interp(*prog);
+  CHECK(Run(interp) == "012");
+
+  // Only f, which was lowered and refers to the re-bound names, is lowered
+  // again: show and k have fresh stubs, while g is now a prototype.
+  CHECK(codegen.Reload(*prog, *after) == 1);
+  CHECK(Run(interp) == "\n1011");
+}
+
+// -----------------------------------------------------------------------------
+static void TestChanged()
+{
+  auto before = Load("before", kBefore);
+  auto changed = Load("changed", std::string(kBefore).replace(
+      std::string(kBefore).find("a + 1"), 5, "a + 5"
+  ));
+
+  Codegen codegen;
+  auto prog = codegen.Translate(*before, true);
+  prog->Decode();
+  Interp interp(*prog);
+  CHECK(Run(interp) == "012");
+  CHECK(codegen.Reload(*prog, *changed) == 1);
+  CHECK(Run(interp) == "016");
+}
+
+// -----------------------------------------------------------------------------
+int main()
+{
+  return RunTests({
+    { "rebind", TestRebind },
+    { "changed", TestChanged },
+  });
+}
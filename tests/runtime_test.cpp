@@ -0,0 +1,83 @@
+// This file is part of the IMP project.
+
+#include <filesystem>
+
+#include "test.h"
+
+
+
+/// Prototypes shared by the programs of the tests.
+static const std::string kPrelude =
+    "func print_ints(n: int, a: int, b: int): int = \"print_ints\"\n";
+
+// -----------------------------------------------------------------------------
+static std::string RunCompiled(const std::string &source, uint64_t jitThreshold)
+{
+  auto path = WriteSource("jit", source);
+  std::shared_ptr<const Program> prog;
+  try {
+    prog = Compile(path);
+  } catch (...) {
+    std::filesystem::remove(path);
+    throw;
+  }
+  std::filesystem::remove(path);
+  Instance instance(prog);
+  instance.GetInterp().SetJitThreshold(jitThreshold);
+  return instance.Run("");
+}
+
+// -----------------------------------------------------------------------------
+static void TestPrintIntsCount()
+{
+  auto source = kPrelude + "print_ints(2, 7, 8)\n";
+  CHECK(RunSource(source) == "7 8\n");
+  CHECK(RunSource(source, "", Program::Format::REGISTER) == "7 8\n");
+}
+
+// -----------------------------------------------------------------------------
+static void TestPrintIntsFewer()
+{
+  // Counting fewer values would leave the rest of the arguments behind.
+  auto source = kPrelude + "print_ints(1, 7, 8)\n";
+  CHECK_THROWS(RunSource(source), "invalid number of values: 1, expecting 2");
+  CHECK_THROWS(
+      RunSource(source, "", Program::Format::REGISTER),
+      "invalid number of values: 1, expecting 2"
+  );
+}
+
+// -----------------------------------------------------------------------------
+static void TestPrintIntsMore()
+{
+  // Counting more values would pop the values of the caller.
+  auto source = kPrelude + "print_ints(5, 7, 8)\n";
+  CHECK_THROWS(RunSource(source), "invalid number of values: 5, expecting 2");
+  CHECK_THROWS(RunSource(source, "", Program::Format::REGISTER), "expecting 2");
+  CHECK_THROWS(RunSource(kPrelude + "print_ints(0 - 1, 7, 8)\n"), "invalid number of values: -1");
+}
+
+// -----------------------------------------------------------------------------
+static void TestPrintIntsNative()
+{
+  // Native code passes the count of arguments to the runtime as well.
+  auto loop = [] (const std::string &count) {
+    return kPrelude +
+        "func p(a: int): int { return print_ints(" + count + ", a, a) }\n"
+        "func f(n: int): int { let i: int = 0; while (i < n) { p(i); i = i + 1 }; return 0 }\n"
+        "f(3)\n";
+  };
+  CHECK(RunCompiled(loop("2"), 1) == "0 0\n1 1\n2 2\n");
+  CHECK_THROWS(RunCompiled(loop("3"), 1), "invalid number of values: 3, expecting 2");
+}
+
+// -----------------------------------------------------------------------------
+int main()
+{
+  return RunTests({
+    { "print_ints_count", TestPrintIntsCount },
+    { "print_ints_fewer", TestPrintIntsFewer },
+    { "print_ints_more", TestPrintIntsMore },
+    { "print_ints_native", TestPrintIntsNative },
+  });
+}
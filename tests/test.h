@@ -0,0 +1,103 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <unistd.h>
+
+#include "engine.h"
+
+
+
+/// Fails the current test if a condition does not hold.
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      throw TestFailure(__FILE__, __LINE__, #cond);                     \
+    }                                                                   \
+  } while (0)
+
+/// Fails the current test unless an expression throws a matching error.
+#define CHECK_THROWS(expr, message)                                     \
+  do {                                                                  \
+    std::string error_;                                                 \
+    try {                                                               \
+      (void)(expr);                                                     \
+    } catch (const std::exception &ex) {                                \
+      error_ = ex.what();                                               \
+    }                                                                   \
+    if (error_.find(message) == std::string::npos) {                    \
+      throw TestFailure(__FILE__, __LINE__,                             \
+          #expr " threw '" + error_ + "', expecting '" message "'");    \
+    }                                                                   \
+  } while (0)
+
+/**
+ * Error raised by a failed check.
+ */
+class TestFailure : public std::runtime_error {
+public:
+  TestFailure(const char *file, int line, const std::string &what)
+    : std::runtime_error(std::string(file) + ":" + std::to_string(line) + ": " + what)
+  {
+  }
+};
+
+/// Named test case.
+using Test = std::pair<const char *, std::function<void()>>;
+
+// -----------------------------------------------------------------------------
+inline std::string WriteSource(const std::string &name, const std::string &source)
+{
+  // The lexer maps its input from a file.
+  auto path = std::filesystem::temp_directory_path() /
+      ("imp_test_" + std::to_string(getpid()) + "_" + name + ".imp");
+  std::ofstream os(path);
+  os << source;
+  if (!os) {
+    throw std::runtime_error("cannot write " + path.string());
+  }
+  return path;
+}
+
+// -----------------------------------------------------------------------------
+inline std::string RunSource(
+    const std::string &source,
+    const std::string &input = "",
+    Program::Format format = Program::Format::STACK)
+{
+  auto path = WriteSource("run", source);
+  std::shared_ptr<const Program> prog;
+  try {
+    prog = Compile(path, format);
+  } catch (...) {
+    std::filesystem::remove(path);
+    throw;
+  }
+  std::filesystem::remove(path);
+  return Instance(prog).Run(input);
+}
+
+// -----------------------------------------------------------------------------
+inline int RunTests(std::initializer_list<Test> tests)
+{
+  int failures = 0;
+  for (auto &[name, test] : tests) {
+    try {
+      test();
+      std::cout << "PASS " << name << std::endl;
+    } catch (const std::exception &ex) {
+      std::cout << "FAIL " << name << ": " << ex.what() << std::endl;
+      ++failures;
+    }
+  }
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
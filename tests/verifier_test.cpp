@@ -0,0 +1,66 @@
+// This file is part of the IMP project.
+
+#include "test.h"
+
+
+
+/// Prototypes shared by the programs of the tests.
+static const std::string kPrelude =
+    "func print_int(a: int): int = \"print_int\"\n"
+    "func read_int(): int = \"read_int\"\n";
+
+// -----------------------------------------------------------------------------
+static void TestContradictionDiv()
+{
+  // The inner branch is unreachable, narrowing the divisor to [1, 0].
+  auto source = kPrelude +
+      "func f(a: int): int { if (a < 1) { if (a > 0) { return 10 / a } }; return 0 }\n"
+      "print_int(f(read_int()))\n";
+  CHECK(RunSource(source, "3") == "0");
+  CHECK(RunSource(source, "0", Program::Format::REGISTER) == "0");
+}
+
+// -----------------------------------------------------------------------------
+static void TestContradictionMod()
+{
+  auto source = kPrelude +
+      "func f(a: int): int { if (a < 1) { if (a > 0) { return 10 % a } }; return 0 }\n"
+      "print_int(f(read_int()))\n";
+  CHECK(RunSource(source, "3") == "0");
+}
+
+// -----------------------------------------------------------------------------
+static void TestContradictionLoop()
+{
+  // Empty ranges also reach arithmetic on both operands inside loops.
+  auto source = kPrelude +
+      "func f(n: int, b: int): int {\n"
+      "  let a: int = n;\n"
+      "  while (a > 5) { if (a < 5) { return (b / a) % (a * b) - a / b }; a = a - 1 };\n"
+      "  return a\n"
+      "}\n"
+      "print_int(f(9, 2))\n";
+  CHECK(RunSource(source) == "5");
+}
+
+// -----------------------------------------------------------------------------
+static void TestDivisionStillChecked()
+{
+  // Reachable divisions which may fail are left to the runtime checks.
+  auto source = kPrelude +
+      "func f(a: int): int { if (a < 1) { return 10 / a }; return 0 }\n"
+      "print_int(f(read_int()))\n";
+  CHECK(RunSource(source, "-5") == "-2");
+  CHECK_THROWS(RunSource(source, "0"), "division by zero");
+}
+
+// -----------------------------------------------------------------------------
+int main()
+{
+  return RunTests({
+    { "contradiction_div", TestContradictionDiv },
+    { "contradiction_mod", TestContradictionMod },
+    { "contradiction_loop", TestContradictionLoop },
+    { "division_still_checked", TestDivisionStillChecked },
+  });
+}
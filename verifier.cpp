@@ -1,11 +1,719 @@
 // This file is part of the IMP project.
 
+#include <algorithm>
+#include <limits>
+
 #include "verifier.h"
 #include "ast.h"
+#include "runtime.h"
+
+
+
+/// Bounds of the values of integers.
+static constexpr int64_t kMin = std::numeric_limits<int64_t>::min();
+static constexpr int64_t kMax = std::numeric_limits<int64_t>::max();
+
+// -----------------------------------------------------------------------------
+static int64_t SaturatingAdd(int64_t lhs, int64_t rhs, bool &safe)
+{
+  int64_t result;
+  if (__builtin_add_overflow(lhs, rhs, &result)) {
+    safe = false;
+    return lhs < 0 ? kMin : kMax;
+  }
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+static int64_t SaturatingSub(int64_t lhs, int64_t rhs, bool &safe)
+{
+  int64_t result;
+  if (__builtin_sub_overflow(lhs, rhs, &result)) {
+    safe = false;
+    return rhs < 0 ? kMax : kMin;
+  }
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+static int64_t SaturatingMul(int64_t lhs, int64_t rhs, bool &safe)
+{
+  int64_t result;
+  if (__builtin_mul_overflow(lhs, rhs, &result)) {
+    safe = false;
+    return (lhs < 0) == (rhs < 0) ? kMax : kMin;
+  }
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+static int64_t SaturatingDiv(int64_t lhs, int64_t rhs, bool &safe)
+{
+  if (lhs == kMin && rhs == -1) {
+    safe = false;
+    return kMax;
+  }
+  return lhs / rhs;
+}
+
+
+// -----------------------------------------------------------------------------
+void Verifier::Verify(const Module &mod)
+{
+  // Record all globals first, as functions can be called before their
+  // definition and from within their own bodies.
+  for (auto item : mod) {
+    const FuncOrProtoDecl *decl = nullptr;
+    if (std::holds_alternative<FuncDecl *>(item)) {
+      decl = std::get<0>(item);
+    }
+    if (std::holds_alternative<ProtoDecl *>(item)) {
+      auto &proto = *std::get<1>(item);
+      if (kRuntimeFns.find(proto.GetPrimitiveName()) == kRuntimeFns.end()) {
+        Error("unknown primitive '" + proto.GetPrimitiveName() + "'");
+      }
+      decl = &proto;
+    }
+    if (!decl) {
+      continue;
+    }
+    if (!globals_.emplace(decl->GetSymbol(), decl).second) {
+      Error("redefinition of '" + decl->GetName() + "'");
+    }
+    VerifySignature(*decl);
+    if (std::holds_alternative<ProtoDecl *>(item)) {
+      VerifyProtoDecl(*std::get<1>(item));
+    }
+  }
+
+  // Top-level statements form a block of their own, hidden from functions.
+  locals_.emplace_back();
+  facts_ = Facts();
+  for (auto item : mod) {
+    if (std::holds_alternative<FuncDecl *>(item)) {
+      VerifyFuncDecl(*std::get<0>(item));
+    }
+    if (std::holds_alternative<Stmt *>(item)) {
+      VerifyBlockItem(*std::get<2>(item));
+    }
+  }
+  locals_.clear();
+  slots_ = 0;
+  facts_ = Facts();
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::VerifySignature(const FuncOrProtoDecl &decl)
+{
+  auto known = [this] (Symbol type) { return type == int_ || type == array_; };
+  if (!known(decl.GetTypeSymbol())) {
+    Error("unknown return type '" + decl.GetType() + "' of '" + decl.GetName() + "'");
+  }
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    if (!known(it->second)) {
+      Error("unknown type '" + it->second.GetName() + "' of argument '" + it->first.GetName() + "'");
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::VerifyProtoDecl(const ProtoDecl &decl)
+{
+  // Runtime methods trust the types of their operands, so prototypes must
+  // declare them as the methods expect.
+  RuntimeSig sig;
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    sig.Args.push_back(it->second.GetName());
+  }
+  sig.Ret = decl.GetType();
+
+  auto &prim = decl.GetPrimitiveName();
+  if (auto it = kRuntimeSigs.find(prim); it != kRuntimeSigs.end()) {
+    if (sig.Args != it->second.Args || sig.Ret != it->second.Ret) {
+      std::string expected = "(";
+      for (auto &arg : it->second.Args) {
+        expected += (expected.size() == 1 ? "" : ", ") + arg;
+      }
+      expected += "): " + it->second.Ret;
+      Error("'" + decl.GetName() + "' must be declared as " + expected + " to bind '" + prim + "'");
+    }
+    return;
+  }
+  auto isInt = [this] (const std::string &type) { return type == int_.GetName(); };
+  if (!isInt(sig.Ret) || !std::all_of(sig.Args.begin(), sig.Args.end(), isInt)) {
+    Error("'" + decl.GetName() + "' must take and return integers to bind '" + prim + "'");
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::VerifyFuncDecl(const FuncDecl &decl)
+{
+  auto topLocals = std::move(locals_);
+  auto topSlots = slots_;
+  auto topFacts = std::move(facts_);
+  auto topTypes = std::move(localTypes_);
+  locals_.clear();
+  slots_ = 0;
+  localTypes_.clear();
+
+  // Nothing is known about the arguments passed by callers.
+  facts_ = Facts();
+  facts_.Args.assign(decl.arg_size(), Range{ kMin, kMax });
+
+  func_ = &decl;
+  args_.clear();
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    if (!args_.emplace(it->first, args_.size()).second) {
+      Error("duplicate argument '" + it->first.GetName() + "'");
+    }
+  }
+
+  // Falling through the end of the body would run into the next function.
+  if (!VerifyBlockStmt(decl.GetBody())) {
+    Error("not all paths return a value");
+  }
+
+  args_.clear();
+  func_ = nullptr;
+
+  locals_ = std::move(topLocals);
+  slots_ = topSlots;
+  facts_ = std::move(topFacts);
+  localTypes_ = std::move(topTypes);
+}
+
+// -----------------------------------------------------------------------------
+bool Verifier::VerifyStmt(const Stmt &stmt)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      return VerifyBlockStmt(static_cast<const BlockStmt &>(stmt));
+    }
+    case Stmt::Kind::WHILE: {
+      VerifyWhileStmt(static_cast<const WhileStmt &>(stmt));
+      return false;
+    }
+    case Stmt::Kind::EXPR: {
+      // The values of expression statements are discarded, whatever their type.
+      Range range;
+      VerifyValue(static_cast<const ExprStmt &>(stmt).GetExpr(), range);
+      return false;
+    }
+    case Stmt::Kind::RETURN: {
+      return VerifyReturnStmt(static_cast<const ReturnStmt &>(stmt));
+    }
+    case Stmt::Kind::IF: {
+      return VerifyIfStmt(static_cast<const IfStmt &>(stmt));
+    }
+    case Stmt::Kind::LET: {
+      Error("declaration of '" + static_cast<const LetStmt &>(stmt).GetName() + "' outside of a block");
+    }
+    case Stmt::Kind::ASSIGN: {
+      VerifyAssignStmt(static_cast<const AssignStmt &>(stmt));
+      return false;
+    }
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+bool Verifier::VerifyBlockStmt(const BlockStmt &blockStmt)
+{
+  unsigned slots = slots_;
+  locals_.emplace_back();
+  bool returns = false;
+  for (auto &stmt : blockStmt) {
+    returns = VerifyBlockItem(*stmt) || returns;
+  }
+  locals_.pop_back();
+  slots_ = slots;
+  if (facts_.Locals.size() > slots) {
+    facts_.Locals.resize(slots);
+  }
+  return returns;
+}
+
+// -----------------------------------------------------------------------------
+bool Verifier::VerifyBlockItem(const Stmt &stmt)
+{
+  if (stmt.GetKind() != Stmt::Kind::LET) {
+    return VerifyStmt(stmt);
+  }
+
+  // The initialiser is checked before the name comes into scope, so it
+  // refers to any outer binding of the name.
+  auto &letStmt = static_cast<const LetStmt &>(stmt);
+  auto type = letStmt.GetTypeSymbol();
+  if (type != int_ && type != array_) {
+    Error("unknown type '" + letStmt.GetType() + "' of local '" + letStmt.GetName() + "'");
+  }
+  auto range = VerifyExpr(letStmt.GetInit(), type);
+  if (!locals_.back().emplace(letStmt.GetSymbol(), slots_).second) {
+    Error("redefinition of local '" + letStmt.GetName() + "'");
+  }
+  if (facts_.Locals.size() <= slots_) {
+    facts_.Locals.resize(slots_ + 1, Range{ kMin, kMax });
+  }
+  facts_.Locals[slots_] = range;
+  if (localTypes_.size() <= slots_) {
+    localTypes_.resize(slots_ + 1, int_);
+  }
+  localTypes_[slots_] = type;
+  letStmt.Allocate(slots_++);
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::VerifyAssignStmt(const AssignStmt &assignStmt)
+{
+  auto &ref = assignStmt.GetTarget();
+  Resolve(ref);
+  if (ref.GetTarget() != RefExpr::Target::LOCAL) {
+    Error("cannot assign to '" + ref.GetName() + "', which is not a local");
+  }
+  auto range = VerifyExpr(assignStmt.GetValue(), localTypes_[ref.GetSlot()]);
+  GetRange(facts_, ref) = range;
+}
 
+// -----------------------------------------------------------------------------
+bool Verifier::VerifyIfStmt(const IfStmt &ifStmt)
+{
+  auto [holds, fails] = VerifyCond(ifStmt.GetCond());
+  facts_ = std::move(holds);
+  bool returns = VerifyStmt(ifStmt.GetStmt());
+  auto then = std::move(facts_);
+  facts_ = std::move(fails);
+  if (auto elseStmt = ifStmt.GetElseStmt()) {
+    returns = VerifyStmt(*elseStmt) && returns;
+  } else {
+    returns = false;
+  }
+  facts_ = Join(then, facts_);
+  return returns;
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::VerifyWhileStmt(const WhileStmt &whileStmt)
+{
+  // The condition is evaluated after any number of iterations, so only the
+  // ranges of the locals which the body does not assign to carry over.
+  Forget(whileStmt.GetStmt());
+  auto [holds, fails] = VerifyCond(whileStmt.GetCond());
+  facts_ = std::move(holds);
+  VerifyStmt(whileStmt.GetStmt());
+  // Loops are only left once their condition fails, or by returning.
+  facts_ = std::move(fails);
+}
+
+// -----------------------------------------------------------------------------
+bool Verifier::VerifyReturnStmt(const ReturnStmt &retStmt)
+{
+  if (!func_) {
+    Error("return outside of a function");
+  }
+  VerifyExpr(retStmt.GetExpr(), func_->GetTypeSymbol());
+  facts_.Reachable = false;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+Verifier::Range Verifier::VerifyExpr(const Expr &expr, Symbol type)
+{
+  Range range;
+  auto actual = VerifyValue(expr, range);
+  if (actual != type) {
+    Error("expected a value of type '" + type.GetName() + "', got '" + actual.GetName() + "'");
+  }
+  return range;
+}
 
+// -----------------------------------------------------------------------------
+Symbol Verifier::VerifyValue(const Expr &expr, Range &range)
+{
+  // Arrays take the full range, which is never used.
+  range = Range{ kMin, kMax };
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      auto &ref = static_cast<const RefExpr &>(expr);
+      Resolve(ref);
+      range = GetRange(facts_, ref);
+      switch (ref.GetTarget()) {
+        case RefExpr::Target::ARG: {
+          return (func_->arg_begin() + ref.GetArgIndex())->second;
+        }
+        case RefExpr::Target::LOCAL: {
+          return localTypes_[ref.GetSlot()];
+        }
+        default: {
+          Error("function '" + ref.GetName() + "' used as a value");
+        }
+      }
+    }
+    case Expr::Kind::BINARY: {
+      range = VerifyBinaryExpr(static_cast<const BinaryExpr &>(expr));
+      return int_;
+    }
+    case Expr::Kind::CALL: {
+      return VerifyCallExpr(static_cast<const CallExpr &>(expr));
+    }
+    case Expr::Kind::INT: {
+      int64_t value = static_cast<const IntExpr &>(expr).GetInt();
+      range = Range{ value, value };
+      return int_;
+    }
+  }
+  return int_;
+}
+
+// -----------------------------------------------------------------------------
+Verifier::Range Verifier::VerifyBinaryExpr(const BinaryExpr &binary)
+{
+  auto lhs = VerifyExpr(binary.GetLHS());
+  auto rhs = VerifyExpr(binary.GetRHS());
+
+  // Contradictory conditions leave empty ranges in unreachable code, where
+  // bounds, which may divide by them, are not worth computing.
+  if (lhs.Lo > lhs.Hi || rhs.Lo > rhs.Hi) {
+    return binary.IsComparison() ? Range{ 0, 1 } : Range{ kMin, kMax };
+  }
+
+  // Bounds saturate: if an operation checked at runtime does not fail, its
+  // result still lies in the range.
+  bool safe = true;
+  Range range{ kMin, kMax };
+  switch (binary.GetKind()) {
+    case BinaryExpr::Kind::ADD: {
+      range.Lo = SaturatingAdd(lhs.Lo, rhs.Lo, safe);
+      range.Hi = SaturatingAdd(lhs.Hi, rhs.Hi, safe);
+      break;
+    }
+    case BinaryExpr::Kind::SUB: {
+      range.Lo = SaturatingSub(lhs.Lo, rhs.Hi, safe);
+      range.Hi = SaturatingSub(lhs.Hi, rhs.Lo, safe);
+      break;
+    }
+    case BinaryExpr::Kind::MUL: {
+      const int64_t bounds[] = {
+        SaturatingMul(lhs.Lo, rhs.Lo, safe),
+        SaturatingMul(lhs.Lo, rhs.Hi, safe),
+        SaturatingMul(lhs.Hi, rhs.Lo, safe),
+        SaturatingMul(lhs.Hi, rhs.Hi, safe),
+      };
+      range.Lo = *std::min_element(std::begin(bounds), std::end(bounds));
+      range.Hi = *std::max_element(std::begin(bounds), std::end(bounds));
+      break;
+    }
+    case BinaryExpr::Kind::DIV: {
+      // Quotients are monotonic in both operands if the divisor keeps its
+      // sign, otherwise nothing is assumed.
+      if (rhs.Lo <= 0 && 0 <= rhs.Hi) {
+        safe = false;
+        break;
+      }
+      const int64_t bounds[] = {
+        SaturatingDiv(lhs.Lo, rhs.Lo, safe),
+        SaturatingDiv(lhs.Lo, rhs.Hi, safe),
+        SaturatingDiv(lhs.Hi, rhs.Lo, safe),
+        SaturatingDiv(lhs.Hi, rhs.Hi, safe),
+      };
+      range.Lo = *std::min_element(std::begin(bounds), std::end(bounds));
+      range.Hi = *std::max_element(std::begin(bounds), std::end(bounds));
+      break;
+    }
+    case BinaryExpr::Kind::MOD: {
+      // Remainders are smaller than the divisor in magnitude and take the
+      // sign of the dividend.
+      if (rhs.Lo <= 0 && 0 <= rhs.Hi) {
+        safe = false;
+      }
+      if (lhs.Lo == kMin && rhs.Lo <= -1 && -1 <= rhs.Hi) {
+        safe = false;
+      }
+      auto bound = [] (int64_t v) { return v < 0 ? -(v + 1) : v - 1; };
+      int64_t m = std::max<int64_t>({ 0, bound(rhs.Lo), bound(rhs.Hi) });
+      range.Lo = lhs.Lo >= 0 ? 0 : std::max(lhs.Lo, -m);
+      range.Hi = lhs.Hi <= 0 ? 0 : std::min(lhs.Hi, m);
+      break;
+    }
+    case BinaryExpr::Kind::DEQ:
+    case BinaryExpr::Kind::NEQ:
+    case BinaryExpr::Kind::SM:
+    case BinaryExpr::Kind::SMEQ:
+    case BinaryExpr::Kind::GR:
+    case BinaryExpr::Kind::GREQ: {
+      return Range{ 0, 1 };
+    }
+  }
+  if (safe) {
+    binary.MarkSafe();
+  }
+  return range;
+}
+
+// -----------------------------------------------------------------------------
+Symbol Verifier::VerifyCallExpr(const CallExpr &call)
+{
+  // Functions are not values, so only global names can be called.
+  auto &callee = call.GetCallee();
+  if (callee.GetKind() != Expr::Kind::REF) {
+    Error("called expression is not a function");
+  }
+  auto &ref = static_cast<const RefExpr &>(callee);
+  Resolve(ref);
+  if (ref.GetTarget() == RefExpr::Target::ARG) {
+    Error("argument '" + ref.GetName() + "' is not a function");
+  }
+  if (ref.GetTarget() == RefExpr::Target::LOCAL) {
+    Error("local '" + ref.GetName() + "' is not a function");
+  }
+
+  auto &decl = *globals_.find(ref.GetSymbol())->second;
+  if (call.arg_size() != decl.arg_size()) {
+    Error(
+        "'" + ref.GetName() + "' expects " + std::to_string(decl.arg_size()) +
+        " arguments, got " + std::to_string(call.arg_size())
+    );
+  }
+  auto param = decl.arg_begin();
+  for (auto it = call.arg_begin(), end = call.arg_end(); it != end; ++it, ++param) {
+    VerifyExpr(**it, param->second);
+  }
+  return decl.GetTypeSymbol();
+}
+
+// -----------------------------------------------------------------------------
+std::pair<Verifier::Facts, Verifier::Facts> Verifier::VerifyCond(const Expr &cond)
+{
+  auto isVar = [] (const Expr &expr) {
+    if (expr.GetKind() != Expr::Kind::REF) {
+      return false;
+    }
+    auto target = static_cast<const RefExpr &>(expr).GetTarget();
+    return target == RefExpr::Target::ARG || target == RefExpr::Target::LOCAL;
+  };
+
+  // Conditions which are not comparisons are compared against zero.
+  if (cond.GetKind() != Expr::Kind::BINARY) {
+    VerifyExpr(cond);
+    Facts holds = facts_, fails = facts_;
+    if (isVar(cond)) {
+      auto &ref = static_cast<const RefExpr &>(cond);
+      Narrow(holds, GetRange(holds, ref), BinaryExpr::Kind::NEQ, Range{ 0, 0 });
+      Narrow(fails, GetRange(fails, ref), BinaryExpr::Kind::DEQ, Range{ 0, 0 });
+    }
+    return { std::move(holds), std::move(fails) };
+  }
+
+  auto &binary = static_cast<const BinaryExpr &>(cond);
+  auto op = binary.GetKind();
+  BinaryExpr::Kind negated;
+  switch (op) {
+    case BinaryExpr::Kind::DEQ: negated = BinaryExpr::Kind::NEQ; break;
+    case BinaryExpr::Kind::NEQ: negated = BinaryExpr::Kind::DEQ; break;
+    case BinaryExpr::Kind::SM: negated = BinaryExpr::Kind::GREQ; break;
+    case BinaryExpr::Kind::SMEQ: negated = BinaryExpr::Kind::GR; break;
+    case BinaryExpr::Kind::GR: negated = BinaryExpr::Kind::SMEQ; break;
+    case BinaryExpr::Kind::GREQ: negated = BinaryExpr::Kind::SM; break;
+    default: {
+      VerifyExpr(cond);
+      return { facts_, facts_ };
+    }
+  }
+  // Comparisons hold the other way around once their operands are swapped.
+  auto swap = [] (BinaryExpr::Kind kind) {
+    switch (kind) {
+      case BinaryExpr::Kind::SM: return BinaryExpr::Kind::GR;
+      case BinaryExpr::Kind::SMEQ: return BinaryExpr::Kind::GREQ;
+      case BinaryExpr::Kind::GR: return BinaryExpr::Kind::SM;
+      case BinaryExpr::Kind::GREQ: return BinaryExpr::Kind::SMEQ;
+      default: return kind;
+    }
+  };
+
+  // Variables compared against other values are narrowed on both sides.
+  auto lhs = VerifyExpr(binary.GetLHS());
+  auto rhs = VerifyExpr(binary.GetRHS());
+  Facts holds = facts_, fails = facts_;
+  if (isVar(binary.GetLHS())) {
+    auto &ref = static_cast<const RefExpr &>(binary.GetLHS());
+    Narrow(holds, GetRange(holds, ref), op, rhs);
+    Narrow(fails, GetRange(fails, ref), negated, rhs);
+  }
+  if (isVar(binary.GetRHS())) {
+    auto &ref = static_cast<const RefExpr &>(binary.GetRHS());
+    Narrow(holds, GetRange(holds, ref), swap(op), lhs);
+    Narrow(fails, GetRange(fails, ref), swap(negated), lhs);
+  }
+  return { std::move(holds), std::move(fails) };
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::Resolve(const RefExpr &ref)
+{
+  // Locals shadow arguments and outer locals, while arguments shadow globals.
+  if (auto slot = FindLocal(ref.GetSymbol())) {
+    ref.Resolve(RefExpr::Target::LOCAL, *slot);
+    return;
+  }
+  if (auto it = args_.find(ref.GetSymbol()); it != args_.end()) {
+    ref.Resolve(RefExpr::Target::ARG, it->second);
+    return;
+  }
+
+  auto it = globals_.find(ref.GetSymbol());
+  if (it == globals_.end()) {
+    Error("unknown name '" + ref.GetName() + "'");
+  }
+  if (dynamic_cast<const FuncDecl *>(it->second)) {
+    ref.Resolve(RefExpr::Target::FUNC);
+  } else {
+    ref.Resolve(RefExpr::Target::PROTO);
+  }
+}
+
+// -----------------------------------------------------------------------------
+const unsigned *Verifier::FindLocal(Symbol name) const
+{
+  for (auto it = locals_.rbegin(); it != locals_.rend(); ++it) {
+    if (auto jt = it->find(name); jt != it->end()) {
+      return &jt->second;
+    }
+  }
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+Verifier::Range &Verifier::GetRange(Facts &facts, const RefExpr &ref)
+{
+  if (ref.GetTarget() == RefExpr::Target::ARG) {
+    return facts.Args[ref.GetArgIndex()];
+  }
+  return facts.Locals[ref.GetSlot()];
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::Narrow(Facts &facts, Range &var, BinaryExpr::Kind op, const Range &other)
+{
+  switch (op) {
+    case BinaryExpr::Kind::SM: {
+      if (other.Hi == kMin) {
+        facts.Reachable = false;
+        return;
+      }
+      var.Hi = std::min(var.Hi, other.Hi - 1);
+      break;
+    }
+    case BinaryExpr::Kind::SMEQ: {
+      var.Hi = std::min(var.Hi, other.Hi);
+      break;
+    }
+    case BinaryExpr::Kind::GR: {
+      if (other.Lo == kMax) {
+        facts.Reachable = false;
+        return;
+      }
+      var.Lo = std::max(var.Lo, other.Lo + 1);
+      break;
+    }
+    case BinaryExpr::Kind::GREQ: {
+      var.Lo = std::max(var.Lo, other.Lo);
+      break;
+    }
+    case BinaryExpr::Kind::DEQ: {
+      var.Lo = std::max(var.Lo, other.Lo);
+      var.Hi = std::min(var.Hi, other.Hi);
+      break;
+    }
+    case BinaryExpr::Kind::NEQ: {
+      // Only constants at either end of the range can be excluded.
+      if (other.Lo != other.Hi) {
+        return;
+      }
+      if (var.Lo == var.Hi && var.Lo == other.Lo) {
+        facts.Reachable = false;
+        return;
+      }
+      if (var.Lo == other.Lo) {
+        ++var.Lo;
+      } else if (var.Hi == other.Lo) {
+        --var.Hi;
+      }
+      break;
+    }
+    default: {
+      return;
+    }
+  }
+  if (var.Lo > var.Hi) {
+    facts.Reachable = false;
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::Forget(const Stmt &stmt)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      for (auto *inner : static_cast<const BlockStmt &>(stmt)) {
+        Forget(*inner);
+      }
+      return;
+    }
+    case Stmt::Kind::WHILE: {
+      return Forget(static_cast<const WhileStmt &>(stmt).GetStmt());
+    }
+    case Stmt::Kind::IF: {
+      auto &ifStmt = static_cast<const IfStmt &>(stmt);
+      Forget(ifStmt.GetStmt());
+      if (auto elseStmt = ifStmt.GetElseStmt()) {
+        Forget(*elseStmt);
+      }
+      return;
+    }
+    case Stmt::Kind::ASSIGN: {
+      // Names are not resolved yet: the nearest binding is forgotten, which
+      // is at worst an outer local shadowed within the body.
+      auto &target = static_cast<const AssignStmt &>(stmt).GetTarget();
+      if (auto slot = FindLocal(target.GetSymbol())) {
+        facts_.Locals[*slot] = Range{ kMin, kMax };
+      }
+      return;
+    }
+    case Stmt::Kind::EXPR:
+    case Stmt::Kind::RETURN:
+    case Stmt::Kind::LET: {
+      return;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+Verifier::Facts Verifier::Join(const Facts &a, const Facts &b)
+{
+  if (!a.Reachable) {
+    return b;
+  }
+  if (!b.Reachable) {
+    return a;
+  }
+  Facts facts = a;
+  facts.Locals.resize(std::min(a.Locals.size(), b.Locals.size()));
+  for (size_t i = 0; i < facts.Args.size(); ++i) {
+    facts.Args[i].Lo = std::min(a.Args[i].Lo, b.Args[i].Lo);
+    facts.Args[i].Hi = std::max(a.Args[i].Hi, b.Args[i].Hi);
+  }
+  for (size_t i = 0; i < facts.Locals.size(); ++i) {
+    facts.Locals[i].Lo = std::min(a.Locals[i].Lo, b.Locals[i].Lo);
+    facts.Locals[i].Hi = std::max(a.Locals[i].Hi, b.Locals[i].Hi);
+  }
+  return facts;
+}
 
 // -----------------------------------------------------------------------------
-void Verifier::Verify(const Module &stat)
+void Verifier::Error(const std::string &msg)
 {
+  if (func_) {
+    throw VerifierError("in function '" + func_->GetName() + "': " + msg);
+  }
+  throw VerifierError(msg);
 }
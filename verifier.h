@@ -2,10 +2,130 @@
 
 #pragma once
 
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
-class Module;
+#include "ast.h"
 
+
+
+/**
+ * Represents an error found while verifying a module.
+ */
+class VerifierError : public std::runtime_error {
+public:
+  VerifierError(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+/**
+ * Checks that names are bound and that programs are well-typed.
+ *
+ * Values are either integers, of type `int`, or arrays of integers, of type
+ * `int[]`, which only runtime methods operate on: functions and prototypes
+ * are bound to global names and can only be called. References are annotated with the
+ * objects they resolve to, allowing the code generators to trust them.
+ * Locals are numbered by the frame slot they occupy: slots are reused once
+ * the block declaring a local ends.
+ *
+ * The range of values of arguments and locals is tracked along the way,
+ * narrowed by the conditions of branches and loops, so that arithmetic which
+ * can neither overflow nor trap is marked safe and need not be checked.
+ */
 class Verifier {
 public:
-  void Verify(const Module &stat);
+  /// Entry point to the verifier: checks an entire module.
+  void Verify(const Module &mod);
+
+private:
+  /// Interval of values an integer might take.
+  struct Range {
+    int64_t Lo;
+    int64_t Hi;
+  };
+
+  /// Ranges of the arguments and locals in scope at a point of the program.
+  struct Facts {
+    /// Ranges of the arguments, by index.
+    std::vector<Range> Args;
+    /// Ranges of the locals, by slot.
+    std::vector<Range> Locals;
+    /// Flag cleared once all paths to the point returned.
+    bool Reachable = true;
+  };
+
+private:
+  /// Checks the argument and return types of a declaration.
+  void VerifySignature(const FuncOrProtoDecl &decl);
+  /// Checks that a prototype matches the signature of its runtime method.
+  void VerifyProtoDecl(const ProtoDecl &decl);
+  /// Checks a function declaration.
+  void VerifyFuncDecl(const FuncDecl &funcDecl);
+
+  /// Checks a statement, returning true if all its paths return.
+  bool VerifyStmt(const Stmt &stmt);
+  /// Checks a block statement.
+  bool VerifyBlockStmt(const BlockStmt &blockStmt);
+  /// Checks a statement of a block, which may declare a local.
+  bool VerifyBlockItem(const Stmt &stmt);
+  /// Checks an assignment to a local.
+  void VerifyAssignStmt(const AssignStmt &assignStmt);
+  /// Checks an if statement.
+  bool VerifyIfStmt(const IfStmt &ifStmt);
+  /// Checks a return statement.
+  bool VerifyReturnStmt(const ReturnStmt &retStmt);
+
+  /// Checks a while statement.
+  void VerifyWhileStmt(const WhileStmt &whileStmt);
+
+  /// Checks an expression producing an integer, returning its range.
+  Range VerifyExpr(const Expr &expr) { return VerifyExpr(expr, int_); }
+  /// Checks an expression producing a value of a given type.
+  Range VerifyExpr(const Expr &expr, Symbol type);
+  /// Checks an expression of any type, returning the type and the range.
+  Symbol VerifyValue(const Expr &expr, Range &range);
+  /// Checks a binary expression, marking safe arithmetic.
+  Range VerifyBinaryExpr(const BinaryExpr &binary);
+  /// Checks a call expression, returning the type of its result.
+  Symbol VerifyCallExpr(const CallExpr &call);
+  /// Checks a condition, returning the facts if it holds and if it does not.
+  std::pair<Facts, Facts> VerifyCond(const Expr &cond);
+  /// Binds a reference to a local, an argument or a global.
+  void Resolve(const RefExpr &ref);
+  /// Returns the slot of the local a name is bound to, if any.
+  const unsigned *FindLocal(Symbol name) const;
+
+  /// Returns the range of an argument or a local among some facts.
+  static Range &GetRange(Facts &facts, const RefExpr &ref);
+  /// Narrows the range of a variable to the values satisfying a comparison.
+  static void Narrow(Facts &facts, Range &var, BinaryExpr::Kind op, const Range &other);
+  /// Forgets the ranges of the locals a statement might assign to.
+  void Forget(const Stmt &stmt);
+  /// Merges the facts of two paths meeting at a point.
+  static Facts Join(const Facts &a, const Facts &b);
+
+  /// Raises an error, naming the function being checked.
+  [[noreturn]] void Error(const std::string &msg);
+
+private:
+  /// Functions and prototypes declared in the module.
+  std::unordered_map<Symbol, const FuncOrProtoDecl *> globals_;
+  /// Arguments of the current function, mapped to their indices.
+  std::unordered_map<Symbol, unsigned> args_;
+  /// Locals declared by each enclosing block, mapped to their slots.
+  std::vector<std::unordered_map<Symbol, unsigned>> locals_;
+  /// Number of slots taken up by the locals in scope.
+  unsigned slots_ = 0;
+  /// Ranges of the variables in scope at the current point.
+  Facts facts_;
+  /// Types of the locals in scope, by slot.
+  std::vector<Symbol> localTypes_;
+  /// Current function being checked.
+  const FuncDecl *func_ = nullptr;
+  /// Names of the types of integers and arrays.
+  const Symbol int_ = Symbol::Intern("int");
+  const Symbol array_ = Symbol::Intern("int[]");
 };